@@ -26,6 +26,7 @@ LOCAL_MODULE_TAGS := optional
 
 LOCAL_SHARED_LIBRARIES := libbinder \
                           libchrome \
+                          libcutils \
                           liblog \
                           libmedia \
                           libstagefright \
@@ -7,16 +7,37 @@
 
 #include <C2VDAAdaptor.h>
 
+#include <string.h>
+
 #include <bitstream_buffer.h>
 #include <native_pixmap_handle.h>
-#include <v4l2_device.h>
 #include <v4l2_video_decode_accelerator.h>
+#include <video_decode_accelerator_factory.h>
 #include <video_pixel_format.h>
 
+#include <cutils/properties.h>
 #include <utils/Log.h>
 
 namespace android {
 
+namespace {
+
+// Which V4L2 decoder API to use: "stateful", "stateless", or "auto" (default) for the stateful
+// one when it supports the profile, else the stateless one.
+media::VideoDecodeAcceleratorFactory::Backend getBackend() {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("debug.v4l2_codec2.vda_backend", value, "auto");
+    if (!strcmp(value, "stateful")) {
+        return media::VideoDecodeAcceleratorFactory::Backend::kStateful;
+    }
+    if (!strcmp(value, "stateless")) {
+        return media::VideoDecodeAcceleratorFactory::Backend::kStateless;
+    }
+    return media::VideoDecodeAcceleratorFactory::Backend::kAuto;
+}
+
+}  // namespace
+
 C2VDAAdaptor::C2VDAAdaptor() : mNumOutputBuffers(0u) {}
 
 C2VDAAdaptor::~C2VDAAdaptor() {
@@ -26,7 +47,7 @@ C2VDAAdaptor::~C2VDAAdaptor() {
 }
 
 VideoDecodeAcceleratorAdaptor::Result C2VDAAdaptor::initialize(
-        media::VideoCodecProfile profile, bool secureMode,
+        media::VideoCodecProfile profile, bool secureMode, bool lowLatency,
         VideoDecodeAcceleratorAdaptor::Client* client) {
     // TODO: use secureMode here, or ignore?
     if (mVDA) {
@@ -37,13 +58,18 @@ VideoDecodeAcceleratorAdaptor::Result C2VDAAdaptor::initialize(
     media::VideoDecodeAccelerator::Config config;
     config.profile = profile;
     config.output_mode = media::VideoDecodeAccelerator::Config::OutputMode::IMPORT;
-
-    // TODO(johnylin): may need to implement factory to create VDA if there are multiple VDA
-    // implementations in the future.
-    scoped_refptr<media::V4L2Device> device = new media::V4L2Device();
-    std::unique_ptr<media::VideoDecodeAccelerator> vda(
-            new media::V4L2VideoDecodeAccelerator(device));
-    if (!vda->Initialize(config, this)) {
+    config.low_latency = lowLatency;
+    config.latency_tracker = mLatencyTracker;
+
+    // Waiting for device events on the VDA's decoder thread saves a thread and two thread hops
+    // per event. Opt-in until it gets more coverage.
+    const auto pollMode = property_get_bool("debug.v4l2_codec2.decoder_thread_poll", false)
+                                  ? media::V4L2VideoDecodeAccelerator::PollMode::kDecoderThread
+                                  : media::V4L2VideoDecodeAccelerator::PollMode::kPollThread;
+    std::unique_ptr<media::VideoDecodeAccelerator> vda =
+            media::VideoDecodeAcceleratorFactory::CreateAndInitialize(getBackend(), pollMode,
+                                                                      config, this);
+    if (!vda) {
         ALOGE("Failed to initialize VDA");
         return PLATFORM_FAILURE;
     }
@@ -54,12 +80,21 @@ VideoDecodeAcceleratorAdaptor::Result C2VDAAdaptor::initialize(
     return SUCCESS;
 }
 
+void C2VDAAdaptor::setLatencyTracker(scoped_refptr<media::FrameLatencyTracker> tracker) {
+    mLatencyTracker = std::move(tracker);
+}
+
 void C2VDAAdaptor::decode(int32_t bitstreamId, int ashmemFd, off_t offset, uint32_t bytesUsed) {
     CHECK(mVDA);
     mVDA->Decode(media::BitstreamBuffer(bitstreamId, base::SharedMemoryHandle(ashmemFd, true),
                                         bytesUsed, offset));
 }
 
+uint32_t C2VDAAdaptor::getNumOutputBuffersForDpbSize(uint32_t dpbSize) {
+    CHECK(mVDA);
+    return static_cast<uint32_t>(mVDA->GetNumPictureBuffersForDpbSize(dpbSize));
+}
+
 void C2VDAAdaptor::assignPictureBuffers(uint32_t numOutputBuffers) {
     CHECK(mVDA);
     std::vector<media::PictureBuffer> buffers;
@@ -123,21 +158,23 @@ void C2VDAAdaptor::destroy() {
 //static
 media::VideoDecodeAccelerator::SupportedProfiles C2VDAAdaptor::GetSupportedProfiles(
         InputCodec inputCodec) {
-    // TODO(johnylin): use factory function to determine whether V4L2 stream or slice API is.
-    uint32_t inputFormatFourcc;
+    media::VideoCodecProfile minProfile;
+    media::VideoCodecProfile maxProfile;
     if (inputCodec == InputCodec::H264) {
-        inputFormatFourcc = V4L2_PIX_FMT_H264;
+        minProfile = media::H264PROFILE_MIN;
+        maxProfile = media::H264PROFILE_MAX;
     } else if (inputCodec == InputCodec::VP8) {
-        inputFormatFourcc = V4L2_PIX_FMT_VP8;
+        minProfile = media::VP8PROFILE_MIN;
+        maxProfile = media::VP8PROFILE_MAX;
     } else {  // InputCodec::VP9
-        inputFormatFourcc = V4L2_PIX_FMT_VP9;
+        minProfile = media::VP9PROFILE_MIN;
+        maxProfile = media::VP9PROFILE_MAX;
     }
 
     media::VideoDecodeAccelerator::SupportedProfiles supportedProfiles;
-    auto allProfiles = media::V4L2VideoDecodeAccelerator::GetSupportedProfiles();
+    auto allProfiles = media::VideoDecodeAcceleratorFactory::GetSupportedProfiles(getBackend());
     for (const auto& profile : allProfiles) {
-        if (inputFormatFourcc ==
-            media::V4L2Device::VideoCodecProfileToV4L2PixFmt(profile.profile)) {
+        if (profile.profile >= minProfile && profile.profile <= maxProfile) {
             supportedProfiles.push_back(profile);
         }
     }
@@ -170,10 +170,12 @@ media::VideoDecodeAccelerator::SupportedProfiles C2VDAAdaptorProxy::GetSupported
 }
 
 VideoDecodeAcceleratorAdaptor::Result C2VDAAdaptorProxy::initialize(
-        media::VideoCodecProfile profile, bool secureMode,
+        media::VideoCodecProfile profile, bool secureMode, bool lowLatency,
         VideoDecodeAcceleratorAdaptor::Client* client) {
-    ALOGV("initialize(profile=%d, secureMode=%d)", static_cast<int>(profile),
-          static_cast<int>(secureMode));
+    ALOGV("initialize(profile=%d, secureMode=%d, lowLatency=%d)", static_cast<int>(profile),
+          static_cast<int>(secureMode), static_cast<int>(lowLatency));
+    // TODO: pass |lowLatency| on once VideoDecodeAcceleratorConfig has a field for it. Until then
+    // the low-latency mode only affects the component side.
     DCHECK(client);
     DCHECK(!mClient);
     mClient = client;
@@ -212,6 +214,12 @@ void C2VDAAdaptorProxy::initializeOnMojoThread(
     mVDAPtr->Initialize(std::move(arcConfig), std::move(client), cb);
 }
 
+void C2VDAAdaptorProxy::setLatencyTracker(scoped_refptr<media::FrameLatencyTracker> tracker) {
+    // The decoder stages are not visible from the mojo client, only the component's own stages
+    // are recorded.
+    (void)tracker;
+}
+
 void C2VDAAdaptorProxy::decode(int32_t bitstreamId, int handleFd, off_t offset, uint32_t size) {
     ALOGV("decode");
     mMojoTaskRunner->PostTask(
@@ -236,6 +244,12 @@ void C2VDAAdaptorProxy::decodeOnMojoThread(int32_t bitstreamId, int handleFd, of
     mVDAPtr->Decode(std::move(bufferPtr));
 }
 
+uint32_t C2VDAAdaptorProxy::getNumOutputBuffersForDpbSize(uint32_t dpbSize) {
+    // The count depends on the decoder behind the mojo service, which is not known here.
+    (void)dpbSize;
+    return 0;
+}
+
 void C2VDAAdaptorProxy::assignPictureBuffers(uint32_t numOutputBuffers) {
     ALOGV("assignPictureBuffers: %d", numOutputBuffers);
     mMojoTaskRunner->PostTask(FROM_HERE,
@@ -19,7 +19,10 @@
 #include <C2VdaBqBlockPool.h>
 #include <C2VdaPooledBlockPool.h>
 
+#include <h264_level_limits.h>
 #include <h264_parser.h>
+#include <vp8_parser.h>
+#include <vp9_parser.h>
 
 #include <C2AllocatorGralloc.h>
 #include <C2ComponentFactory.h>
@@ -29,6 +32,8 @@
 #include <base/bind.h>
 #include <base/bind_helpers.h>
 
+#include <cutils/properties.h>
+
 #include <media/stagefright/MediaDefs.h>
 #include <media/stagefright/foundation/ColorUtils.h>
 #include <utils/Log.h>
@@ -64,8 +69,42 @@ const C2String kVP8SecureDecoderName = "c2.vda.vp8.decoder.secure";
 const C2String kVP9SecureDecoderName = "c2.vda.vp9.decoder.secure";
 
 const uint32_t kDpbOutputBufferExtraCount = 3;  // Use the same number as ACodec.
-const int kDequeueRetryDelayUs = 10000;  // Wait time of dequeue buffer retry in microseconds.
+// In low-latency mode the client does not queue up frames for display, so the extra buffers only
+// cover the ones BufferQueue keeps undequeued: its minimum undequeued count is the consumer's
+// maximum acquired count (1) plus one in synchronous mode. The frame in transit is already counted
+// by the accelerator.
+const uint32_t kDpbOutputBufferExtraCountForLowLatency = 2;
 const int32_t kAllocateBufferMaxRetries = 10;  // Max retry time for fetchGraphicBlock timeout.
+
+// Per-frame latency tracking: 0 disables it, 1 collects the latency histograms which are logged
+// when the component stops, 2 also emits a systrace async slice per frame and stage.
+const char kFrameLatencyProperty[] = "debug.v4l2_codec2.frame_latency";
+// While latency tracking is enabled, the histograms are also logged whenever this property changes,
+// e.g. "adb shell setprop debug.v4l2_codec2.frame_latency_dump $RANDOM". It is checked at most once
+// per kFrameLatencyDumpCheckIntervalMs, when works are done.
+const char kFrameLatencyDumpProperty[] = "debug.v4l2_codec2.frame_latency_dump";
+const int64_t kFrameLatencyDumpCheckIntervalMs = 1000;
+
+// The maximum number of finished works reported to listener in one onWorkDone call, configurable
+// by the property. Each call crosses into the framework, so batching saves IPC and lock overhead
+// at high frame rates.
+const char kMaxFinishedWorksBatchSizeProperty[] = "debug.v4l2_codec2.max_work_batch_size";
+const int32_t kDefaultMaxFinishedWorksBatchSize = 8;
+// The longest a finished work waits in a batch for the following ones, so that a slow stream does
+// not delay its frames by up to a batch.
+const int64_t kMaxFinishedWorksBatchDelayMs = 5;
+
+// After stop(), the accelerator with its device, input buffers and threads, and the output buffers
+// are kept for this long, so that a following start() with the same profile, e.g. on seeking or
+// playing the next item of a playlist, does not initialize them again. 0 disables it, which is the
+// default since the kept device and buffers are not available to other instances meanwhile.
+const char kKeepAcceleratorTimeoutProperty[] = "debug.v4l2_codec2.keep_accelerator_ms";
+const int32_t kDefaultKeepAcceleratorTimeoutMs = 0;
+
+// The bounds of C2VDAMaxWorksInFlightTuning other than 0. An H264 stream may need up to 16
+// reference frames before the first frame is output, so a lower limit could stall decoding.
+const uint32_t kMinWorksInFlight = 20;
+const uint32_t kMaxWorksInFlight = 256;
 }  // namespace
 
 static c2_status_t adaptorResultToC2Status(VideoDecodeAcceleratorAdaptor::Result result) {
@@ -147,6 +186,16 @@ C2R C2VDAComponent::IntfImpl::MergedColorAspectsSetter(
     return C2R::Ok();
 }
 
+// static
+C2R C2VDAComponent::IntfImpl::MaxWorksInFlightSetter(bool mayBlock,
+                                                     C2P<C2VDAMaxWorksInFlightTuning>& me) {
+    (void)mayBlock;
+    if (me.v.value != 0 && me.v.value < kMinWorksInFlight) {
+        me.set().value = kMinWorksInFlight;
+    }
+    return C2R::Ok();
+}
+
 C2VDAComponent::IntfImpl::IntfImpl(C2String name, const std::shared_ptr<C2ReflectorHelper>& helper)
       : C2InterfaceHelper(helper), mInitStatus(C2_OK) {
     setDerivedInstance(this);
@@ -265,14 +314,10 @@ C2VDAComponent::IntfImpl::IntfImpl(C2String name, const std::shared_ptr<C2Reflec
         static C2R MaxSizeCalculator(bool mayBlock, C2P<C2StreamMaxBufferSizeInfo::input>& me,
                                      const C2P<C2StreamPictureSizeInfo::output>& size) {
             (void)mayBlock;
-            // TODO: Need larger size?
-            me.set().value = kLinearBufferSize;
-            const uint32_t width = size.v.width;
-            const uint32_t height = size.v.height;
-            // Enlarge the input buffer for 4k video
-            if ((width > 1920 && height > 1080)) {
-                me.set().value = 4 * kLinearBufferSize;
-            }
+            // Allow half a byte per pixel, i.e. 1MB for 1080p, 4MB for 4k and 16MB for 8k video.
+            // This is the same estimate V4L2VideoDecodeAccelerator sizes its input buffers with.
+            const size_t area = static_cast<size_t>(size.v.width) * size.v.height;
+            me.set().value = std::max(kLinearBufferSize, area / 2);
             return C2R::Ok();
         }
     };
@@ -373,6 +418,19 @@ C2VDAComponent::IntfImpl::IntfImpl(C2String name, const std::shared_ptr<C2Reflec
                                      .inRange(C2Color::MATRIX_UNSPECIFIED, C2Color::MATRIX_OTHER)})
                     .withSetter(MergedColorAspectsSetter, mDefaultColorAspects, mCodedColorAspects)
                     .build());
+
+    addParameter(DefineParam(mLowLatencyMode, C2_PARAMKEY_VDA_LOW_LATENCY_MODE)
+                         .withDefault(new C2VDALowLatencyModeTuning(0u))
+                         .withFields({C2F(mLowLatencyMode, value).oneOf({0u, 1u})})
+                         .withSetter(Setter<C2VDALowLatencyModeTuning>::StrictValueWithNoDeps)
+                         .build());
+
+    addParameter(
+            DefineParam(mMaxWorksInFlight, C2_PARAMKEY_VDA_MAX_WORKS_IN_FLIGHT)
+                    .withDefault(new C2VDAMaxWorksInFlightTuning(0u))
+                    .withFields({C2F(mMaxWorksInFlight, value).inRange(0u, kMaxWorksInFlight)})
+                    .withSetter(MaxWorksInFlightSetter)
+                    .build());
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -404,10 +462,22 @@ C2VDAComponent::C2VDAComponent(C2String name, c2_node_id_t id,
         mVDAInitResult(VideoDecodeAcceleratorAdaptor::Result::ILLEGAL_STATE),
         mComponentState(ComponentState::UNINITIALIZED),
         mPendingOutputEOS(false),
+        mSendFinishedWorksPosted(false),
+        mMaxFinishedWorksBatchSize(kDefaultMaxFinishedWorksBatchSize),
         mPendingColorAspectsChange(false),
         mPendingColorAspectsChangeFrameIndex(0),
+        mColorAspectsSpsId(-1),
+        mOutputBuffersPreallocated(false),
+        mLowLatencyMode(false),
+        mVDAProfile(media::VIDEO_CODEC_PROFILE_UNKNOWN),
+        mBlockPoolId(0),
+        mKeepAcceleratorTimeoutMs(kDefaultKeepAcceleratorTimeoutMs),
+        mKeepAcceleratorGeneration(0),
+        mFrameLatencyDumpRequest(0),
         mCodecProfile(media::VIDEO_CODEC_PROFILE_UNKNOWN),
         mState(State::UNLOADED),
+        mMaxWorksInFlight(0u),
+        mWorksInFlight(0u),
         mWeakThisFactory(this) {
     // TODO(johnylin): the client may need to know if init is failed.
     if (mIntfImpl->status() != C2_OK) {
@@ -416,6 +486,17 @@ C2VDAComponent::C2VDAComponent(C2String name, c2_node_id_t id,
     }
 
     mSecureMode = name.find(".secure") != std::string::npos;
+    const int32_t frameLatency = property_get_int32(kFrameLatencyProperty, 0);
+    if (frameLatency > 0) {
+        mLatencyTracker = new media::FrameLatencyTracker(frameLatency > 1);
+        mFrameLatencyDumpRequest = property_get_int32(kFrameLatencyDumpProperty, 0);
+    }
+    mMaxFinishedWorksBatchSize = std::max(
+            1, property_get_int32(kMaxFinishedWorksBatchSizeProperty,
+                                  kDefaultMaxFinishedWorksBatchSize));
+    mKeepAcceleratorTimeoutMs =
+            std::max(0, property_get_int32(kKeepAcceleratorTimeoutProperty,
+                                           kDefaultKeepAcceleratorTimeoutMs));
     if (!mThread.Start()) {
         ALOGE("Component thread failed to start.");
         return;
@@ -442,26 +523,50 @@ void C2VDAComponent::onDestroy() {
     stopDequeueThread();
 }
 
-void C2VDAComponent::onStart(media::VideoCodecProfile profile, ::base::WaitableEvent* done) {
+void C2VDAComponent::onStart(media::VideoCodecProfile profile, bool lowLatency,
+                             ::base::WaitableEvent* done) {
     DCHECK(mTaskRunner->BelongsToCurrentThread());
     ALOGV("onStart");
     CHECK_EQ(mComponentState, ComponentState::UNINITIALIZED);
 
+    if (mVDAAdaptor) {
+        // The accelerator is kept from the last stop. Cancel its timeout either way.
+        mKeepAcceleratorGeneration++;
+        // The accelerator was reset on stop, which also dropped its mappings of the input
+        // buffers of the previous session.
+        if (profile == mVDAProfile && lowLatency == mLowLatencyMode &&
+            mIntfImpl->getBlockPoolId() == mBlockPoolId && restartKeptAccelerator()) {
+            ALOGV("Restart with the kept accelerator");
+        } else {
+            releaseAccelerator();
+        }
+    }
+
+    if (mVDAAdaptor) {
+        mVDAInitResult = VideoDecodeAcceleratorAdaptor::Result::SUCCESS;
+    } else {
+        mLowLatencyMode = lowLatency;
 #ifdef V4L2_CODEC2_ARC
-    mVDAAdaptor.reset(new arc::C2VDAAdaptorProxy());
+        mVDAAdaptor.reset(new arc::C2VDAAdaptorProxy());
 #else
-    mVDAAdaptor.reset(new C2VDAAdaptor());
+        mVDAAdaptor.reset(new C2VDAAdaptor());
 #endif
 
-    mVDAInitResult = mVDAAdaptor->initialize(profile, mSecureMode, this);
+        mVDAAdaptor->setLatencyTracker(mLatencyTracker);
+        mVDAInitResult = mVDAAdaptor->initialize(profile, mSecureMode, mLowLatencyMode, this);
+        mVDAProfile = profile;
+    }
     if (mVDAInitResult == VideoDecodeAcceleratorAdaptor::Result::SUCCESS) {
         mComponentState = ComponentState::STARTED;
     }
+    mOutputBuffersPreallocated = false;
 
     if (!mSecureMode && mIntfImpl->getInputCodec() == InputCodec::H264) {
         // Get default color aspects on start.
         updateColorAspects();
         mPendingColorAspectsChange = false;
+        mColorAspectsParser.reset();
+        mColorAspectsSpsId = -1;
     }
 
     done->Signal();
@@ -477,8 +582,8 @@ void C2VDAComponent::onQueueWork(std::unique_ptr<C2Work> work) {
     if (work->input.flags & C2FrameData::FLAG_END_OF_STREAM) {
         drainMode = DRAIN_COMPONENT_WITH_EOS;
     }
+    // The size of mQueue may be bounded by queue_nb(), see C2VDAMaxWorksInFlightTuning.
     mQueue.push({std::move(work), drainMode});
-    // TODO(johnylin): set a maximum size of mQueue and check if mQueue is already full.
 
     mTaskRunner->PostTask(FROM_HERE,
                           ::base::Bind(&C2VDAComponent::onDequeueWork, ::base::Unretained(this)));
@@ -487,19 +592,33 @@ void C2VDAComponent::onQueueWork(std::unique_ptr<C2Work> work) {
 void C2VDAComponent::onDequeueWork() {
     DCHECK(mTaskRunner->BelongsToCurrentThread());
     ALOGV("onDequeueWork");
-    EXPECT_RUNNING_OR_RETURN_ON_ERROR();
-    if (mQueue.empty()) {
-        return;
-    }
-    if (mComponentState == ComponentState::DRAINING ||
-        mComponentState == ComponentState::FLUSHING) {
-        ALOGV("Temporarily stop dequeueing works since component is draining/flushing.");
-        return;
-    }
-    if (mComponentState != ComponentState::STARTED) {
-        ALOGE("Work queue should be empty if the component is not in STARTED state.");
-        return;
+    // In low-latency mode, send all queued works to accelerator at once instead of one work per
+    // task, so that input does not wait behind other tasks on the component thread.
+    do {
+        EXPECT_RUNNING_OR_RETURN_ON_ERROR();
+        if (mQueue.empty()) {
+            return;
+        }
+        if (mComponentState == ComponentState::DRAINING ||
+            mComponentState == ComponentState::FLUSHING) {
+            ALOGV("Temporarily stop dequeueing works since component is draining/flushing.");
+            return;
+        }
+        if (mComponentState != ComponentState::STARTED) {
+            ALOGE("Work queue should be empty if the component is not in STARTED state.");
+            return;
+        }
+        processQueuedWork();
+    } while (mLowLatencyMode);
+
+    if (!mQueue.empty()) {
+        mTaskRunner->PostTask(FROM_HERE, ::base::Bind(&C2VDAComponent::onDequeueWork,
+                                                      ::base::Unretained(this)));
     }
+}
+
+void C2VDAComponent::processQueuedWork() {
+    DCHECK(mTaskRunner->BelongsToCurrentThread());
 
     // Dequeue a work from mQueue.
     std::unique_ptr<C2Work> work(std::move(mQueue.front().mWork));
@@ -510,6 +629,9 @@ void C2VDAComponent::onDequeueWork() {
     bool isEmptyCSDWork = false;
     // Use frameIndex as bitstreamId.
     int32_t bitstreamId = frameIndexToBitstreamId(work->input.ordinal.frameIndex);
+    if (mLatencyTracker) {
+        mLatencyTracker->Record(bitstreamId, media::FrameLatencyTracker::Stage::kDequeued);
+    }
     if (work->input.buffers.empty()) {
         // Client may queue a work with no input buffer for either it's EOS or empty CSD, otherwise
         // every work must have one input buffer.
@@ -538,6 +660,13 @@ void C2VDAComponent::onDequeueWork() {
         }
         // Send input buffer to VDA for decode.
         sendInputBufferToAccelerator(linearBlock, bitstreamId);
+
+        // Allocate output buffers while the accelerator is parsing the first frames, instead of
+        // after it reports the output format.
+        if (!mSecureMode && !mOutputBuffersPreallocated && mGraphicBlocks.empty() &&
+            !mPendingOutputFormat) {
+            preallocateOutputBuffers(linearBlock);
+        }
     }
 
     CHECK_EQ(work->worklets.size(), 1u);
@@ -552,16 +681,12 @@ void C2VDAComponent::onDequeueWork() {
     }
 
     // Put work to mPendingWorks.
-    mPendingWorks.emplace_back(std::move(work));
+    mPendingWorksByBitstreamId[bitstreamId] =
+            mPendingWorks.emplace(mPendingWorks.end(), std::move(work));
     if (isEmptyCSDWork) {
         // Directly report the empty CSD work as finished.
         reportWorkIfFinished(bitstreamId);
     }
-
-    if (!mQueue.empty()) {
-        mTaskRunner->PostTask(FROM_HERE, ::base::Bind(&C2VDAComponent::onDequeueWork,
-                                                      ::base::Unretained(this)));
-    }
 }
 
 void C2VDAComponent::onInputBufferDone(int32_t bitstreamId) {
@@ -585,7 +710,7 @@ void C2VDAComponent::onOutputBufferReturned(std::shared_ptr<C2GraphicBlock> bloc
                                             uint32_t poolId) {
     DCHECK(mTaskRunner->BelongsToCurrentThread());
     ALOGV("onOutputBufferReturned: pool id=%u", poolId);
-    if (mComponentState == ComponentState::UNINITIALIZED) {
+    if (mComponentState == ComponentState::UNINITIALIZED && !mVDAAdaptor) {
         // Output buffer is returned from client after component is stopped. Just let the buffer be
         // released.
         return;
@@ -608,15 +733,16 @@ void C2VDAComponent::onOutputBufferReturned(std::shared_ptr<C2GraphicBlock> bloc
     info->mGraphicBlock = std::move(block);
     info->mState = GraphicBlockInfo::State::OWNED_BY_COMPONENT;
 
+    if (mComponentState == ComponentState::UNINITIALIZED) {
+        // The accelerator is kept after stop. Hold the buffer until the component is restarted.
+        return;
+    }
     if (mPendingOutputFormat) {
         tryChangeOutputFormat();
     } else {
         // Do not pass the ownership to accelerator if this buffer will still be reused under
         // |mPendingBuffersToWork|.
-        auto existingFrame = std::find_if(
-                mPendingBuffersToWork.begin(), mPendingBuffersToWork.end(),
-                [id = info->mBlockId](const OutputBufferInfo& o) { return o.mBlockId == id; });
-        bool ownByAccelerator = existingFrame == mPendingBuffersToWork.end();
+        bool ownByAccelerator = info->mPendingToWorkCount == 0;
         sendOutputBufferToAccelerator(info, ownByAccelerator);
         sendOutputBufferToWorkIfAny(false /* dropIfUnavailable */);
     }
@@ -637,6 +763,7 @@ void C2VDAComponent::onOutputBufferDone(int32_t pictureBufferId, int32_t bitstre
         info->mState = GraphicBlockInfo::State::OWNED_BY_COMPONENT;
     }
     mPendingBuffersToWork.push_back({bitstreamId, pictureBufferId});
+    info->mPendingToWorkCount++;
     sendOutputBufferToWorkIfAny(false /* dropIfUnavailable */);
 }
 
@@ -656,9 +783,7 @@ void C2VDAComponent::sendOutputBufferToWorkIfAny(bool dropIfUnavailable) {
 
         if (info->mState == GraphicBlockInfo::State::OWNED_BY_CLIENT) {
             // This buffer is the existing frame and still owned by client.
-            if (!dropIfUnavailable &&
-                std::find(mUndequeuedBlockIds.begin(), mUndequeuedBlockIds.end(),
-                          nextBuffer.mBlockId) == mUndequeuedBlockIds.end()) {
+            if (!dropIfUnavailable && info->mUndequeuedCount == 0) {
                 ALOGV("Still waiting for existing frame returned from client...");
                 return;
             }
@@ -669,7 +794,7 @@ void C2VDAComponent::sendOutputBufferToWorkIfAny(bool dropIfUnavailable) {
             // This buffer is ready to push into the corresponding work.
             // Output buffer will be passed to client soon along with mListener->onWorkDone_nb().
             info->mState = GraphicBlockInfo::State::OWNED_BY_CLIENT;
-            mBuffersInClient++;
+            incrementBuffersInClient();
             updateUndequeuedBlockIds(info->mBlockId);
 
             // Attach output buffer to the work corresponded to bitstreamId.
@@ -693,13 +818,31 @@ void C2VDAComponent::sendOutputBufferToWorkIfAny(bool dropIfUnavailable) {
         }
         reportWorkIfFinished(nextBuffer.mBitstreamId);
         mPendingBuffersToWork.pop_front();
+        info->mPendingToWorkCount--;
     }
 }
 
 void C2VDAComponent::updateUndequeuedBlockIds(int32_t blockId) {
     // The size of |mUndequedBlockIds| will always be the minimum buffer count for display.
     mUndequeuedBlockIds.push_back(blockId);
+    mGraphicBlocks[blockId].mUndequeuedCount++;
+    int32_t poppedBlockId = mUndequeuedBlockIds.front();
     mUndequeuedBlockIds.pop_front();
+    if (poppedBlockId >= 0) {
+        mGraphicBlocks[poppedBlockId].mUndequeuedCount--;
+    }
+}
+
+void C2VDAComponent::resizeUndequeuedBlockIds(size_t size) {
+    mUndequeuedBlockIds.resize(size, -1);
+    for (auto& info : mGraphicBlocks) {
+        info.mUndequeuedCount = 0;
+    }
+    for (int32_t blockId : mUndequeuedBlockIds) {
+        if (blockId >= 0) {
+            mGraphicBlocks[blockId].mUndequeuedCount++;
+        }
+    }
 }
 
 void C2VDAComponent::onDrain(uint32_t drainMode) {
@@ -817,7 +960,7 @@ void C2VDAComponent::onResetDone() {
 void C2VDAComponent::onFlushDone() {
     ALOGV("onFlushDone");
     reportAbandonedWorks();
-    mPendingBuffersToWork.clear();
+    clearPendingBuffersToWork();
     mComponentState = ComponentState::STARTED;
 
     // Work dequeueing was stopped while component flushing. Restart it.
@@ -832,15 +975,25 @@ void C2VDAComponent::onStopDone() {
     // TODO(johnylin): At this moment, there may be C2Buffer still owned by client, do we need to
     // do something for them?
     reportAbandonedWorks();
-    mPendingOutputFormat.reset();
-    mPendingBuffersToWork.clear();
-    if (mVDAAdaptor.get()) {
-        mVDAAdaptor->destroy();
-        mVDAAdaptor.reset(nullptr);
+    clearPendingBuffersToWork();
+    stopDequeueThread();
+
+    // The accelerator is reset, so it can decode the next stream as is unless it was changing the
+    // output format.
+    if (mVDAAdaptor && mKeepAcceleratorTimeoutMs > 0 && !mPendingOutputFormat) {
+        ALOGV("Keep the accelerator for %d ms", mKeepAcceleratorTimeoutMs);
+        mTaskRunner->PostDelayedTask(
+                FROM_HERE,
+                ::base::Bind(&C2VDAComponent::onKeptAcceleratorTimeout, ::base::Unretained(this),
+                             ++mKeepAcceleratorGeneration),
+                ::base::TimeDelta::FromMilliseconds(mKeepAcceleratorTimeoutMs));
+    } else {
+        releaseAccelerator();
     }
 
-    stopDequeueThread();
-    mGraphicBlocks.clear();
+    if (mLatencyTracker) {
+        ALOGI("Frame latency since creation:\n%s", mLatencyTracker->Dump().c_str());
+    }
 
     mStopDoneEvent->Signal();
     mStopDoneEvent = nullptr;
@@ -874,22 +1027,13 @@ void C2VDAComponent::sendInputBufferToAccelerator(const C2ConstLinearBlock& inpu
     mVDAAdaptor->decode(bitstreamId, dupFd, input.offset(), input.size());
 }
 
-std::deque<std::unique_ptr<C2Work>>::iterator C2VDAComponent::findPendingWorkByBitstreamId(
-        int32_t bitstreamId) {
-    return std::find_if(mPendingWorks.begin(), mPendingWorks.end(),
-                        [bitstreamId](const std::unique_ptr<C2Work>& w) {
-                            return frameIndexToBitstreamId(w->input.ordinal.frameIndex) ==
-                                   bitstreamId;
-                        });
-}
-
 C2Work* C2VDAComponent::getPendingWorkByBitstreamId(int32_t bitstreamId) {
-    auto workIter = findPendingWorkByBitstreamId(bitstreamId);
-    if (workIter == mPendingWorks.end()) {
+    auto workIter = mPendingWorksByBitstreamId.find(bitstreamId);
+    if (workIter == mPendingWorksByBitstreamId.end()) {
         ALOGE("Can't find pending work by bitstream ID: %d", bitstreamId);
         return nullptr;
     }
-    return workIter->get();
+    return workIter->second->get();
 }
 
 C2VDAComponent::GraphicBlockInfo* C2VDAComponent::getGraphicBlockById(int32_t blockId) {
@@ -901,16 +1045,101 @@ C2VDAComponent::GraphicBlockInfo* C2VDAComponent::getGraphicBlockById(int32_t bl
 }
 
 C2VDAComponent::GraphicBlockInfo* C2VDAComponent::getGraphicBlockByPoolId(uint32_t poolId) {
-    auto blockIter = std::find_if(mGraphicBlocks.begin(), mGraphicBlocks.end(),
-                                  [poolId](const GraphicBlockInfo& gb) {
-                                      return gb.mPoolId == poolId;
-                                  });
-
-    if (blockIter == mGraphicBlocks.end()) {
+    auto blockIter = mBlockIdsByPoolId.find(poolId);
+    if (blockIter == mBlockIdsByPoolId.end()) {
         ALOGE("getGraphicBlockByPoolId failed: poolId=%u", poolId);
         return nullptr;
     }
-    return &(*blockIter);
+    return &mGraphicBlocks[blockIter->second];
+}
+
+void C2VDAComponent::clearGraphicBlocks() {
+    mGraphicBlocks.clear();
+    mBlockIdsByPoolId.clear();
+}
+
+void C2VDAComponent::updateBlockIdsByPoolId() {
+    mBlockIdsByPoolId.clear();
+    for (const auto& info : mGraphicBlocks) {
+        mBlockIdsByPoolId[info.mPoolId] = info.mBlockId;
+    }
+}
+
+void C2VDAComponent::clearPendingBuffersToWork() {
+    for (const auto& pending : mPendingBuffersToWork) {
+        GraphicBlockInfo* info = getGraphicBlockById(pending.mBlockId);
+        if (info) {
+            info->mPendingToWorkCount--;
+        }
+    }
+    mPendingBuffersToWork.clear();
+}
+
+void C2VDAComponent::onKeptAcceleratorTimeout(uint32_t generation) {
+    DCHECK(mTaskRunner->BelongsToCurrentThread());
+    if (generation != mKeepAcceleratorGeneration ||
+        mComponentState != ComponentState::UNINITIALIZED) {
+        return;  // The accelerator is reused or released already.
+    }
+    ALOGV("Release the kept accelerator");
+    releaseAccelerator();
+}
+
+void C2VDAComponent::onAcceleratorError() {
+    DCHECK(mTaskRunner->BelongsToCurrentThread());
+    if (mComponentState == ComponentState::UNINITIALIZED && mVDAAdaptor) {
+        ALOGV("Release the kept accelerator on error");
+        mKeepAcceleratorGeneration++;
+        releaseAccelerator();
+    } else {
+        // No profile matches on the next start(), so the accelerator is initialized again.
+        mVDAProfile = media::VIDEO_CODEC_PROFILE_UNKNOWN;
+    }
+}
+
+void C2VDAComponent::onRelease(::base::WaitableEvent* done) {
+    DCHECK(mTaskRunner->BelongsToCurrentThread());
+    ALOGV("onRelease");
+    // The component is not started again, so the accelerator kept by stop() is of no use.
+    mKeepAcceleratorGeneration++;
+    releaseAccelerator();
+    done->Signal();
+}
+
+void C2VDAComponent::releaseAccelerator() {
+    DCHECK(mTaskRunner->BelongsToCurrentThread());
+    mPendingOutputFormat.reset();
+    if (mVDAAdaptor.get()) {
+        mVDAAdaptor->destroy();
+        mVDAAdaptor.reset(nullptr);
+    }
+
+    stopDequeueThread();
+    clearGraphicBlocks();
+}
+
+bool C2VDAComponent::restartKeptAccelerator() {
+    DCHECK(mTaskRunner->BelongsToCurrentThread());
+    if (mGraphicBlocks.empty()) {
+        return true;  // The output buffers are not allocated yet.
+    }
+
+    std::shared_ptr<C2BlockPool> blockPool;
+    auto err = GetCodec2BlockPool(mBlockPoolId, shared_from_this(), &blockPool);
+    if (err != C2_OK) {
+        ALOGE("Graphic block allocator is invalid");
+        return false;
+    }
+    // The buffers returned by client while stopped are passed back to accelerator, which still
+    // regards them as owned by client.
+    for (auto& info : mGraphicBlocks) {
+        if (info.mState == GraphicBlockInfo::State::OWNED_BY_COMPONENT) {
+            sendOutputBufferToAccelerator(&info, true /* ownByAccelerator */);
+        }
+    }
+    return startDequeueThread(mOutputFormat.mCodedSize,
+                              static_cast<uint32_t>(mOutputFormat.mPixelFormat),
+                              std::move(blockPool), false /* resetBuffersInClient */);
 }
 
 void C2VDAComponent::onOutputFormatChanged(std::unique_ptr<VideoFormat> format) {
@@ -954,6 +1183,32 @@ void C2VDAComponent::tryChangeOutputFormat() {
 
     CHECK_EQ(mPendingOutputFormat->mPixelFormat, HalPixelFormat::YCbCr_420_888);
 
+    // The accelerator decodes with the layout of the coded size, so the allocated blocks can only
+    // be reused if it is unchanged, e.g. when only the visible rectangle or the number of buffers
+    // changes. Then the blocks are just imported to the accelerator again, which avoids stopping
+    // the dequeue thread and allocating a new buffer set.
+    size_t bufferCount = mPendingOutputFormat->mMinNumBuffers;
+    bufferCount += mLowLatencyMode ? kDpbOutputBufferExtraCountForLowLatency
+                                   : kDpbOutputBufferExtraCount;
+    if (!mGraphicBlocks.empty() && mGraphicBlocks.size() >= bufferCount &&
+        mOutputFormat.mPixelFormat == mPendingOutputFormat->mPixelFormat &&
+        mOutputFormat.mCodedSize == mPendingOutputFormat->mCodedSize) {
+        ALOGV("Reuse %zu graphic blocks for new output format", mGraphicBlocks.size());
+        // As after allocateBuffersFromBlockAllocator(), the count of the buffers in use.
+        mOutputFormat.mMinNumBuffers = mGraphicBlocks.size();
+        setOutputFormatCrop(mPendingOutputFormat->mVisibleRect);
+        mVDAAdaptor->assignPictureBuffers(mGraphicBlocks.size());
+        for (auto& info : mGraphicBlocks) {
+            info.mNeedsReimport = true;
+            // The blocks owned by client are passed to accelerator once they are returned.
+            if (info.mState == GraphicBlockInfo::State::OWNED_BY_COMPONENT) {
+                sendOutputBufferToAccelerator(&info, true /* ownByAccelerator */);
+            }
+        }
+        mPendingOutputFormat.reset();
+        return;
+    }
+
     mOutputFormat.mPixelFormat = mPendingOutputFormat->mPixelFormat;
     mOutputFormat.mMinNumBuffers = mPendingOutputFormat->mMinNumBuffers;
     mOutputFormat.mCodedSize = mPendingOutputFormat->mCodedSize;
@@ -967,6 +1222,9 @@ void C2VDAComponent::tryChangeOutputFormat() {
         reportError(err);
         return;
     }
+    // The blocks include the extra ones on top of the accelerator's minimum, all of which are
+    // imported as picture buffers.
+    mVDAAdaptor->assignPictureBuffers(mGraphicBlocks.size());
 
     for (auto& info : mGraphicBlocks) {
         sendOutputBufferToAccelerator(&info, true /* ownByAccelerator */);
@@ -980,14 +1238,14 @@ c2_status_t C2VDAComponent::allocateBuffersFromBlockAllocator(const media::Size&
 
     stopDequeueThread();
 
-    size_t bufferCount = mOutputFormat.mMinNumBuffers + kDpbOutputBufferExtraCount;
-
-    // Allocate the output buffers.
-    mVDAAdaptor->assignPictureBuffers(bufferCount);
+    size_t bufferCount = mOutputFormat.mMinNumBuffers;
+    bufferCount += mLowLatencyMode ? kDpbOutputBufferExtraCountForLowLatency
+                                   : kDpbOutputBufferExtraCount;
 
     // Get block pool ID configured from the client.
     std::shared_ptr<C2BlockPool> blockPool;
     auto poolId = mIntfImpl->getBlockPoolId();
+    mBlockPoolId = poolId;
     ALOGI("Using C2BlockPool ID = %" PRIu64 " for allocating output buffers", poolId);
     auto err = GetCodec2BlockPool(poolId, shared_from_this(), &blockPool);
     if (err != C2_OK) {
@@ -996,7 +1254,7 @@ c2_status_t C2VDAComponent::allocateBuffersFromBlockAllocator(const media::Size&
         return err;
     }
 
-    mGraphicBlocks.clear();
+    clearGraphicBlocks();
 
     bool useBufferQueue = blockPool->getAllocatorId() == C2PlatformAllocatorStore::BUFFERQUEUE;
     size_t minBuffersForDisplay = 0;
@@ -1044,7 +1302,12 @@ c2_status_t C2VDAComponent::allocateBuffersFromBlockAllocator(const media::Size&
     }
 
     ALOGV("Minimum undequeued buffer count = %zu", minBuffersForDisplay);
-    mUndequeuedBlockIds.resize(minBuffersForDisplay, -1);
+    if (mLowLatencyMode && minBuffersForDisplay > kDpbOutputBufferExtraCountForLowLatency) {
+        ALOGW("%zu buffers are kept undequeued, more than the %u extra ones, decoding may stall",
+              minBuffersForDisplay, kDpbOutputBufferExtraCountForLowLatency);
+    }
+    // Block IDs of the previous buffers do not refer to the new ones.
+    mUndequeuedBlockIds.assign(minBuffersForDisplay, -1);
 
     for (size_t i = 0; i < bufferCount; ++i) {
         std::shared_ptr<C2GraphicBlock> block;
@@ -1060,7 +1323,7 @@ c2_status_t C2VDAComponent::allocateBuffersFromBlockAllocator(const media::Size&
                 ALOGD("allocate buffer timeout, %d retry time(s) left...", retries_left);
                 retries_left--;
             } else if (err != C2_OK) {
-                mGraphicBlocks.clear();
+                clearGraphicBlocks();
                 ALOGE("failed to allocate buffer: %d", err);
                 reportError(err);
                 return err;
@@ -1074,7 +1337,7 @@ c2_status_t C2VDAComponent::allocateBuffersFromBlockAllocator(const media::Size&
             err = C2VdaPooledBlockPool::getPoolIdFromGraphicBlock(block, &poolId);
         }
         if (err != C2_OK) {
-            mGraphicBlocks.clear();
+            clearGraphicBlocks();
             ALOGE("failed to getPoolIdFromGraphicBlock: %d", err);
             reportError(err);
             return err;
@@ -1156,6 +1419,7 @@ void C2VDAComponent::appendOutputBuffer(std::shared_ptr<C2GraphicBlock> block, u
     info.mHandle = std::move(passedHandle);
     info.mPlanes = std::move(passedPlanes);
 
+    mBlockIdsByPoolId[poolId] = info.mBlockId;
     mGraphicBlocks.push_back(std::move(info));
 }
 
@@ -1189,6 +1453,7 @@ void C2VDAComponent::appendSecureOutputBuffer(std::shared_ptr<C2GraphicBlock> bl
     info.mPixelFormat = pixelFormat;
     // In secure mode, since planes are not referred in Chrome side, empty plane is valid.
     info.mPlanes.clear();
+    mBlockIdsByPoolId[poolId] = info.mBlockId;
     mGraphicBlocks.push_back(std::move(info));
 #else
     ALOGE("appendSecureOutputBuffer() is not supported...");
@@ -1206,6 +1471,16 @@ void C2VDAComponent::sendOutputBufferToAccelerator(GraphicBlockInfo* info, bool
         info->mState = GraphicBlockInfo::State::OWNED_BY_ACCELERATOR;
     }
 
+    if (info->mNeedsReimport) {
+        info->mNeedsReimport = false;
+        info->mHandle.reset(dup(info->mGraphicBlock->handle()->data[0]));
+        if (!info->mHandle.is_valid()) {
+            ALOGE("Failed to dup(%d), errno=%d", info->mGraphicBlock->handle()->data[0], errno);
+            reportError(C2_CORRUPTED);
+            return;
+        }
+    }
+
     // is_valid() is true for the first time the buffer is passed to VDA. In that case, VDA needs to
     // import the buffer first.
     if (info->mHandle.is_valid()) {
@@ -1221,7 +1496,10 @@ bool C2VDAComponent::parseCodedColorAspects(const C2ConstLinearBlock& input) {
     const uint8_t* data = view.data();
     const uint32_t size = view.capacity();
 
-    std::unique_ptr<media::H264Parser> h264Parser = std::make_unique<media::H264Parser>();
+    if (!mColorAspectsParser) {
+        mColorAspectsParser = std::make_unique<media::H264Parser>();
+    }
+    media::H264Parser* h264Parser = mColorAspectsParser.get();
     h264Parser->SetStream(data, static_cast<off_t>(size));
     media::H264NALU nalu;
     media::H264Parser::Result parRes = h264Parser->AdvanceToNextNALU(&nalu);
@@ -1235,11 +1513,18 @@ bool C2VDAComponent::parseCodedColorAspects(const C2ConstLinearBlock& input) {
     }
 
     int spsId;
-    parRes = h264Parser->ParseSPS(&spsId);
+    bool spsChanged;
+    parRes = h264Parser->ParseSPS(&spsId, &spsChanged);
     if (parRes != media::H264Parser::kEOStream && parRes != media::H264Parser::kOk) {
         ALOGE("H264 ParseSPS error: %d", static_cast<int>(parRes));
         return false;
     }
+    if (!spsChanged && spsId == mColorAspectsSpsId) {
+        // The color aspects of this SPS were parsed and configured already.
+        ALOGV("SPS unchanged");
+        return false;
+    }
+    mColorAspectsSpsId = spsId;
 
     // Parse ISO color aspects from H264 SPS bitstream.
     const media::H264SPS* sps = h264Parser->GetSPS(spsId);
@@ -1283,6 +1568,105 @@ bool C2VDAComponent::parseCodedColorAspects(const C2ConstLinearBlock& input) {
     return true;
 }
 
+bool C2VDAComponent::predictOutputFormat(const C2ConstLinearBlock& input, media::Size* codedSize,
+                                         uint32_t* dpbSize) {
+    C2ReadView view = input.map().get();
+    const uint8_t* data = view.data();
+    const uint32_t size = view.capacity();
+
+    switch (mIntfImpl->getInputCodec()) {
+    case InputCodec::H264: {
+        media::H264Parser h264Parser;
+        h264Parser.SetStream(data, static_cast<off_t>(size));
+        media::H264NALU nalu;
+        while (h264Parser.AdvanceToNextNALU(&nalu) == media::H264Parser::kOk) {
+            if (nalu.nal_unit_type != media::H264NALU::kSPS) {
+                continue;
+            }
+            int spsId;
+            if (h264Parser.ParseSPS(&spsId) != media::H264Parser::kOk) {
+                return false;
+            }
+            const media::H264SPS* sps = h264Parser.GetSPS(spsId);
+            // Interlaced streams are left to the accelerator, their coded size may be rounded
+            // differently.
+            if (!sps->frame_mbs_only_flag) {
+                return false;
+            }
+            media::Size spsCodedSize = sps->GetCodedSize().value_or(media::Size());
+            if (spsCodedSize.IsEmpty()) {
+                return false;
+            }
+            // The DPB size per spec, as in H264Decoder::ProcessSPS().
+            uint32_t mbs = static_cast<uint32_t>(spsCodedSize.width() / 16) *
+                           (spsCodedSize.height() / 16);
+            uint32_t maxDpbFrames =
+                    std::min(media::H264LevelToMaxDpbMbs(sps->level_idc) / mbs, 16u);
+            uint32_t spsDpbSize = std::max({maxDpbFrames,
+                                            static_cast<uint32_t>(sps->max_num_ref_frames),
+                                            static_cast<uint32_t>(sps->max_dec_frame_buffering)});
+            if (spsDpbSize == 0 || spsDpbSize > 16) {
+                return false;
+            }
+            *codedSize = spsCodedSize;
+            *dpbSize = spsDpbSize;
+            return true;
+        }
+        return false;
+    }
+    case InputCodec::VP8: {
+        media::Vp8Parser vp8Parser;
+        media::Vp8FrameHeader header;
+        if (!vp8Parser.ParseFrame(data, size, &header) || !header.IsKeyframe()) {
+            return false;
+        }
+        // Coded in 16x16 macroblocks. The last, golden and altref frames plus the one decoded.
+        *codedSize = media::Size((header.width + 15) & ~15, (header.height + 15) & ~15);
+        *dpbSize = 4;
+        return !codedSize->IsEmpty();
+    }
+    case InputCodec::VP9: {
+        media::Vp9Parser vp9Parser(false /* parsing_compressed_header */);
+        media::Vp9FrameHeader header;
+        vp9Parser.SetStream(data, static_cast<off_t>(size));
+        if (vp9Parser.ParseNextFrame(&header) != media::Vp9Parser::kOk || !header.IsKeyframe()) {
+            return false;
+        }
+        // The reference frame slots. The frame decoded is written to one of them.
+        *codedSize = media::Size((header.frame_width + 15) & ~15, (header.frame_height + 15) & ~15);
+        *dpbSize = media::kVp9NumRefFrames;
+        return !codedSize->IsEmpty();
+    }
+    }
+    return false;
+}
+
+void C2VDAComponent::preallocateOutputBuffers(const C2ConstLinearBlock& input) {
+    DCHECK(mTaskRunner->BelongsToCurrentThread());
+    media::Size codedSize;
+    uint32_t dpbSize;
+    if (!predictOutputFormat(input, &codedSize, &dpbSize)) {
+        return;
+    }
+    // Ask the accelerator for the count it will report with the actual format, which depends on
+    // its backend and on the low latency mode.
+    uint32_t minNumBuffers = mVDAAdaptor->getNumOutputBuffersForDpbSize(dpbSize);
+    if (minNumBuffers == 0) {
+        return;
+    }
+    ALOGV("Preallocate output buffers for predicted format(coded_size=%s, min_num_buffers=%u)",
+          codedSize.ToString().c_str(), minNumBuffers);
+    mOutputBuffersPreallocated = true;
+
+    // The buffers are assigned to the accelerator in tryChangeOutputFormat() if the actual format
+    // matches, or reallocated otherwise.
+    mOutputFormat.mPixelFormat = HalPixelFormat::YCbCr_420_888;
+    mOutputFormat.mMinNumBuffers = minNumBuffers;
+    mOutputFormat.mCodedSize = codedSize;
+    // The error is reported by allocateBuffersFromBlockAllocator().
+    allocateBuffersFromBlockAllocator(codedSize, static_cast<uint32_t>(mOutputFormat.mPixelFormat));
+}
+
 c2_status_t C2VDAComponent::updateColorAspects() {
     ALOGV("updateColorAspects");
     std::unique_ptr<C2StreamColorAspectsInfo::output> colorAspects =
@@ -1329,6 +1713,7 @@ void C2VDAComponent::onSurfaceChanged() {
     // Get block pool ID configured from the client.
     std::shared_ptr<C2BlockPool> blockPool;
     auto blockPoolId = mIntfImpl->getBlockPoolId();
+    mBlockPoolId = blockPoolId;
     ALOGI("Retrieving C2BlockPool ID = %" PRIu64 " for updating output buffers", blockPoolId);
     auto err = GetCodec2BlockPool(blockPoolId, shared_from_this(), &blockPool);
     if (err != C2_OK) {
@@ -1358,7 +1743,7 @@ void C2VDAComponent::onSurfaceChanged() {
         return;
     }
     ALOGV("Minimum undequeued buffer count = %zu", minBuffersForDisplay);
-    mUndequeuedBlockIds.resize(minBuffersForDisplay, -1);
+    resizeUndequeuedBlockIds(minBuffersForDisplay);
 
     for (auto& info : mGraphicBlocks) {
         bool willCancel = (info.mGraphicBlock == nullptr);
@@ -1372,6 +1757,7 @@ void C2VDAComponent::onSurfaceChanged() {
             // There may be a chance that a task in task runner before onSurfaceChange triggers
             // output format change. If so, block pool will return C2_CANCELED and no need to
             // updateGraphicBlock anymore.
+            updateBlockIdsByPoolId();
             return;
         }
         if (err != C2_OK) {
@@ -1389,6 +1775,7 @@ void C2VDAComponent::onSurfaceChanged() {
             info.mGraphicBlock = std::move(block);
         }
     }
+    updateBlockIdsByPoolId();
 
     if (!startDequeueThread(mOutputFormat.mCodedSize,
                             static_cast<uint32_t>(mOutputFormat.mPixelFormat), std::move(blockPool),
@@ -1402,6 +1789,17 @@ c2_status_t C2VDAComponent::queue_nb(std::list<std::unique_ptr<C2Work>>* const i
         return C2_BAD_STATE;
     }
     while (!items->empty()) {
+        if (mMaxWorksInFlight > 0 && mWorksInFlight.load() >= mMaxWorksInFlight) {
+            // Let the client retry on the next onWorkDone_nb() instead of queueing without bound.
+            ALOGV("Too many works in flight (%u), leave %zu works to client", mMaxWorksInFlight,
+                  items->size());
+            return C2_BLOCKING;
+        }
+        mWorksInFlight++;
+        if (mLatencyTracker) {
+            int32_t bitstreamId = frameIndexToBitstreamId(items->front()->input.ordinal.frameIndex);
+            mLatencyTracker->Record(bitstreamId, media::FrameLatencyTracker::Stage::kQueued);
+        }
         mTaskRunner->PostTask(FROM_HERE,
                               ::base::Bind(&C2VDAComponent::onQueueWork, ::base::Unretained(this),
                                            ::base::Passed(&items->front())));
@@ -1452,12 +1850,18 @@ c2_status_t C2VDAComponent::start() {
 
     mCodecProfile = mIntfImpl->getCodecProfile();
     ALOGI("get parameter: mCodecProfile = %d", static_cast<int>(mCodecProfile));
+    bool lowLatency = mIntfImpl->isLowLatencyMode();
+    ALOGI("get parameter: lowLatency = %d", lowLatency);
+    mMaxWorksInFlight = mIntfImpl->getMaxWorksInFlight();
+    ALOGI("get parameter: mMaxWorksInFlight = %u", mMaxWorksInFlight);
+    // Works not returned before the last stop() are dropped with the accelerator.
+    mWorksInFlight.store(0u);
 
     ::base::WaitableEvent done(::base::WaitableEvent::ResetPolicy::AUTOMATIC,
                                ::base::WaitableEvent::InitialState::NOT_SIGNALED);
     mTaskRunner->PostTask(FROM_HERE,
                           ::base::Bind(&C2VDAComponent::onStart, ::base::Unretained(this),
-                                       mCodecProfile, &done));
+                                       mCodecProfile, lowLatency, &done));
     done.Wait();
     c2_status_t c2Status = adaptorResultToC2Status(mVDAInitResult);
     if (c2Status != C2_OK) {
@@ -1493,7 +1897,18 @@ c2_status_t C2VDAComponent::reset() {
 }
 
 c2_status_t C2VDAComponent::release() {
-    return reset();
+    c2_status_t err = reset();
+    if (err != C2_OK || !mThread.IsRunning()) {
+        return err;
+    }
+
+    std::lock_guard<std::mutex> lock(mStartStopLock);
+    ::base::WaitableEvent done(::base::WaitableEvent::ResetPolicy::AUTOMATIC,
+                               ::base::WaitableEvent::InitialState::NOT_SIGNALED);
+    mTaskRunner->PostTask(
+            FROM_HERE, ::base::Bind(&C2VDAComponent::onRelease, ::base::Unretained(this), &done));
+    done.Wait();
+    return C2_OK;
 }
 
 std::shared_ptr<C2ComponentInterface> C2VDAComponent::intf() {
@@ -1558,19 +1973,21 @@ void C2VDAComponent::notifyError(VideoDecodeAcceleratorAdaptor::Result error) {
         return;
     }
     reportError(err);
+    // Do not keep the accelerator for restart after it fails.
+    mTaskRunner->PostTask(FROM_HERE, ::base::Bind(&C2VDAComponent::onAcceleratorError,
+                                                  ::base::Unretained(this)));
 }
 
 void C2VDAComponent::reportWorkIfFinished(int32_t bitstreamId) {
     DCHECK(mTaskRunner->BelongsToCurrentThread());
 
-    auto workIter = findPendingWorkByBitstreamId(bitstreamId);
-    if (workIter == mPendingWorks.end()) {
+    C2Work* work = getPendingWorkByBitstreamId(bitstreamId);
+    if (!work) {
         reportError(C2_CORRUPTED);
         return;
     }
 
     // EOS work will not be reported here. reportEOSWork() does it.
-    auto work = workIter->get();
     if (isWorkDone(work)) {
         if (work->worklets.front()->output.flags & C2FrameData::FLAG_DROP_FRAME) {
             // TODO: actually framework does not handle FLAG_DROP_FRAME, use C2_NOT_FOUND result to
@@ -1582,13 +1999,84 @@ void C2VDAComponent::reportWorkIfFinished(int32_t bitstreamId) {
         work->workletsProcessed = static_cast<uint32_t>(work->worklets.size());
 
         ALOGV("Reported finished work index=%llu", work->input.ordinal.frameIndex.peekull());
-        std::list<std::unique_ptr<C2Work>> finishedWorks;
-        finishedWorks.emplace_back(std::move(*workIter));
-        mListener->onWorkDone_nb(shared_from_this(), std::move(finishedWorks));
-        mPendingWorks.erase(workIter);
+        auto indexIter = mPendingWorksByBitstreamId.find(bitstreamId);
+        std::unique_ptr<C2Work> finishedWork(std::move(*indexIter->second));
+        mPendingWorks.erase(indexIter->second);
+        mPendingWorksByBitstreamId.erase(indexIter);
+        queueFinishedWork(std::move(finishedWork));
     }
 }
 
+void C2VDAComponent::queueFinishedWork(std::unique_ptr<C2Work> work) {
+    DCHECK(mTaskRunner->BelongsToCurrentThread());
+    const ::base::TimeTicks now = ::base::TimeTicks::Now();
+    if (mFinishedWorks.empty()) {
+        mFinishedWorksBatchStart = now;
+    }
+    mFinishedWorks.emplace_back(std::move(work));
+    // Also send the batch right away if no other work is in the pipeline to join it, or if its
+    // first work has waited long enough.
+    if (mLowLatencyMode || mFinishedWorks.size() >= mMaxFinishedWorksBatchSize ||
+        (mPendingWorks.empty() && mQueue.empty()) ||
+        now - mFinishedWorksBatchStart >=
+                ::base::TimeDelta::FromMilliseconds(kMaxFinishedWorksBatchDelayMs)) {
+        sendFinishedWorks();
+        return;
+    }
+    if (!mSendFinishedWorksPosted) {
+        mSendFinishedWorksPosted = true;
+        mTaskRunner->PostTask(FROM_HERE, ::base::Bind(&C2VDAComponent::onSendFinishedWorks,
+                                                      ::base::Unretained(this)));
+    }
+}
+
+void C2VDAComponent::onSendFinishedWorks() {
+    DCHECK(mTaskRunner->BelongsToCurrentThread());
+    mSendFinishedWorksPosted = false;
+    sendFinishedWorks();
+}
+
+void C2VDAComponent::sendFinishedWorks() {
+    DCHECK(mTaskRunner->BelongsToCurrentThread());
+    if (mFinishedWorks.empty()) {
+        return;
+    }
+    ALOGV("Send %zu finished works", mFinishedWorks.size());
+    if (mLatencyTracker) {
+        for (const auto& work : mFinishedWorks) {
+            const int32_t bitstreamId = frameIndexToBitstreamId(work->input.ordinal.frameIndex);
+            if (work->result == C2_OK) {
+                mLatencyTracker->Record(bitstreamId, media::FrameLatencyTracker::Stage::kDone);
+            } else {
+                // Flushed or dropped, do not count it as overwritten when its record is reused.
+                mLatencyTracker->Forget(bitstreamId);
+            }
+        }
+        maybeDumpFrameLatency();
+    }
+    std::list<std::unique_ptr<C2Work>> finishedWorks;
+    finishedWorks.swap(mFinishedWorks);
+    mWorksInFlight -= finishedWorks.size();
+    mListener->onWorkDone_nb(shared_from_this(), std::move(finishedWorks));
+}
+
+void C2VDAComponent::maybeDumpFrameLatency() {
+    DCHECK(mTaskRunner->BelongsToCurrentThread());
+    const ::base::TimeTicks now = ::base::TimeTicks::Now();
+    if (now < mNextFrameLatencyDumpCheck) {
+        return;
+    }
+    mNextFrameLatencyDumpCheck =
+            now + ::base::TimeDelta::FromMilliseconds(kFrameLatencyDumpCheckIntervalMs);
+
+    const int32_t request = property_get_int32(kFrameLatencyDumpProperty, 0);
+    if (request == mFrameLatencyDumpRequest) {
+        return;
+    }
+    mFrameLatencyDumpRequest = request;
+    ALOGI("Frame latency since creation:\n%s", mLatencyTracker->Dump().c_str());
+}
+
 bool C2VDAComponent::isWorkDone(const C2Work* work) const {
     if (work->input.flags & C2FrameData::FLAG_END_OF_STREAM) {
         // This is EOS work and should be processed by reportEOSWork().
@@ -1627,6 +2115,7 @@ void C2VDAComponent::reportEOSWork() {
 
     std::unique_ptr<C2Work> eosWork(std::move(mPendingWorks.front()));
     mPendingWorks.pop_front();
+    mPendingWorksByBitstreamId.clear();
     if (!eosWork->input.buffers.empty()) {
         eosWork->input.buffers.front().reset();
     }
@@ -1634,9 +2123,9 @@ void C2VDAComponent::reportEOSWork() {
     eosWork->workletsProcessed = static_cast<uint32_t>(eosWork->worklets.size());
     eosWork->worklets.front()->output.flags = C2FrameData::FLAG_END_OF_STREAM;
 
-    std::list<std::unique_ptr<C2Work>> finishedWorks;
-    finishedWorks.emplace_back(std::move(eosWork));
-    mListener->onWorkDone_nb(shared_from_this(), std::move(finishedWorks));
+    // Send the EOS work right away, along with the finished works queued before it.
+    mFinishedWorks.emplace_back(std::move(eosWork));
+    sendFinishedWorks();
 }
 
 void C2VDAComponent::reportAbandonedWorks() {
@@ -1655,6 +2144,7 @@ void C2VDAComponent::reportAbandonedWorks() {
         }
         abandonedWorks.emplace_back(std::move(work));
     }
+    mPendingWorksByBitstreamId.clear();
 
     for (auto& work : mAbandonedWorks) {
         // TODO: correlate the definition of flushed work result to framework.
@@ -1670,9 +2160,9 @@ void C2VDAComponent::reportAbandonedWorks() {
     // Pending EOS work will be abandoned here due to component flush if any.
     mPendingOutputEOS = false;
 
-    if (!abandonedWorks.empty()) {
-        mListener->onWorkDone_nb(shared_from_this(), std::move(abandonedWorks));
-    }
+    // The finished works queued before are sent first to keep the order.
+    mFinishedWorks.splice(mFinishedWorks.end(), abandonedWorks);
+    sendFinishedWorks();
 }
 
 void C2VDAComponent::reportError(c2_status_t error) {
@@ -1697,9 +2187,25 @@ bool C2VDAComponent::startDequeueThread(const media::Size& size, uint32_t pixelF
     return true;
 }
 
+void C2VDAComponent::incrementBuffersInClient() {
+    {
+        // Hold the lock while updating, so that the dequeue thread can not miss the wakeup between
+        // checking |mBuffersInClient| and going to sleep.
+        std::lock_guard<std::mutex> lock(mBuffersInClientLock);
+        if (mBuffersInClient++ > 0) {
+            return;  // the dequeue thread is not waiting.
+        }
+    }
+    mBuffersInClientCond.notify_one();
+}
+
 void C2VDAComponent::stopDequeueThread() {
     if (mDequeueThread.IsRunning()) {
-        mDequeueLoopStop.store(true);
+        {
+            std::lock_guard<std::mutex> lock(mBuffersInClientLock);
+            mDequeueLoopStop.store(true);
+        }
+        mBuffersInClientCond.notify_one();
         mDequeueThread.Stop();
     }
 }
@@ -1709,10 +2215,16 @@ void C2VDAComponent::dequeueThreadLoop(const media::Size& size, uint32_t pixelFo
     ALOGV("dequeueThreadLoop starts");
     DCHECK(mDequeueThread.task_runner()->BelongsToCurrentThread());
 
-    while (!mDequeueLoopStop.load()) {
-        if (mBuffersInClient.load() == 0) {
-            ::usleep(kDequeueRetryDelayUs);  // wait for retry
-            continue;
+    while (true) {
+        {
+            // Sleep until there is a buffer to dequeue back from the client, instead of polling.
+            std::unique_lock<std::mutex> lock(mBuffersInClientLock);
+            mBuffersInClientCond.wait(lock, [this] {
+                return mDequeueLoopStop.load() || mBuffersInClient.load() > 0;
+            });
+        }
+        if (mDequeueLoopStop.load()) {
+            break;
         }
         std::shared_ptr<C2GraphicBlock> block;
         C2MemoryUsage usage = {
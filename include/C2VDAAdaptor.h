@@ -22,9 +22,11 @@ public:
     ~C2VDAAdaptor() override;
 
     // Implementation of the VideoDecodeAcceleratorAdaptor interface.
-    Result initialize(media::VideoCodecProfile profile, bool secureMode,
+    Result initialize(media::VideoCodecProfile profile, bool secureMode, bool lowLatency,
                       VideoDecodeAcceleratorAdaptor::Client* client) override;
+    void setLatencyTracker(scoped_refptr<media::FrameLatencyTracker> tracker) override;
     void decode(int32_t bitstreamId, int handleFd, off_t offset, uint32_t bytesUsed) override;
+    uint32_t getNumOutputBuffersForDpbSize(uint32_t dpbSize) override;
     void assignPictureBuffers(uint32_t numOutputBuffers) override;
     void importBufferForPicture(int32_t pictureBufferId, HalPixelFormat format, int handleFd,
                                 const std::vector<VideoFramePlane>& planes) override;
@@ -50,6 +52,8 @@ public:
 private:
     std::unique_ptr<media::VideoDecodeAccelerator> mVDA;
     VideoDecodeAcceleratorAdaptor::Client* mClient;
+    // The tracker passed to the VDA on initialize(), or null.
+    scoped_refptr<media::FrameLatencyTracker> mLatencyTracker;
 
     // The number of allocated output buffers. This is obtained from assignPictureBuffers call from
     // client, and used to check validity of picture id in importBufferForPicture and
@@ -36,9 +36,11 @@ public:
     bool establishChannel();
 
     // Implementation of the VideoDecodeAcceleratorAdaptor interface.
-    Result initialize(media::VideoCodecProfile profile, bool secureMode,
+    Result initialize(media::VideoCodecProfile profile, bool secureMode, bool lowLatency,
                       VideoDecodeAcceleratorAdaptor::Client* client) override;
+    void setLatencyTracker(scoped_refptr<media::FrameLatencyTracker> tracker) override;
     void decode(int32_t bitstreamId, int handleFd, off_t offset, uint32_t size) override;
+    uint32_t getNumOutputBuffersForDpbSize(uint32_t dpbSize) override;
     void assignPictureBuffers(uint32_t numOutputBuffers) override;
     void importBufferForPicture(int32_t pictureBufferId, HalPixelFormat format, int handleFd,
                                 const std::vector<VideoFramePlane>& planes) override;
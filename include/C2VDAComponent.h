@@ -8,6 +8,7 @@
 #include <C2VDACommon.h>
 #include <VideoDecodeAcceleratorAdaptor.h>
 
+#include <h264_parser.h>
 #include <rect.h>
 #include <size.h>
 #include <video_codecs.h>
@@ -26,9 +27,12 @@
 #include <base/single_thread_task_runner.h>
 #include <base/synchronization/waitable_event.h>
 #include <base/threading/thread.h>
+#include <base/time/time.h>
 
 #include <atomic>
+#include <condition_variable>
 #include <deque>
+#include <list>
 #include <map>
 #include <mutex>
 #include <queue>
@@ -36,6 +40,28 @@
 
 namespace android {
 
+enum C2VDAParamIndexKind : C2Param::type_index_t {
+    kParamIndexVDALowLatencyMode = C2Param::TYPE_INDEX_VENDOR_START,
+    kParamIndexVDAMaxWorksInFlight,
+};
+
+// Low-latency decoding for streams without frame reordering, e.g. video calls and game streaming,
+// where the client displays each frame as soon as it is decoded. Non-zero to enable. The component
+// then keeps fewer output buffers in flight and returns decoded frames without batching. Only read
+// on start().
+typedef C2GlobalParam<C2Tuning, C2Uint32Value, kParamIndexVDALowLatencyMode>
+        C2VDALowLatencyModeTuning;
+constexpr char C2_PARAMKEY_VDA_LOW_LATENCY_MODE[] = "vendor.vda.low-latency-mode";
+
+// The maximum number of works queued to the component and not yet returned to the client, or 0
+// for no limit, which is the default. When it is reached, queue_nb() returns C2_BLOCKING and
+// leaves the remaining works in the list, so that the client does not pin an unbounded number of
+// input buffers while the hardware falls behind. Only for clients that retry the remaining works
+// on onWorkDone_nb(); CCodec treats C2_BLOCKING as an error. Only read on start().
+typedef C2GlobalParam<C2Tuning, C2Uint32Value, kParamIndexVDAMaxWorksInFlight>
+        C2VDAMaxWorksInFlightTuning;
+constexpr char C2_PARAMKEY_VDA_MAX_WORKS_IN_FLIGHT[] = "vendor.vda.max-works-in-flight";
+
 class C2VDAComponent : public C2Component,
                        public VideoDecodeAcceleratorAdaptor::Client,
                        public std::enable_shared_from_this<C2VDAComponent> {
@@ -49,6 +75,8 @@ public:
         media::VideoCodecProfile getCodecProfile() const { return mCodecProfile; }
         C2BlockPool::local_id_t getBlockPoolId() const { return mOutputBlockPoolIds->m.values[0]; }
         InputCodec getInputCodec() const { return mInputCodec; }
+        bool isLowLatencyMode() const { return mLowLatencyMode->value != 0; }
+        uint32_t getMaxWorksInFlight() const { return mMaxWorksInFlight->value; }
 
     private:
         // Configurable parameter setters.
@@ -64,6 +92,8 @@ public:
                                             const C2P<C2StreamColorAspectsTuning::output>& def,
                                             const C2P<C2StreamColorAspectsInfo::input>& coded);
 
+        static C2R MaxWorksInFlightSetter(bool mayBlock, C2P<C2VDAMaxWorksInFlightTuning>& me);
+
         // The input format kind; should be C2FormatCompressed.
         std::shared_ptr<C2StreamBufferTypeSetting::input> mInputFormat;
         // The output format kind; should be C2FormatVideo.
@@ -99,6 +129,10 @@ public:
         // former has higher priority. This parameter is used for component to provide color aspects
         // as C2Info in decoded output buffers.
         std::shared_ptr<C2StreamColorAspectsInfo::output> mColorAspects;
+        // Whether to decode in low-latency mode. See C2VDALowLatencyModeTuning.
+        std::shared_ptr<C2VDALowLatencyModeTuning> mLowLatencyMode;
+        // The limit of works in flight. See C2VDAMaxWorksInFlightTuning.
+        std::shared_ptr<C2VDAMaxWorksInFlightTuning> mMaxWorksInFlight;
 
         c2_status_t mInitStatus;
         media::VideoCodecProfile mCodecProfile;
@@ -201,6 +235,13 @@ private:
         ::base::ScopedFD mHandle;
         // VideoFramePlane information for importing to VDA.
         std::vector<VideoFramePlane> mPlanes;
+        // The number of entries of this block in |mPendingBuffersToWork|.
+        uint32_t mPendingToWorkCount = 0;
+        // The number of entries of this block in |mUndequeuedBlockIds|.
+        uint32_t mUndequeuedCount = 0;
+        // Set when the block is reused for a new output format. The accelerator has dropped the
+        // imported buffer, so |mHandle| is dupped again before the block is passed to it.
+        bool mNeedsReimport = false;
     };
 
     struct VideoFormat {
@@ -222,7 +263,7 @@ private:
 
     // These tasks should be run on the component thread |mThread|.
     void onDestroy();
-    void onStart(media::VideoCodecProfile profile, ::base::WaitableEvent* done);
+    void onStart(media::VideoCodecProfile profile, bool lowLatency, ::base::WaitableEvent* done);
     void onQueueWork(std::unique_ptr<C2Work> work);
     void onDequeueWork();
     void onInputBufferDone(int32_t bitstreamId);
@@ -238,7 +279,13 @@ private:
     void onVisibleRectChanged(const media::Rect& cropRect);
     void onOutputBufferReturned(std::shared_ptr<C2GraphicBlock> block, uint32_t poolId);
     void onSurfaceChanged();
+    void onSendFinishedWorks();
+    void onKeptAcceleratorTimeout(uint32_t generation);
+    void onRelease(::base::WaitableEvent* done);
+    void onAcceleratorError();
 
+    // Pop the first work in |mQueue| and send its input buffer to accelerator.
+    void processQueuedWork();
     // Send input buffer to accelerator with specified bitstream id.
     void sendInputBufferToAccelerator(const C2ConstLinearBlock& input, int32_t bitstreamId);
     // Send output buffer to accelerator. If |passToAccelerator|, change the ownership to
@@ -250,10 +297,18 @@ private:
     GraphicBlockInfo* getGraphicBlockById(int32_t blockId);
     // Helper function to get the specified GraphicBlockInfo object by its pool id.
     GraphicBlockInfo* getGraphicBlockByPoolId(uint32_t poolId);
-    // Helper function to find the work iterator in |mPendingWorks| by bitstream id.
-    std::deque<std::unique_ptr<C2Work>>::iterator findPendingWorkByBitstreamId(int32_t bitstreamId);
     // Helper function to get the specified work in |mPendingWorks| by bitstream id.
     C2Work* getPendingWorkByBitstreamId(int32_t bitstreamId);
+    // Clear |mGraphicBlocks| along with |mBlockIdsByPoolId|.
+    void clearGraphicBlocks();
+    // Rebuild |mBlockIdsByPoolId| after pool IDs of |mGraphicBlocks| are changed.
+    void updateBlockIdsByPoolId();
+    // Clear |mPendingBuffersToWork| along with the pending counts of graphic blocks.
+    void clearPendingBuffersToWork();
+    // Destroy the accelerator and release the output buffers and the dequeue thread.
+    void releaseAccelerator();
+    // Resume decoding with the accelerator kept by the last stop. Return false on failure.
+    bool restartKeptAccelerator();
     // Try to apply the output format change.
     void tryChangeOutputFormat();
     // Allocate output buffers (graphic blocks) from block allocator.
@@ -264,6 +319,14 @@ private:
     void appendSecureOutputBuffer(std::shared_ptr<C2GraphicBlock> block, uint32_t poolId);
     // Parse coded color aspects from bitstream and configs parameter if applicable.
     bool parseCodedColorAspects(const C2ConstLinearBlock& input);
+    // Predict the coded size and the number of frames the decoder needs for reference and
+    // reordering from the stream header in |input|, i.e. the SPS for H264 or a keyframe for VP8
+    // and VP9. Return false if |input| has no such header.
+    bool predictOutputFormat(const C2ConstLinearBlock& input, media::Size* codedSize,
+                             uint32_t* dpbSize);
+    // Allocate output buffers for the format predicted from |input| if possible, so that they are
+    // ready when the accelerator reports the actual output format.
+    void preallocateOutputBuffers(const C2ConstLinearBlock& input);
     // Update color aspects for current output buffer.
     c2_status_t updateColorAspects();
     // Dequeue |mPendingBuffersToWork| to put output buffer to corresponding work and report if
@@ -272,14 +335,26 @@ private:
     void sendOutputBufferToWorkIfAny(bool dropIfUnavailable);
     // Update |mUndequeuedBlockIds| FIFO by pushing |blockId|.
     void updateUndequeuedBlockIds(int32_t blockId);
+    // Resize |mUndequeuedBlockIds| FIFO to |size| and recount the undequeued counts of graphic
+    // blocks.
+    void resizeUndequeuedBlockIds(size_t size);
 
-    // Check if the corresponding work is finished by |bitstreamId|. If yes, make onWorkDone call to
-    // listener and erase the work from |mPendingWorks|.
+    // Check if the corresponding work is finished by |bitstreamId|. If yes, erase the work from
+    // |mPendingWorks| and queue it to |mFinishedWorks|.
     void reportWorkIfFinished(int32_t bitstreamId);
     // Make onWorkDone call to listener for reporting EOS work in |mPendingWorks|.
     void reportEOSWork();
     // Abandon all works in |mPendingWorks| and |mAbandonedWorks|.
     void reportAbandonedWorks();
+    // Queue the finished |work| to |mFinishedWorks|. The queued works are sent to listener by one
+    // onWorkDone call after the tasks already posted to component thread, or as soon as the batch
+    // is full, no other work is pending or the batch is older than kMaxFinishedWorksBatchDelayMs.
+    void queueFinishedWork(std::unique_ptr<C2Work> work);
+    // Make one onWorkDone call to listener for all works in |mFinishedWorks|, if any.
+    void sendFinishedWorks();
+    // Log the histograms of |mLatencyTracker| if kFrameLatencyDumpProperty changed since the last
+    // check, checking it at most once per interval.
+    void maybeDumpFrameLatency();
     // Make onError call to listener for reporting errors.
     void reportError(c2_status_t error);
     // Helper function to determine if the work is finished.
@@ -291,6 +366,8 @@ private:
                             std::shared_ptr<C2BlockPool> blockPool, bool resetBuffersInClient);
     // Stop dequeue thread.
     void stopDequeueThread();
+    // Increment |mBuffersInClient| and wake up the dequeue thread if it was waiting for buffers.
+    void incrementBuffersInClient();
     // The rountine task running on dequeue thread.
     void dequeueThreadLoop(const media::Size& size, uint32_t pixelFormat,
                            std::shared_ptr<C2BlockPool> blockPool);
@@ -313,6 +390,10 @@ private:
     std::atomic<bool> mDequeueLoopStop;
     // The count of buffers owned by client which should be atomic.
     std::atomic<uint32_t> mBuffersInClient;
+    // The lock and condition for the dequeue loop to wait until |mBuffersInClient| becomes
+    // positive or |mDequeueLoopStop| is set.
+    std::mutex mBuffersInClientLock;
+    std::condition_variable mBuffersInClientCond;
 
     // The following members should be utilized on component thread |mThread|.
 
@@ -331,12 +412,26 @@ private:
     bool mPendingOutputEOS;
     // The vector of storing allocated output graphic block information.
     std::vector<GraphicBlockInfo> mGraphicBlocks;
+    // The index from the pool ID to the block ID of |mGraphicBlocks|.
+    std::unordered_map<uint32_t, int32_t> mBlockIdsByPoolId;
     // The work queue. Works are queued along with drain mode from component API queue_nb and
     // dequeued by the decode process of component.
     std::queue<WorkEntry> mQueue;
     // Store all pending works. The dequeued works are placed here until they are finished and then
-    // sent out by onWorkDone call to listener.
-    std::deque<std::unique_ptr<C2Work>> mPendingWorks;
+    // sent out by onWorkDone call to listener. A list, so that erasing a work finished out of order
+    // does not shift the others.
+    std::list<std::unique_ptr<C2Work>> mPendingWorks;
+    // The index from the bitstream ID to the work in |mPendingWorks|.
+    std::unordered_map<int32_t, std::list<std::unique_ptr<C2Work>>::iterator>
+            mPendingWorksByBitstreamId;
+    // Store finished works which are not sent to listener yet. See queueFinishedWork().
+    std::list<std::unique_ptr<C2Work>> mFinishedWorks;
+    // The indicator of whether onSendFinishedWorks() is posted to component thread.
+    bool mSendFinishedWorksPosted;
+    // The maximum number of works sent to listener in one onWorkDone call.
+    size_t mMaxFinishedWorksBatchSize;
+    // When the first work of |mFinishedWorks| was queued.
+    ::base::TimeTicks mFinishedWorksBatchStart;
     // Store all abandoned works. When component gets flushed/stopped, remaining works in queue are
     // dumped here and sent out by onWorkDone call to listener after flush/stop is finished.
     std::vector<std::unique_ptr<C2Work>> mAbandonedWorks;
@@ -359,6 +454,14 @@ private:
     bool mPendingColorAspectsChange;
     // The record of frame index to update color aspects. Details as above.
     uint64_t mPendingColorAspectsChangeFrameIndex;
+    // The parser of the CSD buffers in parseCodedColorAspects(), kept since start to tell when the
+    // SPS is repeated as is.
+    std::unique_ptr<media::H264Parser> mColorAspectsParser;
+    // The ID of the SPS the color aspects were last parsed from, or -1. Another SPS may have been
+    // configured in between, so an unchanged SPS is only skipped if it is also this one.
+    int mColorAspectsSpsId;
+    // Whether output buffers were allocated for a predicted output format since start.
+    bool mOutputBuffersPreallocated;
     // The record of bitstream and block ID of pending output buffers returned from accelerator.
     std::deque<OutputBufferInfo> mPendingBuffersToWork;
     // A FIFO queue to record the block IDs which are currently undequequed for display. The size
@@ -367,6 +470,24 @@ private:
 
     // The indicator of whether component is in secure mode.
     bool mSecureMode;
+    // The indicator of whether component is in low-latency mode, configured on start.
+    bool mLowLatencyMode;
+    // The codec profile the accelerator is initialized with.
+    media::VideoCodecProfile mVDAProfile;
+    // The block pool ID the output buffers are fetched from.
+    C2BlockPool::local_id_t mBlockPoolId;
+    // How long the accelerator is kept after stop for a warm restart, 0 to always destroy it. It
+    // is kept only while |mComponentState| is UNINITIALIZED and |mVDAAdaptor| is not null.
+    int32_t mKeepAcceleratorTimeoutMs;
+    // Incremented whenever the accelerator is kept or reused, to cancel the pending timeout.
+    uint32_t mKeepAcceleratorGeneration;
+    // The per-frame latency tracker shared with the accelerator, or null if latency tracking is
+    // disabled. It is thread-safe and also used on parent thread.
+    scoped_refptr<media::FrameLatencyTracker> mLatencyTracker;
+    // The last value of the property requesting a dump of |mLatencyTracker|, and when to check it
+    // next. See maybeDumpFrameLatency().
+    int32_t mFrameLatencyDumpRequest;
+    ::base::TimeTicks mNextFrameLatencyDumpCheck;
 
     // The following members should be utilized on parent thread.
 
@@ -376,6 +497,11 @@ private:
     std::atomic<State> mState;
     // The mutex lock to synchronize start/stop/reset/release calls.
     std::mutex mStartStopLock;
+    // The limit of |mWorksInFlight|, configured on start. 0 if unlimited.
+    uint32_t mMaxWorksInFlight;
+    // The count of works accepted by queue_nb() and not yet returned to listener. It is incremented
+    // on parent thread and decremented on component thread, hence atomic.
+    std::atomic<uint32_t> mWorksInFlight;
 
     // The WeakPtrFactory for getting weak pointer of this.
     ::base::WeakPtrFactory<C2VDAComponent> mWeakThisFactory;
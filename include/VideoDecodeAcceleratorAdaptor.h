@@ -7,6 +7,7 @@
 
 #include <C2VDACommon.h>
 
+#include <frame_latency_tracker.h>
 #include <rect.h>
 #include <size.h>
 #include <video_codecs.h>
@@ -70,13 +71,24 @@ public:
     };
 
     // Initializes the video decoder with specific profile. This call is synchronous and returns
-    // SUCCESS iff initialization is successful.
-    virtual Result initialize(media::VideoCodecProfile profile, bool secureMode,
+    // SUCCESS iff initialization is successful. With |lowLatency| the decoder is asked to output
+    // pictures as soon as possible and with as few extra output buffers as possible; decoders may
+    // ignore it.
+    virtual Result initialize(media::VideoCodecProfile profile, bool secureMode, bool lowLatency,
                               Client* client) = 0;
 
+    // Sets the tracker to record the decoder stages of each bitstream buffer into. This must be
+    // called before initialize(). Decoders may ignore it.
+    virtual void setLatencyTracker(scoped_refptr<media::FrameLatencyTracker> tracker) = 0;
+
     // Decodes given buffer handle with bitstream ID.
     virtual void decode(int32_t bitstreamId, int handleFd, off_t offset, uint32_t bytesUsed) = 0;
 
+    // Returns the number of output buffers the decoder will request through
+    // Client::providePictureBuffers() for a stream needing |dpbSize| frames for reference and
+    // reordering, or 0 if it cannot tell. Must be called after initialize().
+    virtual uint32_t getNumOutputBuffersForDpbSize(uint32_t dpbSize) = 0;
+
     // Assigns a specified number of picture buffer set to the video decoder.
     virtual void assignPictureBuffers(uint32_t numOutputBuffers) = 0;
 
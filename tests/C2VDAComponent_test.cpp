@@ -14,7 +14,10 @@
 #include <C2PlatformSupport.h>
 #include <C2Work.h>
 #include <SimpleC2Interface.h>
+#include <fake_v4l2_device.h>
+#include <v4l2_device.h>
 
+#include <base/bind.h>
 #include <base/files/file.h>
 #include <base/files/file_path.h>
 #include <base/md5.h>
@@ -109,6 +112,10 @@ const char* gTestVideoData = "bear.mp4:c2.vda.avc.decoder:640:360:82:84";
 // folder of input video file.
 bool gRecordOutputYUV = false;
 
+// Decode on a FakeV4L2Device instead of the V4L2 hardware. The fake decodes no pixels, so the MD5
+// sanity checks are skipped.
+bool gUseFakeV4L2Device = false;
+
 const std::string kH264DecoderName = "c2.vda.avc.decoder";
 const std::string kVP8DecoderName = "c2.vda.vp8.decoder";
 const std::string kVP9DecoderName = "c2.vda.vp9.decoder";
@@ -186,6 +193,8 @@ protected:
     bool mFlushDone;
 
     std::unique_ptr<TestVideoFile> mTestVideoFile;
+    // The options the FakeV4L2Device is created with if |gUseFakeV4L2Device| is set.
+    media::FakeV4L2Device::Options mFakeDeviceOptions;
 };
 
 class Listener : public C2Component::Listener {
@@ -237,9 +246,36 @@ void C2VDAComponentTest::onError(std::weak_ptr<C2Component> component, uint32_t
     FAIL() << "Get error code from component: " << errorCode;
 }
 
+static scoped_refptr<media::V4L2Device> createFakeV4L2Device(
+        const media::FakeV4L2Device::Options& options) {
+    return new media::FakeV4L2Device(options);
+}
+
 void C2VDAComponentTest::SetUp() {
     parseTestVideoData(gTestVideoData);
 
+    if (gUseFakeV4L2Device) {
+        media::FakeV4L2Device::Options& options = mFakeDeviceOptions;
+        switch (mTestVideoFile->mCodec) {
+        case TestVideoFile::CodecType::H264:
+            options.input_fourccs = {V4L2_PIX_FMT_H264};
+            break;
+        case TestVideoFile::CodecType::VP8:
+            options.input_fourccs = {V4L2_PIX_FMT_VP8};
+            break;
+        case TestVideoFile::CodecType::VP9:
+            options.input_fourccs = {V4L2_PIX_FMT_VP9};
+            break;
+        default:
+            break;
+        }
+        options.visible_size = media::Size(mTestVideoFile->mWidth, mTestVideoFile->mHeight);
+        options.coded_size = media::Size((mTestVideoFile->mWidth + 15) & ~15,
+                                         (mTestVideoFile->mHeight + 15) & ~15);
+        media::V4L2Device::SetCreateCallbackForTesting(
+                ::base::Bind(&createFakeV4L2Device, options));
+    }
+
     mWorkQueue.clear();
     for (int i = 0; i < kWorkCount; ++i) {
         mWorkQueue.emplace_back(new C2Work);
@@ -384,9 +420,11 @@ protected:
     uint32_t mNumberOfPlaythrough;
     bool mSanityCheck;
     bool mUseDummyEOSWork;
+
+    void runSimpleDecodeTest();
 };
 
-TEST_P(C2VDAComponentParamTest, SimpleDecodeTest) {
+void C2VDAComponentParamTest::runSimpleDecodeTest() {
     mFlushAfterWorkIndex = std::get<0>(GetParam());
     if (mFlushAfterWorkIndex == FlushPoint::MID_STREAM_FLUSH) {
         mFlushAfterWorkIndex = mTestVideoFile->mNumFragments / 2;
@@ -723,7 +761,7 @@ TEST_P(C2VDAComponentParamTest, SimpleDecodeTest) {
         EXPECT_EQ(mFinishedWorkCounts[i], expectedFinishedWorkCounts[i]) << "At iteration: " << i;
     }
 
-    if (mSanityCheck) {
+    if (mSanityCheck && !gUseFakeV4L2Device) {
         std::vector<std::string> goldenMD5s;
         readGoldenMD5s(mTestVideoFile->mFilename, &goldenMD5s);
         for (uint32_t i = 0; i < mNumberOfPlaythrough; ++i) {
@@ -737,6 +775,36 @@ TEST_P(C2VDAComponentParamTest, SimpleDecodeTest) {
     }
 }
 
+TEST_P(C2VDAComponentParamTest, SimpleDecodeTest) {
+    runSimpleDecodeTest();
+}
+
+// Same as C2VDAComponentParamTest, but the FakeV4L2Device asks for more output buffers than the
+// component predicts from the stream header, so the preallocated buffers are dropped and a new set
+// is allocated when the output format is reported.
+class C2VDAComponentReallocationTest : public C2VDAComponentParamTest {
+protected:
+    // More than the DPB size of 8 frames predicted from the headers of the test streams.
+    enum { kFakeDpbHoldDepth = 10 };
+
+    void SetUp() override {
+        C2VDAComponentParamTest::SetUp();
+        if (gUseFakeV4L2Device) {
+            mFakeDeviceOptions.dpb_hold_depth = kFakeDpbHoldDepth;
+            media::V4L2Device::SetCreateCallbackForTesting(
+                    ::base::Bind(&createFakeV4L2Device, mFakeDeviceOptions));
+        }
+    }
+};
+
+TEST_P(C2VDAComponentReallocationTest, SimpleDecodeTest) {
+    if (!gUseFakeV4L2Device) {
+        printf("[ SKIPPED  ] The buffer count cannot be controlled without -f\n");
+        return;
+    }
+    runSimpleDecodeTest();
+}
+
 // Play input video once, end by draining.
 INSTANTIATE_TEST_CASE_P(SinglePlaythroughTest, C2VDAComponentParamTest,
                         ::testing::Values(std::make_tuple(static_cast<int>(FlushPoint::NO_FLUSH),
@@ -773,17 +841,25 @@ INSTANTIATE_TEST_CASE_P(
         ::testing::Values(std::make_tuple(static_cast<int>(FlushPoint::END_OF_STREAM_FLUSH), 0u,
                                           false, false)));
 
+// Play input video once with reallocated output buffers.
+INSTANTIATE_TEST_CASE_P(ReallocationPlaythroughTest, C2VDAComponentReallocationTest,
+                        ::testing::Values(std::make_tuple(static_cast<int>(FlushPoint::NO_FLUSH),
+                                                          1u, false, false)));
+
 }  // namespace android
 
 static void usage(const char* me) {
-    fprintf(stderr, "usage: %s [-i test_video_data] [-r(ecord YUV)] [gtest options]\n", me);
+    fprintf(stderr,
+            "usage: %s [-i test_video_data] [-r(ecord YUV)] [-f(ake V4L2 device)] "
+            "[gtest options]\n",
+            me);
 }
 
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
 
     int res;
-    while ((res = getopt(argc, argv, "i:r")) >= 0) {
+    while ((res = getopt(argc, argv, "i:rf")) >= 0) {
         switch (res) {
         case 'i': {
             android::gTestVideoData = optarg;
@@ -793,6 +869,10 @@ int main(int argc, char** argv) {
             android::gRecordOutputYUV = true;
             break;
         }
+        case 'f': {
+            android::gUseFakeV4L2Device = true;
+            break;
+        }
         default: {
             usage(argv[0]);
             exit(1);
@@ -0,0 +1,979 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "H264Parser_test"
+
+#include <h264_bit_reader.h>
+#include <h264_parser.h>
+#include <h264_start_code_scanner.h>
+
+#include <gtest/gtest.h>
+#include <utils/Log.h>
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <vector>
+
+namespace android {
+
+// Path of the file used by the start code scanner benchmark. Can be set by the "-i" option.
+const char* gBenchmarkFile = "bear.mp4";
+
+namespace {
+
+const media::StartCodeScanner kAllScanners[] = {
+        media::StartCodeScanner::kScalar, media::StartCodeScanner::kSWAR,
+        media::StartCodeScanner::kSSE2,   media::StartCodeScanner::kAVX2,
+        media::StartCodeScanner::kNEON,
+};
+
+const char* scannerName(media::StartCodeScanner scanner) {
+    switch (scanner) {
+    case media::StartCodeScanner::kScalar:
+        return "scalar";
+    case media::StartCodeScanner::kSWAR:
+        return "swar";
+    case media::StartCodeScanner::kSSE2:
+        return "sse2";
+    case media::StartCodeScanner::kAVX2:
+        return "avx2";
+    case media::StartCodeScanner::kNEON:
+        return "neon";
+    }
+    return "unknown";
+}
+
+// The byte-by-byte definition every scanner must match.
+size_t referenceScan(const uint8_t* data, size_t size) {
+    for (size_t i = 0; i + 2 < size; ++i) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) return i;
+    }
+    return size;
+}
+
+// Random bytes drawn mostly from {0, 1}, so that start codes and near misses are frequent.
+std::vector<uint8_t> makeRandomStream(std::mt19937* rng, size_t size, int zeroPercent) {
+    std::uniform_int_distribution<int> percent(0, 99);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::vector<uint8_t> stream(size);
+    for (auto& b : stream) {
+        const int p = percent(*rng);
+        b = p < zeroPercent ? 0 : (p < zeroPercent + 10 ? 1 : byte(*rng));
+    }
+    return stream;
+}
+
+// The byte-at-a-time H264BitReader the cached one must match, including the
+// number of bits left and of emulation prevention bytes read after each call.
+class ReferenceBitReader {
+public:
+    ReferenceBitReader(const uint8_t* data, off_t size) : mData(data), mBytesLeft(size) {}
+
+    bool readBits(int numBits, int* out) {
+        int bitsLeft = numBits;
+        *out = 0;
+        while (mNumRemainingBitsInCurrByte < bitsLeft) {
+            *out |= static_cast<int>(static_cast<unsigned int>(mCurrByte)
+                                     << (bitsLeft - mNumRemainingBitsInCurrByte));
+            bitsLeft -= mNumRemainingBitsInCurrByte;
+            if (!updateCurrByte()) return false;
+        }
+        *out |= (mCurrByte >> (mNumRemainingBitsInCurrByte - bitsLeft));
+        *out &= ((1u << numBits) - 1u);
+        mNumRemainingBitsInCurrByte -= bitsLeft;
+        return true;
+    }
+
+    bool readUE(int* out) {
+        int numBits = -1;
+        int bit;
+        do {
+            if (!readBits(1, &bit)) return false;
+            numBits++;
+        } while (bit == 0);
+        if (numBits > 31) return false;
+        *out = (1u << numBits) - 1u;
+        int rest = 0;
+        if (numBits > 0 && !readBits(numBits, &rest)) return false;
+        if (numBits == 31) return rest == 0;
+        *out += rest;
+        return true;
+    }
+
+    bool readSE(int* out) {
+        int ue;
+        if (!readUE(&ue)) return false;
+        *out = (ue % 2 == 0) ? -(ue / 2) : ue / 2 + 1;
+        return true;
+    }
+
+    bool hasMoreRBSPData() {
+        if (mNumRemainingBitsInCurrByte == 0 && !updateCurrByte()) return false;
+        if ((mCurrByte & ((1 << (mNumRemainingBitsInCurrByte - 1)) - 1)) != 0) return true;
+        for (off_t i = 0; i < mBytesLeft; i++) {
+            if (mData[i] != 0) return true;
+        }
+        mBytesLeft = 0;
+        return false;
+    }
+
+    off_t numBitsLeft() const { return mNumRemainingBitsInCurrByte + mBytesLeft * 8; }
+    size_t numEmulationPreventionBytesRead() const { return mEmulationPreventionBytes; }
+
+private:
+    bool updateCurrByte() {
+        if (mBytesLeft < 1) return false;
+        if (*mData == 0x03 && (mPrevTwoBytes & 0xffff) == 0) {
+            ++mData;
+            --mBytesLeft;
+            ++mEmulationPreventionBytes;
+            mPrevTwoBytes = 0xffff;
+            if (mBytesLeft < 1) return false;
+        }
+        mCurrByte = *mData++;
+        --mBytesLeft;
+        mNumRemainingBitsInCurrByte = 8;
+        mPrevTwoBytes = ((mPrevTwoBytes & 0xff) << 8) | mCurrByte;
+        return true;
+    }
+
+    const uint8_t* mData;
+    off_t mBytesLeft;
+    int mCurrByte = 0;
+    int mNumRemainingBitsInCurrByte = 0;
+    int mPrevTwoBytes = 0xffff;
+    size_t mEmulationPreventionBytes = 0;
+};
+
+// Writes the syntax elements of H.264 NAL units.
+class BitWriter {
+public:
+    void putBits(uint64_t value, int numBits) {
+        for (int i = numBits - 1; i >= 0; --i) {
+            if (mNumBits % 8 == 0) mRBSP.push_back(0);
+            if ((value >> i) & 1) mRBSP.back() |= 0x80 >> (mNumBits % 8);
+            ++mNumBits;
+        }
+    }
+
+    void putUE(uint32_t value) {
+        const uint64_t codeNum = static_cast<uint64_t>(value) + 1;
+        int numBits = 0;
+        while ((codeNum >> numBits) > 1) ++numBits;
+        putBits(0, numBits);
+        putBits(codeNum, numBits + 1);
+    }
+
+    void putSE(int32_t value) {
+        putUE(value > 0 ? 2 * static_cast<uint32_t>(value) - 1
+                        : 2 * static_cast<uint32_t>(-static_cast<int64_t>(value)));
+    }
+
+    // Writes rbsp_trailing_bits().
+    void putTrailingBits() {
+        putBits(1, 1);
+        while (mNumBits % 8) putBits(0, 1);
+    }
+
+    size_t numBits() const { return mNumBits; }
+    const std::vector<uint8_t>& rbsp() const { return mRBSP; }
+
+    // Returns the NAL unit with a start code and the emulation prevention bytes, whose number
+    // is added to |*numEmulationPreventionBytes| if it is not null.
+    std::vector<uint8_t> toAnnexB(size_t* numEmulationPreventionBytes = nullptr) const {
+        std::vector<uint8_t> nalu = {0x00, 0x00, 0x00, 0x01};
+        int zeros = 0;
+        for (uint8_t byte : mRBSP) {
+            if (zeros >= 2 && byte <= 0x03) {
+                nalu.push_back(0x03);
+                if (numEmulationPreventionBytes) ++*numEmulationPreventionBytes;
+                zeros = 0;
+            }
+            nalu.push_back(byte);
+            zeros = byte == 0 ? zeros + 1 : 0;
+        }
+        return nalu;
+    }
+
+private:
+    std::vector<uint8_t> mRBSP;
+    size_t mNumBits = 0;
+};
+
+// The SPS and PPS of the synthetic slices: 16-bit frame_num and pic_order_cnt_lsb, CABAC, and
+// the optional syntax elements read by ParseSliceHeader() present.
+std::vector<uint8_t> makeParameterSets(int levelIdc = 30) {
+    BitWriter sps;
+    sps.putBits(0x67, 8);  // nal_unit_type 7, nal_ref_idc 3.
+    sps.putBits(66, 8);    // profile_idc
+    sps.putBits(0, 8);     // constraint_set flags, reserved_zero_2bits
+    sps.putBits(levelIdc, 8);  // level_idc
+    sps.putUE(0);          // seq_parameter_set_id
+    sps.putUE(12);         // log2_max_frame_num_minus4
+    sps.putUE(0);          // pic_order_cnt_type
+    sps.putUE(12);         // log2_max_pic_order_cnt_lsb_minus4
+    sps.putUE(4);          // max_num_ref_frames
+    sps.putBits(0, 1);     // gaps_in_frame_num_value_allowed_flag
+    sps.putUE(19);         // pic_width_in_mbs_minus1
+    sps.putUE(14);         // pic_height_in_map_units_minus1
+    sps.putBits(1, 1);     // frame_mbs_only_flag
+    sps.putBits(1, 1);     // direct_8x8_inference_flag
+    sps.putBits(0, 1);     // frame_cropping_flag
+    sps.putBits(0, 1);     // vui_parameters_present_flag
+    sps.putTrailingBits();
+
+    BitWriter pps;
+    pps.putBits(0x68, 8);  // nal_unit_type 8, nal_ref_idc 3.
+    pps.putUE(0);          // pic_parameter_set_id
+    pps.putUE(0);          // seq_parameter_set_id
+    pps.putBits(1, 1);     // entropy_coding_mode_flag
+    pps.putBits(1, 1);     // bottom_field_pic_order_in_frame_present_flag
+    pps.putUE(0);          // num_slice_groups_minus1
+    pps.putUE(2);          // num_ref_idx_l0_default_active_minus1
+    pps.putUE(0);          // num_ref_idx_l1_default_active_minus1
+    pps.putBits(0, 1);     // weighted_pred_flag
+    pps.putBits(0, 2);     // weighted_bipred_idc
+    pps.putSE(0);          // pic_init_qp_minus26
+    pps.putSE(0);          // pic_init_qs_minus26
+    pps.putSE(0);          // chroma_qp_index_offset
+    pps.putBits(1, 1);     // deblocking_filter_control_present_flag
+    pps.putBits(0, 1);     // constrained_intra_pred_flag
+    pps.putBits(0, 1);     // redundant_pic_cnt_present_flag
+    pps.putTrailingBits();
+
+    std::vector<uint8_t> stream = sps.toAnnexB();
+    std::vector<uint8_t> ppsNalu = pps.toAnnexB();
+    stream.insert(stream.end(), ppsNalu.begin(), ppsNalu.end());
+    return stream;
+}
+
+// A random slice for the parameter sets of makeParameterSets(), and the header the parser is
+// expected to return for it. Values are often zero, so that emulation prevention bytes are
+// frequent.
+struct SyntheticSlice {
+    std::vector<uint8_t> mNalu;
+    media::H264SliceHeader mHeader;
+    size_t mNumEmulationPreventionBytes = 0;
+};
+
+SyntheticSlice makeRandomSlice(std::mt19937* rng) {
+    auto random = [rng](int min, int max) {
+        // Half of the values are the minimum.
+        if ((*rng)() % 2) return min;
+        return std::uniform_int_distribution<int>(min, max)(*rng);
+    };
+    SyntheticSlice slice;
+    media::H264SliceHeader& shdr = slice.mHeader;
+    BitWriter w;
+
+    const bool idr = (*rng)() % 4 == 0;
+    const int nalRefIdc = idr ? 1 + (*rng)() % 3 : (*rng)() % 4;
+    shdr.idr_pic_flag = idr;
+    shdr.nal_ref_idc = nalRefIdc;
+    w.putBits(0, 1);  // forbidden_zero_bit
+    w.putBits(nalRefIdc, 2);
+    w.putBits(idr ? 5 : 1, 5);
+
+    shdr.first_mb_in_slice = random(0, 299);
+    w.putUE(shdr.first_mb_in_slice);
+    shdr.slice_type = idr ? (random(0, 1) ? 7 : 2) : random(0, 9);
+    w.putUE(shdr.slice_type);
+    w.putUE(0);  // pic_parameter_set_id
+    shdr.frame_num = random(0, 0xffff);
+    w.putBits(shdr.frame_num, 16);
+    if (idr) {
+        shdr.idr_pic_id = random(0, 65535);
+        w.putUE(shdr.idr_pic_id);
+    }
+
+    size_t start = w.numBits();
+    shdr.pic_order_cnt_lsb = random(0, 0xffff);
+    w.putBits(shdr.pic_order_cnt_lsb, 16);
+    shdr.delta_pic_order_cnt_bottom = random(-1000, 1000);
+    w.putSE(shdr.delta_pic_order_cnt_bottom);
+    shdr.pic_order_cnt_bit_size = w.numBits() - start;
+
+    if (shdr.IsBSlice()) {
+        shdr.direct_spatial_mv_pred_flag = random(0, 1);
+        w.putBits(shdr.direct_spatial_mv_pred_flag, 1);
+    }
+    if (shdr.IsPSlice() || shdr.IsSPSlice() || shdr.IsBSlice()) {
+        shdr.num_ref_idx_active_override_flag = random(0, 1);
+        w.putBits(shdr.num_ref_idx_active_override_flag, 1);
+        shdr.num_ref_idx_l0_active_minus1 = 2;
+        if (shdr.num_ref_idx_active_override_flag) {
+            shdr.num_ref_idx_l0_active_minus1 = random(0, 15);
+            w.putUE(shdr.num_ref_idx_l0_active_minus1);
+            if (shdr.IsBSlice()) {
+                shdr.num_ref_idx_l1_active_minus1 = random(0, 15);
+                w.putUE(shdr.num_ref_idx_l1_active_minus1);
+            }
+        }
+    }
+    if (!shdr.IsISlice() && !shdr.IsSISlice()) {
+        w.putBits(0, 1);  // ref_pic_list_modification_flag_l0
+    }
+    if (shdr.IsBSlice()) {
+        w.putBits(0, 1);  // ref_pic_list_modification_flag_l1
+    }
+
+    if (nalRefIdc != 0) {
+        start = w.numBits();
+        if (idr) {
+            shdr.no_output_of_prior_pics_flag = random(0, 1);
+            w.putBits(shdr.no_output_of_prior_pics_flag, 1);
+            shdr.long_term_reference_flag = random(0, 1);
+            w.putBits(shdr.long_term_reference_flag, 1);
+        } else {
+            shdr.adaptive_ref_pic_marking_mode_flag = random(0, 1);
+            w.putBits(shdr.adaptive_ref_pic_marking_mode_flag, 1);
+            if (shdr.adaptive_ref_pic_marking_mode_flag) {
+                const int numOperations = (*rng)() % 4;
+                for (int i = 0; i < numOperations; ++i) {
+                    media::H264DecRefPicMarking& marking = shdr.ref_pic_marking[i];
+                    marking.memory_mgmnt_control_operation = 1 + (*rng)() % 6;
+                    w.putUE(marking.memory_mgmnt_control_operation);
+                    const int op = marking.memory_mgmnt_control_operation;
+                    if (op == 1 || op == 3) {
+                        marking.difference_of_pic_nums_minus1 = random(0, 100);
+                        w.putUE(marking.difference_of_pic_nums_minus1);
+                    }
+                    if (op == 2) {
+                        marking.long_term_pic_num = random(0, 100);
+                        w.putUE(marking.long_term_pic_num);
+                    }
+                    if (op == 3 || op == 6) {
+                        marking.long_term_frame_idx = random(0, 15);
+                        w.putUE(marking.long_term_frame_idx);
+                    }
+                    if (op == 4) {
+                        marking.max_long_term_frame_idx_plus1 = random(0, 16);
+                        w.putUE(marking.max_long_term_frame_idx_plus1);
+                    }
+                }
+                w.putUE(0);  // End of the operations.
+            }
+        }
+        shdr.dec_ref_pic_marking_bit_size = w.numBits() - start;
+    }
+
+    if (!shdr.IsISlice() && !shdr.IsSISlice()) {
+        shdr.cabac_init_idc = random(0, 2);
+        w.putUE(shdr.cabac_init_idc);
+    }
+    shdr.slice_qp_delta = random(-20, 20);
+    w.putSE(shdr.slice_qp_delta);
+    if (shdr.IsSPSlice() || shdr.IsSISlice()) {
+        if (shdr.IsSPSlice()) {
+            shdr.sp_for_switch_flag = random(0, 1);
+            w.putBits(shdr.sp_for_switch_flag, 1);
+        }
+        shdr.slice_qs_delta = random(-20, 20);
+        w.putSE(shdr.slice_qs_delta);
+    }
+    shdr.disable_deblocking_filter_idc = random(0, 2);
+    w.putUE(shdr.disable_deblocking_filter_idc);
+    if (shdr.disable_deblocking_filter_idc != 1) {
+        shdr.slice_alpha_c0_offset_div2 = random(-6, 6);
+        w.putSE(shdr.slice_alpha_c0_offset_div2);
+        shdr.slice_beta_offset_div2 = random(-6, 6);
+        w.putSE(shdr.slice_beta_offset_div2);
+    }
+    shdr.header_bit_size = w.numBits();
+
+    // Some slice data, mostly zeros.
+    const int dataSize = (*rng)() % 64;
+    for (int i = 0; i < dataSize; ++i) w.putBits(random(0, 255), 8);
+    w.putTrailingBits();
+
+    slice.mNalu = w.toAnnexB(&slice.mNumEmulationPreventionBytes);
+    return slice;
+}
+
+// Checks the fields of a parsed slice header set by makeRandomSlice().
+void expectSliceHeaderEq(const media::H264SliceHeader& expected,
+                         const media::H264SliceHeader& actual) {
+#define EXPECT_FIELD_EQ(field) EXPECT_EQ(expected.field, actual.field) << #field
+    EXPECT_FIELD_EQ(idr_pic_flag);
+    EXPECT_FIELD_EQ(nal_ref_idc);
+    EXPECT_FIELD_EQ(first_mb_in_slice);
+    EXPECT_FIELD_EQ(slice_type);
+    EXPECT_FIELD_EQ(frame_num);
+    EXPECT_FIELD_EQ(idr_pic_id);
+    EXPECT_FIELD_EQ(pic_order_cnt_lsb);
+    EXPECT_FIELD_EQ(delta_pic_order_cnt_bottom);
+    EXPECT_FIELD_EQ(direct_spatial_mv_pred_flag);
+    EXPECT_FIELD_EQ(num_ref_idx_active_override_flag);
+    EXPECT_FIELD_EQ(num_ref_idx_l0_active_minus1);
+    EXPECT_FIELD_EQ(num_ref_idx_l1_active_minus1);
+    EXPECT_FIELD_EQ(no_output_of_prior_pics_flag);
+    EXPECT_FIELD_EQ(long_term_reference_flag);
+    EXPECT_FIELD_EQ(adaptive_ref_pic_marking_mode_flag);
+    for (size_t i = 0; i < arraysize(expected.ref_pic_marking); ++i) {
+        SCOPED_TRACE(i);
+        EXPECT_FIELD_EQ(ref_pic_marking[i].memory_mgmnt_control_operation);
+        EXPECT_FIELD_EQ(ref_pic_marking[i].difference_of_pic_nums_minus1);
+        EXPECT_FIELD_EQ(ref_pic_marking[i].long_term_pic_num);
+        EXPECT_FIELD_EQ(ref_pic_marking[i].long_term_frame_idx);
+        EXPECT_FIELD_EQ(ref_pic_marking[i].max_long_term_frame_idx_plus1);
+    }
+    EXPECT_FIELD_EQ(cabac_init_idc);
+    EXPECT_FIELD_EQ(slice_qp_delta);
+    EXPECT_FIELD_EQ(sp_for_switch_flag);
+    EXPECT_FIELD_EQ(slice_qs_delta);
+    EXPECT_FIELD_EQ(disable_deblocking_filter_idc);
+    EXPECT_FIELD_EQ(slice_alpha_c0_offset_div2);
+    EXPECT_FIELD_EQ(slice_beta_offset_div2);
+    EXPECT_FIELD_EQ(header_bit_size);
+#undef EXPECT_FIELD_EQ
+}
+
+}  // namespace
+
+TEST(H264StartCodeScannerTest, MatchesReferenceOnRandomStreams) {
+    std::mt19937 rng(0x264);
+    for (media::StartCodeScanner scanner : kAllScanners) {
+        media::StartCodeScanFunc scan = media::GetStartCodeScanFunc(scanner);
+        if (!scan) continue;
+        SCOPED_TRACE(scannerName(scanner));
+        for (int zeroPercent : {10, 50, 80}) {
+            for (size_t size = 0; size < 200; ++size) {
+                std::vector<uint8_t> stream = makeRandomStream(&rng, size + 32, zeroPercent);
+                // Vary the alignment of the start of the buffer.
+                for (size_t align = 0; align < 32; align += 7) {
+                    const uint8_t* data = stream.data() + align;
+                    ASSERT_EQ(referenceScan(data, size), scan(data, size))
+                            << "size=" << size << " align=" << align;
+                }
+            }
+        }
+    }
+}
+
+TEST(H264StartCodeScannerTest, FindsEveryPosition) {
+    for (media::StartCodeScanner scanner : kAllScanners) {
+        media::StartCodeScanFunc scan = media::GetStartCodeScanFunc(scanner);
+        if (!scan) continue;
+        SCOPED_TRACE(scannerName(scanner));
+        for (size_t size = 3; size < 100; ++size) {
+            for (size_t pos = 0; pos + 3 <= size; ++pos) {
+                // Only near misses ("\0\0\2" and "\1\0\0") around the start code.
+                std::vector<uint8_t> stream(size, 0x02);
+                for (size_t i = 0; i + 1 < size; i += 3) stream[i] = stream[i + 1] = 0;
+                stream[pos] = 0;
+                stream[pos + 1] = 0;
+                stream[pos + 2] = 1;
+                ASSERT_EQ(referenceScan(stream.data(), size), scan(stream.data(), size))
+                        << "size=" << size << " pos=" << pos;
+            }
+        }
+    }
+}
+
+TEST(H264StartCodeScannerTest, FindStartCodeReportsSize) {
+    const uint8_t kThreeByte[] = {0x12, 0x00, 0x00, 0x01, 0x65};
+    const uint8_t kFourByte[] = {0x12, 0x00, 0x00, 0x00, 0x01, 0x65};
+    const uint8_t kAtStart[] = {0x00, 0x00, 0x01, 0x67};
+    const uint8_t kNone[] = {0x00, 0x00, 0x02, 0x00, 0x00};
+    off_t offset = -1;
+    off_t startCodeSize = -1;
+
+    EXPECT_TRUE(media::H264Parser::FindStartCode(kThreeByte, sizeof(kThreeByte), &offset,
+                                                 &startCodeSize));
+    EXPECT_EQ(1, offset);
+    EXPECT_EQ(3, startCodeSize);
+
+    EXPECT_TRUE(media::H264Parser::FindStartCode(kFourByte, sizeof(kFourByte), &offset,
+                                                 &startCodeSize));
+    EXPECT_EQ(1, offset);
+    EXPECT_EQ(4, startCodeSize);
+
+    EXPECT_TRUE(media::H264Parser::FindStartCode(kAtStart, sizeof(kAtStart), &offset,
+                                                 &startCodeSize));
+    EXPECT_EQ(0, offset);
+    EXPECT_EQ(3, startCodeSize);
+
+    // Without a start code, |offset| points at the first byte not considered.
+    EXPECT_FALSE(
+            media::H264Parser::FindStartCode(kNone, sizeof(kNone), &offset, &startCodeSize));
+    EXPECT_EQ(static_cast<off_t>(sizeof(kNone) - 2), offset);
+    EXPECT_EQ(0, startCodeSize);
+
+    EXPECT_FALSE(media::H264Parser::FindStartCode(kNone, 2, &offset, &startCodeSize));
+    EXPECT_EQ(0, offset);
+    EXPECT_EQ(0, startCodeSize);
+}
+
+// Not a correctness test: prints the throughput of each scanner. Disabled by default, run with
+// --gtest_also_run_disabled_tests --gtest_filter=*Benchmark* to compare them on a device.
+TEST(H264StartCodeScannerTest, DISABLED_Benchmark) {
+    std::vector<std::pair<const char*, std::vector<uint8_t>>> inputs;
+
+    std::ifstream file(gBenchmarkFile, std::ios::binary);
+    if (file) {
+        inputs.emplace_back(gBenchmarkFile,
+                            std::vector<uint8_t>(std::istreambuf_iterator<char>(file),
+                                                 std::istreambuf_iterator<char>()));
+    } else {
+        printf("%s not found, skipping it\n", gBenchmarkFile);
+    }
+    const size_t kSyntheticSize = 4 * 1024 * 1024;
+    // Worst case for memchr(): a 0x01 in every byte.
+    inputs.emplace_back("all 0x01", std::vector<uint8_t>(kSyntheticSize, 0x01));
+    // Worst case for zero-pair candidates: "\0\0\2" repeated.
+    std::vector<uint8_t> zeroPairs(kSyntheticSize);
+    for (size_t i = 0; i < kSyntheticSize; ++i) zeroPairs[i] = (i % 3 == 2) ? 0x02 : 0x00;
+    inputs.emplace_back("00 00 02 repeated", std::move(zeroPairs));
+
+    for (const auto& input : inputs) {
+        const std::vector<uint8_t>& data = input.second;
+        for (media::StartCodeScanner scanner : kAllScanners) {
+            media::StartCodeScanFunc scan = media::GetStartCodeScanFunc(scanner);
+            if (!scan) continue;
+            const int kIterations = 20;
+            size_t found = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < kIterations; ++i) {
+                // Walk through all start codes, like LocateNALU() does.
+                size_t pos = 0;
+                while (pos < data.size()) {
+                    pos += scan(data.data() + pos, data.size() - pos) + 3;
+                    ++found;
+                }
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            printf("%-20s %-6s %8.1f MB/s (%zu start codes)\n", input.first,
+                   scannerName(scanner),
+                   data.size() * kIterations / elapsed.count() / (1024 * 1024),
+                   found / kIterations);
+        }
+    }
+}
+
+TEST(H264BitReaderTest, MatchesReferenceOnRandomStreams) {
+    std::mt19937 rng(0xb17);
+    std::uniform_int_distribution<int> percent(0, 99);
+    for (int zeroPercent : {10, 50, 80}) {
+        for (int i = 0; i < 2000; ++i) {
+            // Mostly zeros and threes, so that emulation prevention bytes are frequent.
+            std::vector<uint8_t> stream(1 + rng() % 100);
+            for (auto& b : stream) {
+                const int p = percent(rng);
+                b = p < zeroPercent ? 0 : (p < zeroPercent + 15 ? 3 : rng() & 0xff);
+            }
+
+            media::H264BitReader reader;
+            ASSERT_TRUE(reader.Initialize(stream.data(), stream.size()));
+            ReferenceBitReader reference(stream.data(), stream.size());
+            for (int op = 0; op < 50; ++op) {
+                SCOPED_TRACE(::testing::Message() << "stream " << i << " op " << op);
+                bool result;
+                bool expectedResult;
+                int value = 0;
+                int expectedValue = 0;
+                switch (rng() % 7) {
+                case 0:
+                case 1: {
+                    const int numBits = 1 + rng() % 31;
+                    result = reader.ReadBits(numBits, &value);
+                    expectedResult = reference.readBits(numBits, &expectedValue);
+                    break;
+                }
+                case 2: {
+                    const int numBits = 1 + rng() % 8;
+                    result = reader.ReadBits(numBits, &value);
+                    expectedResult = reference.readBits(numBits, &expectedValue);
+                    break;
+                }
+                case 3:
+                case 4:
+                    result = reader.ReadUE(&value);
+                    expectedResult = reference.readUE(&expectedValue);
+                    break;
+                case 5:
+                    result = reader.ReadSE(&value);
+                    expectedResult = reference.readSE(&expectedValue);
+                    break;
+                default:
+                    result = reader.HasMoreRBSPData();
+                    expectedResult = reference.hasMoreRBSPData();
+                    break;
+                }
+                ASSERT_EQ(expectedResult, result);
+                // Nothing is defined after a failed read.
+                if (!result) break;
+                ASSERT_EQ(expectedValue, value);
+                ASSERT_EQ(reference.numBitsLeft(), reader.NumBitsLeft());
+                ASSERT_EQ(reference.numEmulationPreventionBytesRead(),
+                          reader.NumEmulationPreventionBytesRead());
+            }
+        }
+    }
+}
+
+TEST(H264BitReaderTest, ReadsExpGolombCodes) {
+    const uint32_t kUnsignedValues[] = {0,       1,       2,          3,          254,
+                                        255,     65535,   65536,      1u << 30,   0x7ffffffe,
+                                        0x7fffffff};
+    const int32_t kSignedValues[] = {0, 1, -1, 2, -2, 100, -100, 0x3fffffff, -0x3fffffff};
+    BitWriter w;
+    for (uint32_t value : kUnsignedValues) {
+        w.putBits(0, 3);  // Vary the alignment, and make emulation prevention bytes likely.
+        w.putUE(value);
+    }
+    for (int32_t value : kSignedValues) {
+        w.putBits(0, 5);
+        w.putSE(value);
+    }
+    w.putTrailingBits();
+    // Without the start code.
+    std::vector<uint8_t> rbsp = w.toAnnexB();
+    rbsp.erase(rbsp.begin(), rbsp.begin() + 4);
+
+    media::H264BitReader reader;
+    ASSERT_TRUE(reader.Initialize(rbsp.data(), rbsp.size()));
+    int bits;
+    int value;
+    for (uint32_t expected : kUnsignedValues) {
+        ASSERT_TRUE(reader.ReadBits(3, &bits));
+        ASSERT_TRUE(reader.ReadUE(&value));
+        EXPECT_EQ(static_cast<int>(expected), value);
+    }
+    for (int32_t expected : kSignedValues) {
+        ASSERT_TRUE(reader.ReadBits(5, &bits));
+        ASSERT_TRUE(reader.ReadSE(&value));
+        EXPECT_EQ(expected, value);
+    }
+    EXPECT_FALSE(reader.HasMoreRBSPData());
+}
+
+TEST(H264BitReaderTest, RejectsInvalidExpGolombCodes) {
+    int value;
+    {
+        // 2^31 does not fit in an int.
+        BitWriter w;
+        w.putUE(0x80000000u);
+        w.putTrailingBits();
+        media::H264BitReader reader;
+        ASSERT_TRUE(reader.Initialize(w.rbsp().data(), w.rbsp().size()));
+        EXPECT_FALSE(reader.ReadUE(&value));
+    }
+    {
+        // 32 leading zeros.
+        BitWriter w;
+        w.putBits(0, 32);
+        w.putBits(1, 1);
+        w.putTrailingBits();
+        media::H264BitReader reader;
+        ASSERT_TRUE(reader.Initialize(w.rbsp().data(), w.rbsp().size()));
+        EXPECT_FALSE(reader.ReadUE(&value));
+    }
+    {
+        // A code cut by the end of the stream.
+        BitWriter w;
+        w.putBits(0, 6);
+        w.putBits(1, 1);
+        w.putBits(0, 1);
+        media::H264BitReader reader;
+        ASSERT_TRUE(reader.Initialize(w.rbsp().data(), w.rbsp().size()));
+        EXPECT_FALSE(reader.ReadUE(&value));
+    }
+}
+
+TEST(H264ParserTest, ParsesSyntheticSliceHeaders) {
+    std::mt19937 rng(0x51ce);
+    std::vector<uint8_t> stream = makeParameterSets();
+    std::vector<SyntheticSlice> slices;
+    for (int i = 0; i < 2000; ++i) {
+        slices.push_back(makeRandomSlice(&rng));
+        stream.insert(stream.end(), slices.back().mNalu.begin(), slices.back().mNalu.end());
+    }
+
+    media::H264Parser parser;
+    parser.SetStream(stream.data(), stream.size());
+    media::H264NALU nalu;
+    int id;
+    ASSERT_EQ(media::H264Parser::kOk, parser.AdvanceToNextNALU(&nalu));
+    ASSERT_EQ(media::H264NALU::kSPS, nalu.nal_unit_type);
+    ASSERT_EQ(media::H264Parser::kOk, parser.ParseSPS(&id));
+    ASSERT_EQ(media::H264Parser::kOk, parser.AdvanceToNextNALU(&nalu));
+    ASSERT_EQ(media::H264NALU::kPPS, nalu.nal_unit_type);
+    ASSERT_EQ(media::H264Parser::kOk, parser.ParsePPS(&id));
+
+    size_t numSlicesWithEmulationPrevention = 0;
+    for (size_t i = 0; i < slices.size(); ++i) {
+        SCOPED_TRACE(::testing::Message() << "slice " << i);
+        ASSERT_EQ(media::H264Parser::kOk, parser.AdvanceToNextNALU(&nalu));
+        media::H264SliceHeader shdr;
+        ASSERT_EQ(media::H264Parser::kOk, parser.ParseSliceHeader(nalu, &shdr));
+        expectSliceHeaderEq(slices[i].mHeader, shdr);
+        // These sizes count the emulation prevention bytes read in the middle of the syntax
+        // elements, so they are only known without any.
+        if (slices[i].mNumEmulationPreventionBytes == 0) {
+            EXPECT_EQ(slices[i].mHeader.pic_order_cnt_bit_size, shdr.pic_order_cnt_bit_size);
+            EXPECT_EQ(slices[i].mHeader.dec_ref_pic_marking_bit_size,
+                      shdr.dec_ref_pic_marking_bit_size);
+        } else {
+            ++numSlicesWithEmulationPrevention;
+        }
+    }
+    EXPECT_EQ(media::H264Parser::kEOStream, parser.AdvanceToNextNALU(&nalu));
+    EXPECT_GT(numSlicesWithEmulationPrevention, 0u);
+}
+
+TEST(H264ParserTest, ParsesScalingLists) {
+    // Scaling list values span 1-255.
+    std::vector<int> list4x4(media::kH264ScalingList4x4Length);
+    std::vector<int> list8x8(media::kH264ScalingList8x8Length);
+    for (size_t i = 0; i < list4x4.size(); ++i) list4x4[i] = i % 2 ? 255 - i : 1 + i;
+    for (size_t i = 0; i < list8x8.size(); ++i) list8x8[i] = 1 + (i * 37) % 255;
+    auto putScalingList = [](BitWriter* w, const std::vector<int>& list) {
+        w->putBits(1, 1);  // scaling_list_present_flag
+        int lastScale = 8;
+        for (int scale : list) {
+            w->putSE(((scale - lastScale + 128) & 0xff) - 128);  // delta_scale
+            lastScale = scale;
+        }
+    };
+
+    BitWriter sps;
+    sps.putBits(0x67, 8);  // nal_unit_type 7, nal_ref_idc 3.
+    sps.putBits(100, 8);   // profile_idc
+    sps.putBits(0, 8);     // constraint_set flags, reserved_zero_2bits
+    sps.putBits(40, 8);    // level_idc
+    sps.putUE(0);          // seq_parameter_set_id
+    sps.putUE(1);          // chroma_format_idc
+    sps.putUE(0);          // bit_depth_luma_minus8
+    sps.putUE(0);          // bit_depth_chroma_minus8
+    sps.putBits(0, 1);     // qpprime_y_zero_transform_bypass_flag
+    sps.putBits(1, 1);     // seq_scaling_matrix_present_flag
+    putScalingList(&sps, list4x4);
+    sps.putBits(0, 1);  // Fall back to the previous list.
+    sps.putBits(1, 1);
+    sps.putSE(-8);      // Use the default list.
+    sps.putBits(0, 3);  // Fall back to the default inter list, and to the previous ones.
+    putScalingList(&sps, list8x8);
+    sps.putBits(0, 1);  // Fall back to the default inter list.
+    sps.putUE(0);       // log2_max_frame_num_minus4
+    sps.putUE(2);       // pic_order_cnt_type
+    sps.putUE(1);       // max_num_ref_frames
+    sps.putBits(0, 1);  // gaps_in_frame_num_value_allowed_flag
+    sps.putUE(19);      // pic_width_in_mbs_minus1
+    sps.putUE(14);      // pic_height_in_map_units_minus1
+    sps.putBits(1, 1);  // frame_mbs_only_flag
+    sps.putBits(1, 1);  // direct_8x8_inference_flag
+    sps.putBits(0, 1);  // frame_cropping_flag
+    sps.putBits(0, 1);  // vui_parameters_present_flag
+    sps.putTrailingBits();
+
+    BitWriter pps;
+    pps.putBits(0x68, 8);  // nal_unit_type 8, nal_ref_idc 3.
+    pps.putUE(0);          // pic_parameter_set_id
+    pps.putUE(0);          // seq_parameter_set_id
+    pps.putBits(0, 2);     // entropy_coding_mode_flag, bottom_field_pic_order_in_frame_present_flag
+    pps.putUE(0);          // num_slice_groups_minus1
+    pps.putUE(0);          // num_ref_idx_l0_default_active_minus1
+    pps.putUE(0);          // num_ref_idx_l1_default_active_minus1
+    pps.putBits(0, 3);     // weighted_pred_flag, weighted_bipred_idc
+    pps.putSE(0);          // pic_init_qp_minus26
+    pps.putSE(0);          // pic_init_qs_minus26
+    pps.putSE(0);          // chroma_qp_index_offset
+    pps.putBits(0, 3);     // deblocking_filter_control_present_flag and the next two flags
+    pps.putBits(1, 1);     // transform_8x8_mode_flag
+    pps.putBits(1, 1);     // pic_scaling_matrix_present_flag
+    pps.putBits(0, 8);     // Fall back to the SPS lists, and to the previous ones.
+    pps.putSE(-3);         // second_chroma_qp_index_offset
+    pps.putTrailingBits();
+
+    std::vector<uint8_t> stream = sps.toAnnexB();
+    std::vector<uint8_t> ppsNalu = pps.toAnnexB();
+    stream.insert(stream.end(), ppsNalu.begin(), ppsNalu.end());
+    media::H264Parser parser;
+    parser.SetStream(stream.data(), stream.size());
+    media::H264NALU nalu;
+    int id;
+    ASSERT_EQ(media::H264Parser::kOk, parser.AdvanceToNextNALU(&nalu));
+    ASSERT_EQ(media::H264Parser::kOk, parser.ParseSPS(&id));
+    ASSERT_EQ(media::H264Parser::kOk, parser.AdvanceToNextNALU(&nalu));
+    ASSERT_EQ(media::H264Parser::kOk, parser.ParsePPS(&id));
+    const media::H264SPS* parsedSps = parser.GetSPS(0);
+    const media::H264PPS* parsedPps = parser.GetPPS(0);
+    ASSERT_NE(nullptr, parsedSps);
+    ASSERT_NE(nullptr, parsedPps);
+    EXPECT_EQ(-3, parsedPps->second_chroma_qp_index_offset);
+
+    for (size_t j = 0; j < list4x4.size(); ++j) {
+        SCOPED_TRACE(::testing::Message() << "4x4 entry " << j);
+        EXPECT_EQ(list4x4[j], parsedSps->scaling_list4x4[0][j]);
+        EXPECT_EQ(list4x4[j], parsedSps->scaling_list4x4[1][j]);
+        // Rule B: the first intra and inter lists fall back to the SPS ones.
+        for (int i = 0; i < 6; ++i) {
+            EXPECT_EQ(i < 3 ? list4x4[j] : parsedSps->scaling_list4x4[3][j],
+                      parsedPps->scaling_list4x4[i][j]);
+        }
+    }
+    // Default_4x4_Intra and Default_4x4_Inter.
+    EXPECT_EQ(6, parsedSps->scaling_list4x4[2][0]);
+    EXPECT_EQ(42, parsedSps->scaling_list4x4[2][15]);
+    for (int i = 3; i < 6; ++i) {
+        EXPECT_EQ(10, parsedSps->scaling_list4x4[i][0]);
+        EXPECT_EQ(34, parsedSps->scaling_list4x4[i][15]);
+    }
+
+    for (size_t j = 0; j < list8x8.size(); ++j) {
+        SCOPED_TRACE(::testing::Message() << "8x8 entry " << j);
+        EXPECT_EQ(list8x8[j], parsedSps->scaling_list8x8[0][j]);
+        EXPECT_EQ(list8x8[j], parsedPps->scaling_list8x8[0][j]);
+        EXPECT_EQ(parsedSps->scaling_list8x8[1][j], parsedPps->scaling_list8x8[1][j]);
+    }
+    // Default_8x8_Inter.
+    EXPECT_EQ(9, parsedSps->scaling_list8x8[1][0]);
+    EXPECT_EQ(35, parsedSps->scaling_list8x8[1][63]);
+}
+
+TEST(H264ParserTest, KeepsRepeatedParameterSets) {
+    // The parameter sets, repeated, then with a new SPS and the same PPS.
+    std::vector<uint8_t> stream = makeParameterSets();
+    for (int levelIdc : {30, 31}) {
+        std::vector<uint8_t> parameterSets = makeParameterSets(levelIdc);
+        stream.insert(stream.end(), parameterSets.begin(), parameterSets.end());
+    }
+    const bool kExpectedChanged[] = {true, false, true};
+
+    media::H264Parser parser;
+    parser.SetStream(stream.data(), stream.size());
+    media::H264NALU nalu;
+    const media::H264SPS* sps = nullptr;
+    const media::H264PPS* pps = nullptr;
+    for (bool expectedChanged : kExpectedChanged) {
+        int id;
+        bool changed;
+        ASSERT_EQ(media::H264Parser::kOk, parser.AdvanceToNextNALU(&nalu));
+        ASSERT_EQ(media::H264Parser::kOk, parser.ParseSPS(&id, &changed));
+        EXPECT_EQ(0, id);
+        EXPECT_EQ(expectedChanged, changed);
+        // Unchanged, the SPS is the same object.
+        if (!changed) {
+            EXPECT_EQ(sps, parser.GetSPS(id));
+        }
+        sps = parser.GetSPS(id);
+        ASSERT_NE(nullptr, sps);
+
+        // The PPS is parsed again after its SPS changes.
+        ASSERT_EQ(media::H264Parser::kOk, parser.AdvanceToNextNALU(&nalu));
+        ASSERT_EQ(media::H264Parser::kOk, parser.ParsePPS(&id, &changed));
+        EXPECT_EQ(0, id);
+        EXPECT_EQ(expectedChanged, changed);
+        if (!changed) {
+            EXPECT_EQ(pps, parser.GetPPS(id));
+        }
+        pps = parser.GetPPS(id);
+        ASSERT_NE(nullptr, pps);
+    }
+    EXPECT_EQ(31, sps->level_idc);
+    EXPECT_EQ(media::H264Parser::kEOStream, parser.AdvanceToNextNALU(&nalu));
+}
+
+// Not a correctness test: prints the speed of ue(v) reads, by H264BitReader and by the byte at a
+// time reference, and of slice header parsing. Disabled by default, run with
+// --gtest_also_run_disabled_tests --gtest_filter=*Benchmark*.
+TEST(H264ParserTest, DISABLED_Benchmark) {
+    std::mt19937 rng(0xbe7c);
+    const int kIterations = 10;
+
+    // Mostly the small values of slice headers.
+    const int kNumCodes = 1 << 20;
+    BitWriter w;
+    for (int i = 0; i < kNumCodes; ++i) w.putUE(rng() % 8 ? rng() % 16 : rng() % 65536);
+    w.putTrailingBits();
+    std::vector<uint8_t> codes = w.toAnnexB();
+    codes.erase(codes.begin(), codes.begin() + 4);
+
+    int64_t sum = 0;
+    int value = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; ++i) {
+        ReferenceBitReader reference(codes.data(), codes.size());
+        for (int j = 0; j < kNumCodes && reference.readUE(&value); ++j) sum += value;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printf("ue(v) byte at a time %8.1f M codes/s\n",
+           kNumCodes * kIterations / elapsed.count() / 1e6);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; ++i) {
+        media::H264BitReader reader;
+        ASSERT_TRUE(reader.Initialize(codes.data(), codes.size()));
+        for (int j = 0; j < kNumCodes && reader.ReadUE(&value); ++j) sum -= value;
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+    printf("ue(v) H264BitReader  %8.1f M codes/s\n",
+           kNumCodes * kIterations / elapsed.count() / 1e6);
+    EXPECT_EQ(0, sum);
+
+    // Many slices per frame, as cameras produce.
+    const int kNumSlices = 10000;
+    std::vector<uint8_t> stream = makeParameterSets();
+    for (int i = 0; i < kNumSlices; ++i) {
+        std::vector<uint8_t> nalu = makeRandomSlice(&rng).mNalu;
+        stream.insert(stream.end(), nalu.begin(), nalu.end());
+    }
+
+    int numSlices = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; ++i) {
+        media::H264Parser parser;
+        parser.SetStream(stream.data(), stream.size());
+        media::H264NALU nalu;
+        int id;
+        while (parser.AdvanceToNextNALU(&nalu) == media::H264Parser::kOk) {
+            if (nalu.nal_unit_type == media::H264NALU::kSPS) {
+                ASSERT_EQ(media::H264Parser::kOk, parser.ParseSPS(&id));
+            } else if (nalu.nal_unit_type == media::H264NALU::kPPS) {
+                ASSERT_EQ(media::H264Parser::kOk, parser.ParsePPS(&id));
+            } else {
+                // A new header for each slice, as H264Decoder does.
+                media::H264SliceHeader shdr;
+                ASSERT_EQ(media::H264Parser::kOk, parser.ParseSliceHeader(nalu, &shdr));
+                ++numSlices;
+            }
+        }
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+    printf("slice headers        %8.1f ns each (%d slices)\n",
+           elapsed.count() * 1e9 / numSlices, numSlices / kIterations);
+}
+
+}  // namespace android
+
+static void usage(const char* me) {
+    fprintf(stderr, "usage: %s [-i benchmark_file] [gtest options]\n", me);
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+    int res;
+    while ((res = getopt(argc, argv, "i:")) >= 0) {
+        switch (res) {
+        case 'i': {
+            android::gBenchmarkFile = optarg;
+            break;
+        }
+        default: {
+            usage(argv[0]);
+            exit(1);
+            break;
+        }
+        }
+    }
+
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,706 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2VideoDecodeAccelerator_test"
+
+#include <bitstream_buffer.h>
+#include <fake_v4l2_device.h>
+#include <native_pixmap_handle.h>
+#include <picture.h>
+#include <v4l2_slice_video_decode_accelerator.h>
+#include <v4l2_stateless_controls.h>
+#include <v4l2_video_decode_accelerator.h>
+
+#include <base/bind.h>
+#include <base/files/scoped_file.h>
+#include <base/location.h>
+#include <base/threading/thread.h>
+#include <cutils/ashmem.h>
+#include <gtest/gtest.h>
+#include <utils/Log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace android {
+
+// Number of frames decoded by each benchmark run. Can be set by the "-n" option.
+int gBenchmarkFrames = 600;
+
+namespace {
+
+using PollMode = media::V4L2VideoDecodeAccelerator::PollMode;
+using Clock = std::chrono::steady_clock;
+
+// Size of each bitstream buffer of the synthetic VP8 streams. The fake device does not look at the
+// content of stateful VP8 buffers, each of them is one frame.
+const size_t kInputBufferSize = 4096;
+// Size and period of the IDR frames of the synthetic H.264 streams.
+const int kH264Width = 176;
+const int kH264Height = 144;
+const int kH264IdrPeriod = 10;
+// Size and period of the keyframes of the synthetic VP9 streams, and the size of their compressed
+// headers.
+const int kVp9Width = 320;
+const int kVp9Height = 240;
+const int kVp9KeyframePeriod = 15;
+const int kVp9CompressedHeaderSize = 16;
+// Time given to a whole decode before the test fails instead of hanging.
+const auto kDecodeTimeout = std::chrono::seconds(30);
+
+const char* pollModeName(PollMode pollMode) {
+    return pollMode == PollMode::kPollThread ? "poll thread" : "decoder thread";
+}
+
+// A bitstream, and the bitstream buffers it is split into.
+struct TestStream {
+    media::VideoCodecProfile mProfile = media::VIDEO_CODEC_PROFILE_UNKNOWN;
+    std::vector<uint8_t> mData;
+    // The offset and size in |mData| of each bitstream buffer.
+    std::vector<std::pair<size_t, size_t>> mBuffers;
+};
+
+// Writes the bits of a bitstream, most significant bit first.
+class BitWriter {
+public:
+    void putBits(uint32_t value, int numBits) {
+        for (int i = numBits - 1; i >= 0; --i) {
+            mCurrentByte = (mCurrentByte << 1) | ((value >> i) & 1);
+            if (++mBitsInCurrentByte == 8) {
+                mBytes.push_back(mCurrentByte);
+                mCurrentByte = 0;
+                mBitsInCurrentByte = 0;
+            }
+        }
+    }
+
+    // Writes |value| as ue(v), an unsigned Exp-Golomb code.
+    void putUe(uint32_t value) {
+        int numBits = 0;
+        while ((value + 1) >> numBits) numBits++;
+        putBits(0, numBits - 1);
+        putBits(value + 1, numBits);
+    }
+
+    // Writes |value| as se(v), a signed Exp-Golomb code.
+    void putSe(int32_t value) { putUe(value > 0 ? 2 * value - 1 : -2 * value); }
+
+    // Pads the bits written with zeros to a whole byte, and returns them.
+    std::vector<uint8_t> finish() {
+        while (mBitsInCurrentByte != 0) putBits(0, 1);
+        return std::move(mBytes);
+    }
+
+    // Ends an H.264 RBSP with its trailing bits, and returns it.
+    std::vector<uint8_t> finishRbsp() {
+        putBits(1, 1);
+        return finish();
+    }
+
+private:
+    std::vector<uint8_t> mBytes;
+    uint8_t mCurrentByte = 0;
+    int mBitsInCurrentByte = 0;
+};
+
+// Appends the NALU of |nalHeader| and |rbsp| to |data| in Annex-B format.
+void appendH264Nalu(std::vector<uint8_t>* data, uint8_t nalHeader,
+                    const std::vector<uint8_t>& rbsp) {
+    data->insert(data->end(), {0, 0, 0, 1, nalHeader});
+    int zeros = 0;
+    for (uint8_t byte : rbsp) {
+        if (zeros == 2 && byte <= 3) {
+            data->push_back(3);  // emulation_prevention_three_byte
+            zeros = 0;
+        }
+        data->push_back(byte);
+        zeros = byte == 0 ? zeros + 1 : 0;
+    }
+}
+
+// A stream of |numFrames| zero-filled VP8 buffers, for stateful devices.
+TestStream makeFakeVp8Stream(int numFrames) {
+    TestStream stream;
+    stream.mProfile = media::VP8PROFILE_ANY;
+    stream.mData.resize(kInputBufferSize);
+    stream.mBuffers.assign(numFrames, std::make_pair(0, kInputBufferSize));
+    return stream;
+}
+
+// A Baseline profile H.264 stream of |numFrames| frames, one per bitstream buffer. Every
+// |kH264IdrPeriod| frames, an IDR frame is preceded by the parameter sets, then P frames follow.
+// The slices carry no macroblocks, as only their headers are parsed.
+TestStream makeH264Stream(int numFrames) {
+    TestStream stream;
+    stream.mProfile = media::H264PROFILE_BASELINE;
+
+    BitWriter sps;
+    sps.putBits(66, 8);  // profile_idc: Baseline.
+    sps.putBits(0, 8);   // constraint_set flags.
+    sps.putBits(10, 8);  // level_idc: 1.0, to keep the DPB small.
+    sps.putUe(0);        // seq_parameter_set_id.
+    sps.putUe(0);        // log2_max_frame_num_minus4.
+    sps.putUe(2);        // pic_order_cnt_type: output order is decoding order.
+    sps.putUe(1);        // max_num_ref_frames.
+    sps.putBits(0, 1);   // gaps_in_frame_num_value_allowed_flag.
+    sps.putUe(kH264Width / 16 - 1);   // pic_width_in_mbs_minus1.
+    sps.putUe(kH264Height / 16 - 1);  // pic_height_in_map_units_minus1.
+    sps.putBits(1, 1);  // frame_mbs_only_flag.
+    sps.putBits(1, 1);  // direct_8x8_inference_flag.
+    sps.putBits(0, 1);  // frame_cropping_flag.
+    sps.putBits(0, 1);  // vui_parameters_present_flag.
+    const std::vector<uint8_t> spsRbsp = sps.finishRbsp();
+
+    BitWriter pps;
+    pps.putUe(0);       // pic_parameter_set_id.
+    pps.putUe(0);       // seq_parameter_set_id.
+    pps.putBits(0, 1);  // entropy_coding_mode_flag.
+    pps.putBits(0, 1);  // bottom_field_pic_order_in_frame_present_flag.
+    pps.putUe(0);       // num_slice_groups_minus1.
+    pps.putUe(0);       // num_ref_idx_l0_default_active_minus1.
+    pps.putUe(0);       // num_ref_idx_l1_default_active_minus1.
+    pps.putBits(0, 1);  // weighted_pred_flag.
+    pps.putBits(0, 2);  // weighted_bipred_idc.
+    pps.putSe(0);       // pic_init_qp_minus26.
+    pps.putSe(0);       // pic_init_qs_minus26.
+    pps.putSe(0);       // chroma_qp_index_offset.
+    pps.putBits(1, 1);  // deblocking_filter_control_present_flag.
+    pps.putBits(0, 1);  // constrained_intra_pred_flag.
+    pps.putBits(0, 1);  // redundant_pic_cnt_present_flag.
+    const std::vector<uint8_t> ppsRbsp = pps.finishRbsp();
+
+    for (int i = 0; i < numFrames; ++i) {
+        const size_t offset = stream.mData.size();
+        const int frameNum = i % kH264IdrPeriod;
+        const bool idr = frameNum == 0;
+        if (idr) {
+            appendH264Nalu(&stream.mData, 0x67, spsRbsp);
+            appendH264Nalu(&stream.mData, 0x68, ppsRbsp);
+        }
+
+        BitWriter slice;
+        slice.putUe(0);             // first_mb_in_slice.
+        slice.putUe(idr ? 7 : 5);   // slice_type: I or P, for all the slices of the frame.
+        slice.putUe(0);             // pic_parameter_set_id.
+        slice.putBits(frameNum, 4);  // frame_num.
+        if (idr) {
+            slice.putUe((i / kH264IdrPeriod) % 2);  // idr_pic_id, differing between neighbours.
+            slice.putBits(0, 1);  // no_output_of_prior_pics_flag.
+            slice.putBits(0, 1);  // long_term_reference_flag.
+        } else {
+            slice.putBits(0, 1);  // num_ref_idx_active_override_flag.
+            slice.putBits(0, 1);  // ref_pic_list_modification_flag_l0.
+            slice.putBits(0, 1);  // adaptive_ref_pic_marking_mode_flag.
+        }
+        slice.putSe(0);  // slice_qp_delta.
+        slice.putUe(1);  // disable_deblocking_filter_idc.
+        // Stands for the slice data.
+        slice.putBits(0xa5a5a5a5, 32);
+        appendH264Nalu(&stream.mData, idr ? 0x65 : 0x41, slice.finishRbsp());
+
+        stream.mBuffers.emplace_back(offset, stream.mData.size() - offset);
+    }
+    return stream;
+}
+
+// A VP9 profile 0 stream of |numFrames| frames, one per bitstream buffer. A keyframe every
+// |kVp9KeyframePeriod| frames is followed by inter frames, which only refresh the first reference
+// slot. Every third frame shows an existing frame instead, alternately the previous frame and the
+// keyframe. The frames carry no tile data, as only their headers are parsed.
+TestStream makeVp9Stream(int numFrames) {
+    TestStream stream;
+    stream.mProfile = media::VP9PROFILE_PROFILE0;
+
+    for (int i = 0; i < numFrames; ++i) {
+        const size_t offset = stream.mData.size();
+        const int frameNum = i % kVp9KeyframePeriod;
+        const bool keyframe = frameNum == 0;
+
+        BitWriter header;
+        header.putBits(2, 2);  // frame_marker.
+        header.putBits(0, 2);  // profile_low_bit and profile_high_bit.
+        if (frameNum % 3 == 2) {
+            header.putBits(1, 1);                          // show_existing_frame.
+            header.putBits(frameNum % 2 == 0 ? 0 : 1, 3);  // frame_to_show_map_idx.
+            const std::vector<uint8_t> frame = header.finish();
+            stream.mData.insert(stream.mData.end(), frame.begin(), frame.end());
+            stream.mBuffers.emplace_back(offset, stream.mData.size() - offset);
+            continue;
+        }
+        header.putBits(0, 1);                 // show_existing_frame.
+        header.putBits(keyframe ? 0 : 1, 1);  // frame_type.
+        header.putBits(1, 1);                 // show_frame.
+        header.putBits(0, 1);                 // error_resilient_mode.
+        if (keyframe) {
+            header.putBits(0x498342, 24);        // frame_sync_code.
+            header.putBits(1, 3);                // color_space: BT.601.
+            header.putBits(0, 1);                // color_range.
+            header.putBits(kVp9Width - 1, 16);   // frame_width_minus_1.
+            header.putBits(kVp9Height - 1, 16);  // frame_height_minus_1.
+            header.putBits(0, 1);                // render_and_frame_size_different.
+        } else {
+            header.putBits(0, 2);     // reset_frame_context.
+            header.putBits(0x01, 8);  // refresh_frame_flags: the first slot only.
+            for (int ref = 0; ref < 3; ++ref) {
+                header.putBits(0, 3);  // ref_frame_idx.
+                header.putBits(0, 1);  // ref_frame_sign_bias.
+            }
+            header.putBits(1, 1);  // found_ref.
+            header.putBits(0, 1);  // render_and_frame_size_different.
+            header.putBits(0, 1);  // allow_high_precision_mv.
+            header.putBits(0, 1);  // is_filter_switchable.
+            header.putBits(0, 2);  // raw_interpolation_filter.
+        }
+        header.putBits(0, 1);   // refresh_frame_context.
+        header.putBits(1, 1);   // frame_parallel_decoding_mode.
+        header.putBits(0, 2);   // frame_context_idx.
+        header.putBits(0, 6);   // filter_level.
+        header.putBits(0, 3);   // sharpness_level.
+        header.putBits(0, 1);   // loop_filter_delta_enabled.
+        header.putBits(60, 8);  // base_q_idx.
+        header.putBits(0, 3);   // delta_coded, for the three delta quantizers.
+        header.putBits(0, 1);   // segmentation_enabled.
+        header.putBits(0, 1);   // increment_tile_rows_log2, no tile columns at this width.
+        header.putBits(kVp9CompressedHeaderSize, 16);  // header_size_in_bytes.
+        const std::vector<uint8_t> frame = header.finish();
+        stream.mData.insert(stream.mData.end(), frame.begin(), frame.end());
+        // A compressed header of zeros updates no probability. Stands for the tile data after it.
+        stream.mData.insert(stream.mData.end(), kVp9CompressedHeaderSize, 0);
+        stream.mData.insert(stream.mData.end(), 16, 0xa5);
+
+        stream.mBuffers.emplace_back(offset, stream.mData.size() - offset);
+    }
+    return stream;
+}
+
+struct DecodeResult {
+    bool mInitialized = false;
+    bool mError = false;
+    bool mTimedOut = false;
+    int mDecodedFrames = 0;
+    // The bitstream buffer id of each picture, in output order.
+    std::vector<int32_t> mPictureBitstreamIds;
+    int mEndOfBitstreams = 0;
+    double mElapsedSeconds = 0;
+    // Time from Decode() to PictureReady() of each frame, in milliseconds.
+    std::vector<double> mLatenciesMs;
+};
+
+// Drives a V4L2VideoDecodeAccelerator or a V4L2SliceVideoDecodeAccelerator decoding on a
+// FakeV4L2Device. The accelerator is created, called and destroyed on |mClientThread|, where its
+// Client callbacks also run.
+class FakeDecodeClient : public media::VideoDecodeAccelerator::Client {
+public:
+    // Decodes with a V4L2VideoDecodeAccelerator in |pollMode|.
+    FakeDecodeClient(const media::FakeV4L2Device::Options& options, PollMode pollMode)
+          : mOptions(options),
+            mSliceVDA(false),
+            mPollMode(pollMode),
+            mNumHeldPictures(0),
+            mClientThread("FakeDecodeClientThread") {}
+
+    // Decodes with a V4L2SliceVideoDecodeAccelerator. Like a renderer, the client holds the last
+    // |numHeldPictures| pictures before returning them, and allocates as many extra buffers.
+    explicit FakeDecodeClient(const media::FakeV4L2Device::Options& options,
+                              size_t numHeldPictures = 0)
+          : mOptions(options),
+            mSliceVDA(true),
+            mPollMode(PollMode::kPollThread),
+            mNumHeldPictures(numHeldPictures),
+            mClientThread("FakeDecodeClientThread") {}
+
+    // Decodes the buffers of |stream|, with at most |maxInFlight| of them given to the accelerator
+    // at a time, and flushes. If |resetAfter| is not negative, the accelerator is reset after the
+    // first |resetAfter| buffers were given to it, then the decode resumes.
+    DecodeResult decode(const TestStream& stream, int maxInFlight, int resetAfter = -1) {
+        mResult = DecodeResult();
+        mStream = &stream;
+        mNumFrames = stream.mBuffers.size();
+        mMaxInFlight = maxInFlight;
+        mResetAfter = resetAfter;
+        mNextBitstreamId = 0;
+        mInFlight = 0;
+        mResetting = false;
+        mHeldPictureIds.clear();
+        mDone = false;
+
+        mInputFd.reset(ashmem_create_region("FakeDecodeInput", stream.mData.size()));
+        mPictureFd.reset(eventfd(0, 0));
+        if (!mInputFd.is_valid() || !mPictureFd.is_valid() || !writeInput(stream.mData)) {
+            ALOGE("Failed to create the buffers");
+            mResult.mError = true;
+            return mResult;
+        }
+
+        if (!mClientThread.Start()) {
+            ALOGE("Failed to start the client thread");
+            mResult.mError = true;
+            return mResult;
+        }
+        mClientThread.task_runner()->PostTask(
+                FROM_HERE, ::base::Bind(&FakeDecodeClient::startTask, ::base::Unretained(this)));
+        {
+            std::unique_lock<std::mutex> l(mDoneLock);
+            if (!mDoneCondition.wait_for(l, kDecodeTimeout, [this] { return mDone; })) {
+                mResult.mTimedOut = true;
+            }
+        }
+        mClientThread.task_runner()->PostTask(
+                FROM_HERE, ::base::Bind(&FakeDecodeClient::destroyTask, ::base::Unretained(this)));
+        mClientThread.Stop();
+        return mResult;
+    }
+
+    // media::VideoDecodeAccelerator::Client implementation.
+    void NotifyInitializationComplete(bool success) override {}
+
+    void ProvidePictureBuffers(uint32_t requestedNumOfBuffers, media::VideoPixelFormat format,
+                               const media::Size& dimensions) override {
+        std::vector<media::PictureBuffer> buffers;
+        for (uint32_t id = 0; id < requestedNumOfBuffers + mNumHeldPictures; ++id) {
+            buffers.push_back(media::PictureBuffer(static_cast<int32_t>(id), dimensions));
+        }
+        mVDA->AssignPictureBuffers(buffers);
+        // The fake device writes nothing to the CAPTURE buffers, any fd stands for a dmabuf.
+        for (const auto& buffer : buffers) {
+            media::NativePixmapHandle handle;
+            handle.fds.emplace_back(::base::FileDescriptor(dup(mPictureFd.get()), true));
+            handle.planes.emplace_back(dimensions.width(), 0, 0);
+            mVDA->ImportBufferForPicture(buffer.id(), format, handle);
+        }
+    }
+
+    void DismissPictureBuffer(int32_t pictureBufferId) override {}
+
+    void PictureReady(const media::Picture& picture) override {
+        auto it = mDecodeStartTimes.find(picture.bitstream_buffer_id());
+        if (it != mDecodeStartTimes.end()) {
+            std::chrono::duration<double, std::milli> latency = Clock::now() - it->second;
+            mResult.mLatenciesMs.push_back(latency.count());
+        }
+        mResult.mDecodedFrames++;
+        mResult.mPictureBitstreamIds.push_back(picture.bitstream_buffer_id());
+        // A buffer shown more than once is returned once per picture.
+        mHeldPictureIds.push_back(picture.picture_buffer_id());
+        if (mHeldPictureIds.size() > mNumHeldPictures) {
+            mVDA->ReusePictureBuffer(mHeldPictureIds.front());
+            mHeldPictureIds.pop_front();
+        }
+    }
+
+    void NotifyEndOfBitstreamBuffer(int32_t bitstreamBufferId) override {
+        mResult.mEndOfBitstreams++;
+        mInFlight--;
+        decodeMore();
+    }
+
+    void NotifyFlushDone() override {
+        mResult.mElapsedSeconds = std::chrono::duration<double>(Clock::now() - mStartTime).count();
+        finish();
+    }
+
+    void NotifyResetDone() override {
+        mResetting = false;
+        decodeMore();
+    }
+
+    void NotifyError(media::VideoDecodeAccelerator::Error error) override {
+        ALOGE("Decode error: %d", static_cast<int>(error));
+        mResult.mError = true;
+        finish();
+    }
+
+private:
+    bool writeInput(const std::vector<uint8_t>& data) {
+        void* address =
+                mmap(nullptr, data.size(), PROT_READ | PROT_WRITE, MAP_SHARED, mInputFd.get(), 0);
+        if (address == MAP_FAILED) return false;
+        memcpy(address, data.data(), data.size());
+        munmap(address, data.size());
+        return true;
+    }
+
+    void startTask() {
+        scoped_refptr<media::V4L2Device> device(new media::FakeV4L2Device(mOptions));
+        if (mSliceVDA) {
+            mVDA = new media::V4L2SliceVideoDecodeAccelerator(device);
+        } else {
+            mVDA = new media::V4L2VideoDecodeAccelerator(device, mPollMode);
+        }
+        media::VideoDecodeAccelerator::Config config(mStream->mProfile);
+        config.output_mode = media::VideoDecodeAccelerator::Config::OutputMode::IMPORT;
+        mResult.mInitialized = mVDA->Initialize(config, this);
+        if (!mResult.mInitialized) {
+            finish();
+            return;
+        }
+        mStartTime = Clock::now();
+        decodeMore();
+    }
+
+    void destroyTask() {
+        if (mVDA) {
+            mVDA->Destroy();
+            mVDA = nullptr;
+        }
+    }
+
+    // Gives bitstream buffers to the accelerator until |mMaxInFlight| of them are in flight, and
+    // flushes after the last one.
+    void decodeMore() {
+        while (!mResetting && mInFlight < mMaxInFlight && mNextBitstreamId < mNumFrames) {
+            const int32_t bitstreamId = mNextBitstreamId++;
+            const auto& buffer = mStream->mBuffers[bitstreamId];
+            mDecodeStartTimes[bitstreamId] = Clock::now();
+            mInFlight++;
+            // The accelerator takes the ownership of the handle.
+            mVDA->Decode(media::BitstreamBuffer(
+                    bitstreamId, ::base::SharedMemoryHandle(dup(mInputFd.get()), true),
+                    buffer.second, buffer.first));
+
+            if (mNextBitstreamId == mNumFrames) {
+                mVDA->Flush();
+            } else if (mNextBitstreamId == mResetAfter) {
+                mResetting = true;
+                mVDA->Reset();
+            }
+        }
+    }
+
+    void finish() {
+        std::lock_guard<std::mutex> l(mDoneLock);
+        mDone = true;
+        mDoneCondition.notify_all();
+    }
+
+    const media::FakeV4L2Device::Options mOptions;
+    const bool mSliceVDA;
+    const PollMode mPollMode;
+    const size_t mNumHeldPictures;
+    ::base::Thread mClientThread;
+
+    // Members below are only accessed on |mClientThread|, or while it is stopped.
+    media::VideoDecodeAccelerator* mVDA = nullptr;
+    const TestStream* mStream = nullptr;
+    ::base::ScopedFD mInputFd;
+    ::base::ScopedFD mPictureFd;
+    int mNumFrames = 0;
+    int mMaxInFlight = 0;
+    int mResetAfter = -1;
+    int32_t mNextBitstreamId = 0;
+    int mInFlight = 0;
+    bool mResetting = false;
+    // The picture buffers not returned to the accelerator yet, oldest first.
+    std::deque<int32_t> mHeldPictureIds;
+    Clock::time_point mStartTime;
+    std::map<int32_t, Clock::time_point> mDecodeStartTimes;
+    DecodeResult mResult;
+
+    std::mutex mDoneLock;
+    std::condition_variable mDoneCondition;
+    bool mDone = false;
+};
+
+media::FakeV4L2Device::Options makeOptions(::base::TimeDelta decodeLatency, size_t dpbHoldDepth) {
+    media::FakeV4L2Device::Options options;
+    options.input_fourccs = {V4L2_PIX_FMT_VP8};
+    options.coded_size = media::Size(640, 368);
+    options.visible_size = media::Size(640, 360);
+    options.decode_latency = decodeLatency;
+    options.dpb_hold_depth = dpbHoldDepth;
+    return options;
+}
+
+media::FakeV4L2Device::Options makeSliceOptions(uint32_t inputFourcc) {
+    media::FakeV4L2Device::Options options;
+    options.input_fourccs = {inputFourcc};
+    options.decode_latency = ::base::TimeDelta::FromMilliseconds(1);
+    return options;
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    size_t index = static_cast<size_t>(p / 100 * (values.size() - 1) + 0.5);
+    return values[std::min(index, values.size() - 1)];
+}
+
+}  // namespace
+
+// Test parameters:
+// - The poll mode of the accelerator.
+// - The number of frames the fake device holds in its DPB.
+class V4L2VDAFakeDeviceTest : public ::testing::TestWithParam<std::tuple<PollMode, size_t>> {};
+
+TEST_P(V4L2VDAFakeDeviceTest, DecodeAndFlush) {
+    const int kNumFrames = 60;
+    FakeDecodeClient client(
+            makeOptions(::base::TimeDelta::FromMilliseconds(1), std::get<1>(GetParam())),
+            std::get<0>(GetParam()));
+    DecodeResult result = client.decode(makeFakeVp8Stream(kNumFrames), 8);
+
+    ASSERT_TRUE(result.mInitialized);
+    EXPECT_FALSE(result.mTimedOut);
+    EXPECT_FALSE(result.mError);
+    EXPECT_EQ(kNumFrames, result.mEndOfBitstreams);
+    EXPECT_EQ(kNumFrames, result.mDecodedFrames);
+}
+
+TEST_P(V4L2VDAFakeDeviceTest, ResetMidStream) {
+    const int kNumFrames = 60;
+    const int kResetAfter = 20;
+    FakeDecodeClient client(
+            makeOptions(::base::TimeDelta::FromMilliseconds(1), std::get<1>(GetParam())),
+            std::get<0>(GetParam()));
+    DecodeResult result = client.decode(makeFakeVp8Stream(kNumFrames), 8, kResetAfter);
+
+    ASSERT_TRUE(result.mInitialized);
+    EXPECT_FALSE(result.mTimedOut);
+    EXPECT_FALSE(result.mError);
+    // Every buffer is returned, but the frames in flight at the reset may be dropped.
+    EXPECT_EQ(kNumFrames, result.mEndOfBitstreams);
+    EXPECT_GE(result.mDecodedFrames, kNumFrames - kResetAfter);
+    EXPECT_LE(result.mDecodedFrames, kNumFrames);
+}
+
+INSTANTIATE_TEST_CASE_P(PollModesAndDpbDepths, V4L2VDAFakeDeviceTest,
+                        ::testing::Combine(::testing::Values(PollMode::kPollThread,
+                                                             PollMode::kDecoderThread),
+                                           ::testing::Values(0u, 4u)));
+
+// Test parameter: the number of bitstream buffers given to the accelerator at a time.
+class V4L2SliceVDAFakeDeviceTest : public ::testing::TestWithParam<int> {};
+
+TEST_P(V4L2SliceVDAFakeDeviceTest, DecodeAndFlushH264) {
+    const int kNumFrames = 60;
+    const TestStream stream = makeH264Stream(kNumFrames);
+    FakeDecodeClient client(makeSliceOptions(V4L2_PIX_FMT_H264_SLICE));
+    DecodeResult result = client.decode(stream, GetParam());
+
+    ASSERT_TRUE(result.mInitialized);
+    EXPECT_FALSE(result.mTimedOut);
+    EXPECT_FALSE(result.mError);
+    EXPECT_EQ(kNumFrames, result.mEndOfBitstreams);
+    // Each buffer holds one frame, output once and in order.
+    ASSERT_EQ(kNumFrames, result.mDecodedFrames);
+    for (int i = 0; i < kNumFrames; ++i) {
+        EXPECT_EQ(i, result.mPictureBitstreamIds[i]);
+    }
+}
+
+TEST_P(V4L2SliceVDAFakeDeviceTest, ResetMidStreamH264) {
+    const int kNumFrames = 60;
+    const int kResetAfter = 2 * kH264IdrPeriod;
+    const TestStream stream = makeH264Stream(kNumFrames);
+    FakeDecodeClient client(makeSliceOptions(V4L2_PIX_FMT_H264_SLICE));
+    DecodeResult result = client.decode(stream, GetParam(), kResetAfter);
+
+    ASSERT_TRUE(result.mInitialized);
+    EXPECT_FALSE(result.mTimedOut);
+    EXPECT_FALSE(result.mError);
+    // Every buffer is returned, but the frames in flight at the reset may be dropped. The decode
+    // resumes at the IDR frame following the reset.
+    EXPECT_EQ(kNumFrames, result.mEndOfBitstreams);
+    EXPECT_GE(result.mDecodedFrames, kNumFrames - kResetAfter);
+    EXPECT_LE(result.mDecodedFrames, kNumFrames);
+    EXPECT_TRUE(std::is_sorted(result.mPictureBitstreamIds.begin(),
+                               result.mPictureBitstreamIds.end()));
+}
+
+// Frames shown again by show_existing_frame are output as the pictures of their own bitstream
+// buffers, also while the client still holds the buffer of the frame.
+TEST_P(V4L2SliceVDAFakeDeviceTest, DecodeAndFlushVp9ShowExistingFrame) {
+    const int kNumFrames = 60;
+    const size_t kNumHeldPictures = 4;
+    const TestStream stream = makeVp9Stream(kNumFrames);
+    FakeDecodeClient client(makeSliceOptions(V4L2_PIX_FMT_VP9_FRAME), kNumHeldPictures);
+    DecodeResult result = client.decode(stream, GetParam());
+
+    ASSERT_TRUE(result.mInitialized);
+    EXPECT_FALSE(result.mTimedOut);
+    EXPECT_FALSE(result.mError);
+    EXPECT_EQ(kNumFrames, result.mEndOfBitstreams);
+    ASSERT_EQ(kNumFrames, result.mDecodedFrames);
+    for (int i = 0; i < kNumFrames; ++i) {
+        EXPECT_EQ(i, result.mPictureBitstreamIds[i]);
+    }
+}
+
+INSTANTIATE_TEST_CASE_P(BuffersInFlight, V4L2SliceVDAFakeDeviceTest, ::testing::Values(1, 8));
+
+// The stateless VP9 control takes no reset for both values 0 and 1 of reset_frame_context, so the
+// values of the bitstream are shifted.
+TEST(V4L2SliceVDAVp9Test, ResetFrameContextToV4L2) {
+    EXPECT_EQ(V4L2_VP9_RESET_FRAME_CTX_NONE, media::Vp9ResetFrameContextToV4L2(0));
+    EXPECT_EQ(V4L2_VP9_RESET_FRAME_CTX_NONE, media::Vp9ResetFrameContextToV4L2(1));
+    EXPECT_EQ(V4L2_VP9_RESET_FRAME_CTX_SPEC, media::Vp9ResetFrameContextToV4L2(2));
+    EXPECT_EQ(V4L2_VP9_RESET_FRAME_CTX_ALL, media::Vp9ResetFrameContextToV4L2(3));
+}
+
+// Not a correctness test: prints the throughput and the latency of the accelerator, with the
+// hardware replaced by the fake device. Disabled by default, run with
+// --gtest_also_run_disabled_tests --gtest_filter=*Benchmark* to compare the poll modes on a device.
+TEST(V4L2VDAFakeDeviceBenchmark, DISABLED_Benchmark) {
+    for (PollMode pollMode : {PollMode::kPollThread, PollMode::kDecoderThread}) {
+        for (int latencyUs : {0, 2000}) {
+            for (size_t dpbHoldDepth : {0u, 4u}) {
+                FakeDecodeClient client(
+                        makeOptions(::base::TimeDelta::FromMicroseconds(latencyUs), dpbHoldDepth),
+                        pollMode);
+                DecodeResult result = client.decode(makeFakeVp8Stream(gBenchmarkFrames), 8);
+                ASSERT_TRUE(result.mInitialized);
+                ASSERT_FALSE(result.mTimedOut);
+                ASSERT_FALSE(result.mError);
+                printf("%-14s latency %4d us, dpb %zu: %8.1f fps, "
+                       "frame latency p50 %6.2f ms p90 %6.2f ms p99 %6.2f ms\n",
+                       pollModeName(pollMode), latencyUs, dpbHoldDepth,
+                       result.mDecodedFrames / result.mElapsedSeconds,
+                       percentile(result.mLatenciesMs, 50), percentile(result.mLatenciesMs, 90),
+                       percentile(result.mLatenciesMs, 99));
+            }
+        }
+    }
+}
+
+}  // namespace android
+
+static void usage(const char* me) {
+    fprintf(stderr, "usage: %s [-n benchmark_frames] [gtest options]\n", me);
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+    int res;
+    while ((res = getopt(argc, argv, "n:")) >= 0) {
+        switch (res) {
+        case 'n': {
+            android::gBenchmarkFrames = atoi(optarg);
+            break;
+        }
+        default: {
+            usage(argv[0]);
+            exit(1);
+            break;
+        }
+        }
+    }
+
+    return RUN_ALL_TESTS();
+}
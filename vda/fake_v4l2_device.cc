@@ -0,0 +1,1104 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "fake_v4l2_device.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/bind.h"
+#include "base/logging.h"
+#include "base/posix/eintr_wrapper.h"
+#include "v4l2_stateless_controls.h"
+
+#define DVLOGF(level) DVLOG(level) << __func__ << "(): "
+#define VLOGF(level) VLOG(level) << __func__ << "(): "
+#define VPLOGF(level) VPLOG(level) << __func__ << "(): "
+
+namespace media {
+
+namespace {
+
+// The mmap() offsets of the OUTPUT buffers are their index times this.
+constexpr unsigned int kMmapOffsetStep = 4096;
+// The OUTPUT buffer size if none is set by VIDIOC_S_FMT.
+constexpr size_t kDefaultInputBufferSize = 1024 * 1024;
+
+// The size of an NV12 frame of |coded_size|.
+size_t GetFrameSize(const Size& coded_size) {
+  return coded_size.width() * coded_size.height() * 3 / 2;
+}
+
+bool IsH264SliceNalu(uint8_t nalu_header) {
+  const uint8_t nal_unit_type = nalu_header & 0x1f;
+  // Coded slice of a non-IDR picture, or of an IDR picture.
+  return nal_unit_type == 1 || nal_unit_type == 5;
+}
+
+bool IsStatelessFourcc(uint32_t fourcc) {
+  return fourcc == V4L2_PIX_FMT_H264_SLICE ||
+         fourcc == V4L2_PIX_FMT_VP8_FRAME || fourcc == V4L2_PIX_FMT_VP9_FRAME;
+}
+
+// The controls without which a request cannot decode a frame of |fourcc|.
+std::vector<uint32_t> GetRequiredControls(uint32_t fourcc) {
+  switch (fourcc) {
+    case V4L2_PIX_FMT_H264_SLICE:
+      return {V4L2_CID_STATELESS_H264_SPS, V4L2_CID_STATELESS_H264_PPS,
+              V4L2_CID_STATELESS_H264_DECODE_PARAMS};
+    case V4L2_PIX_FMT_VP8_FRAME:
+      return {V4L2_CID_STATELESS_VP8_FRAME};
+    case V4L2_PIX_FMT_VP9_FRAME:
+      return {V4L2_CID_STATELESS_VP9_FRAME};
+    default:
+      return {};
+  }
+}
+
+// Round |value| up to a whole number of macroblocks.
+int AlignToMacroblocks(int value) {
+  return (value + 15) & ~15;
+}
+
+}  // namespace
+
+FakeV4L2Device::Options::Options()
+    : input_fourccs({V4L2_PIX_FMT_H264, V4L2_PIX_FMT_VP8, V4L2_PIX_FMT_VP9}),
+      max_resolution(1920, 1088),
+      coded_size(320, 240),
+      visible_size(320, 240),
+      dpb_hold_depth(0),
+      create_bufs_supported(true) {}
+
+FakeV4L2Device::Options::Options(const Options& other) = default;
+
+FakeV4L2Device::Options::~Options() {}
+
+FakeV4L2Device::InputBuffer::InputBuffer()
+    : length(0),
+      queued(false),
+      bytes_used(0),
+      data_offset(0),
+      timestamp(),
+      request_fd(-1) {}
+
+FakeV4L2Device::InputBuffer::InputBuffer(InputBuffer&& other) = default;
+
+FakeV4L2Device::InputBuffer::~InputBuffer() {}
+
+FakeV4L2Device::Request::Request() : state(State::kIdle), input_index(-1) {}
+
+FakeV4L2Device::Request::Request(const Request& other) = default;
+
+FakeV4L2Device::Request::~Request() {}
+
+FakeV4L2Device::FakeV4L2Device(const Options& options)
+    : options_(options),
+      epoll_polls_device_(false),
+      decode_thread_("FakeV4L2DecodeThread"),
+      opened_(false),
+      input_fourcc_(0),
+      stateless_(false),
+      coded_size_(options.coded_size),
+      input_buffer_size_(kDefaultInputBufferSize),
+      event_subscribed_(false),
+      format_known_(false),
+      device_ready_signalled_(false),
+      input_memory_(V4L2_MEMORY_MMAP),
+      input_streaming_(false),
+      output_buffer_count_(0),
+      output_streaming_(false),
+      decoding_(false),
+      decoding_output_(-1),
+      generation_(0),
+      draining_(false),
+      stopped_(false) {}
+
+FakeV4L2Device::~FakeV4L2Device() {
+  // The decodes still scheduled refer to this device.
+  decode_thread_.Stop();
+}
+
+bool FakeV4L2Device::Open(Type type, uint32_t v4l2_pixfmt) {
+  VLOGF(2);
+  DCHECK(!opened_);
+  if (type != Type::kDecoder ||
+      std::find(options_.input_fourccs.begin(), options_.input_fourccs.end(),
+                v4l2_pixfmt) == options_.input_fourccs.end()) {
+    VLOGF(1) << "No fake device supporting " << std::hex << "0x"
+             << v4l2_pixfmt << " for type: " << static_cast<int>(type);
+    return false;
+  }
+
+  device_poll_interrupt_fd_.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+  device_ready_fd_.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+  epoll_fd_.reset(epoll_create1(EPOLL_CLOEXEC));
+  if (!device_poll_interrupt_fd_.is_valid() || !device_ready_fd_.is_valid() ||
+      !epoll_fd_.is_valid()) {
+    VPLOGF(1) << "Failed creating the poll fds";
+    return false;
+  }
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = device_poll_interrupt_fd_.get();
+  if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, device_poll_interrupt_fd_.get(),
+                &event) != 0) {
+    VPLOGF(1) << "Failed adding the poll interrupt fd to epoll";
+    return false;
+  }
+
+  if (!decode_thread_.Start()) {
+    VLOGF(1) << "Failed starting the decode thread";
+    return false;
+  }
+
+  base::AutoLock auto_lock(lock_);
+  input_fourcc_ = v4l2_pixfmt;
+  stateless_ = IsStatelessFourcc(v4l2_pixfmt);
+  if (stateless_) {
+    // The client sets the format of stateless devices, from the stream it
+    // parses.
+    coded_size_ = Size();
+    format_known_ = true;
+  }
+  opened_ = true;
+  return true;
+}
+
+int FakeV4L2Device::Ioctl(int request, void* arg) {
+  base::AutoLock auto_lock(lock_);
+  DCHECK(opened_);
+
+  int result;
+  switch (static_cast<unsigned int>(request)) {
+    case VIDIOC_QUERYCAP:
+      result = QueryCap(static_cast<struct v4l2_capability*>(arg));
+      break;
+    case VIDIOC_ENUM_FMT:
+      result = EnumFmt(static_cast<struct v4l2_fmtdesc*>(arg));
+      break;
+    case VIDIOC_ENUM_FRAMESIZES:
+      result = EnumFrameSizes(static_cast<struct v4l2_frmsizeenum*>(arg));
+      break;
+    case VIDIOC_G_FMT:
+      result = GetFmt(static_cast<struct v4l2_format*>(arg));
+      break;
+    case VIDIOC_S_FMT:
+      result = SetFmt(static_cast<struct v4l2_format*>(arg));
+      break;
+    case VIDIOC_G_SELECTION:
+      result = GetSelection(static_cast<struct v4l2_selection*>(arg));
+      break;
+    case VIDIOC_G_CTRL:
+      result = GetCtrl(static_cast<struct v4l2_control*>(arg));
+      break;
+    case VIDIOC_S_EXT_CTRLS:
+      result = SetExtCtrls(static_cast<struct v4l2_ext_controls*>(arg));
+      break;
+    case VIDIOC_REQBUFS:
+      result = RequestBuffers(static_cast<struct v4l2_requestbuffers*>(arg));
+      break;
+    case VIDIOC_CREATE_BUFS:
+      result = CreateBuffers(static_cast<struct v4l2_create_buffers*>(arg));
+      break;
+    case VIDIOC_QUERYBUF:
+      result = QueryBuffer(static_cast<struct v4l2_buffer*>(arg));
+      break;
+    case VIDIOC_QBUF:
+      result = QueueBuffer(static_cast<struct v4l2_buffer*>(arg));
+      break;
+    case VIDIOC_DQBUF:
+      result = DequeueBuffer(static_cast<struct v4l2_buffer*>(arg));
+      break;
+    case VIDIOC_STREAMON:
+      result = StreamOn(static_cast<const __u32*>(arg));
+      break;
+    case VIDIOC_STREAMOFF:
+      result = StreamOff(static_cast<const __u32*>(arg));
+      break;
+    case VIDIOC_SUBSCRIBE_EVENT:
+      result = SubscribeEvent(
+          static_cast<const struct v4l2_event_subscription*>(arg));
+      break;
+    case VIDIOC_DQEVENT:
+      result = DequeueEvent(static_cast<struct v4l2_event*>(arg));
+      break;
+    case VIDIOC_TRY_DECODER_CMD:
+      result = DecoderCmd(static_cast<struct v4l2_decoder_cmd*>(arg), true);
+      break;
+    case VIDIOC_DECODER_CMD:
+      result = DecoderCmd(static_cast<struct v4l2_decoder_cmd*>(arg), false);
+      break;
+    default:
+      DVLOGF(3) << "Unsupported ioctl 0x" << std::hex << request;
+      result = ENOTTY;
+      break;
+  }
+  UpdateReadinessLocked();
+
+  if (result != 0) {
+    errno = result;
+    return -1;
+  }
+  return 0;
+}
+
+bool FakeV4L2Device::Poll(bool poll_device, bool* event_pending) {
+  struct pollfd pollfds[2];
+  nfds_t nfds = 1;
+  pollfds[0].fd = device_poll_interrupt_fd_.get();
+  pollfds[0].events = POLLIN | POLLERR;
+  if (poll_device) {
+    pollfds[nfds].fd = device_ready_fd_.get();
+    pollfds[nfds].events = POLLIN;
+    nfds++;
+  }
+
+  if (HANDLE_EINTR(poll(pollfds, nfds, -1)) == -1) {
+    VPLOGF(1) << "poll() failed";
+    return false;
+  }
+
+  base::AutoLock auto_lock(lock_);
+  *event_pending = poll_device && !pending_events_.empty();
+  return true;
+}
+
+bool FakeV4L2Device::SetDevicePollInterrupt() {
+  const uint64_t buf = 1;
+  if (HANDLE_EINTR(write(device_poll_interrupt_fd_.get(), &buf, sizeof(buf))) ==
+      -1) {
+    VPLOGF(1) << "write() failed";
+    return false;
+  }
+  return true;
+}
+
+bool FakeV4L2Device::ClearDevicePollInterrupt() {
+  uint64_t buf;
+  if (HANDLE_EINTR(read(device_poll_interrupt_fd_.get(), &buf, sizeof(buf))) ==
+          -1 &&
+      errno != EAGAIN) {
+    VPLOGF(1) << "read() failed";
+    return false;
+  }
+  return true;
+}
+
+int FakeV4L2Device::GetEpollFd() const {
+  return epoll_fd_.get();
+}
+
+bool FakeV4L2Device::SetEpollDevice(bool poll_device) {
+  if (poll_device == epoll_polls_device_)
+    return true;
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = device_ready_fd_.get();
+  if (epoll_ctl(epoll_fd_.get(), poll_device ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                device_ready_fd_.get(), &event) != 0) {
+    VPLOGF(1) << "epoll_ctl() failed";
+    return false;
+  }
+  epoll_polls_device_ = poll_device;
+  return true;
+}
+
+bool FakeV4L2Device::GetEpollEvents(uint32_t* device_events) {
+  *device_events = 0;
+  if (!epoll_polls_device_)
+    return true;
+
+  base::AutoLock auto_lock(lock_);
+  if (!done_outputs_.empty())
+    *device_events |= EPOLLIN;
+  if (!done_inputs_.empty())
+    *device_events |= EPOLLOUT;
+  if (!pending_events_.empty())
+    *device_events |= EPOLLPRI;
+  return true;
+}
+
+void* FakeV4L2Device::Mmap(void* addr,
+                           unsigned int len,
+                           int prot,
+                           int flags,
+                           unsigned int offset) {
+  base::AutoLock auto_lock(lock_);
+  const size_t index = offset / kMmapOffsetStep;
+  if (offset % kMmapOffsetStep != 0 || index >= input_buffers_.size() ||
+      !input_buffers_[index].data || len > input_buffers_[index].length) {
+    errno = EINVAL;
+    return MAP_FAILED;
+  }
+  return input_buffers_[index].data.get();
+}
+
+void FakeV4L2Device::Munmap(void* addr, unsigned int len) {
+  // The memory belongs to the buffer, and is freed with it.
+}
+
+std::vector<base::ScopedFD> FakeV4L2Device::GetDmabufsForV4L2Buffer(
+    int index,
+    size_t num_planes,
+    enum v4l2_buf_type type) {
+  VLOGF(1) << "Buffers cannot be exported from the fake device";
+  return std::vector<base::ScopedFD>();
+}
+
+bool FakeV4L2Device::OpenMediaDevice() {
+  base::AutoLock auto_lock(lock_);
+  if (!stateless_) {
+    VLOGF(1) << "Stateful fake devices have no media device";
+    return false;
+  }
+  return true;
+}
+
+base::ScopedFD FakeV4L2Device::AllocateRequest() {
+  base::AutoLock auto_lock(lock_);
+  DCHECK(stateless_);
+  // Any fd does, only its number is used.
+  base::ScopedFD request_fd(eventfd(0, EFD_CLOEXEC));
+  if (!request_fd.is_valid()) {
+    VPLOGF(1) << "Failed creating the request fd";
+    return base::ScopedFD();
+  }
+  requests_[request_fd.get()] = Request();
+  return request_fd;
+}
+
+bool FakeV4L2Device::QueueRequest(int request_fd) {
+  base::AutoLock auto_lock(lock_);
+  const auto iter = requests_.find(request_fd);
+  if (iter == requests_.end() || iter->second.state != Request::State::kIdle) {
+    VLOGF(1) << "Request " << request_fd << " cannot be queued";
+    errno = EBUSY;
+    return false;
+  }
+  Request& request = iter->second;
+  if (request.input_index < 0) {
+    VLOGF(1) << "No buffer in request " << request_fd;
+    errno = ENOENT;
+    return false;
+  }
+  for (uint32_t id : GetRequiredControls(input_fourcc_)) {
+    if (request.control_ids.count(id) == 0) {
+      VLOGF(1) << "Control 0x" << std::hex << id << " missing in request "
+               << std::dec << request_fd;
+      errno = EINVAL;
+      return false;
+    }
+  }
+
+  request.state = Request::State::kQueued;
+  pending_inputs_.push_back(request.input_index);
+  TryDecodeLocked();
+  UpdateReadinessLocked();
+  return true;
+}
+
+bool FakeV4L2Device::ReinitRequest(int request_fd) {
+  base::AutoLock auto_lock(lock_);
+  const auto iter = requests_.find(request_fd);
+  if (iter == requests_.end()) {
+    errno = EINVAL;
+    return false;
+  }
+  if (iter->second.state == Request::State::kQueued) {
+    errno = EBUSY;
+    return false;
+  }
+  // A buffer queued in a request that was never queued goes back to the
+  // client.
+  const int input_index = iter->second.input_index;
+  if (iter->second.state == Request::State::kIdle && input_index >= 0) {
+    input_buffers_[input_index].queued = false;
+    input_buffers_[input_index].request_fd = -1;
+  }
+  iter->second = Request();
+  return true;
+}
+
+void FakeV4L2Device::GetSupportedResolution(uint32_t pixelformat,
+                                            Size* min_resolution,
+                                            Size* max_resolution) {
+  min_resolution->SetSize(16, 16);
+  *max_resolution = options_.max_resolution;
+}
+
+VideoDecodeAccelerator::SupportedProfiles
+FakeV4L2Device::GetSupportedDecodeProfiles(const size_t num_formats,
+                                           const uint32_t pixelformats[]) {
+  VideoDecodeAccelerator::SupportedProfiles profiles;
+  for (uint32_t pixelformat : options_.input_fourccs) {
+    if (std::find(pixelformats, pixelformats + num_formats, pixelformat) ==
+        pixelformats + num_formats)
+      continue;
+
+    VideoDecodeAccelerator::SupportedProfile profile;
+    GetSupportedResolution(pixelformat, &profile.min_resolution,
+                           &profile.max_resolution);
+    for (const auto& video_codec_profile :
+         V4L2PixFmtToVideoCodecProfiles(pixelformat, false)) {
+      profile.profile = video_codec_profile;
+      profiles.push_back(profile);
+    }
+  }
+  return profiles;
+}
+
+int FakeV4L2Device::QueryCap(struct v4l2_capability* caps) {
+  memset(caps, 0, sizeof(*caps));
+  snprintf(reinterpret_cast<char*>(caps->driver), sizeof(caps->driver),
+           "fake-v4l2");
+  snprintf(reinterpret_cast<char*>(caps->card), sizeof(caps->card),
+           stateless_ ? "Fake V4L2 stateless decoder"
+                      : "Fake V4L2 stateful decoder");
+  snprintf(reinterpret_cast<char*>(caps->bus_info), sizeof(caps->bus_info),
+           "platform:fake-v4l2");
+  caps->device_caps = V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING;
+  caps->capabilities = caps->device_caps | V4L2_CAP_DEVICE_CAPS;
+  return 0;
+}
+
+int FakeV4L2Device::EnumFmt(struct v4l2_fmtdesc* fmtdesc) {
+  if (fmtdesc->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+    if (fmtdesc->index >= options_.input_fourccs.size())
+      return EINVAL;
+    fmtdesc->pixelformat = options_.input_fourccs[fmtdesc->index];
+    fmtdesc->flags = V4L2_FMT_FLAG_COMPRESSED;
+    return 0;
+  }
+  if (fmtdesc->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+    if (fmtdesc->index != 0)
+      return EINVAL;
+    fmtdesc->pixelformat = V4L2_PIX_FMT_NV12;
+    fmtdesc->flags = 0;
+    return 0;
+  }
+  return EINVAL;
+}
+
+int FakeV4L2Device::EnumFrameSizes(struct v4l2_frmsizeenum* frame_size) {
+  if (frame_size->index != 0 ||
+      std::find(options_.input_fourccs.begin(), options_.input_fourccs.end(),
+                frame_size->pixel_format) == options_.input_fourccs.end()) {
+    return EINVAL;
+  }
+  frame_size->type = V4L2_FRMSIZE_TYPE_STEPWISE;
+  frame_size->stepwise.min_width = 16;
+  frame_size->stepwise.min_height = 16;
+  frame_size->stepwise.max_width = options_.max_resolution.width();
+  frame_size->stepwise.max_height = options_.max_resolution.height();
+  frame_size->stepwise.step_width = 16;
+  frame_size->stepwise.step_height = 16;
+  return 0;
+}
+
+int FakeV4L2Device::GetFmt(struct v4l2_format* format) {
+  struct v4l2_pix_format_mplane* pix_mp = &format->fmt.pix_mp;
+  if (format->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+    memset(pix_mp, 0, sizeof(*pix_mp));
+    if (stateless_) {
+      pix_mp->width = coded_size_.width();
+      pix_mp->height = coded_size_.height();
+    }
+    pix_mp->pixelformat = input_fourcc_;
+    pix_mp->num_planes = 1;
+    pix_mp->plane_fmt[0].sizeimage = input_buffer_size_;
+    return 0;
+  }
+  if (format->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+    // The format is only known once the stream header is parsed.
+    if (!format_known_)
+      return EINVAL;
+    memset(pix_mp, 0, sizeof(*pix_mp));
+    pix_mp->width = coded_size_.width();
+    pix_mp->height = coded_size_.height();
+    pix_mp->pixelformat = V4L2_PIX_FMT_NV12;
+    pix_mp->field = V4L2_FIELD_NONE;
+    pix_mp->num_planes = 1;
+    pix_mp->plane_fmt[0].bytesperline = coded_size_.width();
+    pix_mp->plane_fmt[0].sizeimage = GetFrameSize(coded_size_);
+    return 0;
+  }
+  return EINVAL;
+}
+
+int FakeV4L2Device::SetFmt(struct v4l2_format* format) {
+  const struct v4l2_pix_format_mplane& pix_mp = format->fmt.pix_mp;
+  if (format->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+    if (input_streaming_ || !input_buffers_.empty())
+      return EBUSY;
+    // The CAPTURE format of stateless devices follows the OUTPUT one.
+    if (stateless_ && output_buffer_count_ != 0)
+      return EBUSY;
+    if (std::find(options_.input_fourccs.begin(), options_.input_fourccs.end(),
+                  pix_mp.pixelformat) == options_.input_fourccs.end() ||
+        IsStatelessFourcc(pix_mp.pixelformat) != stateless_) {
+      return EINVAL;
+    }
+    if (stateless_ &&
+        (pix_mp.width > static_cast<__u32>(options_.max_resolution.width()) ||
+         pix_mp.height >
+             static_cast<__u32>(options_.max_resolution.height()))) {
+      return EINVAL;
+    }
+    input_fourcc_ = pix_mp.pixelformat;
+    if (pix_mp.plane_fmt[0].sizeimage != 0)
+      input_buffer_size_ = pix_mp.plane_fmt[0].sizeimage;
+    if (stateless_) {
+      coded_size_.SetSize(AlignToMacroblocks(pix_mp.width),
+                          AlignToMacroblocks(pix_mp.height));
+    }
+    return GetFmt(format);
+  }
+  if (format->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+    if (pix_mp.pixelformat != V4L2_PIX_FMT_NV12)
+      return EINVAL;
+    // Until the format is known, only the fourcc is set.
+    return format_known_ ? GetFmt(format) : 0;
+  }
+  return EINVAL;
+}
+
+int FakeV4L2Device::GetSelection(struct v4l2_selection* selection) {
+  if (selection->type != V4L2_BUF_TYPE_VIDEO_CAPTURE &&
+      selection->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+    return EINVAL;
+  }
+  if (selection->target != V4L2_SEL_TGT_COMPOSE &&
+      selection->target != V4L2_SEL_TGT_COMPOSE_DEFAULT) {
+    return EINVAL;
+  }
+  if (!format_known_)
+    return EINVAL;
+  selection->r.left = 0;
+  selection->r.top = 0;
+  selection->r.width = options_.visible_size.width();
+  selection->r.height = options_.visible_size.height();
+  return 0;
+}
+
+int FakeV4L2Device::GetCtrl(struct v4l2_control* ctrl) {
+  if (ctrl->id != V4L2_CID_MIN_BUFFERS_FOR_CAPTURE)
+    return EINVAL;
+  // The held frames, and one to decode into.
+  ctrl->value = options_.dpb_hold_depth + 1;
+  return 0;
+}
+
+int FakeV4L2Device::SetExtCtrls(struct v4l2_ext_controls* ctrls) {
+  if (ctrls->count > 0 && !ctrls->controls)
+    return EINVAL;
+
+  const int request_fd = GetV4L2ExtControlsRequestFd(*ctrls);
+  if (request_fd >= 0) {
+    if (!stateless_)
+      return EACCES;
+    const auto iter = requests_.find(request_fd);
+    if (iter == requests_.end())
+      return EINVAL;
+    if (iter->second.state != Request::State::kIdle)
+      return EBUSY;
+    for (size_t i = 0; i < ctrls->count; ++i)
+      iter->second.control_ids.insert(ctrls->controls[i].id);
+    return 0;
+  }
+
+  // Only the H.264 modes the device decodes in can be set outside requests.
+  for (size_t i = 0; i < ctrls->count; ++i) {
+    const struct v4l2_ext_control& ctrl = ctrls->controls[i];
+    if (input_fourcc_ == V4L2_PIX_FMT_H264_SLICE &&
+        ((ctrl.id == V4L2_CID_STATELESS_H264_DECODE_MODE &&
+          ctrl.value == V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED) ||
+         (ctrl.id == V4L2_CID_STATELESS_H264_START_CODE &&
+          ctrl.value == V4L2_STATELESS_H264_START_CODE_ANNEX_B))) {
+      continue;
+    }
+    ctrls->error_idx = i;
+    return EINVAL;
+  }
+  return 0;
+}
+
+int FakeV4L2Device::RequestBuffers(struct v4l2_requestbuffers* reqbufs) {
+  reqbufs->count = std::min<__u32>(reqbufs->count, VIDEO_MAX_FRAME);
+  if (reqbufs->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+    if (input_streaming_)
+      return EBUSY;
+    if (reqbufs->memory != V4L2_MEMORY_MMAP &&
+        reqbufs->memory != V4L2_MEMORY_DMABUF) {
+      return EINVAL;
+    }
+    input_memory_ = static_cast<enum v4l2_memory>(reqbufs->memory);
+    // The buffers queued in requests that were not queued are freed too.
+    for (auto& request : requests_) {
+      if (request.second.state == Request::State::kIdle)
+        request.second.input_index = -1;
+    }
+    input_buffers_.clear();
+    pending_inputs_.clear();
+    done_inputs_.clear();
+    if (input_memory_ == V4L2_MEMORY_MMAP)
+      AddInputBuffersLocked(reqbufs->count, input_buffer_size_);
+    else
+      input_buffers_.resize(reqbufs->count);
+    return 0;
+  }
+  if (reqbufs->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+    if (output_streaming_)
+      return EBUSY;
+    // The decoded frames always go to buffers imported by the client.
+    if (reqbufs->memory != V4L2_MEMORY_DMABUF)
+      return EINVAL;
+    output_buffer_count_ = reqbufs->count;
+    output_queued_.assign(output_buffer_count_, false);
+    free_outputs_.clear();
+    held_frames_.clear();
+    done_outputs_.clear();
+    return 0;
+  }
+  return EINVAL;
+}
+
+int FakeV4L2Device::CreateBuffers(struct v4l2_create_buffers* create) {
+  if (!options_.create_bufs_supported)
+    return ENOTTY;
+  if (create->format.type != V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE ||
+      create->memory != V4L2_MEMORY_MMAP ||
+      (input_memory_ != V4L2_MEMORY_MMAP && !input_buffers_.empty())) {
+    return EINVAL;
+  }
+  create->index = input_buffers_.size();
+  create->count = std::min<__u32>(create->count,
+                                  VIDEO_MAX_FRAME - input_buffers_.size());
+  if (create->count == 0)
+    return 0;
+
+  input_memory_ = V4L2_MEMORY_MMAP;
+  const size_t size = create->format.fmt.pix_mp.plane_fmt[0].sizeimage;
+  AddInputBuffersLocked(create->count, size ? size : input_buffer_size_);
+  return 0;
+}
+
+int FakeV4L2Device::QueryBuffer(struct v4l2_buffer* buffer) {
+  if (buffer->type != V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE ||
+      buffer->memory != V4L2_MEMORY_MMAP || input_memory_ != V4L2_MEMORY_MMAP ||
+      buffer->index >= input_buffers_.size() || !buffer->m.planes ||
+      buffer->length < 1) {
+    return EINVAL;
+  }
+  const InputBuffer& input_buffer = input_buffers_[buffer->index];
+  buffer->length = 1;
+  buffer->flags = input_buffer.queued ? V4L2_BUF_FLAG_QUEUED : 0;
+  buffer->m.planes[0].length = input_buffer.length;
+  buffer->m.planes[0].m.mem_offset = buffer->index * kMmapOffsetStep;
+  return 0;
+}
+
+int FakeV4L2Device::QueueBuffer(struct v4l2_buffer* buffer) {
+  if (!buffer->m.planes || buffer->length < 1)
+    return EINVAL;
+
+  if (buffer->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+    if (buffer->index >= input_buffers_.size() ||
+        buffer->memory != input_memory_) {
+      return EINVAL;
+    }
+    InputBuffer& input_buffer = input_buffers_[buffer->index];
+    const struct v4l2_plane& plane = buffer->m.planes[0];
+    if (input_buffer.queued || plane.data_offset > plane.bytesused ||
+        (input_memory_ == V4L2_MEMORY_MMAP &&
+         plane.bytesused > input_buffer.length)) {
+      return EINVAL;
+    }
+    if (stateless_)
+      return QueueInputBufferInRequestLocked(buffer);
+    input_buffer.queued = true;
+    input_buffer.bytes_used = plane.bytesused;
+    input_buffer.data_offset = plane.data_offset;
+    input_buffer.timestamp = buffer->timestamp;
+    pending_inputs_.push_back(buffer->index);
+    TryDecodeLocked();
+    return 0;
+  }
+
+  if (buffer->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+    if (buffer->index >= output_buffer_count_ ||
+        buffer->memory != V4L2_MEMORY_DMABUF ||
+        output_queued_[buffer->index]) {
+      return EINVAL;
+    }
+    output_queued_[buffer->index] = true;
+    free_outputs_.push_back(buffer->index);
+    TryFinishDrainLocked();
+    TryDecodeLocked();
+    return 0;
+  }
+
+  return EINVAL;
+}
+
+int FakeV4L2Device::DequeueBuffer(struct v4l2_buffer* buffer) {
+  if (!buffer->m.planes || buffer->length < 1)
+    return EINVAL;
+
+  if (buffer->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+    if (done_inputs_.empty())
+      return EAGAIN;
+    const size_t index = done_inputs_.front();
+    done_inputs_.pop_front();
+    InputBuffer& input_buffer = input_buffers_[index];
+    input_buffer.queued = false;
+    buffer->index = index;
+    buffer->flags = 0;
+    buffer->timestamp = input_buffer.timestamp;
+    buffer->m.planes[0].bytesused = input_buffer.bytes_used;
+    return 0;
+  }
+
+  if (buffer->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+    if (done_outputs_.empty())
+      return stopped_ ? EPIPE : EAGAIN;
+    const DoneOutput done_output = done_outputs_.front();
+    done_outputs_.pop_front();
+    output_queued_[done_output.index] = false;
+    buffer->index = done_output.index;
+    buffer->flags = done_output.flags;
+    buffer->timestamp = done_output.timestamp;
+    buffer->m.planes[0].bytesused = done_output.bytes_used;
+    if (done_output.flags & V4L2_BUF_FLAG_LAST)
+      stopped_ = true;
+    return 0;
+  }
+
+  return EINVAL;
+}
+
+int FakeV4L2Device::StreamOn(const __u32* type) {
+  if (*type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+    input_streaming_ = true;
+  } else if (*type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+    output_streaming_ = true;
+    TryFinishDrainLocked();
+  } else {
+    return EINVAL;
+  }
+  TryDecodeLocked();
+  return 0;
+}
+
+int FakeV4L2Device::StreamOff(const __u32* type) {
+  if (*type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+    CancelDecodeLocked();
+    input_streaming_ = false;
+    // All the OUTPUT buffers go back to the client, decoded or not, and the
+    // requests of the ones not decoded are cancelled.
+    for (size_t i = 0; i < input_buffers_.size(); ++i) {
+      CompleteRequestLocked(i);
+      input_buffers_[i].queued = false;
+    }
+    pending_inputs_.clear();
+    done_inputs_.clear();
+    draining_ = false;
+    return 0;
+  }
+
+  if (*type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+    CancelDecodeLocked();
+    output_streaming_ = false;
+    // All the CAPTURE buffers go back to the client, including the frames
+    // held in the DPB.
+    output_queued_.assign(output_buffer_count_, false);
+    free_outputs_.clear();
+    held_frames_.clear();
+    done_outputs_.clear();
+    stopped_ = false;
+    return 0;
+  }
+
+  return EINVAL;
+}
+
+int FakeV4L2Device::SubscribeEvent(
+    const struct v4l2_event_subscription* sub) {
+  if (sub->type != V4L2_EVENT_SOURCE_CHANGE)
+    return EINVAL;
+  event_subscribed_ = true;
+  return 0;
+}
+
+int FakeV4L2Device::DequeueEvent(struct v4l2_event* event) {
+  if (pending_events_.empty())
+    return ENOENT;
+  *event = pending_events_.front();
+  pending_events_.pop_front();
+  event->pending = pending_events_.size();
+  return 0;
+}
+
+int FakeV4L2Device::DecoderCmd(struct v4l2_decoder_cmd* cmd, bool try_only) {
+  // Stateless decoders have no stream to stop, the client holds it.
+  if (stateless_)
+    return ENOTTY;
+
+  switch (cmd->cmd) {
+    case V4L2_DEC_CMD_STOP:
+      if (!try_only) {
+        draining_ = true;
+        TryFinishDrainLocked();
+      }
+      return 0;
+
+    case V4L2_DEC_CMD_START:
+      if (!try_only)
+        stopped_ = false;
+      return 0;
+
+    default:
+      return EINVAL;
+  }
+}
+
+int FakeV4L2Device::QueueInputBufferInRequestLocked(
+    struct v4l2_buffer* buffer) {
+  lock_.AssertAcquired();
+  DCHECK(stateless_);
+  // Stateless devices only decode frames queued in requests.
+  const int request_fd = GetV4L2BufferRequestFd(*buffer);
+  if (request_fd < 0)
+    return EBADR;
+  const auto iter = requests_.find(request_fd);
+  if (iter == requests_.end())
+    return EINVAL;
+  Request& request = iter->second;
+  if (request.state != Request::State::kIdle || request.input_index >= 0)
+    return EBUSY;
+
+  InputBuffer& input_buffer = input_buffers_[buffer->index];
+  const struct v4l2_plane& plane = buffer->m.planes[0];
+  input_buffer.queued = true;
+  input_buffer.bytes_used = plane.bytesused;
+  input_buffer.data_offset = plane.data_offset;
+  input_buffer.timestamp = buffer->timestamp;
+  input_buffer.request_fd = request_fd;
+  request.input_index = buffer->index;
+  return 0;
+}
+
+void FakeV4L2Device::CompleteRequestLocked(size_t input_index) {
+  lock_.AssertAcquired();
+  InputBuffer& input_buffer = input_buffers_[input_index];
+  if (input_buffer.request_fd < 0)
+    return;
+
+  const auto iter = requests_.find(input_buffer.request_fd);
+  if (iter != requests_.end() &&
+      iter->second.input_index == static_cast<int>(input_index)) {
+    iter->second.state = Request::State::kCompleted;
+  }
+  input_buffer.request_fd = -1;
+}
+
+void FakeV4L2Device::AddInputBuffersLocked(size_t count, size_t size) {
+  lock_.AssertAcquired();
+  for (size_t i = 0; i < count; ++i) {
+    InputBuffer input_buffer;
+    input_buffer.data.reset(new uint8_t[size]);
+    input_buffer.length = size;
+    input_buffers_.push_back(std::move(input_buffer));
+  }
+}
+
+bool FakeV4L2Device::HasFrameLocked(const InputBuffer& buffer) const {
+  lock_.AssertAcquired();
+  if (buffer.bytes_used <= buffer.data_offset)
+    return false;
+  // Each request of a stateless device carries one frame.
+  if (stateless_)
+    return true;
+  // VP8 and VP9 buffers carry one frame each. The content of imported buffers
+  // is not looked at.
+  if (input_fourcc_ != V4L2_PIX_FMT_H264 || !buffer.data)
+    return true;
+
+  // H.264 buffers may also carry only parameter sets, or other NALUs that
+  // produce no picture.
+  const uint8_t* data = buffer.data.get();
+  for (size_t i = buffer.data_offset; i + 3 < buffer.bytes_used; ++i) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1 &&
+        IsH264SliceNalu(data[i + 3])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void FakeV4L2Device::SetFormatKnownLocked() {
+  lock_.AssertAcquired();
+  if (format_known_)
+    return;
+
+  DVLOGF(3) << "Stream format known, coded size: " << coded_size_.ToString();
+  format_known_ = true;
+  if (!event_subscribed_)
+    return;
+  struct v4l2_event event;
+  memset(&event, 0, sizeof(event));
+  event.type = V4L2_EVENT_SOURCE_CHANGE;
+  event.u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION;
+  pending_events_.push_back(event);
+}
+
+void FakeV4L2Device::TryDecodeLocked() {
+  lock_.AssertAcquired();
+  if (decoding_ || !input_streaming_ || pending_inputs_.empty())
+    return;
+
+  const size_t input_index = pending_inputs_.front();
+  int output_index = -1;
+  if (HasFrameLocked(input_buffers_[input_index])) {
+    // Like a real stateful decoder, stop at the first frame until the client
+    // set up the CAPTURE queue for the format it reports.
+    if (!format_known_) {
+      SetFormatKnownLocked();
+      return;
+    }
+    if (!output_streaming_ || free_outputs_.empty())
+      return;
+    output_index = free_outputs_.front();
+    free_outputs_.pop_front();
+  }
+
+  decoding_ = true;
+  decoding_output_ = output_index;
+  decode_thread_.task_runner()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&FakeV4L2Device::DecodeDoneTask, base::Unretained(this),
+                 generation_, input_index, output_index),
+      options_.decode_latency);
+}
+
+void FakeV4L2Device::DecodeDoneTask(uint64_t generation,
+                                    size_t input_index,
+                                    int output_index) {
+  DCHECK(decode_thread_.task_runner()->BelongsToCurrentThread());
+  base::AutoLock auto_lock(lock_);
+  if (generation != generation_) {
+    DVLOGF(4) << "Dropping the decode of a stopped queue";
+    return;
+  }
+
+  DCHECK(decoding_);
+  DCHECK_EQ(pending_inputs_.front(), input_index);
+  decoding_ = false;
+  decoding_output_ = -1;
+  pending_inputs_.pop_front();
+  CompleteRequestLocked(input_index);
+  done_inputs_.push_back(input_index);
+
+  if (output_index >= 0) {
+    HeldFrame frame;
+    frame.index = output_index;
+    frame.timestamp = input_buffers_[input_index].timestamp;
+    held_frames_.push_back(frame);
+    const size_t hold_depth = stateless_ ? 0 : options_.dpb_hold_depth;
+    while (held_frames_.size() > hold_depth) {
+      DoneOutput done_output;
+      done_output.index = held_frames_.front().index;
+      done_output.bytes_used = GetFrameSize(coded_size_);
+      done_output.flags = 0;
+      done_output.timestamp = held_frames_.front().timestamp;
+      done_outputs_.push_back(done_output);
+      held_frames_.pop_front();
+    }
+  }
+
+  TryFinishDrainLocked();
+  TryDecodeLocked();
+  UpdateReadinessLocked();
+}
+
+void FakeV4L2Device::TryFinishDrainLocked() {
+  lock_.AssertAcquired();
+  if (!draining_ || decoding_ || !pending_inputs_.empty())
+    return;
+
+  // A stream stopped before its first frame still reports its format, so
+  // that the client sets up the CAPTURE queue the last buffer is returned on.
+  if (!format_known_) {
+    SetFormatKnownLocked();
+    return;
+  }
+
+  if (!held_frames_.empty()) {
+    while (!held_frames_.empty()) {
+      DoneOutput done_output;
+      done_output.index = held_frames_.front().index;
+      done_output.bytes_used = GetFrameSize(coded_size_);
+      done_output.flags = held_frames_.size() == 1 ? V4L2_BUF_FLAG_LAST : 0;
+      done_output.timestamp = held_frames_.front().timestamp;
+      done_outputs_.push_back(done_output);
+      held_frames_.pop_front();
+    }
+  } else {
+    // With no frame left, the last buffer is an empty one.
+    if (!output_streaming_ || free_outputs_.empty())
+      return;
+    DoneOutput done_output;
+    done_output.index = free_outputs_.front();
+    done_output.bytes_used = 0;
+    done_output.flags = V4L2_BUF_FLAG_LAST;
+    done_output.timestamp = timeval();
+    done_outputs_.push_back(done_output);
+    free_outputs_.pop_front();
+  }
+  draining_ = false;
+}
+
+void FakeV4L2Device::CancelDecodeLocked() {
+  lock_.AssertAcquired();
+  if (!decoding_)
+    return;
+
+  ++generation_;
+  decoding_ = false;
+  if (decoding_output_ >= 0)
+    free_outputs_.push_front(decoding_output_);
+  decoding_output_ = -1;
+}
+
+void FakeV4L2Device::UpdateReadinessLocked() {
+  lock_.AssertAcquired();
+  const bool ready = !done_inputs_.empty() || !done_outputs_.empty() ||
+                     !pending_events_.empty();
+  if (ready == device_ready_signalled_)
+    return;
+
+  uint64_t buf = 1;
+  ssize_t result;
+  if (ready) {
+    result = HANDLE_EINTR(write(device_ready_fd_.get(), &buf, sizeof(buf)));
+  } else {
+    result = HANDLE_EINTR(read(device_ready_fd_.get(), &buf, sizeof(buf)));
+  }
+  if (result == -1)
+    VPLOGF(1) << "Failed signaling the device readiness";
+  device_ready_signalled_ = ready;
+}
+
+}  //  namespace media
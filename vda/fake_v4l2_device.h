@@ -0,0 +1,264 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+// This file contains a V4L2Device emulating a stateful or a stateless V4L2
+// decoder in userspace, so that the decode accelerators and their clients can
+// run, be tested and be benchmarked without V4L2 hardware. No pixels are
+// decoded: the device only follows the buffer, event and command flow of the
+// V4L2 stateful decoder interface, or the buffer and request flow of the
+// stateless one and of the Media Request API, with a configurable decode
+// latency and DPB depth.
+
+#ifndef FAKE_V4L2_DEVICE_H_
+#define FAKE_V4L2_DEVICE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "base/files/scoped_file.h"
+#include "base/macros.h"
+#include "base/synchronization/lock.h"
+#include "base/threading/thread.h"
+#include "base/time/time.h"
+#include "size.h"
+#include "v4l2_device.h"
+
+namespace media {
+
+class FakeV4L2Device : public V4L2Device {
+ public:
+  struct Options {
+    Options();
+    Options(const Options& other);
+    ~Options();
+
+    // The input fourccs the device decodes. The device is stateful if it is
+    // opened for a bitstream fourcc, e.g. V4L2_PIX_FMT_H264, and stateless if
+    // it is opened for a parsed one, e.g. V4L2_PIX_FMT_H264_SLICE.
+    std::vector<uint32_t> input_fourccs;
+    // The maximum coded size of the streams the device accepts.
+    Size max_resolution;
+    // The coded and visible size of the stream, reported by stateful devices
+    // with a V4L2_EVENT_SOURCE_CHANGE once the first frame is queued.
+    // Stateless devices take the coded size of the OUTPUT format instead.
+    Size coded_size;
+    Size visible_size;
+    // The time it takes to decode one input buffer.
+    base::TimeDelta decode_latency;
+    // The number of decoded frames a stateful device holds back, as a decoder
+    // does to reorder them, before returning them on the CAPTURE queue. All of
+    // them are returned by V4L2_DEC_CMD_STOP. Stateless devices hold none.
+    size_t dpb_hold_depth;
+    // Whether OUTPUT buffers can be added by VIDIOC_CREATE_BUFS.
+    bool create_bufs_supported;
+  };
+
+  explicit FakeV4L2Device(const Options& options);
+
+  // V4L2Device implementation.
+  bool Open(Type type, uint32_t v4l2_pixfmt) override;
+  int Ioctl(int request, void* arg) override;
+  bool Poll(bool poll_device, bool* event_pending) override;
+  bool SetDevicePollInterrupt() override;
+  bool ClearDevicePollInterrupt() override;
+  int GetEpollFd() const override;
+  bool SetEpollDevice(bool poll_device) override;
+  bool GetEpollEvents(uint32_t* device_events) override;
+  void* Mmap(void* addr,
+             unsigned int len,
+             int prot,
+             int flags,
+             unsigned int offset) override;
+  void Munmap(void* addr, unsigned int len) override;
+  std::vector<base::ScopedFD> GetDmabufsForV4L2Buffer(
+      int index,
+      size_t num_planes,
+      enum v4l2_buf_type type) override;
+  bool OpenMediaDevice() override;
+  base::ScopedFD AllocateRequest() override;
+  bool QueueRequest(int request_fd) override;
+  bool ReinitRequest(int request_fd) override;
+  void GetSupportedResolution(uint32_t pixelformat,
+                              Size* min_resolution,
+                              Size* max_resolution) override;
+  VideoDecodeAccelerator::SupportedProfiles GetSupportedDecodeProfiles(
+      const size_t num_formats,
+      const uint32_t pixelformats[]) override;
+
+ private:
+  // A buffer of the OUTPUT queue, holding the bitstream.
+  struct InputBuffer {
+    InputBuffer();
+    InputBuffer(InputBuffer&& other);
+    ~InputBuffer();
+
+    // The memory of V4L2_MEMORY_MMAP buffers.
+    std::unique_ptr<uint8_t[]> data;
+    size_t length;
+    bool queued;
+    uint32_t bytes_used;
+    uint32_t data_offset;
+    struct timeval timestamp;
+    // The request the buffer is queued in, or -1.
+    int request_fd;
+  };
+
+  // A request of the Media Request API. Its fd only stands for it.
+  struct Request {
+    enum class State {
+      kIdle,       // Taking a buffer and controls.
+      kQueued,     // Queued by QueueRequest(), until its buffer is decoded.
+      kCompleted,  // Decoded or cancelled, until ReinitRequest().
+    };
+
+    Request();
+    Request(const Request& other);
+    ~Request();
+
+    State state;
+    // The OUTPUT buffer queued in the request, or -1.
+    int input_index;
+    // The ids of the controls set in the request.
+    std::set<uint32_t> control_ids;
+  };
+
+  // A CAPTURE buffer returned to the client.
+  struct DoneOutput {
+    size_t index;
+    uint32_t bytes_used;
+    uint32_t flags;
+    struct timeval timestamp;
+  };
+
+  // A decoded frame the device holds in its DPB.
+  struct HeldFrame {
+    size_t index;
+    struct timeval timestamp;
+  };
+
+  ~FakeV4L2Device() override;
+
+  // Handlers of the ioctls, returning 0 on success or an errno value. Called
+  // with |lock_| held, like the methods suffixed with Locked.
+  int QueryCap(struct v4l2_capability* caps);
+  int EnumFmt(struct v4l2_fmtdesc* fmtdesc);
+  int EnumFrameSizes(struct v4l2_frmsizeenum* frame_size);
+  int GetFmt(struct v4l2_format* format);
+  int SetFmt(struct v4l2_format* format);
+  int GetSelection(struct v4l2_selection* selection);
+  int GetCtrl(struct v4l2_control* ctrl);
+  int SetExtCtrls(struct v4l2_ext_controls* ctrls);
+  int RequestBuffers(struct v4l2_requestbuffers* reqbufs);
+  int CreateBuffers(struct v4l2_create_buffers* create);
+  int QueryBuffer(struct v4l2_buffer* buffer);
+  int QueueBuffer(struct v4l2_buffer* buffer);
+  int DequeueBuffer(struct v4l2_buffer* buffer);
+  int StreamOn(const __u32* type);
+  int StreamOff(const __u32* type);
+  int SubscribeEvent(const struct v4l2_event_subscription* sub);
+  int DequeueEvent(struct v4l2_event* event);
+  int DecoderCmd(struct v4l2_decoder_cmd* cmd, bool try_only);
+
+  // Queue |buffer| in the request it names, for stateless devices.
+  int QueueInputBufferInRequestLocked(struct v4l2_buffer* buffer);
+  // Complete the queued request of the OUTPUT buffer |input_index|, if any.
+  void CompleteRequestLocked(size_t input_index);
+
+  // Add |count| MMAP OUTPUT buffers of |size| bytes.
+  void AddInputBuffersLocked(size_t count, size_t size);
+  // Whether |buffer| holds a frame, i.e. produces a decoded picture.
+  bool HasFrameLocked(const InputBuffer& buffer) const;
+  // Report the stream format with a V4L2_EVENT_SOURCE_CHANGE, once.
+  void SetFormatKnownLocked();
+  // Start decoding the next queued OUTPUT buffer, if it can be decoded.
+  void TryDecodeLocked();
+  // Complete the decode of |input_index| into the CAPTURE buffer
+  // |output_index|, or into none if it is -1, unless the queues were stopped
+  // since, as told by |generation|.
+  void DecodeDoneTask(uint64_t generation,
+                      size_t input_index,
+                      int output_index);
+  // Return the frames held in the DPB and the last buffer, if a drain asked
+  // for by V4L2_DEC_CMD_STOP can complete.
+  void TryFinishDrainLocked();
+  // Cancel the decode in progress, leaving its OUTPUT buffer queued.
+  void CancelDecodeLocked();
+  // Make the device fd readable in Poll() and the epoll set if it is ready.
+  void UpdateReadinessLocked();
+
+  const Options options_;
+
+  // Signals Poll() and the epoll fd, like the poll interrupt of real devices.
+  base::ScopedFD device_poll_interrupt_fd_;
+  // Readable while the device has something to dequeue, standing in for the
+  // fd of a real device.
+  base::ScopedFD device_ready_fd_;
+  base::ScopedFD epoll_fd_;
+  bool epoll_polls_device_;
+
+  // Runs DecodeDoneTask() after the decode latency.
+  base::Thread decode_thread_;
+
+  // Protects all the members below.
+  base::Lock lock_;
+
+  bool opened_;
+  uint32_t input_fourcc_;
+  // Whether |input_fourcc_| is a parsed format, decoded statelessly.
+  bool stateless_;
+  // The coded size of the stream, reported by stateful devices and set by the
+  // client on stateless ones.
+  Size coded_size_;
+  size_t input_buffer_size_;
+  bool event_subscribed_;
+  // Whether the source change was reported, and the CAPTURE format is set.
+  bool format_known_;
+  bool device_ready_signalled_;
+
+  enum v4l2_memory input_memory_;
+  std::vector<InputBuffer> input_buffers_;
+  bool input_streaming_;
+  // Queued OUTPUT buffers, in decode order.
+  std::deque<size_t> pending_inputs_;
+  // OUTPUT buffers ready to be dequeued.
+  std::deque<size_t> done_inputs_;
+
+  size_t output_buffer_count_;
+  std::vector<bool> output_queued_;
+  bool output_streaming_;
+  // Queued CAPTURE buffers not holding a frame.
+  std::deque<size_t> free_outputs_;
+  std::deque<HeldFrame> held_frames_;
+  std::deque<DoneOutput> done_outputs_;
+
+  std::deque<struct v4l2_event> pending_events_;
+
+  // The requests returned by AllocateRequest(), by fd. The fds are owned by
+  // the client, and their entries replaced when a number is reused.
+  std::map<int, Request> requests_;
+
+  // Whether a decode is in progress, and the CAPTURE buffer it decodes into,
+  // or -1 if its input holds no frame.
+  bool decoding_;
+  int decoding_output_;
+  // Incremented when the queues are stopped, to drop the decodes in progress.
+  uint64_t generation_;
+  // Whether V4L2_DEC_CMD_STOP was received and the last buffer not returned.
+  bool draining_;
+  // Whether the last buffer was dequeued, after which CAPTURE dequeues fail
+  // with EPIPE until V4L2_DEC_CMD_START or VIDIOC_STREAMOFF.
+  bool stopped_;
+
+  DISALLOW_COPY_AND_ASSIGN(FakeV4L2Device);
+};
+
+}  //  namespace media
+
+#endif  // FAKE_V4L2_DEVICE_H_
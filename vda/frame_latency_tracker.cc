@@ -0,0 +1,255 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "frame_latency_tracker.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "base/logging.h"
+#include "base/time/time.h"
+
+namespace media {
+
+namespace {
+
+const char* const kTraceMarkerPaths[] = {
+    "/sys/kernel/tracing/trace_marker",
+    "/sys/kernel/debug/tracing/trace_marker",
+};
+
+// Returns the upper bound of histogram bucket |bucket| in microseconds.
+uint64_t BucketLimitUs(size_t bucket) {
+  return 1ull << (bucket + 1);
+}
+
+}  // namespace
+
+FrameLatencyTracker::FrameLatencyTracker(bool emit_trace_events)
+    : emit_trace_events_(emit_trace_events), trace_marker_fd_(-1) {
+  for (auto& frame : frames_) {
+    frame.bitstream_id.store(-1, std::memory_order_relaxed);
+    for (auto& time_us : frame.time_us)
+      time_us.store(0, std::memory_order_relaxed);
+  }
+  for (auto& histogram : stage_histograms_) {
+    for (auto& bucket : histogram.buckets)
+      bucket.store(0, std::memory_order_relaxed);
+    histogram.count.store(0, std::memory_order_relaxed);
+    histogram.sum_us.store(0, std::memory_order_relaxed);
+    histogram.max_us.store(0, std::memory_order_relaxed);
+  }
+  for (auto& bucket : total_histogram_.buckets)
+    bucket.store(0, std::memory_order_relaxed);
+  total_histogram_.count.store(0, std::memory_order_relaxed);
+  total_histogram_.sum_us.store(0, std::memory_order_relaxed);
+  total_histogram_.max_us.store(0, std::memory_order_relaxed);
+  overwritten_records_.store(0, std::memory_order_relaxed);
+
+  if (emit_trace_events_) {
+    for (const char* path : kTraceMarkerPaths) {
+      trace_marker_fd_ = open(path, O_WRONLY | O_CLOEXEC);
+      if (trace_marker_fd_ >= 0)
+        break;
+    }
+    if (trace_marker_fd_ < 0)
+      DPLOG(ERROR) << "Failed to open the trace marker, not emitting events";
+  }
+}
+
+FrameLatencyTracker::~FrameLatencyTracker() {
+  if (trace_marker_fd_ >= 0)
+    close(trace_marker_fd_);
+}
+
+void FrameLatencyTracker::Record(int32_t bitstream_id, Stage stage) {
+  DCHECK(stage != Stage::kCount);
+  if (bitstream_id < 0)
+    return;
+  const int64_t now_us =
+      (base::TimeTicks::Now() - base::TimeTicks()).InMicroseconds();
+  FrameRecord& frame = frames_[bitstream_id % kMaxFramesInFlight];
+  const int index = static_cast<int>(stage);
+
+  if (stage == Stage::kQueued) {
+    const int32_t previous_id =
+        frame.bitstream_id.load(std::memory_order_relaxed);
+    if (previous_id >= 0 && previous_id != bitstream_id &&
+        frame.time_us[static_cast<int>(Stage::kDone)].load(
+            std::memory_order_relaxed) == 0) {
+      overwritten_records_.fetch_add(1, std::memory_order_relaxed);
+    }
+    // Invalidate the slot while resetting it, so that stages of the frame
+    // previously using it are not mixed into the new record.
+    frame.bitstream_id.store(-1, std::memory_order_relaxed);
+    for (auto& time_us : frame.time_us)
+      time_us.store(0, std::memory_order_relaxed);
+    frame.time_us[index].store(now_us, std::memory_order_relaxed);
+    frame.bitstream_id.store(bitstream_id, std::memory_order_release);
+    WriteTraceMarker('S', StageToString(stage), bitstream_id);
+    return;
+  }
+
+  if (frame.bitstream_id.load(std::memory_order_acquire) != bitstream_id)
+    return;
+  int64_t expected = 0;
+  if (!frame.time_us[index].compare_exchange_strong(
+          expected, now_us, std::memory_order_relaxed)) {
+    return;  // Only the first time a frame reaches a stage counts.
+  }
+
+  int previous = index - 1;
+  int64_t previous_us = 0;
+  for (; previous >= 0; --previous) {
+    previous_us = frame.time_us[previous].load(std::memory_order_relaxed);
+    if (previous_us != 0)
+      break;
+  }
+  if (previous < 0)
+    return;
+  AddToHistogram(&stage_histograms_[index], now_us - previous_us);
+
+  if (stage == Stage::kDone) {
+    const int64_t queued_us =
+        frame.time_us[static_cast<int>(Stage::kQueued)].load(
+            std::memory_order_relaxed);
+    if (queued_us != 0)
+      AddToHistogram(&total_histogram_, now_us - queued_us);
+  }
+
+  // Stages may be reached out of order, e.g. the picture may be dequeued
+  // before the input buffer it was decoded from. Trace events only follow the
+  // latest stage, so that every slice that is started also gets finished.
+  for (int next = index + 1; next < kNumStages; ++next) {
+    if (frame.time_us[next].load(std::memory_order_relaxed) != 0)
+      return;
+  }
+  WriteTraceMarker('F', StageToString(static_cast<Stage>(previous)),
+                   bitstream_id);
+  if (stage != Stage::kDone)
+    WriteTraceMarker('S', StageToString(stage), bitstream_id);
+}
+
+void FrameLatencyTracker::Forget(int32_t bitstream_id) {
+  if (bitstream_id < 0)
+    return;
+  FrameRecord& frame = frames_[bitstream_id % kMaxFramesInFlight];
+  int32_t expected = bitstream_id;
+  frame.bitstream_id.compare_exchange_strong(expected, -1,
+                                             std::memory_order_relaxed);
+}
+
+std::string FrameLatencyTracker::Dump() const {
+  std::string out =
+      "stage               count   mean_us    max_us  p50<=us  p90<=us  "
+      "p99<=us\n";
+  for (int i = static_cast<int>(Stage::kDequeued); i < kNumStages; ++i)
+    AppendHistogram(StageToString(static_cast<Stage>(i)), stage_histograms_[i],
+                    &out);
+  AppendHistogram("total", total_histogram_, &out);
+  const uint64_t overwritten =
+      overwritten_records_.load(std::memory_order_relaxed);
+  if (overwritten > 0) {
+    char line[128];
+    snprintf(line, sizeof(line),
+             "%" PRIu64 " frames not counted, more than %d were in flight\n",
+             overwritten, static_cast<int>(kMaxFramesInFlight));
+    out.append(line);
+  }
+  return out;
+}
+
+// static
+const char* FrameLatencyTracker::StageToString(Stage stage) {
+  switch (stage) {
+    case Stage::kQueued:
+      return "queued";
+    case Stage::kDequeued:
+      return "dequeued";
+    case Stage::kDecode:
+      return "decode";
+    case Stage::kInputQueued:
+      return "input_queued";
+    case Stage::kInputDequeued:
+      return "input_dequeued";
+    case Stage::kOutputDequeued:
+      return "output_dequeued";
+    case Stage::kPictureReady:
+      return "picture_ready";
+    case Stage::kDone:
+      return "done";
+    case Stage::kCount:
+      break;
+  }
+  NOTREACHED();
+  return "unknown";
+}
+
+// static
+void FrameLatencyTracker::AddToHistogram(Histogram* histogram,
+                                         int64_t interval_us) {
+  const uint64_t value = interval_us > 0 ? interval_us : 0;
+  size_t bucket = 0;
+  while (bucket + 1 < kHistogramBuckets && value >= BucketLimitUs(bucket))
+    ++bucket;
+  histogram->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  histogram->count.fetch_add(1, std::memory_order_relaxed);
+  histogram->sum_us.fetch_add(value, std::memory_order_relaxed);
+  uint64_t max_us = histogram->max_us.load(std::memory_order_relaxed);
+  while (value > max_us &&
+         !histogram->max_us.compare_exchange_weak(max_us, value,
+                                                  std::memory_order_relaxed)) {
+  }
+}
+
+// static
+void FrameLatencyTracker::AppendHistogram(const char* name,
+                                          const Histogram& histogram,
+                                          std::string* out) {
+  const uint64_t count = histogram.count.load(std::memory_order_relaxed);
+  const uint64_t sum_us = histogram.sum_us.load(std::memory_order_relaxed);
+  const uint64_t max_us = histogram.max_us.load(std::memory_order_relaxed);
+
+  // The percentiles are reported as the upper bound of their bucket.
+  const double kPercentiles[] = {0.5, 0.9, 0.99};
+  uint64_t percentile_us[arraysize(kPercentiles)] = {};
+  uint64_t seen = 0;
+  size_t next = 0;
+  for (size_t i = 0; i < kHistogramBuckets && next < arraysize(kPercentiles);
+       ++i) {
+    seen += histogram.buckets[i].load(std::memory_order_relaxed);
+    while (next < arraysize(kPercentiles) &&
+           seen >= kPercentiles[next] * count && seen > 0) {
+      percentile_us[next++] = BucketLimitUs(i);
+    }
+  }
+
+  char line[128];
+  snprintf(line, sizeof(line),
+           "%-16s %8" PRIu64 " %9" PRIu64 " %9" PRIu64 " %8" PRIu64
+           " %8" PRIu64 " %8" PRIu64 "\n",
+           name, count, count ? sum_us / count : 0, max_us, percentile_us[0],
+           percentile_us[1], percentile_us[2]);
+  out->append(line);
+}
+
+void FrameLatencyTracker::WriteTraceMarker(char type,
+                                           const char* name,
+                                           int32_t bitstream_id) {
+  if (trace_marker_fd_ < 0)
+    return;
+  // Async slice events in the format of atrace: "S|pid|name|cookie" starts a
+  // slice, "F|pid|name|cookie" finishes it.
+  char event[64];
+  int length = snprintf(event, sizeof(event), "%c|%d|frame_%s|%d", type,
+                        getpid(), name, bitstream_id);
+  if (length > 0 &&
+      write(trace_marker_fd_, event, length) != static_cast<ssize_t>(length)) {
+    DVPLOG(2) << "Failed to write to the trace marker";
+  }
+}
+
+}  // namespace media
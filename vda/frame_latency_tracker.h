@@ -0,0 +1,116 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef FRAME_LATENCY_TRACKER_H_
+#define FRAME_LATENCY_TRACKER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "base/macros.h"
+#include "base/memory/ref_counted.h"
+
+namespace media {
+
+// Records when each bitstream buffer passes the stages of the decode pipeline,
+// from the client queueing it to the decoded frame being returned, and
+// accumulates the time spent between consecutive stages into histograms. This
+// tells whether frames wait in the decode queue, in the driver or in the
+// client.
+//
+// Optionally, each stage is also written to the kernel trace marker as an
+// async slice per bitstream buffer, so that it shows up in systrace and
+// Perfetto traces next to the rest of the system.
+//
+// Record() is lock-free and may be called from any thread. Timestamps are kept
+// for the last kMaxFramesInFlight bitstream ids only; stages of older frames
+// are ignored, and the frames whose record was reused before they were done
+// are counted in the dump.
+class FrameLatencyTracker
+    : public base::RefCountedThreadSafe<FrameLatencyTracker> {
+ public:
+  enum class Stage {
+    kQueued,          // The client queued the bitstream buffer.
+    kDequeued,        // The client side sent it to the decoder.
+    kDecode,          // VideoDecodeAccelerator::Decode() was called.
+    kInputQueued,     // The first input buffer with its data was queued.
+    kInputDequeued,   // The device returned that input buffer.
+    kOutputDequeued,  // The device returned the decoded picture.
+    kPictureReady,    // The picture was sent to the client.
+    kDone,            // The client returned the frame to its own client.
+    kCount,
+  };
+
+  explicit FrameLatencyTracker(bool emit_trace_events);
+
+  // Records that |bitstream_id| reached |stage| now. kQueued starts a new
+  // record for |bitstream_id|, later stages of a frame are recorded once.
+  void Record(int32_t bitstream_id, Stage stage);
+
+  // Drops the record of |bitstream_id|, for a frame that will not reach
+  // kDone, e.g. because it was flushed.
+  void Forget(int32_t bitstream_id);
+
+  // Returns the histograms in a human readable form, one line per stage.
+  std::string Dump() const;
+
+  static const char* StageToString(Stage stage);
+
+ private:
+  friend class base::RefCountedThreadSafe<FrameLatencyTracker>;
+
+  enum {
+    // The maximum number of works in flight the component can be configured
+    // with. Without that limit more frames may be in flight, see
+    // |overwritten_records_|.
+    kMaxFramesInFlight = 256,
+    // Bucket i counts intervals in [2^i, 2^(i+1)) microseconds, except that
+    // the first and the last buckets are open-ended.
+    kHistogramBuckets = 24,
+    kNumStages = static_cast<int>(Stage::kCount),
+  };
+
+  struct FrameRecord {
+    std::atomic<int32_t> bitstream_id;
+    // In microseconds, 0 if the stage has not been reached.
+    std::atomic<int64_t> time_us[kNumStages];
+  };
+
+  struct Histogram {
+    std::atomic<uint32_t> buckets[kHistogramBuckets];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_us;
+    std::atomic<uint64_t> max_us;
+  };
+
+  ~FrameLatencyTracker();
+
+  static void AddToHistogram(Histogram* histogram, int64_t interval_us);
+  static void AppendHistogram(const char* name,
+                              const Histogram& histogram,
+                              std::string* out);
+
+  void WriteTraceMarker(char type, const char* name, int32_t bitstream_id);
+
+  const bool emit_trace_events_;
+  // Fd of the kernel trace marker, or -1.
+  int trace_marker_fd_;
+
+  FrameRecord frames_[kMaxFramesInFlight];
+  // |stage_histograms_[s]| holds the time from the previous stage to stage s.
+  Histogram stage_histograms_[kNumStages];
+  // From kQueued to kDone.
+  Histogram total_histogram_;
+  // Number of records reused for a new frame before their frame was done.
+  std::atomic<uint64_t> overwritten_records_;
+
+  DISALLOW_COPY_AND_ASSIGN(FrameLatencyTracker);
+};
+
+}  // namespace media
+
+#endif  // FRAME_LATENCY_TRACKER_H_
@@ -0,0 +1,573 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+// Note: ported from Chromium commit head: 09ea0d2
+
+#include "generic_v4l2_device.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include "base/numerics/safe_conversions.h"
+#include "base/posix/eintr_wrapper.h"
+#include "base/strings/stringprintf.h"
+#include "base/synchronization/lock.h"
+#include "v4l2_stateless_controls.h"
+
+#define DVLOGF(level) DVLOG(level) << __func__ << "(): "
+#define VLOGF(level) VLOG(level) << __func__ << "(): "
+#define VPLOGF(level) VPLOG(level) << __func__ << "(): "
+
+namespace media {
+
+// The device nodes and their capabilities do not change while the process is
+// running, so they are probed once and shared by all GenericV4L2Device
+// instances. Otherwise every component interface and decoder created would
+// open and query each candidate device node again. Empty or failed results are
+// not cached though: a device node may not be ready yet when the first
+// instance probes it.
+struct GenericV4L2Device::CapabilityCache {
+  base::Lock lock;
+  // Entries are never removed, so references to them stay valid.
+  std::map<Type, Devices> devices_by_type;
+  // Minimum and maximum resolution, keyed by device path and fourcc.
+  std::map<std::pair<std::string, uint32_t>, std::pair<Size, Size>>
+      resolutions;
+  // Keyed by the fourccs passed to GetSupportedDecodeProfiles().
+  std::map<std::vector<uint32_t>, VideoDecodeAccelerator::SupportedProfiles>
+      decode_profiles;
+};
+
+// static
+GenericV4L2Device::CapabilityCache* GenericV4L2Device::GetCapabilityCache() {
+  // Intentionally leaked, it is used until the process exits.
+  static CapabilityCache* cache = new CapabilityCache();
+  return cache;
+}
+
+GenericV4L2Device::GenericV4L2Device() : epoll_polls_device_(false) {}
+
+GenericV4L2Device::~GenericV4L2Device() {
+  CloseDevice();
+}
+
+int GenericV4L2Device::Ioctl(int request, void* arg) {
+  DCHECK(device_fd_.is_valid());
+  return HANDLE_EINTR(ioctl(device_fd_.get(), request, arg));
+}
+
+bool GenericV4L2Device::Poll(bool poll_device, bool* event_pending) {
+  struct pollfd pollfds[2];
+  nfds_t nfds;
+  int pollfd = -1;
+
+  pollfds[0].fd = device_poll_interrupt_fd_.get();
+  pollfds[0].events = POLLIN | POLLERR;
+  nfds = 1;
+
+  if (poll_device) {
+    DVLOGF(5) << "Poll(): adding device fd to poll() set";
+    pollfds[nfds].fd = device_fd_.get();
+    pollfds[nfds].events = POLLIN | POLLOUT | POLLERR | POLLPRI;
+    pollfd = nfds;
+    nfds++;
+  }
+
+  if (HANDLE_EINTR(poll(pollfds, nfds, -1)) == -1) {
+    VPLOGF(1) << "poll() failed";
+    return false;
+  }
+  *event_pending = (pollfd != -1 && pollfds[pollfd].revents & POLLPRI);
+  return true;
+}
+
+void* GenericV4L2Device::Mmap(void* addr,
+                              unsigned int len,
+                              int prot,
+                              int flags,
+                              unsigned int offset) {
+  DCHECK(device_fd_.is_valid());
+  return mmap(addr, len, prot, flags, device_fd_.get(), offset);
+}
+
+void GenericV4L2Device::Munmap(void* addr, unsigned int len) {
+  munmap(addr, len);
+}
+
+bool GenericV4L2Device::SetDevicePollInterrupt() {
+  DVLOGF(4);
+
+  const uint64_t buf = 1;
+  if (HANDLE_EINTR(write(device_poll_interrupt_fd_.get(), &buf, sizeof(buf))) ==
+      -1) {
+    VPLOGF(1) << "write() failed";
+    return false;
+  }
+  return true;
+}
+
+bool GenericV4L2Device::ClearDevicePollInterrupt() {
+  DVLOGF(5);
+
+  uint64_t buf;
+  if (HANDLE_EINTR(read(device_poll_interrupt_fd_.get(), &buf, sizeof(buf))) ==
+      -1) {
+    if (errno == EAGAIN) {
+      // No interrupt flag set, and we're reading nonblocking.  Not an error.
+      return true;
+    } else {
+      VPLOGF(1) << "read() failed";
+      return false;
+    }
+  }
+  return true;
+}
+
+int GenericV4L2Device::GetEpollFd() const {
+  return epoll_fd_.get();
+}
+
+bool GenericV4L2Device::SetEpollDevice(bool poll_device) {
+  DVLOGF(5) << "poll_device=" << poll_device;
+  if (poll_device == epoll_polls_device_)
+    return true;
+
+  // The device fd is removed rather than left with no events, as EPOLLERR is
+  // always reported, and V4L2 signals it while no buffers are queued.
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLPRI;
+  event.data.fd = device_fd_.get();
+  if (epoll_ctl(epoll_fd_.get(), poll_device ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                device_fd_.get(), &event) != 0) {
+    VPLOGF(1) << "epoll_ctl() failed";
+    return false;
+  }
+  epoll_polls_device_ = poll_device;
+  return true;
+}
+
+bool GenericV4L2Device::GetEpollEvents(uint32_t* device_events) {
+  struct epoll_event events[2];
+  const int nfds =
+      HANDLE_EINTR(epoll_wait(epoll_fd_.get(), events, arraysize(events), 0));
+  if (nfds == -1) {
+    VPLOGF(1) << "epoll_wait() failed";
+    return false;
+  }
+
+  *device_events = 0;
+  for (int i = 0; i < nfds; ++i) {
+    if (events[i].data.fd == device_fd_.get())
+      *device_events = events[i].events;
+  }
+  return true;
+}
+
+bool GenericV4L2Device::Open(Type type, uint32_t v4l2_pixfmt) {
+  VLOGF(2);
+  std::string path = GetDevicePathFor(type, v4l2_pixfmt);
+
+  if (path.empty()) {
+    VLOGF(1) << "No devices supporting " << std::hex << "0x" << v4l2_pixfmt
+             << " for type: " << static_cast<int>(type);
+    return false;
+  }
+
+  if (!OpenDevicePath(path, type)) {
+    VLOGF(1) << "Failed opening " << path;
+    return false;
+  }
+
+  device_poll_interrupt_fd_.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+  if (!device_poll_interrupt_fd_.is_valid()) {
+    VLOGF(1) << "Failed creating a poll interrupt fd";
+    return false;
+  }
+
+  epoll_fd_.reset(epoll_create1(EPOLL_CLOEXEC));
+  if (!epoll_fd_.is_valid()) {
+    VPLOGF(1) << "Failed creating an epoll fd";
+    return false;
+  }
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = device_poll_interrupt_fd_.get();
+  if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, device_poll_interrupt_fd_.get(),
+                &event) != 0) {
+    VPLOGF(1) << "Failed adding the poll interrupt fd to epoll";
+    return false;
+  }
+  epoll_polls_device_ = false;
+
+  return true;
+}
+
+bool GenericV4L2Device::OpenMediaDevice() {
+  DCHECK(device_fd_.is_valid());
+  if (media_fd_.is_valid())
+    return true;
+
+  struct v4l2_capability caps;
+  memset(&caps, 0, sizeof(caps));
+  if (Ioctl(VIDIOC_QUERYCAP, &caps) != 0) {
+    VPLOGF(1) << "ioctl() failed: VIDIOC_QUERYCAP";
+    return false;
+  }
+  const std::string bus_info(reinterpret_cast<const char*>(caps.bus_info),
+                             strnlen(reinterpret_cast<const char*>(
+                                         caps.bus_info),
+                                     sizeof(caps.bus_info)));
+  if (bus_info.empty()) {
+    VLOGF(1) << "No bus info to find the media device of " << device_path_;
+    return false;
+  }
+
+  // As for the video devices, try the likely nodes instead of listing /dev.
+  // The media device is the one on the same bus as the video device.
+  std::vector<std::string> candidate_paths;
+  candidate_paths.push_back("/dev/media-dec");
+  for (int i = 0; i < 10; ++i)
+    candidate_paths.push_back(base::StringPrintf("/dev/media-dec%d", i));
+  for (int i = 0; i < 10; ++i)
+    candidate_paths.push_back(base::StringPrintf("/dev/media%d", i));
+
+  for (const auto& path : candidate_paths) {
+    base::ScopedFD fd(HANDLE_EINTR(open(path.c_str(), O_RDWR | O_CLOEXEC)));
+    if (!fd.is_valid())
+      continue;
+
+    struct media_device_info info;
+    memset(&info, 0, sizeof(info));
+    if (HANDLE_EINTR(ioctl(fd.get(), MEDIA_IOC_DEVICE_INFO, &info)) != 0)
+      continue;
+    if (bus_info.compare(0, std::string::npos, info.bus_info,
+                         strnlen(info.bus_info, sizeof(info.bus_info))) != 0) {
+      continue;
+    }
+
+    VLOGF(2) << "Found media device " << path << " for " << device_path_;
+    media_fd_ = std::move(fd);
+    return true;
+  }
+
+  VLOGF(1) << "No media device found for " << device_path_;
+  return false;
+}
+
+base::ScopedFD GenericV4L2Device::AllocateRequest() {
+  DCHECK(media_fd_.is_valid());
+  int request_fd = -1;
+  if (HANDLE_EINTR(ioctl(media_fd_.get(), MEDIA_IOC_REQUEST_ALLOC,
+                         &request_fd)) != 0) {
+    VPLOGF(1) << "ioctl() failed: MEDIA_IOC_REQUEST_ALLOC";
+    return base::ScopedFD();
+  }
+  return base::ScopedFD(request_fd);
+}
+
+bool GenericV4L2Device::QueueRequest(int request_fd) {
+  if (HANDLE_EINTR(ioctl(request_fd, MEDIA_REQUEST_IOC_QUEUE)) != 0) {
+    VPLOGF(1) << "ioctl() failed: MEDIA_REQUEST_IOC_QUEUE";
+    return false;
+  }
+  return true;
+}
+
+bool GenericV4L2Device::ReinitRequest(int request_fd) {
+  if (HANDLE_EINTR(ioctl(request_fd, MEDIA_REQUEST_IOC_REINIT)) != 0) {
+    VPLOGF(1) << "ioctl() failed: MEDIA_REQUEST_IOC_REINIT";
+    return false;
+  }
+  return true;
+}
+
+std::vector<base::ScopedFD> GenericV4L2Device::GetDmabufsForV4L2Buffer(
+    int index,
+    size_t num_planes,
+    enum v4l2_buf_type buf_type) {
+  VLOGF(2);
+  DCHECK(V4L2_TYPE_IS_MULTIPLANAR(buf_type));
+
+  std::vector<base::ScopedFD> dmabuf_fds;
+  for (size_t i = 0; i < num_planes; ++i) {
+    struct v4l2_exportbuffer expbuf;
+    memset(&expbuf, 0, sizeof(expbuf));
+    expbuf.type = buf_type;
+    expbuf.index = index;
+    expbuf.plane = i;
+    expbuf.flags = O_CLOEXEC;
+    if (Ioctl(VIDIOC_EXPBUF, &expbuf) != 0) {
+      dmabuf_fds.clear();
+      break;
+    }
+
+    dmabuf_fds.push_back(base::ScopedFD(expbuf.fd));
+  }
+
+  return dmabuf_fds;
+}
+
+VideoDecodeAccelerator::SupportedProfiles
+GenericV4L2Device::GetSupportedDecodeProfiles(const size_t num_formats,
+                                              const uint32_t pixelformats[]) {
+  CapabilityCache* cache = GetCapabilityCache();
+  const std::vector<uint32_t> key(pixelformats, pixelformats + num_formats);
+  {
+    base::AutoLock auto_lock(cache->lock);
+    const auto it = cache->decode_profiles.find(key);
+    if (it != cache->decode_profiles.end())
+      return it->second;
+  }
+
+  VideoDecodeAccelerator::SupportedProfiles supported_profiles;
+
+  Type type = Type::kDecoder;
+  const auto& devices = GetDevicesForType(type);
+  for (const auto& device : devices) {
+    if (!OpenDevicePath(device.first, type)) {
+      VLOGF(1) << "Failed opening " << device.first;
+      continue;
+    }
+
+    const auto& profiles =
+        EnumerateSupportedDecodeProfiles(num_formats, pixelformats);
+    supported_profiles.insert(supported_profiles.end(), profiles.begin(),
+                              profiles.end());
+    CloseDevice();
+  }
+
+  if (!supported_profiles.empty()) {
+    base::AutoLock auto_lock(cache->lock);
+    cache->decode_profiles.emplace(key, supported_profiles);
+  }
+  return supported_profiles;
+}
+
+void GenericV4L2Device::GetSupportedResolution(uint32_t pixelformat,
+                                               Size* min_resolution,
+                                               Size* max_resolution) {
+  CapabilityCache* cache = GetCapabilityCache();
+  const auto key = std::make_pair(device_path_, pixelformat);
+  {
+    base::AutoLock auto_lock(cache->lock);
+    const auto it = cache->resolutions.find(key);
+    if (it != cache->resolutions.end()) {
+      *min_resolution = it->second.first;
+      *max_resolution = it->second.second;
+      return;
+    }
+  }
+
+  max_resolution->SetSize(0, 0);
+  min_resolution->SetSize(0, 0);
+  v4l2_frmsizeenum frame_size;
+  memset(&frame_size, 0, sizeof(frame_size));
+  frame_size.pixel_format = pixelformat;
+  for (; Ioctl(VIDIOC_ENUM_FRAMESIZES, &frame_size) == 0; ++frame_size.index) {
+    if (frame_size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+      if (frame_size.discrete.width >=
+              base::checked_cast<uint32_t>(max_resolution->width()) &&
+          frame_size.discrete.height >=
+              base::checked_cast<uint32_t>(max_resolution->height())) {
+        max_resolution->SetSize(frame_size.discrete.width,
+                                frame_size.discrete.height);
+      }
+      if (min_resolution->IsEmpty() ||
+          (frame_size.discrete.width <=
+               base::checked_cast<uint32_t>(min_resolution->width()) &&
+           frame_size.discrete.height <=
+               base::checked_cast<uint32_t>(min_resolution->height()))) {
+        min_resolution->SetSize(frame_size.discrete.width,
+                                frame_size.discrete.height);
+      }
+    } else if (frame_size.type == V4L2_FRMSIZE_TYPE_STEPWISE ||
+               frame_size.type == V4L2_FRMSIZE_TYPE_CONTINUOUS) {
+      max_resolution->SetSize(frame_size.stepwise.max_width,
+                              frame_size.stepwise.max_height);
+      min_resolution->SetSize(frame_size.stepwise.min_width,
+                              frame_size.stepwise.min_height);
+      break;
+    }
+  }
+  // Only the resolutions reported by the device are cached, not the fallbacks.
+  const bool cacheable =
+      !max_resolution->IsEmpty() && !min_resolution->IsEmpty();
+  if (max_resolution->IsEmpty()) {
+    max_resolution->SetSize(1920, 1088);
+    VLOGF(1) << "GetSupportedResolution failed to get maximum resolution for "
+             << "fourcc " << std::hex << pixelformat
+             << ", fall back to " << max_resolution->ToString();
+  }
+  if (min_resolution->IsEmpty()) {
+    min_resolution->SetSize(16, 16);
+    VLOGF(1) << "GetSupportedResolution failed to get minimum resolution for "
+             << "fourcc " << std::hex << pixelformat
+             << ", fall back to " << min_resolution->ToString();
+  }
+
+  if (cacheable && !device_path_.empty()) {
+    base::AutoLock auto_lock(cache->lock);
+    cache->resolutions.emplace(
+        key, std::make_pair(*min_resolution, *max_resolution));
+  }
+}
+
+std::vector<uint32_t> GenericV4L2Device::EnumerateSupportedPixelformats(
+    v4l2_buf_type buf_type) {
+  std::vector<uint32_t> pixelformats;
+
+  v4l2_fmtdesc fmtdesc;
+  memset(&fmtdesc, 0, sizeof(fmtdesc));
+  fmtdesc.type = buf_type;
+
+  for (; Ioctl(VIDIOC_ENUM_FMT, &fmtdesc) == 0; ++fmtdesc.index) {
+    DVLOGF(3) << "Found " << fmtdesc.description << std::hex << " (0x"
+              << fmtdesc.pixelformat << ")";
+    pixelformats.push_back(fmtdesc.pixelformat);
+  }
+
+  return pixelformats;
+}
+
+VideoDecodeAccelerator::SupportedProfiles
+GenericV4L2Device::EnumerateSupportedDecodeProfiles(
+    const size_t num_formats,
+    const uint32_t pixelformats[]) {
+  VideoDecodeAccelerator::SupportedProfiles profiles;
+
+  const auto& supported_pixelformats =
+      EnumerateSupportedPixelformats(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+
+  for (uint32_t pixelformat : supported_pixelformats) {
+    if (std::find(pixelformats, pixelformats + num_formats, pixelformat) ==
+        pixelformats + num_formats)
+      continue;
+
+    VideoDecodeAccelerator::SupportedProfile profile;
+    GetSupportedResolution(pixelformat, &profile.min_resolution,
+                           &profile.max_resolution);
+
+    const auto video_codec_profiles =
+        V4L2PixFmtToVideoCodecProfiles(pixelformat, false);
+
+    for (const auto& video_codec_profile : video_codec_profiles) {
+      profile.profile = video_codec_profile;
+      profiles.push_back(profile);
+
+      DVLOGF(3) << "Found decoder profile " << GetProfileName(profile.profile)
+                << ", resolutions: " << profile.min_resolution.ToString() << " "
+                << profile.max_resolution.ToString();
+    }
+  }
+
+  return profiles;
+}
+
+bool GenericV4L2Device::OpenDevicePath(const std::string& path, Type type) {
+  DCHECK(!device_fd_.is_valid());
+
+  device_fd_.reset(
+      HANDLE_EINTR(open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC)));
+  if (!device_fd_.is_valid())
+    return false;
+
+  device_path_ = path;
+  return true;
+}
+
+void GenericV4L2Device::CloseDevice() {
+  VLOGF(2);
+  media_fd_.reset();
+  device_fd_.reset();
+  device_path_.clear();
+}
+
+GenericV4L2Device::Devices GenericV4L2Device::EnumerateDevicesForType(
+    Type type) {
+  static const std::string kDecoderDevicePattern = "/dev/video-dec";
+  std::string device_pattern;
+  v4l2_buf_type buf_type;
+  switch (type) {
+    case Type::kDecoder:
+      device_pattern = kDecoderDevicePattern;
+      buf_type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+      break;
+    default:
+      LOG(ERROR) << "Only decoder type is supported!!";
+      return Devices();
+  }
+
+  std::vector<std::string> candidate_paths;
+
+  // TODO(posciak): Remove this legacy unnumbered device once
+  // all platforms are updated to use numbered devices.
+  candidate_paths.push_back(device_pattern);
+
+  // We are sandboxed, so we can't query directory contents to check which
+  // devices are actually available. Try to open the first 10; if not present,
+  // we will just fail to open immediately.
+  for (int i = 0; i < 10; ++i) {
+    candidate_paths.push_back(
+        base::StringPrintf("%s%d", device_pattern.c_str(), i));
+  }
+
+  Devices devices;
+  for (const auto& path : candidate_paths) {
+    if (!OpenDevicePath(path, type))
+      continue;
+
+    const auto& supported_pixelformats =
+        EnumerateSupportedPixelformats(buf_type);
+    if (!supported_pixelformats.empty()) {
+      DVLOGF(3) << "Found device: " << path;
+      devices.push_back(std::make_pair(path, supported_pixelformats));
+    }
+
+    CloseDevice();
+  }
+
+  return devices;
+}
+
+const GenericV4L2Device::Devices& GenericV4L2Device::GetDevicesForType(
+    Type type) {
+  CapabilityCache* cache = GetCapabilityCache();
+  // Hold the lock while enumerating, so that the devices are probed only once
+  // even if several instances ask for them at the same time.
+  base::AutoLock auto_lock(cache->lock);
+  auto it = cache->devices_by_type.find(type);
+  if (it == cache->devices_by_type.end()) {
+    Devices devices = EnumerateDevicesForType(type);
+    if (devices.empty()) {
+      // Enumerate again on the next call.
+      static const Devices* no_devices = new Devices();
+      return *no_devices;
+    }
+    it = cache->devices_by_type.emplace(type, std::move(devices)).first;
+  }
+  return it->second;
+}
+
+std::string GenericV4L2Device::GetDevicePathFor(Type type, uint32_t pixfmt) {
+  const Devices& devices = GetDevicesForType(type);
+
+  for (const auto& device : devices) {
+    if (std::find(device.second.begin(), device.second.end(), pixfmt) !=
+        device.second.end())
+      return device.first;
+  }
+
+  return std::string();
+}
+
+}  //  namespace media
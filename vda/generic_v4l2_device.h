@@ -0,0 +1,115 @@
+// Copyright 2014 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+// This file contains the implementation of V4L2Device for the V4L2 device
+// nodes of the platform.
+// Note: ported from Chromium commit head: fb70f64
+
+#ifndef GENERIC_V4L2_DEVICE_H_
+#define GENERIC_V4L2_DEVICE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/files/scoped_file.h"
+#include "base/macros.h"
+#include "v4l2_device.h"
+
+namespace media {
+
+class GenericV4L2Device : public V4L2Device {
+ public:
+  GenericV4L2Device();
+
+  // V4L2Device implementation.
+  bool Open(Type type, uint32_t v4l2_pixfmt) override;
+  int Ioctl(int request, void* arg) override;
+  bool Poll(bool poll_device, bool* event_pending) override;
+  bool SetDevicePollInterrupt() override;
+  bool ClearDevicePollInterrupt() override;
+  int GetEpollFd() const override;
+  bool SetEpollDevice(bool poll_device) override;
+  bool GetEpollEvents(uint32_t* device_events) override;
+  void* Mmap(void* addr,
+             unsigned int len,
+             int prot,
+             int flags,
+             unsigned int offset) override;
+  void Munmap(void* addr, unsigned int len) override;
+  std::vector<base::ScopedFD> GetDmabufsForV4L2Buffer(
+      int index,
+      size_t num_planes,
+      enum v4l2_buf_type type) override;
+  bool OpenMediaDevice() override;
+  base::ScopedFD AllocateRequest() override;
+  bool QueueRequest(int request_fd) override;
+  bool ReinitRequest(int request_fd) override;
+  void GetSupportedResolution(uint32_t pixelformat,
+                              Size* min_resolution,
+                              Size* max_resolution) override;
+  VideoDecodeAccelerator::SupportedProfiles GetSupportedDecodeProfiles(
+      const size_t num_formats,
+      const uint32_t pixelformats[]) override;
+
+ private:
+  ~GenericV4L2Device() override;
+
+  // Vector of video device node paths and corresponding pixelformats supported
+  // by each device node.
+  using Devices = std::vector<std::pair<std::string, std::vector<uint32_t>>>;
+
+  VideoDecodeAccelerator::SupportedProfiles EnumerateSupportedDecodeProfiles(
+      const size_t num_formats,
+      const uint32_t pixelformats[]);
+
+  std::vector<uint32_t> EnumerateSupportedPixelformats(v4l2_buf_type buf_type);
+
+  // Open device node for |path| as a device of |type|.
+  bool OpenDevicePath(const std::string& path, Type type);
+
+  // Close the currently open device.
+  void CloseDevice();
+
+  // Enumerate all V4L2 devices on the system for |type| and return them.
+  Devices EnumerateDevicesForType(Type type);
+
+  // Return device information for all devices of |type| available in the
+  // system. Enumerates and queries devices on the first call in the process
+  // that finds any, and caches the results for subsequent calls.
+  const Devices& GetDevicesForType(Type type);
+
+  // Return device node path for device of |type| supporting |pixfmt|, or
+  // an empty string if the given combination is not supported by the system.
+  std::string GetDevicePathFor(Type type, uint32_t pixfmt);
+
+  // The capabilities of the devices, shared by all instances in the process.
+  struct CapabilityCache;
+  static CapabilityCache* GetCapabilityCache();
+
+  // The actual device fd.
+  base::ScopedFD device_fd_;
+  // Path of the device node opened as |device_fd_|, empty if none.
+  std::string device_path_;
+  // The media device of |device_fd_|, once OpenMediaDevice() succeeded.
+  base::ScopedFD media_fd_;
+
+  // eventfd fd to signal device poll thread when its poll() should be
+  // interrupted.
+  base::ScopedFD device_poll_interrupt_fd_;
+
+  // epoll fd watching |device_poll_interrupt_fd_|, and |device_fd_| if
+  // |epoll_polls_device_|.
+  base::ScopedFD epoll_fd_;
+  bool epoll_polls_device_;
+
+  DISALLOW_COPY_AND_ASSIGN(GenericV4L2Device);
+};
+
+}  //  namespace media
+
+#endif  // GENERIC_V4L2_DEVICE_H_
@@ -3,16 +3,33 @@
 // found in the LICENSE file.
 // Note: ported from Chromium commit head: 2de6929
 
-#include "base/logging.h"
 #include "h264_bit_reader.h"
 
+#include <string.h>
+
+#include "base/logging.h"
+#include "base/sys_byteorder.h"
+
 namespace media {
 
+namespace {
+
+const int kWordSizeInBits = sizeof(uint64_t) * 8;
+
+// Returns a word with 0x80 set in each byte of |v| that is zero, without
+// false positives.
+inline uint64_t ZeroBytes(uint64_t v) {
+  const uint64_t k7f = 0x7f7f7f7f7f7f7f7fULL;
+  return ~(((v & k7f) + k7f) | v | k7f);
+}
+
+}  // namespace
+
 H264BitReader::H264BitReader()
     : data_(NULL),
       bytes_left_(0),
-      curr_byte_(0),
-      num_remaining_bits_in_curr_byte_(0),
+      curr_word_(0),
+      num_bits_in_curr_word_(0),
       prev_two_bytes_(0),
       emulation_prevention_bytes_(0) {}
 
@@ -26,7 +43,8 @@ bool H264BitReader::Initialize(const uint8_t* data, off_t size) {
 
   data_ = data;
   bytes_left_ = size;
-  num_remaining_bits_in_curr_byte_ = 0;
+  curr_word_ = 0;
+  num_bits_in_curr_word_ = 0;
   // Initially set to 0xffff to accept all initial two-byte sequences.
   prev_two_bytes_ = 0xffff;
   emulation_prevention_bytes_ = 0;
@@ -34,73 +52,184 @@ bool H264BitReader::Initialize(const uint8_t* data, off_t size) {
   return true;
 }
 
-bool H264BitReader::UpdateCurrByte() {
-  if (bytes_left_ < 1)
-    return false;
+bool H264BitReader::Refill(bool skip_epb) {
+  DCHECK_LE(num_bits_in_curr_word_, kWordSizeInBits - 8);
+  if (bytes_left_ < 8)
+    return RefillSlow(skip_epb);
+
+  const int num_bytes = (kWordSizeInBits - num_bits_in_curr_word_) / 8;
+  uint64_t word;
+  memcpy(&word, data_, sizeof(word));
+  word = base::NetToHost64(word);
+
+  // Emulation prevention bytes are 0x03, so their absence is enough to load
+  // the bytes as they are.
+  const uint64_t kThrees = 0x0303030303030303ULL;
+  const uint64_t loaded_bytes_mask =
+      num_bytes == 8 ? ~0ULL : ~(~0ULL >> (num_bytes * 8));
+  if (ZeroBytes(word ^ kThrees) & loaded_bytes_mask)
+    return RefillSlow(skip_epb);
+
+  word &= loaded_bytes_mask;
+  curr_word_ |= word >> num_bits_in_curr_word_;
+  num_bits_in_curr_word_ += num_bytes * 8;
+  data_ += num_bytes;
+  bytes_left_ -= num_bytes;
+
+  // The last two bytes loaded.
+  const int last_bytes =
+      static_cast<int>(word >> (kWordSizeInBits - num_bytes * 8)) & 0xffff;
+  prev_two_bytes_ = num_bytes >= 2
+                        ? last_bytes
+                        : ((prev_two_bytes_ & 0xff) << 8) | last_bytes;
 
-  // Emulation prevention three-byte detection.
-  // If a sequence of 0x000003 is found, skip (ignore) the last byte (0x03).
-  if (*data_ == 0x03 && (prev_two_bytes_ & 0xffff) == 0) {
-    // Detected 0x000003, skip last byte.
-    ++data_;
+  return true;
+}
+
+bool H264BitReader::RefillSlow(bool skip_epb) {
+  bool loaded = false;
+  while (num_bits_in_curr_word_ <= kWordSizeInBits - 8 && bytes_left_ > 0) {
+    // Emulation prevention three-byte detection.
+    // If a sequence of 0x000003 is found, skip (ignore) the last byte (0x03).
+    if (*data_ == 0x03 && (prev_two_bytes_ & 0xffff) == 0) {
+      if (loaded || !skip_epb)
+        break;
+
+      // Detected 0x000003, skip last byte.
+      ++data_;
+      --bytes_left_;
+      ++emulation_prevention_bytes_;
+      // Need another full three bytes before we can detect the sequence
+      // again.
+      prev_two_bytes_ = 0xffff;
+      continue;
+    }
+
+    // Load a new byte and advance pointers.
+    const int byte = *data_++ & 0xff;
     --bytes_left_;
-    ++emulation_prevention_bytes_;
-    // Need another full three bytes before we can detect the sequence again.
-    prev_two_bytes_ = 0xffff;
+    curr_word_ |= static_cast<uint64_t>(byte)
+                  << (kWordSizeInBits - 8 - num_bits_in_curr_word_);
+    num_bits_in_curr_word_ += 8;
+    loaded = true;
 
-    if (bytes_left_ < 1)
-      return false;
+    prev_two_bytes_ = ((prev_two_bytes_ & 0xff) << 8) | byte;
   }
 
-  // Load a new byte and advance pointers.
-  curr_byte_ = *data_++ & 0xff;
-  --bytes_left_;
-  num_remaining_bits_in_curr_byte_ = 8;
-
-  prev_two_bytes_ = ((prev_two_bytes_ & 0xff) << 8) | curr_byte_;
-
-  return true;
+  return loaded;
 }
 
 // Read |num_bits| (1 to 31 inclusive) from the stream and return them
 // in |out|, with first bit in the stream as MSB in |out| at position
 // (|num_bits| - 1).
 bool H264BitReader::ReadBits(int num_bits, int* out) {
-  int bits_left = num_bits;
-  *out = 0;
   DCHECK(num_bits <= 31);
+  *out = 0;
+  if (num_bits <= 0)
+    return true;
+
+  while (num_bits_in_curr_word_ < num_bits) {
+    if (!Refill(true))
+      return false;
+  }
 
-  while (num_remaining_bits_in_curr_byte_ < bits_left) {
-    // Take all that's left in current byte, shift to make space for the rest.
-    *out |= (curr_byte_ << (bits_left - num_remaining_bits_in_curr_byte_));
-    bits_left -= num_remaining_bits_in_curr_byte_;
+  *out = static_cast<int>(curr_word_ >> (kWordSizeInBits - num_bits));
+  curr_word_ <<= num_bits;
+  num_bits_in_curr_word_ -= num_bits;
 
-    if (!UpdateCurrByte())
+  return true;
+}
+
+bool H264BitReader::ReadUE(int* out) {
+  // Load the bits up to the next emulation prevention byte, which is only
+  // skipped if the code does not end before it.
+  while (num_bits_in_curr_word_ < 32) {
+    if (!Refill(false))
+      break;
+  }
+
+  // Short codes are entirely in curr_word_ and are read at once.
+  if (curr_word_ != 0) {
+    const int num_zeros = __builtin_clzll(curr_word_);
+    const int code_size = 2 * num_zeros + 1;
+    if (num_zeros < 16 && code_size <= num_bits_in_curr_word_) {
+      *out = static_cast<int>(curr_word_ >> (kWordSizeInBits - code_size)) - 1;
+      curr_word_ <<= code_size;
+      num_bits_in_curr_word_ -= code_size;
+      return true;
+    }
+  }
+
+  int num_bits = -1;
+  int bit;
+  int rest;
+
+  // Count the number of contiguous zero bits.
+  do {
+    if (!ReadBits(1, &bit))
       return false;
+    num_bits++;
+  } while (bit == 0);
+
+  if (num_bits > 31)
+    return false;
+
+  // Calculate exp-Golomb code value of size num_bits.
+  // Special case for |num_bits| == 31 to avoid integer overflow. The only
+  // valid representation as an int is 2^31 - 1, so the remaining bits must
+  // be 0 or else the number is too large.
+  *out = (1u << num_bits) - 1u;
+
+  if (num_bits == 31) {
+    if (!ReadBits(num_bits, &rest))
+      return false;
+    return rest == 0;
   }
 
-  *out |= (curr_byte_ >> (num_remaining_bits_in_curr_byte_ - bits_left));
-  *out &= ((1u << num_bits) - 1u);
-  num_remaining_bits_in_curr_byte_ -= bits_left;
+  if (num_bits > 0) {
+    if (!ReadBits(num_bits, &rest))
+      return false;
+    *out += rest;
+  }
+
+  return true;
+}
+
+bool H264BitReader::ReadSE(int* out) {
+  int ue;
+  if (!ReadUE(&ue))
+    return false;
+
+  // See Chapter 9 in the spec.
+  if (ue % 2 == 0)
+    *out = -(ue / 2);
+  else
+    *out = ue / 2 + 1;
 
   return true;
 }
 
 off_t H264BitReader::NumBitsLeft() {
-  return (num_remaining_bits_in_curr_byte_ + bytes_left_ * 8);
+  return (num_bits_in_curr_word_ + bytes_left_ * 8);
 }
 
 bool H264BitReader::HasMoreRBSPData() {
   // Make sure we have more bits, if we are at 0 bits in current byte and
   // updating current byte fails, we don't have more data anyway.
-  if (num_remaining_bits_in_curr_byte_ == 0 && !UpdateCurrByte())
+  if (num_bits_in_curr_word_ == 0 && !Refill(true))
     return false;
 
-  // If there is no more RBSP data, then |curr_byte_| contains the stop bit and
-  // zero padding. Check to see if there is other data instead.
+  // Unread bits of the current byte, the ones after it in curr_word_ are
+  // whole bytes.
+  int num_bits_in_curr_byte = num_bits_in_curr_word_ % 8;
+  if (num_bits_in_curr_byte == 0)
+    num_bits_in_curr_byte = 8;
+
+  // If there is no more RBSP data, then the current byte contains the stop
+  // bit and zero padding. Check to see if there is other data instead.
   // (We don't actually check for the stop bit itself, instead treating the
   // invalid case of all trailing zeros identically).
-  if ((curr_byte_ & ((1 << (num_remaining_bits_in_curr_byte_ - 1)) - 1)) != 0)
+  if ((curr_word_ << 1) != 0)
     return true;
 
   // While the spec disallows it (7.4.1: "The last byte of the NAL unit shall
@@ -113,6 +242,7 @@ bool H264BitReader::HasMoreRBSPData() {
   }
 
   bytes_left_ = 0;
+  num_bits_in_curr_word_ = num_bits_in_curr_byte;
   return false;
 }
 
@@ -39,6 +39,15 @@ class H264BitReader {
   // bits in the stream), true otherwise.
   bool ReadBits(int num_bits, int* out);
 
+  // Read an unsigned Exp-Golomb-coded value, ue(v), into |*out|.
+  // Return false if the stream ends before the end of the code, or if the
+  // value does not fit in an int.
+  bool ReadUE(int* out);
+
+  // Read a signed Exp-Golomb-coded value, se(v), into |*out|, with the same
+  // failure cases as ReadUE().
+  bool ReadSE(int* out);
+
   // Return the number of bits left in the stream.
   off_t NumBitsLeft();
 
@@ -49,22 +58,32 @@ class H264BitReader {
   size_t NumEmulationPreventionBytesRead();
 
  private:
-  // Advance to the next byte, loading it into curr_byte_.
+  // Load at least one more byte into curr_word_. An emulation prevention
+  // byte just before it is skipped if |skip_epb| is true, otherwise the
+  // refill fails there. Bytes are loaded eight at a time when none of them
+  // can be an emulation prevention byte.
   // Return false on end of stream.
-  bool UpdateCurrByte();
+  bool Refill(bool skip_epb);
+
+  // Refill() one byte at a time. The refill stops before any other
+  // emulation prevention byte, so that each one is only skipped, and
+  // counted, when a read needs the bits following it.
+  bool RefillSlow(bool skip_epb);
 
-  // Pointer to the next unread (not in curr_byte_) byte in the stream.
+  // Pointer to the next byte in the stream not loaded into curr_word_.
   const uint8_t* data_;
 
-  // Bytes left in the stream (without the curr_byte_).
+  // Bytes left in the stream (without the ones in curr_word_).
   off_t bytes_left_;
 
-  // Contents of the current byte; first unread bit starting at position
-  // 8 - num_remaining_bits_in_curr_byte_ from MSB.
-  int curr_byte_;
+  // The next bits of the stream, emulation prevention bytes removed, with
+  // the first unread bit at the MSB. The bits past
+  // num_bits_in_curr_word_ are zero.
+  uint64_t curr_word_;
 
-  // Number of bits remaining in curr_byte_
-  int num_remaining_bits_in_curr_byte_;
+  // Number of unread bits in curr_word_. Always a whole number of bytes
+  // plus the unread bits of the current byte.
+  int num_bits_in_curr_word_;
 
   // Used in emulation prevention three byte detection (see spec).
   // Initially set to 0xffff to accept all initial two-byte sequences.
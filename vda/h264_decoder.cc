@@ -14,6 +14,7 @@
 #include "base/optional.h"
 #include "base/stl_util.h"
 #include "h264_decoder.h"
+#include "h264_level_limits.h"
 
 namespace media {
 
@@ -27,6 +28,7 @@ H264Decoder::H264Decoder(H264Accelerator* accelerator)
       max_pic_num_(0),
       max_long_term_frame_idx_(0),
       max_num_reorder_frames_(0),
+      processed_sps_id_(-1),
       accelerator_(accelerator) {
   DCHECK(accelerator_);
   Reset();
@@ -1003,42 +1005,6 @@ bool H264Decoder::FinishPicture(scoped_refptr<H264Picture> pic) {
   return true;
 }
 
-static int LevelToMaxDpbMbs(int level) {
-  // See table A-1 in spec.
-  switch (level) {
-    case 10:
-      return 396;
-    case 11:
-      return 900;
-    case 12:  //  fallthrough
-    case 13:  //  fallthrough
-    case 20:
-      return 2376;
-    case 21:
-      return 4752;
-    case 22:  //  fallthrough
-    case 30:
-      return 8100;
-    case 31:
-      return 18000;
-    case 32:
-      return 20480;
-    case 40:  //  fallthrough
-    case 41:
-      return 32768;
-    case 42:
-      return 34816;
-    case 50:
-      return 110400;
-    case 51:  //  fallthrough
-    case 52:
-      return 184320;
-    default:
-      DVLOG(1) << "Invalid codec level (" << level << ")";
-      return 0;
-  }
-}
-
 bool H264Decoder::UpdateMaxNumReorderFrames(const H264SPS* sps) {
   if (sps->vui_parameters_present_flag && sps->bitstream_restriction_flag) {
     max_num_reorder_frames_ =
@@ -1084,6 +1050,7 @@ bool H264Decoder::ProcessSPS(int sps_id, bool* need_new_buffers) {
     return false;
 
   *need_new_buffers = false;
+  processed_sps_id_ = -1;
 
   if (sps->frame_mbs_only_flag == 0) {
     DVLOG(1) << "frame_mbs_only_flag != 1 not supported";
@@ -1106,7 +1073,7 @@ bool H264Decoder::ProcessSPS(int sps_id, bool* need_new_buffers) {
   }
 
   int level = sps->level_idc;
-  int max_dpb_mbs = LevelToMaxDpbMbs(level);
+  int max_dpb_mbs = base::checked_cast<int>(H264LevelToMaxDpbMbs(level));
   if (max_dpb_mbs == 0)
     return false;
 
@@ -1151,6 +1118,7 @@ bool H264Decoder::ProcessSPS(int sps_id, bool* need_new_buffers) {
     return false;
   DVLOG(1) << "max_num_reorder_frames: " << max_num_reorder_frames_;
 
+  processed_sps_id_ = sps_id;
   return true;
 }
 
@@ -1391,13 +1359,17 @@ H264Decoder::DecodeResult H264Decoder::Decode() {
         if (!FinishPrevFrameIfPresent())
           SET_ERROR_AND_RETURN();
 
-        par_res = parser_.ParseSPS(&sps_id);
+        bool sps_changed;
+        par_res = parser_.ParseSPS(&sps_id, &sps_changed);
         if (par_res != H264Parser::kOk)
           SET_ERROR_AND_RETURN();
 
+        // Processing again the SPS last processed would change nothing.
         bool need_new_buffers = false;
-        if (!ProcessSPS(sps_id, &need_new_buffers))
+        if ((sps_changed || sps_id != processed_sps_id_) &&
+            !ProcessSPS(sps_id, &need_new_buffers)) {
           SET_ERROR_AND_RETURN();
+        }
 
         if (state_ == kNeedStreamMetadata)
           state_ = kAfterReset;
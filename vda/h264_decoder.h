@@ -271,6 +271,10 @@ class H264Decoder : public AcceleratedVideoDecoder {
   // Output visible cropping rect.
   Rect visible_rect_;
 
+  // Id of the SPS the picture size, visible rect and DPB size were last set
+  // from by ProcessSPS(), or -1.
+  int processed_sps_id_;
+
   // PicOrderCount of the previously outputted frame.
   int last_output_poc_;
 
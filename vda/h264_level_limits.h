@@ -0,0 +1,18 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef H264_LEVEL_LIMITS_H_
+#define H264_LEVEL_LIMITS_H_
+
+#include <stdint.h>
+
+namespace media {
+
+// Returns the MaxDpbMbs limit of H.264 |level|, see table A-1 in the spec, or
+// 0 if |level| is invalid.
+uint32_t H264LevelToMaxDpbMbs(int level);
+
+}  // namespace media
+
+#endif  // H264_LEVEL_LIMITS_H_
@@ -4,8 +4,11 @@
 // Note: ported from Chromium commit head: 2de6929
 
 #include "h264_parser.h"
+#include "h264_start_code_scanner.h"
 #include "subsample_entry.h"
 
+#include <string.h>
+
 #include <limits>
 #include <memory>
 
@@ -206,6 +209,8 @@ H264Parser::~H264Parser() = default;
 void H264Parser::Reset() {
   stream_ = NULL;
   bytes_left_ = 0;
+  nalu_payload_ = NULL;
+  nalu_payload_size_ = 0;
   encrypted_ranges_.clear();
 }
 
@@ -257,59 +262,42 @@ const H264SPS* H264Parser::GetSPS(int sps_id) const {
   return it->second.get();
 }
 
-static inline bool IsStartCode(const uint8_t* data) {
-  return data[0] == 0x00 && data[1] == 0x00 && data[2] == 0x01;
-}
-
 // static
 bool H264Parser::FindStartCode(const uint8_t* data,
                                off_t data_size,
                                off_t* offset,
                                off_t* start_code_size) {
   DCHECK_GE(data_size, 0);
-  off_t bytes_left = data_size;
-
-  while (bytes_left >= 3) {
-    // The start code is "\0\0\1", ones are more unusual than zeroes, so let's
-    // search for it first.
-    const uint8_t* tmp =
-        reinterpret_cast<const uint8_t*>(memchr(data + 2, 1, bytes_left - 2));
-    if (!tmp) {
-      data += bytes_left - 2;
-      bytes_left = 2;
-      break;
-    }
-    tmp -= 2;
-    bytes_left -= tmp - data;
-    data = tmp;
-
-    if (IsStartCode(data)) {
-      // Found three-byte start code, set pointer at its beginning.
-      *offset = data_size - bytes_left;
-      *start_code_size = 3;
-
-      // If there is a zero byte before this start code,
-      // then it's actually a four-byte start code, so backtrack one byte.
-      if (*offset > 0 && *(data - 1) == 0x00) {
-        --(*offset);
-        ++(*start_code_size);
-      }
 
-      return true;
-    }
+  // Note: there is no security issue when receiving a negative |data_size|
+  // since in this case, |*offset| is equal to 0 (valid offset).
+  if (data_size < 3) {
+    *offset = 0;
+    *start_code_size = 0;
+    return false;
+  }
 
-    ++data;
-    --bytes_left;
+  const size_t pos = FindThreeByteStartCode(data, data_size);
+  if (pos == static_cast<size_t>(data_size)) {
+    // End of data: offset is pointing to the first byte that was not
+    // considered as a possible start of a start code.
+    *offset = data_size - 2;
+    *start_code_size = 0;
+    return false;
   }
 
-  // End of data: offset is pointing to the first byte that was not considered
-  // as a possible start of a start code.
-  // Note: there is no security issue when receiving a negative |data_size|
-  // since in this case, |bytes_left| is equal to |data_size| and thus
-  // |*offset| is equal to 0 (valid offset).
-  *offset = data_size - bytes_left;
-  *start_code_size = 0;
-  return false;
+  // Found three-byte start code, set pointer at its beginning.
+  *offset = pos;
+  *start_code_size = 3;
+
+  // If there is a zero byte before this start code,
+  // then it's actually a four-byte start code, so backtrack one byte.
+  if (*offset > 0 && data[*offset - 1] == 0x00) {
+    --(*offset);
+    ++(*start_code_size);
+  }
+
+  return true;
 }
 
 bool H264Parser::LocateNALU(off_t* nalu_size, off_t* start_code_size) {
@@ -415,53 +403,11 @@ bool H264Parser::ParseNALUs(const uint8_t* stream,
 }
 
 H264Parser::Result H264Parser::ReadUE(int* val) {
-  int num_bits = -1;
-  int bit;
-  int rest;
-
-  // Count the number of contiguous zero bits.
-  do {
-    READ_BITS_OR_RETURN(1, &bit);
-    num_bits++;
-  } while (bit == 0);
-
-  if (num_bits > 31)
-    return kInvalidStream;
-
-  // Calculate exp-Golomb code value of size num_bits.
-  // Special case for |num_bits| == 31 to avoid integer overflow. The only
-  // valid representation as an int is 2^31 - 1, so the remaining bits must
-  // be 0 or else the number is too large.
-  *val = (1u << num_bits) - 1u;
-
-  if (num_bits == 31) {
-    READ_BITS_OR_RETURN(num_bits, &rest);
-    return (rest == 0) ? kOk : kInvalidStream;
-  }
-
-  if (num_bits > 0) {
-    READ_BITS_OR_RETURN(num_bits, &rest);
-    *val += rest;
-  }
-
-  return kOk;
+  return br_.ReadUE(val) ? kOk : kInvalidStream;
 }
 
 H264Parser::Result H264Parser::ReadSE(int* val) {
-  int ue;
-  Result res;
-
-  // See Chapter 9 in the spec.
-  res = ReadUE(&ue);
-  if (res != kOk)
-    return res;
-
-  if (ue % 2 == 0)
-    *val = -(ue / 2);
-  else
-    *val = ue / 2 + 1;
-
-  return kOk;
+  return br_.ReadSE(val) ? kOk : kInvalidStream;
 }
 
 H264Parser::Result H264Parser::AdvanceToNextNALU(H264NALU* nalu) {
@@ -492,6 +438,8 @@ H264Parser::Result H264Parser::AdvanceToNextNALU(H264NALU* nalu) {
   // in bit reader for parsing, so we don't have to remember it here.
   stream_ += nalu_size_with_start_code;
   bytes_left_ -= nalu_size_with_start_code;
+  nalu_payload_ = nalu->data + 1;
+  nalu_payload_size_ = nalu->size - 1;
 
   // Read NALU header, skip the forbidden_zero_bit, but check for it.
   int data;
@@ -510,22 +458,22 @@ H264Parser::Result H264Parser::AdvanceToNextNALU(H264NALU* nalu) {
 }
 
 // Default scaling lists (per spec).
-static const int kDefault4x4Intra[kH264ScalingList4x4Length] = {
+static const uint8_t kDefault4x4Intra[kH264ScalingList4x4Length] = {
     6, 13, 13, 20, 20, 20, 28, 28, 28, 28, 32, 32, 32, 37, 37, 42,
 };
 
-static const int kDefault4x4Inter[kH264ScalingList4x4Length] = {
+static const uint8_t kDefault4x4Inter[kH264ScalingList4x4Length] = {
     10, 14, 14, 20, 20, 20, 24, 24, 24, 24, 27, 27, 27, 30, 30, 34,
 };
 
-static const int kDefault8x8Intra[kH264ScalingList8x8Length] = {
+static const uint8_t kDefault8x8Intra[kH264ScalingList8x8Length] = {
     6,  10, 10, 13, 11, 13, 16, 16, 16, 16, 18, 18, 18, 18, 18, 23,
     23, 23, 23, 23, 23, 25, 25, 25, 25, 25, 25, 25, 27, 27, 27, 27,
     27, 27, 27, 27, 29, 29, 29, 29, 29, 29, 29, 31, 31, 31, 31, 31,
     31, 33, 33, 33, 33, 33, 36, 36, 36, 36, 38, 38, 38, 40, 40, 42,
 };
 
-static const int kDefault8x8Inter[kH264ScalingList8x8Length] = {
+static const uint8_t kDefault8x8Inter[kH264ScalingList8x8Length] = {
     9,  13, 13, 15, 13, 15, 17, 17, 17, 17, 19, 19, 19, 19, 19, 21,
     21, 21, 21, 21, 21, 22, 22, 22, 22, 22, 22, 22, 24, 24, 24, 24,
     24, 24, 24, 24, 25, 25, 25, 25, 25, 25, 25, 27, 27, 27, 27, 27,
@@ -534,7 +482,7 @@ static const int kDefault8x8Inter[kH264ScalingList8x8Length] = {
 
 static inline void DefaultScalingList4x4(
     int i,
-    int scaling_list4x4[][kH264ScalingList4x4Length]) {
+    uint8_t scaling_list4x4[][kH264ScalingList4x4Length]) {
   DCHECK_LT(i, 6);
 
   if (i < 3)
@@ -545,7 +493,7 @@ static inline void DefaultScalingList4x4(
 
 static inline void DefaultScalingList8x8(
     int i,
-    int scaling_list8x8[][kH264ScalingList8x8Length]) {
+    uint8_t scaling_list8x8[][kH264ScalingList8x8Length]) {
   DCHECK_LT(i, 6);
 
   if (i % 2 == 0)
@@ -556,9 +504,9 @@ static inline void DefaultScalingList8x8(
 
 static void FallbackScalingList4x4(
     int i,
-    const int default_scaling_list_intra[],
-    const int default_scaling_list_inter[],
-    int scaling_list4x4[][kH264ScalingList4x4Length]) {
+    const uint8_t default_scaling_list_intra[],
+    const uint8_t default_scaling_list_inter[],
+    uint8_t scaling_list4x4[][kH264ScalingList4x4Length]) {
   static const int kScalingList4x4ByteSize =
       sizeof(scaling_list4x4[0][0]) * kH264ScalingList4x4Length;
 
@@ -597,9 +545,9 @@ static void FallbackScalingList4x4(
 
 static void FallbackScalingList8x8(
     int i,
-    const int default_scaling_list_intra[],
-    const int default_scaling_list_inter[],
-    int scaling_list8x8[][kH264ScalingList8x8Length]) {
+    const uint8_t default_scaling_list_intra[],
+    const uint8_t default_scaling_list_inter[],
+    uint8_t scaling_list8x8[][kH264ScalingList8x8Length]) {
   static const int kScalingList8x8ByteSize =
       sizeof(scaling_list8x8[0][0]) * kH264ScalingList8x8Length;
 
@@ -637,7 +585,7 @@ static void FallbackScalingList8x8(
 }
 
 H264Parser::Result H264Parser::ParseScalingList(int size,
-                                                int* scaling_list,
+                                                uint8_t* scaling_list,
                                                 bool* use_default) {
   // See chapter 7.3.2.1.1.1.
   int last_scale = 8;
@@ -890,12 +838,49 @@ static void FillDefaultSeqScalingLists(H264SPS* sps) {
       sps->scaling_list8x8[i][j] = 16;
 }
 
+int H264Parser::PeekParameterSetId(int num_bits_before_id) const {
+  H264BitReader br;
+  int data;
+  int id;
+  if (!br.Initialize(nalu_payload_, nalu_payload_size_))
+    return -1;
+  if (num_bits_before_id > 0 && !br.ReadBits(num_bits_before_id, &data))
+    return -1;
+  if (!br.ReadUE(&id))
+    return -1;
+  return id;
+}
+
+bool H264Parser::IsSameParameterSetNALU(
+    const std::map<int, std::vector<uint8_t>>& nalus,
+    int id) const {
+  auto it = nalus.find(id);
+  return it != nalus.end() &&
+         it->second.size() == static_cast<size_t>(nalu_payload_size_) &&
+         memcmp(it->second.data(), nalu_payload_, nalu_payload_size_) == 0;
+}
+
 H264Parser::Result H264Parser::ParseSPS(int* sps_id) {
+  bool changed;
+  return ParseSPS(sps_id, &changed);
+}
+
+H264Parser::Result H264Parser::ParseSPS(int* sps_id, bool* changed) {
   // See 7.4.2.1.
   int data;
   Result res;
 
   *sps_id = -1;
+  *changed = true;
+
+  // seq_parameter_set_id follows profile_idc, the constraint flags and
+  // level_idc.
+  const int id = PeekParameterSetId(24);
+  if (IsSameParameterSetNALU(sps_nalus_, id) && GetSPS(id)) {
+    *sps_id = id;
+    *changed = false;
+    return kOk;
+  }
 
   std::unique_ptr<H264SPS> sps(new H264SPS());
 
@@ -1004,19 +989,40 @@ H264Parser::Result H264Parser::ParseSPS(int* sps_id) {
       return res;
   }
 
-  // If an SPS with the same id already exists, replace it.
+  // If an SPS with the same id already exists, replace it. The PPSes
+  // referring to it must then be parsed again.
   *sps_id = sps->seq_parameter_set_id;
   active_SPSes_[*sps_id] = std::move(sps);
+  sps_nalus_[*sps_id].assign(nalu_payload_,
+                             nalu_payload_ + nalu_payload_size_);
+  for (const auto& id_and_pps : active_PPSes_) {
+    if (id_and_pps.second->seq_parameter_set_id == *sps_id)
+      pps_nalus_.erase(id_and_pps.first);
+  }
 
   return kOk;
 }
 
 H264Parser::Result H264Parser::ParsePPS(int* pps_id) {
+  bool changed;
+  return ParsePPS(pps_id, &changed);
+}
+
+H264Parser::Result H264Parser::ParsePPS(int* pps_id, bool* changed) {
   // See 7.4.2.2.
   const H264SPS* sps;
   Result res;
 
   *pps_id = -1;
+  *changed = true;
+
+  // pic_parameter_set_id comes first.
+  const int id = PeekParameterSetId(0);
+  if (IsSameParameterSetNALU(pps_nalus_, id) && GetPPS(id)) {
+    *pps_id = id;
+    *changed = false;
+    return kOk;
+  }
 
   std::unique_ptr<H264PPS> pps(new H264PPS());
 
@@ -1082,6 +1088,8 @@ H264Parser::Result H264Parser::ParsePPS(int* pps_id) {
   // If a PPS with the same id already exists, replace it.
   *pps_id = pps->pic_parameter_set_id;
   active_PPSes_[*pps_id] = std::move(pps);
+  pps_nalus_[*pps_id].assign(nalu_payload_,
+                             nalu_payload_ + nalu_payload_size_);
 
   return kOk;
 }
@@ -1164,15 +1172,19 @@ H264Parser::Result H264Parser::ParseWeightingFactors(
     H264WeightingFactors* w_facts) {
   int def_luma_weight = 1 << luma_log2_weight_denom;
   int def_chroma_weight = 1 << chroma_log2_weight_denom;
+  int weight;
+  int offset;
 
   for (int i = 0; i < num_ref_idx_active_minus1 + 1; ++i) {
     READ_BOOL_OR_RETURN(&w_facts->luma_weight_flag);
     if (w_facts->luma_weight_flag) {
-      READ_SE_OR_RETURN(&w_facts->luma_weight[i]);
-      IN_RANGE_OR_RETURN(w_facts->luma_weight[i], -128, 127);
+      READ_SE_OR_RETURN(&weight);
+      IN_RANGE_OR_RETURN(weight, -128, 127);
+      w_facts->luma_weight[i] = weight;
 
-      READ_SE_OR_RETURN(&w_facts->luma_offset[i]);
-      IN_RANGE_OR_RETURN(w_facts->luma_offset[i], -128, 127);
+      READ_SE_OR_RETURN(&offset);
+      IN_RANGE_OR_RETURN(offset, -128, 127);
+      w_facts->luma_offset[i] = offset;
     } else {
       w_facts->luma_weight[i] = def_luma_weight;
       w_facts->luma_offset[i] = 0;
@@ -1182,11 +1194,13 @@ H264Parser::Result H264Parser::ParseWeightingFactors(
       READ_BOOL_OR_RETURN(&w_facts->chroma_weight_flag);
       if (w_facts->chroma_weight_flag) {
         for (int j = 0; j < 2; ++j) {
-          READ_SE_OR_RETURN(&w_facts->chroma_weight[i][j]);
-          IN_RANGE_OR_RETURN(w_facts->chroma_weight[i][j], -128, 127);
+          READ_SE_OR_RETURN(&weight);
+          IN_RANGE_OR_RETURN(weight, -128, 127);
+          w_facts->chroma_weight[i][j] = weight;
 
-          READ_SE_OR_RETURN(&w_facts->chroma_offset[i][j]);
-          IN_RANGE_OR_RETURN(w_facts->chroma_offset[i][j], -128, 127);
+          READ_SE_OR_RETURN(&offset);
+          IN_RANGE_OR_RETURN(offset, -128, 127);
+          w_facts->chroma_offset[i][j] = offset;
         }
       } else {
         for (int j = 0; j < 2; ++j) {
@@ -1283,8 +1297,6 @@ H264Parser::Result H264Parser::ParseSliceHeader(const H264NALU& nalu,
   const H264PPS* pps;
   Result res;
 
-  memset(shdr, 0, sizeof(*shdr));
-
   shdr->idr_pic_flag = (nalu.nal_unit_type == 5);
   shdr->nal_ref_idc = nalu.nal_ref_idc;
   shdr->nalu_data = nalu.data;
@@ -118,8 +118,9 @@ struct H264SPS {
   bool qpprime_y_zero_transform_bypass_flag;
 
   bool seq_scaling_matrix_present_flag;
-  int scaling_list4x4[6][kH264ScalingList4x4Length];
-  int scaling_list8x8[6][kH264ScalingList8x8Length];
+  // Scaling list entries are 1-255 (7.4.2.1.1.1).
+  uint8_t scaling_list4x4[6][kH264ScalingList4x4Length];
+  uint8_t scaling_list8x8[6][kH264ScalingList8x8Length];
 
   int log2_max_frame_num_minus4;
   int pic_order_cnt_type;
@@ -162,20 +163,9 @@ struct H264SPS {
   int transfer_characteristics;
   int matrix_coefficients;
 
-  // TODO(posciak): actually parse these instead of ParseAndIgnoreHRDParameters.
-  bool nal_hrd_parameters_present_flag;
-  int cpb_cnt_minus1;
-  int bit_rate_scale;
-  int cpb_size_scale;
-  int bit_rate_value_minus1[32];
-  int cpb_size_value_minus1[32];
-  bool cbr_flag[32];
-  int initial_cpb_removal_delay_length_minus_1;
-  int cpb_removal_delay_length_minus1;
-  int dpb_output_delay_length_minus1;
-  int time_offset_length;
-
-  bool low_delay_hrd_flag;
+  // TODO(posciak): actually parse the HRD parameters instead of
+  // ParseAndIgnoreHRDParameters, into a structure allocated only when they are
+  // present rather than arrays held by every SPS.
 
   int chroma_array_type;
 
@@ -208,8 +198,8 @@ struct H264PPS {
   bool transform_8x8_mode_flag;
 
   bool pic_scaling_matrix_present_flag;
-  int scaling_list4x4[6][kH264ScalingList4x4Length];
-  int scaling_list8x8[6][kH264ScalingList8x8Length];
+  uint8_t scaling_list4x4[6][kH264ScalingList4x4Length];
+  uint8_t scaling_list8x8[6][kH264ScalingList8x8Length];
 
   int second_chroma_qp_index_offset;
 };
@@ -222,13 +212,15 @@ struct H264ModificationOfPicNum {
   };
 };
 
+// The weights are 1 << log2_weight_denom (up to 128) by default, and in
+// [-128, 127] otherwise, as are the offsets.
 struct H264WeightingFactors {
   bool luma_weight_flag;
   bool chroma_weight_flag;
-  int luma_weight[32];
-  int luma_offset[32];
-  int chroma_weight[32][2];
-  int chroma_offset[32][2];
+  int16_t luma_weight[32];
+  int16_t luma_offset[32];
+  int16_t chroma_weight[32][2];
+  int16_t chroma_offset[32][2];
 };
 
 struct H264DecRefPicMarking {
@@ -421,6 +413,14 @@ class H264Parser {
   Result ParseSPS(int* sps_id);
   Result ParsePPS(int* pps_id);
 
+  // Same as above, also setting |*changed| to whether the SPS/PPS was parsed.
+  // It is not when the NALU is identical to the one the SPS/PPS with the same
+  // id was last parsed from, as streams repeat them before every IDR or even
+  // every frame: the stored structure is then kept as is. A PPS is parsed
+  // again after its SPS changes.
+  Result ParseSPS(int* sps_id, bool* changed);
+  Result ParsePPS(int* pps_id, bool* changed);
+
   // Return a pointer to SPS/PPS with given |sps_id|/|pps_id| or NULL if not
   // present.
   const H264SPS* GetSPS(int sps_id) const;
@@ -433,6 +433,8 @@ class H264Parser {
 
   // Parse a slice header, returning it in |*shdr|. |*nalu| must be set to
   // the NALU returned from AdvanceToNextNALU() and corresponding to |*shdr|.
+  // |*shdr| must be newly constructed: the syntax elements absent from the
+  // slice header are not reset.
   Result ParseSliceHeader(const H264NALU& nalu, H264SliceHeader* shdr);
 
   // Parse a SEI message, returning it in |*sei_msg|, provided and managed
@@ -449,6 +451,15 @@ class H264Parser {
   // - the size in bytes of the start code is returned in |*start_code_size|.
   bool LocateNALU(off_t* nalu_size, off_t* start_code_size);
 
+  // Return the id of the SPS or PPS in the current NALU, read after
+  // |num_bits_before_id| bits of its payload, or -1 on error.
+  int PeekParameterSetId(int num_bits_before_id) const;
+
+  // Whether the payload of the current NALU is the one in |nalus| for |id|.
+  bool IsSameParameterSetNALU(
+      const std::map<int, std::vector<uint8_t>>& nalus,
+      int id) const;
+
   // Exp-Golomb code parsing as specified in chapter 9.1 of the spec.
   // Read one unsigned exp-Golomb code from the stream and return in |*val|.
   Result ReadUE(int* val);
@@ -457,7 +468,7 @@ class H264Parser {
   Result ReadSE(int* val);
 
   // Parse scaling lists (see spec).
-  Result ParseScalingList(int size, int* scaling_list, bool* use_default);
+  Result ParseScalingList(int size, uint8_t* scaling_list, bool* use_default);
   Result ParseSPSScalingLists(H264SPS* sps);
   Result ParsePPSScalingLists(const H264SPS& sps, H264PPS* pps);
 
@@ -490,12 +501,20 @@ class H264Parser {
   // Bytes left in the stream after the current NALU.
   off_t bytes_left_;
 
+  // Payload of the current NALU, after its header.
+  const uint8_t* nalu_payload_;
+  off_t nalu_payload_size_;
+
   H264BitReader br_;
 
   // PPSes and SPSes stored for future reference.
   std::map<int, std::unique_ptr<H264SPS>> active_SPSes_;
   std::map<int, std::unique_ptr<H264PPS>> active_PPSes_;
 
+  // Payloads of the NALUs the stored SPSes and PPSes were parsed from.
+  std::map<int, std::vector<uint8_t>> sps_nalus_;
+  std::map<int, std::vector<uint8_t>> pps_nalus_;
+
   // Ranges of encrypted bytes in the buffer passed to
   // SetEncryptedStream().
   Ranges<const uint8_t*> encrypted_ranges_;
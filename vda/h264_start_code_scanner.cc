@@ -0,0 +1,205 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "h264_start_code_scanner.h"
+
+#include <string.h>
+
+#include "base/logging.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAS_X86_SCANNERS 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAS_NEON_SCANNER 1
+#endif
+
+namespace media {
+
+namespace {
+
+// Checks every remaining position from |pos| one byte at a time. Used for the
+// tails that are too short for the wide scanners.
+size_t ScanTail(const uint8_t* data, size_t size, size_t pos) {
+  for (; pos + 2 < size; ++pos) {
+    if (data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1)
+      return pos;
+  }
+  return size;
+}
+
+size_t ScanScalar(const uint8_t* data, size_t size) {
+  // The start code is "\0\0\1", ones are more unusual than zeroes, so let's
+  // search for it first.
+  size_t pos = 2;
+  while (pos < size) {
+    const uint8_t* one =
+        static_cast<const uint8_t*>(memchr(data + pos, 1, size - pos));
+    if (!one)
+      return size;
+    pos = one - data;
+    if (data[pos - 1] == 0 && data[pos - 2] == 0)
+      return pos - 2;
+    ++pos;
+  }
+  return size;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+inline uint64_t Load64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Returns a word with 0x80 set in each byte of |v| that is zero. Unlike the
+// usual (v - 0x01..) & ~v trick this has no false positives above a zero byte,
+// so the lowest set bit always marks the first match.
+inline uint64_t ZeroBytes(uint64_t v) {
+  const uint64_t k7f = 0x7f7f7f7f7f7f7f7fULL;
+  return ~(((v & k7f) + k7f) | v | k7f);
+}
+
+size_t ScanSWAR(const uint8_t* data, size_t size) {
+  const uint64_t kOnes = 0x0101010101010101ULL;
+  size_t pos = 0;
+  // Each step tests the 8 positions [pos, pos + 8), reading up to pos + 9.
+  for (; pos + 10 <= size; pos += 8) {
+    const uint64_t matches = ZeroBytes(Load64(data + pos)) &
+                             ZeroBytes(Load64(data + pos + 1)) &
+                             ZeroBytes(Load64(data + pos + 2) ^ kOnes);
+    if (matches)
+      return pos + (__builtin_ctzll(matches) >> 3);
+  }
+  return ScanTail(data, size, pos);
+}
+#define HAS_SWAR_SCANNER 1
+#endif
+
+#if defined(HAS_X86_SCANNERS)
+size_t ScanSSE2(const uint8_t* data, size_t size) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  size_t pos = 0;
+  for (; pos + 18 <= size; pos += 16) {
+    const __m128i b0 =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+    const __m128i b1 =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos + 1));
+    const __m128i b2 =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos + 2));
+    const __m128i m = _mm_and_si128(
+        _mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+        _mm_cmpeq_epi8(b2, one));
+    const int bits = _mm_movemask_epi8(m);
+    if (bits)
+      return pos + __builtin_ctz(bits);
+  }
+  return ScanTail(data, size, pos);
+}
+
+__attribute__((target("avx2"))) size_t ScanAVX2(const uint8_t* data,
+                                                size_t size) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+  size_t pos = 0;
+  for (; pos + 34 <= size; pos += 32) {
+    const __m256i b0 =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+    const __m256i b1 =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos + 1));
+    const __m256i b2 =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos + 2));
+    const __m256i m = _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpeq_epi8(b0, zero),
+                         _mm256_cmpeq_epi8(b1, zero)),
+        _mm256_cmpeq_epi8(b2, one));
+    const uint32_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(m));
+    if (bits)
+      return pos + __builtin_ctz(bits);
+  }
+  return ScanSSE2(data + pos, size - pos) + pos;
+}
+
+bool CpuSupportsAVX2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif  // defined(HAS_X86_SCANNERS)
+
+#if defined(HAS_NEON_SCANNER)
+size_t ScanNEON(const uint8_t* data, size_t size) {
+  const uint8x16_t zero = vdupq_n_u8(0);
+  const uint8x16_t one = vdupq_n_u8(1);
+  size_t pos = 0;
+  for (; pos + 18 <= size; pos += 16) {
+    const uint8x16_t m =
+        vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(data + pos), zero),
+                          vceqq_u8(vld1q_u8(data + pos + 1), zero)),
+                 vceqq_u8(vld1q_u8(data + pos + 2), one));
+    // Narrow each 0x00/0xff byte to a nibble to get a 64-bit mask.
+    const uint64_t bits = vget_lane_u64(
+        vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+    if (bits)
+      return pos + (__builtin_ctzll(bits) >> 2);
+  }
+  return ScanTail(data, size, pos);
+}
+#endif  // defined(HAS_NEON_SCANNER)
+
+StartCodeScanFunc ChooseScanFunc() {
+  static const StartCodeScanner kPreferred[] = {
+      StartCodeScanner::kAVX2, StartCodeScanner::kSSE2,
+      StartCodeScanner::kNEON, StartCodeScanner::kSWAR,
+  };
+  for (StartCodeScanner scanner : kPreferred) {
+    StartCodeScanFunc func = GetStartCodeScanFunc(scanner);
+    if (func)
+      return func;
+  }
+  return ScanScalar;
+}
+
+}  // namespace
+
+size_t FindThreeByteStartCode(const uint8_t* data, size_t size) {
+  static const StartCodeScanFunc scan_func = ChooseScanFunc();
+  return scan_func(data, size);
+}
+
+StartCodeScanFunc GetStartCodeScanFunc(StartCodeScanner scanner) {
+  switch (scanner) {
+    case StartCodeScanner::kScalar:
+      return ScanScalar;
+    case StartCodeScanner::kSWAR:
+#if defined(HAS_SWAR_SCANNER)
+      return ScanSWAR;
+#else
+      return nullptr;
+#endif
+    case StartCodeScanner::kSSE2:
+#if defined(HAS_X86_SCANNERS)
+      return ScanSSE2;
+#else
+      return nullptr;
+#endif
+    case StartCodeScanner::kAVX2:
+#if defined(HAS_X86_SCANNERS)
+      return CpuSupportsAVX2() ? ScanAVX2 : nullptr;
+#else
+      return nullptr;
+#endif
+    case StartCodeScanner::kNEON:
+#if defined(HAS_NEON_SCANNER)
+      return ScanNEON;
+#else
+      return nullptr;
+#endif
+  }
+  NOTREACHED();
+  return nullptr;
+}
+
+}  // namespace media
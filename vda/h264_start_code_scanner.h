@@ -0,0 +1,38 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+// This file contains the scanners used by H264Parser to locate Annex B start
+// codes. The scanners look for the "\0\0\1" pattern a register at a time and
+// are bit-exact with a plain byte-by-byte search.
+
+#ifndef H264_START_CODE_SCANNER_H_
+#define H264_START_CODE_SCANNER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace media {
+
+// Returns the offset of the first "\0\0\1" sequence in |data| of |size| bytes,
+// or |size| if there is none. Uses the fastest scanner supported by the CPU.
+size_t FindThreeByteStartCode(const uint8_t* data, size_t size);
+
+// The scanner implementations, exposed for testing and benchmarking.
+enum class StartCodeScanner {
+  kScalar,  // memchr() for 0x01, then check the two preceding bytes.
+  kSWAR,    // 64-bit SIMD-within-a-register.
+  kSSE2,
+  kAVX2,
+  kNEON,
+};
+
+using StartCodeScanFunc = size_t (*)(const uint8_t* data, size_t size);
+
+// Returns the implementation of |scanner|, or nullptr if it is not compiled in
+// or not supported by the CPU.
+StartCodeScanFunc GetStartCodeScanFunc(StartCodeScanner scanner);
+
+}  // namespace media
+
+#endif  // H264_START_CODE_SCANNER_H_
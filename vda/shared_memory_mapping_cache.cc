@@ -0,0 +1,147 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "shared_memory_mapping_cache.h"
+
+#include <linux/magic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "base/logging.h"
+
+namespace media {
+
+namespace {
+
+// Returns whether the inode of |fd| may be shared with other buffers.
+bool HasSharedInode(int fd) {
+  struct statfs fs;
+  if (fstatfs(fd, &fs) != 0) {
+    DPLOG(1) << "fstatfs() failed";
+    return true;
+  }
+  return fs.f_type == ANON_INODE_FS_MAGIC;
+}
+
+}  // namespace
+
+SharedMemoryMappingCache::SharedMemoryMappingCache(size_t capacity)
+    : capacity_(capacity), hits_(0), misses_(0) {
+  DCHECK_GT(capacity_, 0u);
+}
+
+SharedMemoryMappingCache::~SharedMemoryMappingCache() {
+  for (const auto& entry : entries_) {
+    DCHECK_EQ(entry.num_users, 0u);
+    Unmap(entry);
+  }
+}
+
+const uint8_t* SharedMemoryMappingCache::Map(int fd, off_t offset,
+                                             size_t size) {
+  if (fd < 0 || offset < 0) {
+    DVLOG(1) << "Invalid fd: " << fd << " or offset: " << offset;
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    DPLOG(1) << "fstat() failed";
+    return nullptr;
+  }
+  const size_t needed = static_cast<size_t>(offset) + size;
+  const bool cacheable = !HasSharedInode(fd);
+
+  for (auto it = entries_.begin(); cacheable && it != entries_.end(); ++it) {
+    if (it->stale || it->dev != st.st_dev || it->ino != st.st_ino)
+      continue;
+    if (it->length < needed) {
+      // The buffer is used with a larger payload than before. Drop the old
+      // mapping and map again below.
+      if (it->num_users > 0) {
+        it->stale = true;
+      } else {
+        Unmap(*it);
+        entries_.erase(it);
+      }
+      break;
+    }
+    ++hits_;
+    ++it->num_users;
+    entries_.splice(entries_.begin(), entries_, it);
+    return static_cast<const uint8_t*>(it->address) + offset;
+  }
+
+  ++misses_;
+  const size_t page_size = getpagesize();
+  const size_t length = (needed + page_size - 1) / page_size * page_size;
+  void* address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  if (address == MAP_FAILED) {
+    DPLOG(1) << "mmap() failed, length: " << length;
+    return nullptr;
+  }
+
+  // An entry that is not cacheable is stale from the start: it is never
+  // returned by Map() again, and is unmapped on its Release().
+  entries_.push_front(
+      Entry{st.st_dev, st.st_ino, address, length, 1, !cacheable});
+  Trim();
+  return static_cast<const uint8_t*>(address) + offset;
+}
+
+void SharedMemoryMappingCache::Release(const uint8_t* memory, off_t offset) {
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (static_cast<const uint8_t*>(it->address) + offset != memory)
+      continue;
+    DCHECK_GT(it->num_users, 0u);
+    if (--it->num_users == 0) {
+      if (it->stale) {
+        Unmap(*it);
+        entries_.erase(it);
+      } else {
+        Trim();
+      }
+    }
+    return;
+  }
+  NOTREACHED() << "Releasing an address not returned by Map()";
+}
+
+void SharedMemoryMappingCache::Clear() {
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it->num_users > 0) {
+      it->stale = true;
+      ++it;
+    } else {
+      Unmap(*it);
+      it = entries_.erase(it);
+    }
+  }
+}
+
+void SharedMemoryMappingCache::Trim() {
+  size_t num_cached = 0;
+  for (const auto& entry : entries_) {
+    if (!entry.stale)
+      ++num_cached;
+  }
+  for (auto it = entries_.end(); num_cached > capacity_ &&
+                                 it != entries_.begin();) {
+    --it;
+    if (it->stale || it->num_users > 0)
+      continue;
+    Unmap(*it);
+    it = entries_.erase(it);
+    --num_cached;
+  }
+}
+
+void SharedMemoryMappingCache::Unmap(const Entry& entry) {
+  if (munmap(entry.address, entry.length) != 0)
+    DPLOG(1) << "munmap() failed";
+}
+
+}  // namespace media
@@ -0,0 +1,87 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SHARED_MEMORY_MAPPING_CACHE_H_
+#define SHARED_MEMORY_MAPPING_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <list>
+
+#include "base/macros.h"
+
+namespace media {
+
+// A small LRU cache of read-only mmap()s of shared memory buffers, keyed by the
+// identity (device and inode) of the file behind the fd. Clients usually
+// recycle a handful of buffers from a pool, each time with a new fd, so keeping
+// the mappings alive avoids a mmap()/munmap() pair per buffer.
+//
+// A cached mapping holds a reference to the underlying buffer, so its memory is
+// not released until the entry is evicted or the cache is cleared. An inode
+// therefore cannot be reused by another buffer while it is cached.
+//
+// Before Linux 4.20, all dma-bufs share the single inode of the anonymous
+// inode filesystem, so the inode does not identify the buffer. Buffers on that
+// filesystem are mapped for each Map() and never cached.
+//
+// Every Map() must be balanced by a Release() of the returned address. Mappings
+// in use are never unmapped by eviction or Clear(); they are unmapped when their
+// last user releases them instead.
+//
+// This class is not thread-safe.
+class SharedMemoryMappingCache {
+ public:
+  explicit SharedMemoryMappingCache(size_t capacity);
+  ~SharedMemoryMappingCache();
+
+  // Returns the address of |offset| in the memory behind |fd|, which must be
+  // readable for |size| bytes. Maps the memory if there is no cached mapping
+  // covering it. Returns nullptr on failure.
+  const uint8_t* Map(int fd, off_t offset, size_t size);
+
+  // Releases the address |memory| returned by Map() for |offset|.
+  void Release(const uint8_t* memory, off_t offset);
+
+  // Unmaps all cached mappings not in use, and makes the ones in use unmapped
+  // on their last Release(). Call this when the client may have released or
+  // replaced its buffers, e.g. on reset or resolution change.
+  void Clear();
+
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+
+ private:
+  struct Entry {
+    dev_t dev;
+    ino_t ino;
+    void* address;
+    size_t length;
+    // Number of Map() results not released yet.
+    size_t num_users;
+    // Set if the entry was cleared while in use. It is no longer returned by
+    // Map() and is unmapped on its last Release().
+    bool stale;
+  };
+
+  // Evicts least recently used entries not in use until at most |capacity_|
+  // entries are left.
+  void Trim();
+  void Unmap(const Entry& entry);
+
+  const size_t capacity_;
+  // Most recently used entry at the front.
+  std::list<Entry> entries_;
+
+  size_t hits_;
+  size_t misses_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMemoryMappingCache);
+};
+
+}  // namespace media
+
+#endif  // SHARED_MEMORY_MAPPING_CACHE_H_
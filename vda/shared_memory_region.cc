@@ -15,7 +15,9 @@ SharedMemoryRegion::SharedMemoryRegion(const base::SharedMemoryHandle& handle,
     : shm_(handle, read_only),
       offset_(offset),
       size_(size),
-      alignment_size_(offset % base::SysInfo::VMAllocationGranularity()) {
+      alignment_size_(offset % base::SysInfo::VMAllocationGranularity()),
+      cache_(nullptr),
+      cached_memory_(nullptr) {
   DCHECK_GE(offset_, 0) << "Invalid offset: " << offset_;
 }
 
@@ -26,6 +28,11 @@ SharedMemoryRegion::SharedMemoryRegion(const BitstreamBuffer& bitstream_buffer,
                          bitstream_buffer.size(),
                          read_only) {}
 
+SharedMemoryRegion::~SharedMemoryRegion() {
+  if (cached_memory_)
+    cache_->Release(cached_memory_, offset_);
+}
+
 bool SharedMemoryRegion::Map() {
   if (offset_ < 0) {
     DVLOG(1) << "Invalid offset: " << offset_;
@@ -34,9 +41,22 @@ bool SharedMemoryRegion::Map() {
   return shm_.MapAt(offset_ - alignment_size_, size_ + alignment_size_);
 }
 
+bool SharedMemoryRegion::Map(SharedMemoryMappingCache* cache) {
+  DCHECK(!cached_memory_);
+  cache_ = cache;
+  cached_memory_ = cache_->Map(fd(), offset_, size_);
+  return cached_memory_ != nullptr;
+}
+
 void* SharedMemoryRegion::memory() {
+  if (cached_memory_)
+    return const_cast<uint8_t*>(cached_memory_);
   int8_t* addr = reinterpret_cast<int8_t*>(shm_.memory());
   return addr ? addr + alignment_size_ : nullptr;
 }
 
+int SharedMemoryRegion::fd() const {
+  return base::SharedMemory::GetFdFromSharedMemoryHandle(shm_.handle());
+}
+
 }  // namespace media
@@ -8,6 +8,7 @@
 
 #include "base/memory/shared_memory.h"
 #include "bitstream_buffer.h"
+#include "shared_memory_mapping_cache.h"
 
 namespace media {
 
@@ -32,10 +33,17 @@ class SharedMemoryRegion {
   // Creates a SharedMemoryRegion from the given |bistream_buffer|.
   SharedMemoryRegion(const BitstreamBuffer& bitstream_buffer, bool read_only);
 
+  ~SharedMemoryRegion();
+
   // Maps the shared memory into the caller's address space.
   // Return true on success, false otherwise.
   bool Map();
 
+  // Same as Map(), but takes the mapping from |cache|, which keeps it alive
+  // after this region is destroyed. |cache| must outlive this region. Must not
+  // be called more than once.
+  bool Map(SharedMemoryMappingCache* cache);
+
   // Gets a pointer to the mapped region if it has been mapped via Map().
   // Returns |nullptr| if it is not mapped. The returned pointer points
   // to the memory at the offset previously passed to the constructor.
@@ -43,11 +51,19 @@ class SharedMemoryRegion {
 
   size_t size() const { return size_; }
 
+  // Gets the file descriptor of the underlying shared memory, and the offset
+  // of the region in it. These are valid whether or not Map() was called.
+  int fd() const;
+  off_t offset() const { return offset_; }
+
  private:
   base::SharedMemory shm_;
   off_t offset_;
   size_t size_;
   size_t alignment_size_;
+  // Set if the region was mapped through |cache_|.
+  SharedMemoryMappingCache* cache_;
+  const uint8_t* cached_memory_;
 
   DISALLOW_COPY_AND_ASSIGN(SharedMemoryRegion);
 };
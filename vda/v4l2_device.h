@@ -6,7 +6,6 @@
 // V4L2DecodeAccelerator class to delegate/pass the device specific
 // handling of any of the functionalities.
 // Note: ported from Chromium commit head: fb70f64
-// Note: it's also merged with generic_v4l2_device.h (head: fb70f64)
 
 #ifndef V4L2_DEVICE_H_
 #define V4L2_DEVICE_H_
@@ -15,7 +14,11 @@
 #include <map>
 #include <stddef.h>
 #include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "base/callback.h"
 #include "base/files/scoped_file.h"
 #include "base/memory/ref_counted.h"
 #include "size.h"
@@ -34,14 +37,14 @@ namespace media {
 // Implemented for decoder usage only.
 class V4L2Device : public base::RefCountedThreadSafe<V4L2Device> {
  public:
-  V4L2Device();
-  ~V4L2Device();
-
   // Utility format conversion functions
   static VideoPixelFormat V4L2PixFmtToVideoPixelFormat(uint32_t format);
   static uint32_t VideoPixelFormatToV4L2PixFmt(VideoPixelFormat format);
-  static uint32_t VideoCodecProfileToV4L2PixFmt(VideoCodecProfile profile);
-  std::vector<VideoCodecProfile> V4L2PixFmtToVideoCodecProfiles(
+  // Return the input fourcc for |profile|, as parsed slices for stateless
+  // decoders if |slice_based|, or as a bitstream otherwise.
+  static uint32_t VideoCodecProfileToV4L2PixFmt(VideoCodecProfile profile,
+                                                bool slice_based);
+  static std::vector<VideoCodecProfile> V4L2PixFmtToVideoCodecProfiles(
       uint32_t pix_fmt,
       bool is_encoder);
 
@@ -52,14 +55,24 @@ class V4L2Device : public base::RefCountedThreadSafe<V4L2Device> {
     kJpegDecoder,
   };
 
+  // Create a V4L2Device for the V4L2 devices of the platform, or the one
+  // returned by the callback set with SetCreateCallbackForTesting().
+  static scoped_refptr<V4L2Device> Create();
+
+  using CreateCallback = base::Callback<scoped_refptr<V4L2Device>()>;
+  // Make Create() return the devices of |create_cb|, e.g. fakes to run without
+  // V4L2 hardware, or the platform ones again if |create_cb| is null. Must be
+  // called before the devices are used.
+  static void SetCreateCallbackForTesting(const CreateCallback& create_cb);
+
   // Open a V4L2 device of |type| for use with |v4l2_pixfmt|.
   // Return true on success.
   // The device will be closed in the destructor.
-  bool Open(Type type, uint32_t v4l2_pixfmt);
+  virtual bool Open(Type type, uint32_t v4l2_pixfmt) = 0;
 
   // Parameters and return value are the same as for the standard ioctl() system
   // call.
-  int Ioctl(int request, void* arg);
+  virtual int Ioctl(int request, void* arg) = 0;
 
   // This method sleeps until either:
   // - SetDevicePollInterrupt() is called (on another thread),
@@ -68,7 +81,7 @@ class V4L2Device : public base::RefCountedThreadSafe<V4L2Device> {
   //   |*event_pending| will be set to true.
   // Returns false on error, true otherwise.
   // This method should be called from a separate thread.
-  bool Poll(bool poll_device, bool* event_pending);
+  virtual bool Poll(bool poll_device, bool* event_pending) = 0;
 
   // These methods are used to interrupt the thread sleeping on Poll() and force
   // it to return regardless of device state, which is usually when the client
@@ -76,25 +89,49 @@ class V4L2Device : public base::RefCountedThreadSafe<V4L2Device> {
   // client state change, etc.). When SetDevicePollInterrupt() is called, Poll()
   // will return immediately, and any subsequent calls to it will also do so
   // until ClearDevicePollInterrupt() is called.
-  bool SetDevicePollInterrupt();
-  bool ClearDevicePollInterrupt();
+  virtual bool SetDevicePollInterrupt() = 0;
+  virtual bool ClearDevicePollInterrupt() = 0;
+
+  // Alternative to Poll() for clients that wait in their own event loop
+  // instead of on a separate thread. Return an epoll fd that becomes readable
+  // whenever Poll() would return, i.e. when the poll interrupt is set or, if
+  // SetEpollDevice(true) was called, when the device is ready.
+  virtual int GetEpollFd() const = 0;
+  // Add the device fd to or remove it from the GetEpollFd() set, like the
+  // |poll_device| argument of Poll().
+  virtual bool SetEpollDevice(bool poll_device) = 0;
+  // Store the EPOLL* events pending on the device fd, if any, in
+  // |device_events|, without blocking. EPOLLPRI means an event has arrived.
+  // Returns false on error, true otherwise.
+  virtual bool GetEpollEvents(uint32_t* device_events) = 0;
 
   // Wrappers for standard mmap/munmap system calls.
-  void* Mmap(void* addr,
-             unsigned int len,
-             int prot,
-             int flags,
-             unsigned int offset);
-  void Munmap(void* addr, unsigned int len);
+  virtual void* Mmap(void* addr,
+                     unsigned int len,
+                     int prot,
+                     int flags,
+                     unsigned int offset) = 0;
+  virtual void Munmap(void* addr, unsigned int len) = 0;
 
   // Return a vector of dmabuf file descriptors, exported for V4L2 buffer with
   // |index|, assuming the buffer contains |num_planes| V4L2 planes and is of
   // |type|. Return an empty vector on failure.
   // The caller is responsible for closing the file descriptors after use.
-  std::vector<base::ScopedFD> GetDmabufsForV4L2Buffer(
+  virtual std::vector<base::ScopedFD> GetDmabufsForV4L2Buffer(
       int index,
       size_t num_planes,
-      enum v4l2_buf_type type);
+      enum v4l2_buf_type type) = 0;
+
+  // Open the media controller device of the open video device, which requests
+  // of the Media Request API are allocated from. Return true on success.
+  virtual bool OpenMediaDevice() = 0;
+  // Allocate a request on the media device. Return an invalid fd on failure.
+  virtual base::ScopedFD AllocateRequest() = 0;
+  // Queue |request_fd| for processing, once its buffers and controls are set.
+  // Return true on success.
+  virtual bool QueueRequest(int request_fd) = 0;
+  // Make the completed |request_fd| ready for reuse. Return true on success.
+  virtual bool ReinitRequest(int request_fd) = 0;
 
   // NOTE: The below methods to query capabilities have a side effect of
   // closing the previously-open device, if any, and should not be called after
@@ -103,59 +140,22 @@ class V4L2Device : public base::RefCountedThreadSafe<V4L2Device> {
 
   // Get minimum and maximum resolution for fourcc |pixelformat| and store to
   // |min_resolution| and |max_resolution|.
-  void GetSupportedResolution(uint32_t pixelformat,
-                              Size* min_resolution,
-                              Size* max_resolution);
+  virtual void GetSupportedResolution(uint32_t pixelformat,
+                                      Size* min_resolution,
+                                      Size* max_resolution) = 0;
 
   // Return supported profiles for decoder, including only profiles for given
   // fourcc |pixelformats|.
-  VideoDecodeAccelerator::SupportedProfiles GetSupportedDecodeProfiles(
+  virtual VideoDecodeAccelerator::SupportedProfiles GetSupportedDecodeProfiles(
       const size_t num_formats,
-      const uint32_t pixelformats[]);
+      const uint32_t pixelformats[]) = 0;
 
- private:
+ protected:
   friend class base::RefCountedThreadSafe<V4L2Device>;
+  V4L2Device();
+  virtual ~V4L2Device();
 
-  // Vector of video device node paths and corresponding pixelformats supported
-  // by each device node.
-  using Devices = std::vector<std::pair<std::string, std::vector<uint32_t>>>;
-
-  VideoDecodeAccelerator::SupportedProfiles EnumerateSupportedDecodeProfiles(
-      const size_t num_formats,
-      const uint32_t pixelformats[]);
-
-  std::vector<uint32_t> EnumerateSupportedPixelformats(v4l2_buf_type buf_type);
-
-  // Open device node for |path| as a device of |type|.
-  bool OpenDevicePath(const std::string& path, Type type);
-
-  // Close the currently open device.
-  void CloseDevice();
-
-  // Enumerate all V4L2 devices on the system for |type| and store the results
-  // under devices_by_type_[type].
-  void EnumerateDevicesForType(Type type);
-
-  // Return device information for all devices of |type| available in the
-  // system. Enumerates and queries devices on first run and caches the results
-  // for subsequent calls.
-  const Devices& GetDevicesForType(Type type);
-
-  // Return device node path for device of |type| supporting |pixfmt|, or
-  // an empty string if the given combination is not supported by the system.
-  std::string GetDevicePathFor(Type type, uint32_t pixfmt);
-
-  // Stores information for all devices available on the system
-  // for each device Type.
-  std::map<Type, Devices> devices_by_type_;
-
-  // The actual device fd.
-  base::ScopedFD device_fd_;
-
-  // eventfd fd to signal device poll thread when its poll() should be
-  // interrupted.
-  base::ScopedFD device_poll_interrupt_fd_;
-
+ private:
   DISALLOW_COPY_AND_ASSIGN(V4L2Device);
 };
 
@@ -0,0 +1,2438 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "v4l2_slice_video_decode_accelerator.h"
+
+#include <errno.h>
+#include <linux/videodev2.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include "base/bind.h"
+#include "base/single_thread_task_runner.h"
+#include "base/threading/thread_task_runner_handle.h"
+#include "h264_decoder.h"
+#include "h264_dpb.h"
+#include "shared_memory_region.h"
+#include "v4l2_stateless_controls.h"
+#include "vp8_decoder.h"
+#include "vp9_decoder.h"
+
+#define DVLOGF(level) DVLOG(level) << __func__ << "(): "
+#define VLOGF(level) VLOG(level) << __func__ << "(): "
+#define VPLOGF(level) VPLOG(level) << __func__ << "(): "
+
+#define NOTIFY_ERROR(x)                      \
+  do {                                       \
+    VLOGF(1) << "Setting error state:" << x; \
+    SetErrorState(x);                        \
+  } while (0)
+
+#define IOCTL_OR_ERROR_RETURN_VALUE(type, arg, value, type_str) \
+  do {                                                          \
+    if (device_->Ioctl(type, arg) != 0) {                       \
+      VPLOGF(1) << "ioctl() failed: " << type_str;              \
+      NOTIFY_ERROR(PLATFORM_FAILURE);                           \
+      return value;                                             \
+    }                                                           \
+  } while (0)
+
+#define IOCTL_OR_ERROR_RETURN(type, arg) \
+  IOCTL_OR_ERROR_RETURN_VALUE(type, arg, ((void)0), #type)
+
+#define IOCTL_OR_ERROR_RETURN_FALSE(type, arg) \
+  IOCTL_OR_ERROR_RETURN_VALUE(type, arg, false, #type)
+
+#define IOCTL_OR_LOG_ERROR(type, arg)           \
+  do {                                          \
+    if (device_->Ioctl(type, arg) != 0)         \
+      VPLOGF(1) << "ioctl() failed: " << #type; \
+  } while (0)
+
+namespace media {
+
+namespace {
+
+// Raster positions of the coefficients of 4x4 and 8x8 blocks in zigzag scan
+// order. The parser keeps the scaling lists in the zigzag order of the
+// bitstream, V4L2 expects them in raster order.
+const uint8_t kZigzagScan4x4[kH264ScalingList4x4Length] = {
+    0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15};
+
+const uint8_t kZigzagScan8x8[kH264ScalingList8x8Length] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+}  // namespace
+
+uint8_t Vp9ResetFrameContextToV4L2(uint8_t reset_frame_context) {
+  // Values 0 and 1 of the syntax element both mean no reset.
+  switch (reset_frame_context) {
+    case 2:
+      return V4L2_VP9_RESET_FRAME_CTX_SPEC;
+    case 3:
+      return V4L2_VP9_RESET_FRAME_CTX_ALL;
+    default:
+      return V4L2_VP9_RESET_FRAME_CTX_NONE;
+  }
+}
+
+// An H264Picture decoded into a V4L2DecodeSurface.
+class V4L2H264Picture : public H264Picture {
+ public:
+  explicit V4L2H264Picture(
+      const scoped_refptr<
+          V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>& dec_surface)
+      : dec_surface_(dec_surface) {}
+
+  V4L2H264Picture* AsV4L2H264Picture() override { return this; }
+  const scoped_refptr<V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>&
+  dec_surface() const {
+    return dec_surface_;
+  }
+
+ private:
+  ~V4L2H264Picture() override {}
+
+  scoped_refptr<V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>
+      dec_surface_;
+
+  DISALLOW_COPY_AND_ASSIGN(V4L2H264Picture);
+};
+
+// A VP8Picture decoded into a V4L2DecodeSurface.
+class V4L2VP8Picture : public VP8Picture {
+ public:
+  explicit V4L2VP8Picture(
+      const scoped_refptr<
+          V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>& dec_surface)
+      : dec_surface_(dec_surface) {}
+
+  V4L2VP8Picture* AsV4L2VP8Picture() override { return this; }
+  const scoped_refptr<V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>&
+  dec_surface() const {
+    return dec_surface_;
+  }
+
+ private:
+  ~V4L2VP8Picture() override {}
+
+  scoped_refptr<V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>
+      dec_surface_;
+
+  DISALLOW_COPY_AND_ASSIGN(V4L2VP8Picture);
+};
+
+// A VP9Picture decoded into a V4L2DecodeSurface.
+class V4L2VP9Picture : public VP9Picture {
+ public:
+  explicit V4L2VP9Picture(
+      const scoped_refptr<
+          V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>& dec_surface)
+      : dec_surface_(dec_surface) {}
+
+  V4L2VP9Picture* AsV4L2VP9Picture() override { return this; }
+  const scoped_refptr<V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>&
+  dec_surface() const {
+    return dec_surface_;
+  }
+
+ private:
+  ~V4L2VP9Picture() override {}
+
+  scoped_refptr<V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>
+      dec_surface_;
+
+  DISALLOW_COPY_AND_ASSIGN(V4L2VP9Picture);
+};
+
+// Translates the calls of H264Decoder into the stateless H.264 controls, for
+// frame-based decoding of Annex-B streams: all the slices of a frame are
+// copied into one input buffer, each with a start code, and the frame is
+// decoded at once.
+class V4L2SliceVideoDecodeAccelerator::V4L2H264Accelerator
+    : public H264Decoder::H264Accelerator {
+ public:
+  explicit V4L2H264Accelerator(V4L2SliceVideoDecodeAccelerator* v4l2_dec);
+  ~V4L2H264Accelerator() override;
+
+  // H264Decoder::H264Accelerator implementation.
+  scoped_refptr<H264Picture> CreateH264Picture() override;
+  bool SubmitFrameMetadata(const H264SPS* sps,
+                           const H264PPS* pps,
+                           const H264DPB& dpb,
+                           const H264Picture::Vector& ref_pic_listp0,
+                           const H264Picture::Vector& ref_pic_listb0,
+                           const H264Picture::Vector& ref_pic_listb1,
+                           const scoped_refptr<H264Picture>& pic) override;
+  bool SubmitSlice(const H264PPS* pps,
+                   const H264SliceHeader* slice_hdr,
+                   const H264Picture::Vector& ref_pic_list0,
+                   const H264Picture::Vector& ref_pic_list1,
+                   const scoped_refptr<H264Picture>& pic,
+                   const uint8_t* data,
+                   size_t size) override;
+  bool SubmitDecode(const scoped_refptr<H264Picture>& pic) override;
+  bool OutputPicture(const scoped_refptr<H264Picture>& pic) override;
+  void Reset() override;
+
+ private:
+  scoped_refptr<V4L2DecodeSurface> H264PictureToV4L2DecodeSurface(
+      const scoped_refptr<H264Picture>& pic);
+
+  V4L2SliceVideoDecodeAccelerator* const v4l2_dec_;
+
+  // Controls of the current frame, set by SubmitFrameMetadata() and
+  // completed by the first SubmitSlice().
+  struct v4l2_ctrl_h264_sps sps_;
+  struct v4l2_ctrl_h264_pps pps_;
+  struct v4l2_ctrl_h264_scaling_matrix scaling_matrix_;
+  struct v4l2_ctrl_h264_decode_params decode_params_;
+  // Number of slices of the current frame submitted so far.
+  size_t num_slices_;
+  // The surfaces the DPB entries of the current frame point to.
+  std::vector<scoped_refptr<V4L2DecodeSurface>> ref_surfaces_;
+
+  DISALLOW_COPY_AND_ASSIGN(V4L2H264Accelerator);
+};
+
+// Translates the calls of VP8Decoder into the stateless VP8 frame control.
+class V4L2SliceVideoDecodeAccelerator::V4L2VP8Accelerator
+    : public VP8Decoder::VP8Accelerator {
+ public:
+  explicit V4L2VP8Accelerator(V4L2SliceVideoDecodeAccelerator* v4l2_dec);
+  ~V4L2VP8Accelerator() override;
+
+  // VP8Decoder::VP8Accelerator implementation.
+  scoped_refptr<VP8Picture> CreateVP8Picture() override;
+  bool SubmitDecode(const scoped_refptr<VP8Picture>& pic,
+                    const Vp8FrameHeader* frame_hdr,
+                    const scoped_refptr<VP8Picture>& last_frame,
+                    const scoped_refptr<VP8Picture>& golden_frame,
+                    const scoped_refptr<VP8Picture>& alt_frame) override;
+  bool OutputPicture(const scoped_refptr<VP8Picture>& pic) override;
+
+ private:
+  scoped_refptr<V4L2DecodeSurface> VP8PictureToV4L2DecodeSurface(
+      const scoped_refptr<VP8Picture>& pic);
+
+  V4L2SliceVideoDecodeAccelerator* const v4l2_dec_;
+
+  DISALLOW_COPY_AND_ASSIGN(V4L2VP8Accelerator);
+};
+
+// Translates the calls of VP9Decoder into the stateless VP9 controls. The
+// device keeps the probability contexts and adapts them itself, it only needs
+// the probability updates of the compressed header. The parser still tracks
+// the contexts to parse the updates, so the forward-updated context of each
+// frame is fed back to it once the frame is submitted, in place of the adapted
+// one it would otherwise wait for.
+class V4L2SliceVideoDecodeAccelerator::V4L2VP9Accelerator
+    : public VP9Decoder::VP9Accelerator {
+ public:
+  explicit V4L2VP9Accelerator(V4L2SliceVideoDecodeAccelerator* v4l2_dec);
+  ~V4L2VP9Accelerator() override;
+
+  // VP9Decoder::VP9Accelerator implementation.
+  scoped_refptr<VP9Picture> CreateVP9Picture() override;
+  bool SubmitDecode(const scoped_refptr<VP9Picture>& pic,
+                    const Vp9SegmentationParams& segm_params,
+                    const Vp9LoopFilterParams& lf_params,
+                    const std::vector<scoped_refptr<VP9Picture>>& ref_pictures,
+                    const base::Closure& done_cb) override;
+  bool OutputPicture(const scoped_refptr<VP9Picture>& pic) override;
+  bool IsFrameContextRequired() const override;
+  bool GetFrameContext(const scoped_refptr<VP9Picture>& pic,
+                       Vp9FrameContext* frame_ctx) override;
+
+ private:
+  scoped_refptr<V4L2DecodeSurface> VP9PictureToV4L2DecodeSurface(
+      const scoped_refptr<VP9Picture>& pic);
+
+  V4L2SliceVideoDecodeAccelerator* const v4l2_dec_;
+
+  DISALLOW_COPY_AND_ASSIGN(V4L2VP9Accelerator);
+};
+
+struct V4L2SliceVideoDecodeAccelerator::BitstreamBufferRef {
+  BitstreamBufferRef(
+      base::WeakPtr<Client>& client,
+      scoped_refptr<base::SingleThreadTaskRunner>& client_task_runner,
+      std::unique_ptr<SharedMemoryRegion> shm,
+      int32_t input_id);
+  ~BitstreamBufferRef();
+  const base::WeakPtr<Client> client;
+  const scoped_refptr<base::SingleThreadTaskRunner> client_task_runner;
+  const std::unique_ptr<SharedMemoryRegion> shm;
+  const int32_t input_id;
+};
+
+V4L2SliceVideoDecodeAccelerator::BitstreamBufferRef::BitstreamBufferRef(
+    base::WeakPtr<Client>& client,
+    scoped_refptr<base::SingleThreadTaskRunner>& client_task_runner,
+    std::unique_ptr<SharedMemoryRegion> shm,
+    int32_t input_id)
+    : client(client),
+      client_task_runner(client_task_runner),
+      shm(std::move(shm)),
+      input_id(input_id) {}
+
+V4L2SliceVideoDecodeAccelerator::BitstreamBufferRef::~BitstreamBufferRef() {
+  if (input_id >= 0) {
+    client_task_runner->PostTask(
+        FROM_HERE,
+        base::Bind(&Client::NotifyEndOfBitstreamBuffer, client, input_id));
+  }
+}
+
+V4L2SliceVideoDecodeAccelerator::InputRecord::InputRecord()
+    : at_device(false), address(nullptr), length(0), bytes_used(0) {}
+
+V4L2SliceVideoDecodeAccelerator::InputRecord::~InputRecord() {}
+
+V4L2SliceVideoDecodeAccelerator::OutputRecord::OutputRecord()
+    : at_device(false),
+      num_times_sent_to_client(0),
+      held_by_surface(false),
+      picture_id(-1) {}
+
+V4L2SliceVideoDecodeAccelerator::OutputRecord::~OutputRecord() {}
+
+V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface::V4L2DecodeSurface(
+    int32_t bitstream_id,
+    int input_record,
+    int output_record,
+    const ReleaseCB& release_cb)
+    : bitstream_id_(bitstream_id),
+      input_record_(input_record),
+      output_record_(output_record),
+      input_queued_(false),
+      decoded_(false),
+      release_cb_(release_cb) {}
+
+V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface::~V4L2DecodeSurface() {
+  DVLOGF(5) << "Releasing output record " << output_record_;
+  release_cb_.Run(input_queued_ ? -1 : input_record_, output_record_);
+}
+
+void V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface::SetReferenceSurfaces(
+    const std::vector<scoped_refptr<V4L2DecodeSurface>>& ref_surfaces) {
+  DCHECK(reference_surfaces_.empty());
+  reference_surfaces_ = ref_surfaces;
+}
+
+void V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface::SetDecoded() {
+  DCHECK(!decoded_);
+  decoded_ = true;
+
+  // We can now drop references to all reference surfaces for this surface
+  // as we are done with decoding.
+  reference_surfaces_.clear();
+}
+
+struct timeval
+V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface::timestamp() const {
+  // Frames of the same bitstream buffer decode into different output buffers.
+  struct timeval timestamp;
+  timestamp.tv_sec = bitstream_id_;
+  timestamp.tv_usec = output_record_;
+  return timestamp;
+}
+
+uint64_t V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface::timestamp_ns()
+    const {
+  const struct timeval tv = timestamp();
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000000 +
+         static_cast<uint64_t>(tv.tv_usec) * 1000;
+}
+
+V4L2SliceVideoDecodeAccelerator::V4L2SliceVideoDecodeAccelerator(
+    const scoped_refptr<V4L2Device>& device)
+    : child_task_runner_(base::ThreadTaskRunnerHandle::Get()),
+      device_(device),
+      decoder_thread_("V4L2SliceDecoderThread"),
+      device_poll_thread_("V4L2SliceDevicePollThread"),
+      state_(kUninitialized),
+      low_latency_(false),
+      video_profile_(VIDEO_CODEC_PROFILE_UNKNOWN),
+      input_format_fourcc_(0),
+      output_format_fourcc_(0),
+      decoder_mapping_cache_(kInputMappingCacheSize),
+      decoder_decode_buffer_task_scheduled_(false),
+      surface_set_change_pending_(false),
+      decoder_flushing_(false),
+      reset_pending_(false),
+      input_streamon_(false),
+      input_buffer_queued_count_(0),
+      output_streamon_(false),
+      output_buffer_queued_count_(0),
+      output_planes_count_(0),
+      weak_this_factory_(this) {
+  weak_this_ = weak_this_factory_.GetWeakPtr();
+}
+
+V4L2SliceVideoDecodeAccelerator::~V4L2SliceVideoDecodeAccelerator() {
+  DCHECK(!decoder_thread_.IsRunning());
+  DCHECK(!device_poll_thread_.IsRunning());
+  DVLOGF(2);
+
+  DCHECK(input_buffer_map_.empty());
+  DCHECK(output_buffer_map_.empty());
+}
+
+bool V4L2SliceVideoDecodeAccelerator::Initialize(const Config& config,
+                                                 Client* client) {
+  VLOGF(2) << "profile: " << config.profile;
+  DCHECK(child_task_runner_->BelongsToCurrentThread());
+  DCHECK_EQ(state_, kUninitialized);
+
+  if (config.output_mode != Config::OutputMode::IMPORT) {
+    NOTREACHED() << "Only IMPORT OutputModes are supported";
+    return false;
+  }
+
+  if (!(config.profile >= H264PROFILE_MIN &&
+        config.profile <= H264PROFILE_MAX) &&
+      !(config.profile >= VP8PROFILE_MIN && config.profile <= VP8PROFILE_MAX) &&
+      !(config.profile >= VP9PROFILE_MIN && config.profile <= VP9PROFILE_MAX)) {
+    VLOGF(1) << "Unsupported profile: " << config.profile;
+    return false;
+  }
+
+  client_ptr_factory_.reset(new base::WeakPtrFactory<Client>(client));
+  client_ = client_ptr_factory_->GetWeakPtr();
+  // If we haven't been set up to decode on separate thread via
+  // TryToSetupDecodeOnSeparateThread(), use the main thread/client for
+  // decode tasks.
+  if (!decode_task_runner_) {
+    decode_task_runner_ = child_task_runner_;
+    DCHECK(!decode_client_);
+    decode_client_ = client_;
+  }
+
+  video_profile_ = config.profile;
+  input_format_fourcc_ =
+      V4L2Device::VideoCodecProfileToV4L2PixFmt(video_profile_, true);
+
+  if (!device_->Open(V4L2Device::Type::kDecoder, input_format_fourcc_)) {
+    VLOGF(1) << "Failed to open device for profile: " << config.profile
+             << " fourcc: " << std::hex << "0x" << input_format_fourcc_;
+    return false;
+  }
+
+  // Capabilities check.
+  struct v4l2_capability caps;
+  const __u32 kCapsRequired = V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING;
+  IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_QUERYCAP, &caps);
+  if ((caps.capabilities & kCapsRequired) != kCapsRequired) {
+    VLOGF(1) << "ioctl() failed: VIDIOC_QUERYCAP"
+             << ", caps check failed: 0x" << std::hex << caps.capabilities;
+    return false;
+  }
+
+  // Requests are allocated from the media device of the decoder.
+  if (!device_->OpenMediaDevice()) {
+    VLOGF(1) << "Failed to open the media device of the decoder";
+    return false;
+  }
+
+  if (!SetupDecodeControls())
+    return false;
+
+  // The coded size is not known until the first SPS, start with the smallest
+  // input buffers.
+  if (!SetupFormats(Size()))
+    return false;
+
+  if (video_profile_ >= H264PROFILE_MIN && video_profile_ <= H264PROFILE_MAX) {
+    h264_accelerator_.reset(new V4L2H264Accelerator(this));
+    decoder_.reset(new H264Decoder(h264_accelerator_.get()));
+  } else if (video_profile_ >= VP8PROFILE_MIN &&
+             video_profile_ <= VP8PROFILE_MAX) {
+    vp8_accelerator_.reset(new V4L2VP8Accelerator(this));
+    decoder_.reset(new VP8Decoder(vp8_accelerator_.get()));
+  } else {
+    vp9_accelerator_.reset(new V4L2VP9Accelerator(this));
+    decoder_.reset(new VP9Decoder(vp9_accelerator_.get()));
+  }
+
+  if (!decoder_thread_.Start()) {
+    VLOGF(1) << "decoder thread failed to start";
+    return false;
+  }
+
+  state_ = kDecoding;
+  low_latency_ = config.low_latency;
+  latency_tracker_ = config.latency_tracker;
+
+  // InitializeTask will NOTIFY_ERROR on failure.
+  decoder_thread_.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&V4L2SliceVideoDecodeAccelerator::InitializeTask,
+                            base::Unretained(this)));
+
+  return true;
+}
+
+void V4L2SliceVideoDecodeAccelerator::InitializeTask() {
+  VLOGF(2);
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK_EQ(state_, kDecoding);
+
+  if (!CreateInputBuffers()) {
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    return;
+  }
+
+  StartDevicePoll();
+}
+
+void V4L2SliceVideoDecodeAccelerator::Decode(
+    const BitstreamBuffer& bitstream_buffer) {
+  DVLOGF(4) << "input_id=" << bitstream_buffer.id()
+            << ", size=" << bitstream_buffer.size();
+  DCHECK(decode_task_runner_->BelongsToCurrentThread());
+
+  if (bitstream_buffer.id() < 0) {
+    VLOGF(1) << "Invalid bitstream_buffer, id: " << bitstream_buffer.id();
+    if (base::SharedMemory::IsHandleValid(bitstream_buffer.handle()))
+      base::SharedMemory::CloseHandle(bitstream_buffer.handle());
+    NOTIFY_ERROR(INVALID_ARGUMENT);
+    return;
+  }
+  RecordLatency(bitstream_buffer.id(), FrameLatencyTracker::Stage::kDecode);
+
+  decoder_thread_.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&V4L2SliceVideoDecodeAccelerator::DecodeTask,
+                            base::Unretained(this), bitstream_buffer));
+}
+
+void V4L2SliceVideoDecodeAccelerator::AssignPictureBuffers(
+    const std::vector<PictureBuffer>& buffers) {
+  VLOGF(2) << "buffer_count=" << buffers.size();
+  DCHECK(child_task_runner_->BelongsToCurrentThread());
+
+  decoder_thread_.task_runner()->PostTask(
+      FROM_HERE,
+      base::Bind(&V4L2SliceVideoDecodeAccelerator::AssignPictureBuffersTask,
+                 base::Unretained(this), buffers));
+}
+
+void V4L2SliceVideoDecodeAccelerator::ImportBufferForPicture(
+    int32_t picture_buffer_id,
+    VideoPixelFormat pixel_format,
+    const NativePixmapHandle& native_pixmap_handle) {
+  DVLOGF(3) << "picture_buffer_id=" << picture_buffer_id;
+  DCHECK(child_task_runner_->BelongsToCurrentThread());
+
+  if (pixel_format !=
+      V4L2Device::V4L2PixFmtToVideoPixelFormat(output_format_fourcc_)) {
+    VLOGF(1) << "Unsupported import format: " << pixel_format;
+    NOTIFY_ERROR(INVALID_ARGUMENT);
+    return;
+  }
+
+  std::vector<base::ScopedFD> dmabuf_fds;
+  for (const auto& fd : native_pixmap_handle.fds) {
+    DCHECK_NE(fd.fd, -1);
+    dmabuf_fds.push_back(base::ScopedFD(fd.fd));
+  }
+
+  decoder_thread_.task_runner()->PostTask(
+      FROM_HERE,
+      base::Bind(&V4L2SliceVideoDecodeAccelerator::ImportBufferForPictureTask,
+                 base::Unretained(this), picture_buffer_id,
+                 base::Passed(&dmabuf_fds)));
+}
+
+void V4L2SliceVideoDecodeAccelerator::ReusePictureBuffer(
+    int32_t picture_buffer_id) {
+  DVLOGF(4) << "picture_buffer_id=" << picture_buffer_id;
+  DCHECK(child_task_runner_->BelongsToCurrentThread());
+
+  decoder_thread_.task_runner()->PostTask(
+      FROM_HERE,
+      base::Bind(&V4L2SliceVideoDecodeAccelerator::ReusePictureBufferTask,
+                 base::Unretained(this), picture_buffer_id));
+}
+
+void V4L2SliceVideoDecodeAccelerator::Flush() {
+  VLOGF(2);
+  DCHECK(child_task_runner_->BelongsToCurrentThread());
+  decoder_thread_.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&V4L2SliceVideoDecodeAccelerator::FlushTask,
+                            base::Unretained(this)));
+}
+
+void V4L2SliceVideoDecodeAccelerator::Reset() {
+  VLOGF(2);
+  DCHECK(child_task_runner_->BelongsToCurrentThread());
+  decoder_thread_.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&V4L2SliceVideoDecodeAccelerator::ResetTask,
+                            base::Unretained(this)));
+}
+
+void V4L2SliceVideoDecodeAccelerator::Destroy() {
+  VLOGF(2);
+  DCHECK(child_task_runner_->BelongsToCurrentThread());
+
+  // We're destroying; cancel all callbacks.
+  client_ptr_factory_.reset();
+  weak_this_factory_.InvalidateWeakPtrs();
+
+  // If the decoder thread is running, destroy using posted task.
+  if (decoder_thread_.IsRunning()) {
+    decoder_thread_.task_runner()->PostTask(
+        FROM_HERE, base::Bind(&V4L2SliceVideoDecodeAccelerator::DestroyTask,
+                              base::Unretained(this)));
+    // DestroyTask() will cause the decoder_thread_ to flush all tasks.
+    decoder_thread_.Stop();
+  } else {
+    // Otherwise, call the destroy task directly.
+    DestroyTask();
+  }
+
+  delete this;
+  VLOGF(2) << "Destroyed.";
+}
+
+size_t V4L2SliceVideoDecodeAccelerator::GetNumPictureBuffersForDpbSize(
+    size_t dpb_size) const {
+  return dpb_size + kPicsInPipeline;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::TryToSetupDecodeOnSeparateThread(
+    const base::WeakPtr<Client>& decode_client,
+    const scoped_refptr<base::SingleThreadTaskRunner>& decode_task_runner) {
+  VLOGF(2);
+  decode_client_ = decode_client;
+  decode_task_runner_ = decode_task_runner;
+  return true;
+}
+
+// static
+VideoDecodeAccelerator::SupportedProfiles
+V4L2SliceVideoDecodeAccelerator::GetSupportedProfiles() {
+  scoped_refptr<V4L2Device> device = V4L2Device::Create();
+  if (!device)
+    return SupportedProfiles();
+
+  const uint32_t kSupportedInputFourccs[] = {
+      V4L2_PIX_FMT_H264_SLICE, V4L2_PIX_FMT_VP8_FRAME, V4L2_PIX_FMT_VP9_FRAME,
+  };
+  return device->GetSupportedDecodeProfiles(arraysize(kSupportedInputFourccs),
+                                            kSupportedInputFourccs);
+}
+
+scoped_refptr<V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>
+V4L2SliceVideoDecodeAccelerator::CreateSurface() {
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK(decoder_current_bitstream_buffer_.get());
+
+  if (free_input_buffers_.empty() || free_output_buffers_.empty()) {
+    DVLOGF(4) << "No free buffers, free inputs: " << free_input_buffers_.size()
+              << ", free outputs: " << free_output_buffers_.size();
+    return nullptr;
+  }
+
+  const int input = free_input_buffers_.front();
+  free_input_buffers_.pop_front();
+  DCHECK_EQ(input_buffer_map_[input].bytes_used, 0u);
+  const int output = free_output_buffers_.front();
+  free_output_buffers_.pop_front();
+  OutputRecord& output_record = output_buffer_map_[output];
+  DCHECK(!output_record.held_by_surface);
+  output_record.held_by_surface = true;
+
+  // The decoder thread outlives all surfaces, DestroyTask() drops them.
+  return new V4L2DecodeSurface(
+      decoder_current_bitstream_buffer_->input_id, input, output,
+      base::Bind(&V4L2SliceVideoDecodeAccelerator::ReleaseSurface,
+                 base::Unretained(this)));
+}
+
+bool V4L2SliceVideoDecodeAccelerator::AppendToInputBuffer(
+    const scoped_refptr<V4L2DecodeSurface>& surface,
+    const void* data,
+    size_t size) {
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  InputRecord& input_record = input_buffer_map_[surface->input_record()];
+  DCHECK(!input_record.at_device);
+
+  if (input_record.bytes_used + size > input_record.length) {
+    VLOGF(1) << "Input buffer too small for the frame: "
+             << input_record.bytes_used + size << " > "
+             << input_record.length;
+    return false;
+  }
+
+  memcpy(static_cast<uint8_t*>(input_record.address) + input_record.bytes_used,
+         data, size);
+  input_record.bytes_used += size;
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::SetExtCtrls(
+    const scoped_refptr<V4L2DecodeSurface>& surface,
+    struct v4l2_ext_control* ext_ctrls,
+    size_t num_ctrls) {
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  struct v4l2_ext_controls ctrls;
+  memset(&ctrls, 0, sizeof(ctrls));
+  ctrls.count = num_ctrls;
+  ctrls.controls = ext_ctrls;
+  SetV4L2ExtControlsRequestFd(
+      &ctrls, input_buffer_map_[surface->input_record()].request_fd.get());
+  if (device_->Ioctl(VIDIOC_S_EXT_CTRLS, &ctrls) != 0) {
+    VPLOGF(1) << "ioctl() failed: VIDIOC_S_EXT_CTRLS";
+    return false;
+  }
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::DecodeSurface(
+    const scoped_refptr<V4L2DecodeSurface>& surface) {
+  DVLOGF(4) << "bitstream_id=" << surface->bitstream_id()
+            << ", input=" << surface->input_record()
+            << ", output=" << surface->output_record();
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  const bool was_idle =
+      input_buffer_queued_count_ + output_buffer_queued_count_ == 0;
+
+  // The output buffer must be queued before the request that decodes into it.
+  if (!EnqueueOutputRecord(surface) || !EnqueueInputRecord(surface))
+    return false;
+  if (!device_->QueueRequest(
+          input_buffer_map_[surface->input_record()].request_fd.get())) {
+    VPLOGF(1) << "Failed to queue the request";
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    return false;
+  }
+  surfaces_at_device_.push_back(surface);
+
+  if (!StartStreams())
+    return false;
+  if (was_idle)
+    SchedulePollIfNeeded();
+  return true;
+}
+
+void V4L2SliceVideoDecodeAccelerator::SurfaceReady(
+    const scoped_refptr<V4L2DecodeSurface>& surface,
+    int32_t bitstream_id) {
+  DVLOGF(4) << "output=" << surface->output_record()
+            << ", bitstream_id=" << bitstream_id;
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  decoder_display_queue_.push(std::make_pair(bitstream_id, surface));
+  TryOutputSurfaces();
+}
+
+void V4L2SliceVideoDecodeAccelerator::DecodeTask(
+    const BitstreamBuffer& bitstream_buffer) {
+  DVLOGF(4) << "input_id=" << bitstream_buffer.id();
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  std::unique_ptr<BitstreamBufferRef> bitstream_record(new BitstreamBufferRef(
+      decode_client_, decode_task_runner_,
+      std::unique_ptr<SharedMemoryRegion>(
+          new SharedMemoryRegion(bitstream_buffer, true)),
+      bitstream_buffer.id()));
+
+  // Skip empty buffer.
+  if (bitstream_buffer.size() == 0)
+    return;
+
+  if (state_ == kError) {
+    VLOGF(2) << "early out: kError state";
+    return;
+  }
+
+  if (!bitstream_record->shm->Map(&decoder_mapping_cache_)) {
+    VLOGF(1) << "could not map bitstream_buffer";
+    NOTIFY_ERROR(UNREADABLE_INPUT);
+    return;
+  }
+  DVLOGF(4) << "mapped at=" << bitstream_record->shm->memory();
+
+  decoder_input_queue_.push(
+      linked_ptr<BitstreamBufferRef>(bitstream_record.release()));
+  ScheduleDecodeBufferTaskIfNeeded();
+}
+
+void V4L2SliceVideoDecodeAccelerator::DecodeBufferTask() {
+  DVLOGF(4);
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  decoder_decode_buffer_task_scheduled_ = false;
+
+  // Nothing is decoded while the output buffers are being replaced, or until
+  // a flush completes.
+  if (state_ != kDecoding || surface_set_change_pending_ ||
+      decoder_flushing_) {
+    DVLOGF(3) << "early out: state=" << state_;
+    return;
+  }
+
+  while (true) {
+    if (!decoder_current_bitstream_buffer_.get()) {
+      if (decoder_input_queue_.empty())
+        return;
+
+      if (decoder_input_queue_.front()->input_id == kFlushBufferId) {
+        decoder_input_queue_.pop();
+        VLOGF(2) << "Reached the flush buffer";
+        // Output all the pictures, NotifyFlushDoneIfNeeded() then waits for
+        // them to be decoded.
+        if (!decoder_->Flush()) {
+          VLOGF(1) << "Failed flushing the decoder";
+          NOTIFY_ERROR(PLATFORM_FAILURE);
+          return;
+        }
+        decoder_flushing_ = true;
+        NotifyFlushDoneIfNeeded();
+        return;
+      }
+
+      decoder_current_bitstream_buffer_ = decoder_input_queue_.front();
+      decoder_input_queue_.pop();
+      const auto& shm = decoder_current_bitstream_buffer_->shm;
+      decoder_->SetStream(static_cast<const uint8_t*>(shm->memory()),
+                          shm->size());
+    }
+
+    switch (decoder_->Decode()) {
+      case AcceleratedVideoDecoder::kAllocateNewSurfaces:
+        VLOGF(2) << "Decoder requesting a new set of surfaces";
+        InitiateSurfaceSetChange();
+        return;
+
+      case AcceleratedVideoDecoder::kRanOutOfStreamData:
+        // The slices have been copied to the input buffers already.
+        decoder_current_bitstream_buffer_.reset();
+        break;
+
+      case AcceleratedVideoDecoder::kRanOutOfSurfaces:
+        // ReleaseSurface() and DequeueInputBuffer() will resume us.
+        DVLOGF(4) << "Ran out of surfaces";
+        return;
+
+      case AcceleratedVideoDecoder::kNeedContextUpdate:
+      case AcceleratedVideoDecoder::kDecodeError:
+        VLOGF(1) << "Error decoding stream";
+        NOTIFY_ERROR(PLATFORM_FAILURE);
+        return;
+    }
+  }
+}
+
+void V4L2SliceVideoDecodeAccelerator::ScheduleDecodeBufferTaskIfNeeded() {
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  if (decoder_decode_buffer_task_scheduled_)
+    return;
+
+  decoder_decode_buffer_task_scheduled_ = true;
+  decoder_thread_.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&V4L2SliceVideoDecodeAccelerator::DecodeBufferTask,
+                            base::Unretained(this)));
+}
+
+void V4L2SliceVideoDecodeAccelerator::InitiateSurfaceSetChange() {
+  VLOGF(2);
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK_EQ(state_, kDecoding);
+  DCHECK(!surface_set_change_pending_);
+
+  surface_set_change_pending_ = true;
+  FinishSurfaceSetChange();
+}
+
+bool V4L2SliceVideoDecodeAccelerator::FinishSurfaceSetChange() {
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  if (!surface_set_change_pending_ || state_ != kDecoding)
+    return false;
+
+  // The decoder flushed all the pictures of the previous stream before asking
+  // for new surfaces; wait for the device to decode them and for them to be
+  // sent to the client.
+  if (!surfaces_at_device_.empty() || !decoder_display_queue_.empty()) {
+    DVLOGF(3) << "Waiting for " << surfaces_at_device_.size()
+              << " surfaces to be decoded";
+    return false;
+  }
+
+  VLOGF(2) << "New coded size: " << decoder_->GetPicSize().ToString();
+  if (!(StopDevicePoll() && StopStreams()))
+    return false;
+
+  // The formats cannot change while buffers are allocated.
+  DestroyInputBuffers();
+  if (!DestroyOutputBuffers())
+    return false;
+  // The client may also reallocate its bitstream buffers for the new size.
+  // Mappings of the buffers still queued stay alive until they are returned.
+  decoder_mapping_cache_.Clear();
+
+  if (!SetupFormats(decoder_->GetPicSize()) || !CreateInputBuffers()) {
+    VLOGF(1) << "Failed reallocating the buffers";
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    return false;
+  }
+
+  if (!StartDevicePoll())
+    return false;
+
+  // Go into kAwaitingPictureBuffers to prevent us from doing any more decoding
+  // until AssignPictureBuffers().
+  state_ = kAwaitingPictureBuffers;
+  child_task_runner_->PostTask(
+      FROM_HERE,
+      base::Bind(&Client::ProvidePictureBuffers, client_,
+                 decoder_->GetRequiredNumOfPictures(),
+                 V4L2Device::V4L2PixFmtToVideoPixelFormat(
+                     output_format_fourcc_),
+                 coded_size_));
+  return true;
+}
+
+void V4L2SliceVideoDecodeAccelerator::AssignPictureBuffersTask(
+    const std::vector<PictureBuffer>& buffers) {
+  VLOGF(2);
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  if (state_ == kError) {
+    VLOGF(2) << "early out: kError state";
+    return;
+  }
+  DCHECK_EQ(state_, kAwaitingPictureBuffers);
+
+  const size_t req_buffer_count = decoder_->GetRequiredNumOfPictures();
+  if (buffers.size() < req_buffer_count) {
+    VLOGF(1) << "Failed to provide requested picture buffers. (Got "
+             << buffers.size() << ", requested " << req_buffer_count << ")";
+    NOTIFY_ERROR(INVALID_ARGUMENT);
+    return;
+  }
+
+  // The client imports its own buffers, so the device only needs the buffer
+  // slots and decodes straight into the imported dmabufs.
+  struct v4l2_requestbuffers reqbufs;
+  memset(&reqbufs, 0, sizeof(reqbufs));
+  reqbufs.count = buffers.size();
+  reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  reqbufs.memory = V4L2_MEMORY_DMABUF;
+  IOCTL_OR_ERROR_RETURN(VIDIOC_REQBUFS, &reqbufs);
+
+  if (reqbufs.count != buffers.size()) {
+    VLOGF(1) << "Could not allocate enough output buffers";
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    return;
+  }
+
+  DCHECK(free_output_buffers_.empty());
+  DCHECK(output_buffer_map_.empty());
+  output_buffer_map_.resize(buffers.size());
+  for (size_t i = 0; i < output_buffer_map_.size(); ++i) {
+    OutputRecord& output_record = output_buffer_map_[i];
+    output_record.picture_id = buffers[i].id();
+    // This will remain at the client until ImportBufferForPicture is called.
+    output_record.num_times_sent_to_client = 1;
+    DVLOGF(3) << "buffer[" << i << "]: picture_id=" << output_record.picture_id;
+  }
+
+  state_ = kDecoding;
+  surface_set_change_pending_ = false;
+
+  if (reset_pending_) {
+    FinishReset();
+    return;
+  }
+  ScheduleDecodeBufferTaskIfNeeded();
+}
+
+void V4L2SliceVideoDecodeAccelerator::ImportBufferForPictureTask(
+    int32_t picture_buffer_id,
+    std::vector<base::ScopedFD> dmabuf_fds) {
+  DVLOGF(3) << "picture_buffer_id=" << picture_buffer_id
+            << ", dmabuf_fds.size()=" << dmabuf_fds.size();
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  const auto iter =
+      std::find_if(output_buffer_map_.begin(), output_buffer_map_.end(),
+                   [picture_buffer_id](const OutputRecord& output_record) {
+                     return output_record.picture_id == picture_buffer_id;
+                   });
+  if (iter == output_buffer_map_.end()) {
+    // It's possible that we've already posted a DismissPictureBuffer for this
+    // picture, but it has not yet executed when this ImportBufferForPicture was
+    // posted to us by the client. In that case just ignore this (we've already
+    // dismissed it and accounted for that).
+    DVLOGF(3) << "got picture id=" << picture_buffer_id
+              << " not in use (anymore?).";
+    return;
+  }
+
+  if (iter->num_times_sent_to_client == 0) {
+    VLOGF(1) << "Cannot import buffer not owned by client";
+    NOTIFY_ERROR(INVALID_ARGUMENT);
+    return;
+  }
+
+  DCHECK_EQ(output_planes_count_, dmabuf_fds.size());
+  iter->dmabuf_fds.swap(dmabuf_fds);
+  iter->num_times_sent_to_client--;
+  MaybeFreeOutputRecord(iter - output_buffer_map_.begin());
+  ScheduleDecodeBufferTaskIfNeeded();
+}
+
+void V4L2SliceVideoDecodeAccelerator::ReusePictureBufferTask(
+    int32_t picture_buffer_id) {
+  DVLOGF(4) << "picture_buffer_id=" << picture_buffer_id;
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  if (state_ == kError) {
+    DVLOGF(4) << "early out: kError state";
+    return;
+  }
+
+  const auto iter =
+      std::find_if(output_buffer_map_.begin(), output_buffer_map_.end(),
+                   [picture_buffer_id](const OutputRecord& output_record) {
+                     return output_record.picture_id == picture_buffer_id;
+                   });
+  if (iter == output_buffer_map_.end()) {
+    // Dismissed by a surface set change in the meantime.
+    DVLOGF(3) << "got picture id=" << picture_buffer_id
+              << " not in use (anymore?).";
+    return;
+  }
+
+  if (iter->num_times_sent_to_client == 0) {
+    VLOGF(1) << "picture_buffer_id not reusable";
+    NOTIFY_ERROR(INVALID_ARGUMENT);
+    return;
+  }
+
+  iter->num_times_sent_to_client--;
+  MaybeFreeOutputRecord(iter - output_buffer_map_.begin());
+  ScheduleDecodeBufferTaskIfNeeded();
+}
+
+void V4L2SliceVideoDecodeAccelerator::ServiceDeviceTask() {
+  DVLOGF(4);
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  if (state_ == kError) {
+    DVLOGF(3) << "early out: kError state";
+    return;
+  }
+
+  Dequeue();
+  SchedulePollIfNeeded();
+
+  DVLOGF(3) << "buffer counts: DEC[" << decoder_input_queue_.size()
+            << "] => DEVICE[" << free_input_buffers_.size() << "+"
+            << input_buffer_queued_count_ << "/" << input_buffer_map_.size()
+            << "->" << free_output_buffers_.size() << "+"
+            << output_buffer_queued_count_ << "/" << output_buffer_map_.size()
+            << "] => DISPLAY[" << decoder_display_queue_.size() << "]";
+}
+
+void V4L2SliceVideoDecodeAccelerator::Dequeue() {
+  DVLOGF(4);
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  while (input_buffer_queued_count_ > 0) {
+    if (!DequeueInputBuffer())
+      break;
+  }
+  while (output_buffer_queued_count_ > 0) {
+    if (!DequeueOutputBuffer())
+      break;
+  }
+  if (state_ == kError)
+    return;
+
+  TryOutputSurfaces();
+  NotifyFlushDoneIfNeeded();
+  FinishSurfaceSetChange();
+  ScheduleDecodeBufferTaskIfNeeded();
+}
+
+bool V4L2SliceVideoDecodeAccelerator::DequeueInputBuffer() {
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK_GT(input_buffer_queued_count_, 0);
+
+  struct v4l2_buffer dqbuf;
+  struct v4l2_plane planes[1];
+  memset(&dqbuf, 0, sizeof(dqbuf));
+  memset(planes, 0, sizeof(planes));
+  dqbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  dqbuf.memory = V4L2_MEMORY_MMAP;
+  dqbuf.m.planes = planes;
+  dqbuf.length = 1;
+  if (device_->Ioctl(VIDIOC_DQBUF, &dqbuf) != 0) {
+    if (errno == EAGAIN) {
+      // EAGAIN if we're just out of buffers to dequeue.
+      return false;
+    }
+    VPLOGF(1) << "ioctl() failed: VIDIOC_DQBUF";
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    return false;
+  }
+  InputRecord& input_record = input_buffer_map_[dqbuf.index];
+  DCHECK(input_record.at_device);
+  RecordLatency(dqbuf.timestamp.tv_sec,
+                FrameLatencyTracker::Stage::kInputDequeued);
+  input_record.at_device = false;
+  input_record.bytes_used = 0;
+  input_buffer_queued_count_--;
+  if (!ReinitInputRequest(&input_record))
+    return false;
+  free_input_buffers_.push_back(dqbuf.index);
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::DequeueOutputBuffer() {
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK_GT(output_buffer_queued_count_, 0);
+
+  struct v4l2_buffer dqbuf;
+  std::unique_ptr<struct v4l2_plane[]> planes(
+      new v4l2_plane[output_planes_count_]);
+  memset(&dqbuf, 0, sizeof(dqbuf));
+  memset(planes.get(), 0, sizeof(struct v4l2_plane) * output_planes_count_);
+  dqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  dqbuf.memory = V4L2_MEMORY_DMABUF;
+  dqbuf.m.planes = planes.get();
+  dqbuf.length = output_planes_count_;
+  if (device_->Ioctl(VIDIOC_DQBUF, &dqbuf) != 0) {
+    if (errno == EAGAIN) {
+      // EAGAIN if we're just out of buffers to dequeue.
+      return false;
+    }
+    VPLOGF(1) << "ioctl() failed: VIDIOC_DQBUF";
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    return false;
+  }
+  OutputRecord& output_record = output_buffer_map_[dqbuf.index];
+  DCHECK(output_record.at_device);
+  output_record.at_device = false;
+  output_buffer_queued_count_--;
+
+  const auto iter = std::find_if(
+      surfaces_at_device_.begin(), surfaces_at_device_.end(),
+      [&dqbuf](const scoped_refptr<V4L2DecodeSurface>& surface) {
+        return surface->output_record() == static_cast<int>(dqbuf.index);
+      });
+  DCHECK(iter != surfaces_at_device_.end());
+  const scoped_refptr<V4L2DecodeSurface> surface = *iter;
+  surfaces_at_device_.erase(iter);
+  DVLOGF(4) << "Dequeued output buffer " << dqbuf.index
+            << ", bitstream_id=" << surface->bitstream_id();
+
+  if (dqbuf.flags & V4L2_BUF_FLAG_ERROR) {
+    VLOGF(1) << "Failed decoding bitstream_id=" << surface->bitstream_id();
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    return false;
+  }
+
+  RecordLatency(surface->bitstream_id(),
+                FrameLatencyTracker::Stage::kOutputDequeued);
+  surface->SetDecoded();
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::EnqueueOutputRecord(
+    const scoped_refptr<V4L2DecodeSurface>& surface) {
+  const int index = surface->output_record();
+  OutputRecord& output_record = output_buffer_map_[index];
+  DVLOGF(4) << "buffer " << index;
+  DCHECK(!output_record.at_device);
+  DCHECK_EQ(output_record.num_times_sent_to_client, 0);
+  DCHECK(output_record.held_by_surface);
+  DCHECK_EQ(output_record.dmabuf_fds.size(), output_planes_count_);
+
+  struct v4l2_buffer qbuf;
+  std::unique_ptr<struct v4l2_plane[]> qbuf_planes(
+      new v4l2_plane[output_planes_count_]);
+  memset(&qbuf, 0, sizeof(qbuf));
+  memset(qbuf_planes.get(), 0,
+         sizeof(struct v4l2_plane) * output_planes_count_);
+  for (size_t i = 0; i < output_planes_count_; ++i)
+    qbuf_planes[i].m.fd = output_record.dmabuf_fds[i].get();
+  qbuf.index = index;
+  qbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  qbuf.memory = V4L2_MEMORY_DMABUF;
+  qbuf.m.planes = qbuf_planes.get();
+  qbuf.length = output_planes_count_;
+  IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_QBUF, &qbuf);
+  output_record.at_device = true;
+  output_buffer_queued_count_++;
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::EnqueueInputRecord(
+    const scoped_refptr<V4L2DecodeSurface>& surface) {
+  const int index = surface->input_record();
+  InputRecord& input_record = input_buffer_map_[index];
+  DVLOGF(4) << "buffer " << index << ", size=" << input_record.bytes_used;
+  DCHECK(!input_record.at_device);
+
+  struct v4l2_buffer qbuf;
+  struct v4l2_plane qbuf_plane;
+  memset(&qbuf, 0, sizeof(qbuf));
+  memset(&qbuf_plane, 0, sizeof(qbuf_plane));
+  qbuf.index = index;
+  qbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  // The device copies the timestamp to the output buffer, and the controls of
+  // later frames refer to this frame by it.
+  qbuf.timestamp = surface->timestamp();
+  qbuf.memory = V4L2_MEMORY_MMAP;
+  qbuf.m.planes = &qbuf_plane;
+  qbuf.m.planes[0].bytesused = input_record.bytes_used;
+  qbuf.length = 1;
+  SetV4L2BufferRequestFd(&qbuf, input_record.request_fd.get());
+  IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_QBUF, &qbuf);
+  RecordLatency(surface->bitstream_id(),
+                FrameLatencyTracker::Stage::kInputQueued);
+  input_record.at_device = true;
+  input_buffer_queued_count_++;
+  surface->set_input_queued();
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::StartStreams() {
+  if (!input_streamon_) {
+    __u32 type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_STREAMON, &type);
+    input_streamon_ = true;
+  }
+  if (!output_streamon_) {
+    __u32 type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_STREAMON, &type);
+    output_streamon_ = true;
+  }
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::ReinitInputRequest(
+    InputRecord* input_record) {
+  if (device_->ReinitRequest(input_record->request_fd.get()))
+    return true;
+
+  // Some drivers keep requests busy for a while after their buffers are done,
+  // don't wait for them.
+  VPLOGF(2) << "Failed to reinit the request, allocating a new one";
+  input_record->request_fd = device_->AllocateRequest();
+  if (!input_record->request_fd.is_valid()) {
+    VLOGF(1) << "Failed to allocate a request";
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    return false;
+  }
+  return true;
+}
+
+void V4L2SliceVideoDecodeAccelerator::TryOutputSurfaces() {
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  while (!decoder_display_queue_.empty()) {
+    const int32_t bitstream_id = decoder_display_queue_.front().first;
+    const scoped_refptr<V4L2DecodeSurface>& surface =
+        decoder_display_queue_.front().second;
+    if (!surface->decoded())
+      break;
+
+    // A frame shown again, e.g. by a VP9 show_existing_frame, is sent once
+    // more even if the client still has it; the client returns the buffer
+    // once per picture.
+    OutputRecord& output_record = output_buffer_map_[surface->output_record()];
+    output_record.num_times_sent_to_client++;
+
+    const Picture picture(output_record.picture_id, bitstream_id,
+                          surface->visible_rect(), false);
+    DVLOGF(4) << "picture_id=" << picture.picture_buffer_id()
+              << ", bitstream_id=" << picture.bitstream_buffer_id();
+    decode_task_runner_->PostTask(
+        FROM_HERE, base::Bind(&Client::PictureReady, decode_client_, picture));
+    RecordLatency(bitstream_id, FrameLatencyTracker::Stage::kPictureReady);
+    decoder_display_queue_.pop();
+  }
+}
+
+void V4L2SliceVideoDecodeAccelerator::ReleaseSurface(int input_record,
+                                                     int output_record) {
+  DVLOGF(4) << "input=" << input_record << ", output=" << output_record;
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  if (input_record >= 0) {
+    // The frame was dropped before being queued, e.g. by a reset.
+    input_buffer_map_[input_record].bytes_used = 0;
+    free_input_buffers_.push_back(input_record);
+  }
+
+  DCHECK_LT(static_cast<size_t>(output_record), output_buffer_map_.size());
+  OutputRecord& record = output_buffer_map_[output_record];
+  DCHECK(record.held_by_surface);
+  record.held_by_surface = false;
+  MaybeFreeOutputRecord(output_record);
+
+  if (state_ == kDecoding)
+    ScheduleDecodeBufferTaskIfNeeded();
+}
+
+void V4L2SliceVideoDecodeAccelerator::MaybeFreeOutputRecord(
+    int output_record) {
+  const OutputRecord& record = output_buffer_map_[output_record];
+  if (record.at_device || record.num_times_sent_to_client > 0 ||
+      record.held_by_surface) {
+    return;
+  }
+
+  DCHECK_EQ(std::count(free_output_buffers_.begin(),
+                       free_output_buffers_.end(), output_record),
+            0);
+  free_output_buffers_.push_back(output_record);
+}
+
+void V4L2SliceVideoDecodeAccelerator::FlushTask() {
+  VLOGF(2);
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  if (state_ == kError) {
+    VLOGF(2) << "early out: kError state";
+    return;
+  }
+
+  // Queue up an empty buffer -- this triggers the flush once all the buffers
+  // before it are decoded.
+  decoder_input_queue_.push(
+      linked_ptr<BitstreamBufferRef>(new BitstreamBufferRef(
+          decode_client_, decode_task_runner_, nullptr, kFlushBufferId)));
+  ScheduleDecodeBufferTaskIfNeeded();
+}
+
+void V4L2SliceVideoDecodeAccelerator::NotifyFlushDoneIfNeeded() {
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  if (!decoder_flushing_)
+    return;
+
+  if (!surfaces_at_device_.empty() || !decoder_display_queue_.empty()) {
+    DVLOGF(3) << "Some surfaces are not output yet";
+    return;
+  }
+
+  decoder_flushing_ = false;
+  VLOGF(2) << "returning flush";
+  child_task_runner_->PostTask(FROM_HERE,
+                               base::Bind(&Client::NotifyFlushDone, client_));
+
+  // While we were flushing, we early-outed DecodeBufferTask()s.
+  ScheduleDecodeBufferTaskIfNeeded();
+}
+
+void V4L2SliceVideoDecodeAccelerator::ResetTask() {
+  VLOGF(2);
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  if (state_ == kError) {
+    VLOGF(2) << "early out: kError state";
+    return;
+  }
+
+  decoder_current_bitstream_buffer_.reset();
+  while (!decoder_input_queue_.empty()) {
+    // A flush that was not reached yet is completed by the reset.
+    if (decoder_input_queue_.front()->input_id == kFlushBufferId)
+      decoder_flushing_ = true;
+    decoder_input_queue_.pop();
+  }
+  // The client may replace its bitstream buffers after a reset.
+  decoder_mapping_cache_.Clear();
+
+  // If we are awaiting picture buffers, postpone reset until we get them.
+  DCHECK(!reset_pending_);
+  if (state_ == kAwaitingPictureBuffers) {
+    reset_pending_ = true;
+    return;
+  }
+  FinishReset();
+}
+
+void V4L2SliceVideoDecodeAccelerator::FinishReset() {
+  VLOGF(2);
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK_EQ(state_, kDecoding);
+
+  reset_pending_ = false;
+
+  // Drop the pictures of the decoder first, so that the input buffers of the
+  // frames it did not submit are freed before the queued ones.
+  decoder_->Reset();
+  while (!decoder_display_queue_.empty())
+    decoder_display_queue_.pop();
+
+  if (!(StopDevicePoll() && StopStreams()))
+    return;
+
+  // If we were flushing, we'll never return any more BitstreamBuffers or
+  // PictureBuffers; they have all been dropped and returned by now.
+  NotifyFlushDoneIfNeeded();
+
+  if (!StartDevicePoll())
+    return;
+
+  VLOGF(2) << "Reset done";
+  child_task_runner_->PostTask(FROM_HERE,
+                               base::Bind(&Client::NotifyResetDone, client_));
+
+  // A surface set change waiting for the dropped surfaces can complete now.
+  if (!FinishSurfaceSetChange())
+    ScheduleDecodeBufferTaskIfNeeded();
+}
+
+void V4L2SliceVideoDecodeAccelerator::DestroyTask() {
+  VLOGF(2);
+
+  // DestroyTask() should run regardless of state_.
+
+  // Set our state to kError, so that dropping the surfaces below schedules no
+  // more work.
+  state_ = kError;
+
+  if (decoder_)
+    decoder_->Reset();
+  while (!decoder_display_queue_.empty())
+    decoder_display_queue_.pop();
+
+  StopDevicePoll();
+  StopStreams();
+
+  decoder_current_bitstream_buffer_.reset();
+  decoder_decode_buffer_task_scheduled_ = false;
+  while (!decoder_input_queue_.empty())
+    decoder_input_queue_.pop();
+  decoder_flushing_ = false;
+
+  DestroyInputBuffers();
+  DestroyOutputBuffers();
+
+  VLOGF(2) << "bitstream mapping cache hits: " << decoder_mapping_cache_.hits()
+           << ", misses: " << decoder_mapping_cache_.misses();
+  decoder_mapping_cache_.Clear();
+}
+
+bool V4L2SliceVideoDecodeAccelerator::StartDevicePoll() {
+  DVLOGF(3);
+  DCHECK(!device_poll_thread_.IsRunning());
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  // DevicePollTask()s are posted by SchedulePollIfNeeded() once buffers are
+  // queued.
+  if (!device_poll_thread_.Start()) {
+    VLOGF(1) << "Device thread failed to start";
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    return false;
+  }
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::StopDevicePoll() {
+  DVLOGF(3);
+
+  if (!device_poll_thread_.IsRunning())
+    return true;
+
+  if (decoder_thread_.IsRunning())
+    DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  // Signal the DevicePollTask() to stop, and stop the device poll thread.
+  if (!device_->SetDevicePollInterrupt()) {
+    VPLOGF(1) << "SetDevicePollInterrupt(): failed";
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    return false;
+  }
+  device_poll_thread_.Stop();
+  // Clear the interrupt now, to be sure.
+  if (!device_->ClearDevicePollInterrupt()) {
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    return false;
+  }
+  DVLOGF(3) << "device poll stopped";
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::StopStreams() {
+  VLOGF(2);
+
+  if (input_streamon_) {
+    __u32 type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_STREAMOFF, &type);
+    input_streamon_ = false;
+  }
+  if (output_streamon_) {
+    __u32 type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_STREAMOFF, &type);
+    output_streamon_ = false;
+  }
+
+  // After streamoff, the device drops ownership of all buffers, even if we
+  // don't dequeue them explicitly. The input buffers of the frames that were
+  // not queued yet are already free.
+  for (size_t i = 0; i < input_buffer_map_.size(); ++i) {
+    InputRecord& input_record = input_buffer_map_[i];
+    if (!input_record.at_device)
+      continue;
+    input_record.at_device = false;
+    input_record.bytes_used = 0;
+    if (!ReinitInputRequest(&input_record))
+      return false;
+    free_input_buffers_.push_back(i);
+  }
+  input_buffer_queued_count_ = 0;
+
+  for (size_t i = 0; i < output_buffer_map_.size(); ++i)
+    output_buffer_map_[i].at_device = false;
+  output_buffer_queued_count_ = 0;
+
+  // The surfaces at the device will never be decoded. Dropping them frees
+  // their output buffers, unless they are still referenced.
+  surfaces_at_device_.clear();
+  return true;
+}
+
+void V4L2SliceVideoDecodeAccelerator::SchedulePollIfNeeded() {
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+
+  if (!device_poll_thread_.IsRunning()) {
+    DVLOGF(4) << "Device poll thread stopped, will not schedule poll";
+    return;
+  }
+  if (input_buffer_queued_count_ + output_buffer_queued_count_ == 0) {
+    DVLOGF(4) << "Nothing queued, will not schedule poll";
+    return;
+  }
+
+  device_poll_thread_.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&V4L2SliceVideoDecodeAccelerator::DevicePollTask,
+                            base::Unretained(this)));
+}
+
+void V4L2SliceVideoDecodeAccelerator::DevicePollTask() {
+  DVLOGF(4);
+  DCHECK(device_poll_thread_.task_runner()->BelongsToCurrentThread());
+
+  // Stateless decoders send no events.
+  bool event_pending = false;
+  if (!device_->Poll(true, &event_pending)) {
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    return;
+  }
+
+  // All processing should happen on ServiceDeviceTask(), since we shouldn't
+  // touch decoder state from this thread.
+  decoder_thread_.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&V4L2SliceVideoDecodeAccelerator::ServiceDeviceTask,
+                            base::Unretained(this)));
+}
+
+void V4L2SliceVideoDecodeAccelerator::NotifyError(Error error) {
+  VLOGF(1);
+
+  if (!child_task_runner_->BelongsToCurrentThread()) {
+    child_task_runner_->PostTask(
+        FROM_HERE, base::Bind(&V4L2SliceVideoDecodeAccelerator::NotifyError,
+                              weak_this_, error));
+    return;
+  }
+
+  if (client_) {
+    client_->NotifyError(error);
+    client_ptr_factory_.reset();
+  }
+}
+
+void V4L2SliceVideoDecodeAccelerator::SetErrorState(Error error) {
+  // We can touch state_ only if this is the decoder thread or the decoder
+  // thread isn't running.
+  if (decoder_thread_.task_runner() &&
+      !decoder_thread_.task_runner()->BelongsToCurrentThread()) {
+    decoder_thread_.task_runner()->PostTask(
+        FROM_HERE, base::Bind(&V4L2SliceVideoDecodeAccelerator::SetErrorState,
+                              base::Unretained(this), error));
+    return;
+  }
+
+  // Post NotifyError only if we are already initialized, as the API does
+  // not allow doing so before that.
+  if (state_ != kError && state_ != kUninitialized)
+    NotifyError(error);
+
+  state_ = kError;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::SetupDecodeControls() {
+  // VP8 and VP9 frames are always decoded whole.
+  if (input_format_fourcc_ != V4L2_PIX_FMT_H264_SLICE)
+    return true;
+
+  // The accelerators submit whole frames, with the start codes of the slices.
+  struct v4l2_ext_control ctrls[2];
+  memset(ctrls, 0, sizeof(ctrls));
+  ctrls[0].id = V4L2_CID_STATELESS_H264_DECODE_MODE;
+  ctrls[0].value = V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED;
+  ctrls[1].id = V4L2_CID_STATELESS_H264_START_CODE;
+  ctrls[1].value = V4L2_STATELESS_H264_START_CODE_ANNEX_B;
+
+  struct v4l2_ext_controls ext_ctrls;
+  memset(&ext_ctrls, 0, sizeof(ext_ctrls));
+  ext_ctrls.count = arraysize(ctrls);
+  ext_ctrls.controls = ctrls;
+  if (device_->Ioctl(VIDIOC_S_EXT_CTRLS, &ext_ctrls) != 0) {
+    VPLOGF(1) << "Frame-based decoding of Annex-B streams is not supported";
+    return false;
+  }
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::SetupFormats(const Size& coded_size) {
+  DCHECK(!input_streamon_);
+  DCHECK(!output_streamon_);
+
+  const size_t input_size = GetInputBufferSize(coded_size);
+  struct v4l2_format format;
+  memset(&format, 0, sizeof(format));
+  format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  format.fmt.pix_mp.pixelformat = input_format_fourcc_;
+  format.fmt.pix_mp.width = coded_size.width();
+  format.fmt.pix_mp.height = coded_size.height();
+  format.fmt.pix_mp.plane_fmt[0].sizeimage = input_size;
+  format.fmt.pix_mp.num_planes = 1;
+  IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_S_FMT, &format);
+  VLOGF(2) << "input buffer size: " << input_size;
+
+  // The output formats available depend on the input format.
+  output_format_fourcc_ = 0;
+  struct v4l2_fmtdesc fmtdesc;
+  memset(&fmtdesc, 0, sizeof(fmtdesc));
+  fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  while (device_->Ioctl(VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
+    // Only support V4L2_PIX_FMT_NV12 output format for now.
+    if (fmtdesc.pixelformat == V4L2_PIX_FMT_NV12) {
+      output_format_fourcc_ = fmtdesc.pixelformat;
+      break;
+    }
+    ++fmtdesc.index;
+  }
+  if (output_format_fourcc_ == 0) {
+    VLOGF(1) << "NV12 output is not supported";
+    return false;
+  }
+
+  memset(&format, 0, sizeof(format));
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  format.fmt.pix_mp.pixelformat = output_format_fourcc_;
+  format.fmt.pix_mp.width = coded_size.width();
+  format.fmt.pix_mp.height = coded_size.height();
+  IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_S_FMT, &format);
+  if (format.fmt.pix_mp.pixelformat != output_format_fourcc_) {
+    VLOGF(1) << "Output format not accepted: 0x" << std::hex
+             << format.fmt.pix_mp.pixelformat;
+    return false;
+  }
+
+  // The device may align the coded size.
+  coded_size_.SetSize(format.fmt.pix_mp.width, format.fmt.pix_mp.height);
+  output_planes_count_ = format.fmt.pix_mp.num_planes;
+  VLOGF(2) << "Output format=" << output_format_fourcc_
+           << ", coded size=" << coded_size_.ToString()
+           << ", planes=" << output_planes_count_;
+  return true;
+}
+
+// static
+size_t V4L2SliceVideoDecodeAccelerator::GetInputBufferSize(
+    const Size& coded_size) {
+  // Compressed frames are assumed to take at most half a byte per pixel.
+  const size_t frame_size =
+      static_cast<size_t>(coded_size.width()) * coded_size.height() / 2;
+  return std::max<size_t>(kInputBufferMinSize, frame_size);
+}
+
+bool V4L2SliceVideoDecodeAccelerator::CreateInputBuffers() {
+  VLOGF(2);
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK(!input_streamon_);
+  DCHECK(input_buffer_map_.empty());
+
+  struct v4l2_requestbuffers reqbufs;
+  memset(&reqbufs, 0, sizeof(reqbufs));
+  reqbufs.count = kInputBufferCount;
+  reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  reqbufs.memory = V4L2_MEMORY_MMAP;
+  IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_REQBUFS, &reqbufs);
+  input_buffer_map_.resize(reqbufs.count);
+
+  for (size_t i = 0; i < input_buffer_map_.size(); ++i) {
+    InputRecord& input_record = input_buffer_map_[i];
+
+    // Query for the MEMORY_MMAP pointer.
+    struct v4l2_plane planes[1];
+    struct v4l2_buffer buffer;
+    memset(&buffer, 0, sizeof(buffer));
+    memset(planes, 0, sizeof(planes));
+    buffer.index = i;
+    buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    buffer.m.planes = planes;
+    buffer.length = 1;
+    IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_QUERYBUF, &buffer);
+    void* address = device_->Mmap(nullptr, buffer.m.planes[0].length,
+                                  PROT_READ | PROT_WRITE, MAP_SHARED,
+                                  buffer.m.planes[0].m.mem_offset);
+    if (address == MAP_FAILED) {
+      VPLOGF(1) << "mmap() failed";
+      return false;
+    }
+    input_record.address = address;
+    input_record.length = buffer.m.planes[0].length;
+
+    input_record.request_fd = device_->AllocateRequest();
+    if (!input_record.request_fd.is_valid()) {
+      VLOGF(1) << "Failed to allocate a request";
+      return false;
+    }
+    free_input_buffers_.push_back(i);
+  }
+
+  return true;
+}
+
+void V4L2SliceVideoDecodeAccelerator::DestroyInputBuffers() {
+  VLOGF(2);
+  DCHECK(!decoder_thread_.IsRunning() ||
+         decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK(!input_streamon_);
+
+  if (input_buffer_map_.empty())
+    return;
+
+  for (size_t i = 0; i < input_buffer_map_.size(); ++i) {
+    if (input_buffer_map_[i].address != nullptr) {
+      device_->Munmap(input_buffer_map_[i].address,
+                      input_buffer_map_[i].length);
+    }
+  }
+
+  struct v4l2_requestbuffers reqbufs;
+  memset(&reqbufs, 0, sizeof(reqbufs));
+  reqbufs.count = 0;
+  reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  reqbufs.memory = V4L2_MEMORY_MMAP;
+  IOCTL_OR_LOG_ERROR(VIDIOC_REQBUFS, &reqbufs);
+
+  // This also closes the requests.
+  input_buffer_map_.clear();
+  free_input_buffers_.clear();
+}
+
+bool V4L2SliceVideoDecodeAccelerator::DestroyOutputBuffers() {
+  VLOGF(2);
+  DCHECK(!decoder_thread_.IsRunning() ||
+         decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK(!output_streamon_);
+  bool success = true;
+
+  if (output_buffer_map_.empty())
+    return true;
+
+  for (size_t i = 0; i < output_buffer_map_.size(); ++i) {
+    OutputRecord& output_record = output_buffer_map_[i];
+    DCHECK(!output_record.held_by_surface);
+
+    DVLOGF(3) << "dismissing PictureBuffer id=" << output_record.picture_id;
+    child_task_runner_->PostTask(
+        FROM_HERE, base::Bind(&Client::DismissPictureBuffer, client_,
+                              output_record.picture_id));
+  }
+
+  struct v4l2_requestbuffers reqbufs;
+  memset(&reqbufs, 0, sizeof(reqbufs));
+  reqbufs.count = 0;
+  reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  reqbufs.memory = V4L2_MEMORY_DMABUF;
+  if (device_->Ioctl(VIDIOC_REQBUFS, &reqbufs) != 0) {
+    VPLOGF(1) << "ioctl() failed: VIDIOC_REQBUFS";
+    NOTIFY_ERROR(PLATFORM_FAILURE);
+    success = false;
+  }
+
+  output_buffer_map_.clear();
+  free_output_buffers_.clear();
+  output_buffer_queued_count_ = 0;
+
+  return success;
+}
+
+void V4L2SliceVideoDecodeAccelerator::RecordLatency(
+    int32_t bitstream_id,
+    FrameLatencyTracker::Stage stage) {
+  if (latency_tracker_)
+    latency_tracker_->Record(bitstream_id, stage);
+}
+
+V4L2SliceVideoDecodeAccelerator::V4L2H264Accelerator::V4L2H264Accelerator(
+    V4L2SliceVideoDecodeAccelerator* v4l2_dec)
+    : v4l2_dec_(v4l2_dec), num_slices_(0) {
+  DCHECK(v4l2_dec_);
+  memset(&sps_, 0, sizeof(sps_));
+  memset(&pps_, 0, sizeof(pps_));
+  memset(&scaling_matrix_, 0, sizeof(scaling_matrix_));
+  memset(&decode_params_, 0, sizeof(decode_params_));
+}
+
+V4L2SliceVideoDecodeAccelerator::V4L2H264Accelerator::~V4L2H264Accelerator() {}
+
+scoped_refptr<H264Picture>
+V4L2SliceVideoDecodeAccelerator::V4L2H264Accelerator::CreateH264Picture() {
+  scoped_refptr<V4L2DecodeSurface> dec_surface = v4l2_dec_->CreateSurface();
+  if (!dec_surface)
+    return nullptr;
+
+  return new V4L2H264Picture(dec_surface);
+}
+
+bool V4L2SliceVideoDecodeAccelerator::V4L2H264Accelerator::SubmitFrameMetadata(
+    const H264SPS* sps,
+    const H264PPS* pps,
+    const H264DPB& dpb,
+    const H264Picture::Vector& ref_pic_listp0,
+    const H264Picture::Vector& ref_pic_listb0,
+    const H264Picture::Vector& ref_pic_listb1,
+    const scoped_refptr<H264Picture>& pic) {
+  memset(&sps_, 0, sizeof(sps_));
+#define SPS_TO_V4L2SPS(a) sps_.a = sps->a
+#define SET_V4L2_SPS_FLAG_IF(cond, flag) \
+  sps_.flags |= ((sps->cond) ? (flag) : 0)
+  SPS_TO_V4L2SPS(profile_idc);
+  SPS_TO_V4L2SPS(level_idc);
+  SPS_TO_V4L2SPS(seq_parameter_set_id);
+  SPS_TO_V4L2SPS(chroma_format_idc);
+  SPS_TO_V4L2SPS(bit_depth_luma_minus8);
+  SPS_TO_V4L2SPS(bit_depth_chroma_minus8);
+  SPS_TO_V4L2SPS(log2_max_frame_num_minus4);
+  SPS_TO_V4L2SPS(pic_order_cnt_type);
+  SPS_TO_V4L2SPS(log2_max_pic_order_cnt_lsb_minus4);
+  SPS_TO_V4L2SPS(max_num_ref_frames);
+  SPS_TO_V4L2SPS(num_ref_frames_in_pic_order_cnt_cycle);
+  std::copy(std::begin(sps->offset_for_ref_frame),
+            std::end(sps->offset_for_ref_frame),
+            std::begin(sps_.offset_for_ref_frame));
+  SPS_TO_V4L2SPS(offset_for_non_ref_pic);
+  SPS_TO_V4L2SPS(offset_for_top_to_bottom_field);
+  SPS_TO_V4L2SPS(pic_width_in_mbs_minus1);
+  SPS_TO_V4L2SPS(pic_height_in_map_units_minus1);
+
+  sps_.constraint_set_flags =
+      (sps->constraint_set0_flag ? V4L2_H264_SPS_CONSTRAINT_SET0_FLAG : 0) |
+      (sps->constraint_set1_flag ? V4L2_H264_SPS_CONSTRAINT_SET1_FLAG : 0) |
+      (sps->constraint_set2_flag ? V4L2_H264_SPS_CONSTRAINT_SET2_FLAG : 0) |
+      (sps->constraint_set3_flag ? V4L2_H264_SPS_CONSTRAINT_SET3_FLAG : 0) |
+      (sps->constraint_set4_flag ? V4L2_H264_SPS_CONSTRAINT_SET4_FLAG : 0) |
+      (sps->constraint_set5_flag ? V4L2_H264_SPS_CONSTRAINT_SET5_FLAG : 0);
+
+  SET_V4L2_SPS_FLAG_IF(separate_colour_plane_flag,
+                       V4L2_H264_SPS_FLAG_SEPARATE_COLOUR_PLANE);
+  SET_V4L2_SPS_FLAG_IF(qpprime_y_zero_transform_bypass_flag,
+                       V4L2_H264_SPS_FLAG_QPPRIME_Y_ZERO_TRANSFORM_BYPASS);
+  SET_V4L2_SPS_FLAG_IF(delta_pic_order_always_zero_flag,
+                       V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO);
+  SET_V4L2_SPS_FLAG_IF(gaps_in_frame_num_value_allowed_flag,
+                       V4L2_H264_SPS_FLAG_GAPS_IN_FRAME_NUM_VALUE_ALLOWED);
+  SET_V4L2_SPS_FLAG_IF(frame_mbs_only_flag, V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY);
+  SET_V4L2_SPS_FLAG_IF(mb_adaptive_frame_field_flag,
+                       V4L2_H264_SPS_FLAG_MB_ADAPTIVE_FRAME_FIELD);
+  SET_V4L2_SPS_FLAG_IF(direct_8x8_inference_flag,
+                       V4L2_H264_SPS_FLAG_DIRECT_8X8_INFERENCE);
+#undef SET_V4L2_SPS_FLAG_IF
+#undef SPS_TO_V4L2SPS
+
+  memset(&pps_, 0, sizeof(pps_));
+#define PPS_TO_V4L2PPS(a) pps_.a = pps->a
+#define SET_V4L2_PPS_FLAG_IF(cond, flag) \
+  pps_.flags |= ((pps->cond) ? (flag) : 0)
+  PPS_TO_V4L2PPS(pic_parameter_set_id);
+  PPS_TO_V4L2PPS(seq_parameter_set_id);
+  PPS_TO_V4L2PPS(num_slice_groups_minus1);
+  PPS_TO_V4L2PPS(num_ref_idx_l0_default_active_minus1);
+  PPS_TO_V4L2PPS(num_ref_idx_l1_default_active_minus1);
+  PPS_TO_V4L2PPS(weighted_bipred_idc);
+  PPS_TO_V4L2PPS(pic_init_qp_minus26);
+  PPS_TO_V4L2PPS(pic_init_qs_minus26);
+  PPS_TO_V4L2PPS(chroma_qp_index_offset);
+  PPS_TO_V4L2PPS(second_chroma_qp_index_offset);
+
+  SET_V4L2_PPS_FLAG_IF(entropy_coding_mode_flag,
+                       V4L2_H264_PPS_FLAG_ENTROPY_CODING_MODE);
+  SET_V4L2_PPS_FLAG_IF(
+      bottom_field_pic_order_in_frame_present_flag,
+      V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT);
+  SET_V4L2_PPS_FLAG_IF(weighted_pred_flag, V4L2_H264_PPS_FLAG_WEIGHTED_PRED);
+  SET_V4L2_PPS_FLAG_IF(deblocking_filter_control_present_flag,
+                       V4L2_H264_PPS_FLAG_DEBLOCKING_FILTER_CONTROL_PRESENT);
+  SET_V4L2_PPS_FLAG_IF(constrained_intra_pred_flag,
+                       V4L2_H264_PPS_FLAG_CONSTRAINED_INTRA_PRED);
+  SET_V4L2_PPS_FLAG_IF(redundant_pic_cnt_present_flag,
+                       V4L2_H264_PPS_FLAG_REDUNDANT_PIC_CNT_PRESENT);
+  SET_V4L2_PPS_FLAG_IF(transform_8x8_mode_flag,
+                       V4L2_H264_PPS_FLAG_TRANSFORM_8X8_MODE);
+#undef SET_V4L2_PPS_FLAG_IF
+#undef PPS_TO_V4L2PPS
+
+  // The parser falls back to the SPS lists, then to the default ones, for the
+  // lists the PPS does not carry. The driver uses flat lists if neither
+  // parameter set has a matrix.
+  if (sps->seq_scaling_matrix_present_flag ||
+      pps->pic_scaling_matrix_present_flag) {
+    pps_.flags |= V4L2_H264_PPS_FLAG_SCALING_MATRIX_PRESENT;
+  }
+  for (size_t i = 0; i < arraysize(scaling_matrix_.scaling_list_4x4); ++i) {
+    for (size_t j = 0; j < kH264ScalingList4x4Length; ++j) {
+      scaling_matrix_.scaling_list_4x4[i][kZigzagScan4x4[j]] =
+          pps->scaling_list4x4[i][j];
+    }
+  }
+  for (size_t i = 0; i < arraysize(scaling_matrix_.scaling_list_8x8); ++i) {
+    for (size_t j = 0; j < kH264ScalingList8x8Length; ++j) {
+      scaling_matrix_.scaling_list_8x8[i][kZigzagScan8x8[j]] =
+          pps->scaling_list8x8[i][j];
+    }
+  }
+
+  memset(&decode_params_, 0, sizeof(decode_params_));
+  decode_params_.nal_ref_idc = pic->nal_ref_idc;
+  decode_params_.frame_num = pic->frame_num;
+  decode_params_.top_field_order_cnt = pic->top_field_order_cnt;
+  decode_params_.bottom_field_order_cnt = pic->bottom_field_order_cnt;
+  decode_params_.idr_pic_id = pic->idr_pic_id;
+  decode_params_.pic_order_cnt_lsb = pic->pic_order_cnt_lsb;
+  decode_params_.delta_pic_order_cnt_bottom = pic->delta_pic_order_cnt_bottom;
+  decode_params_.delta_pic_order_cnt0 = pic->delta_pic_order_cnt0;
+  decode_params_.delta_pic_order_cnt1 = pic->delta_pic_order_cnt1;
+  if (pic->idr)
+    decode_params_.flags |= V4L2_H264_DECODE_PARAM_FLAG_IDR_PIC;
+
+  // In frame-based mode, the device builds the reference lists from the DPB
+  // itself.
+  ref_surfaces_.clear();
+  size_t i = 0;
+  for (const auto& ref_pic : dpb) {
+    // The pictures created for gaps in frame_num have no surface.
+    V4L2H264Picture* v4l2_pic = ref_pic->AsV4L2H264Picture();
+    if (!v4l2_pic)
+      continue;
+    DCHECK_LT(i, arraysize(decode_params_.dpb));
+
+    const scoped_refptr<V4L2DecodeSurface>& ref_surface =
+        v4l2_pic->dec_surface();
+    struct v4l2_h264_dpb_entry& entry = decode_params_.dpb[i++];
+    entry.reference_ts = ref_surface->timestamp_ns();
+    entry.pic_num =
+        ref_pic->long_term ? ref_pic->long_term_pic_num : ref_pic->pic_num;
+    entry.frame_num =
+        ref_pic->long_term ? ref_pic->long_term_frame_idx : ref_pic->frame_num;
+    entry.fields = V4L2_H264_FRAME_REF;
+    entry.top_field_order_cnt = ref_pic->top_field_order_cnt;
+    entry.bottom_field_order_cnt = ref_pic->bottom_field_order_cnt;
+    entry.flags = V4L2_H264_DPB_ENTRY_FLAG_VALID;
+    if (ref_pic->ref)
+      entry.flags |= V4L2_H264_DPB_ENTRY_FLAG_ACTIVE;
+    if (ref_pic->long_term)
+      entry.flags |= V4L2_H264_DPB_ENTRY_FLAG_LONG_TERM;
+    ref_surfaces_.push_back(ref_surface);
+  }
+
+  num_slices_ = 0;
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::V4L2H264Accelerator::SubmitSlice(
+    const H264PPS* pps,
+    const H264SliceHeader* slice_hdr,
+    const H264Picture::Vector& ref_pic_list0,
+    const H264Picture::Vector& ref_pic_list1,
+    const scoped_refptr<H264Picture>& pic,
+    const uint8_t* data,
+    size_t size) {
+  scoped_refptr<V4L2DecodeSurface> dec_surface =
+      H264PictureToV4L2DecodeSurface(pic);
+
+  if (num_slices_++ == 0) {
+    decode_params_.dec_ref_pic_marking_bit_size =
+        slice_hdr->dec_ref_pic_marking_bit_size;
+    decode_params_.pic_order_cnt_bit_size = slice_hdr->pic_order_cnt_bit_size;
+  }
+  // A frame with B slices is a B frame, one with P slices only a P frame.
+  if (slice_hdr->IsBSlice()) {
+    decode_params_.flags &= ~V4L2_H264_DECODE_PARAM_FLAG_PFRAME;
+    decode_params_.flags |= V4L2_H264_DECODE_PARAM_FLAG_BFRAME;
+  } else if (slice_hdr->IsPSlice() &&
+             !(decode_params_.flags & V4L2_H264_DECODE_PARAM_FLAG_BFRAME)) {
+    decode_params_.flags |= V4L2_H264_DECODE_PARAM_FLAG_PFRAME;
+  }
+
+  // |data| starts at the NAL header, the device expects Annex-B NALUs.
+  static const uint8_t kStartCode[] = {0x00, 0x00, 0x01};
+  return v4l2_dec_->AppendToInputBuffer(dec_surface, kStartCode,
+                                        sizeof(kStartCode)) &&
+         v4l2_dec_->AppendToInputBuffer(dec_surface, data, size);
+}
+
+bool V4L2SliceVideoDecodeAccelerator::V4L2H264Accelerator::SubmitDecode(
+    const scoped_refptr<H264Picture>& pic) {
+  scoped_refptr<V4L2DecodeSurface> dec_surface =
+      H264PictureToV4L2DecodeSurface(pic);
+
+  struct v4l2_ext_control ctrls[4];
+  memset(ctrls, 0, sizeof(ctrls));
+  ctrls[0].id = V4L2_CID_STATELESS_H264_SPS;
+  ctrls[0].size = sizeof(sps_);
+  ctrls[0].ptr = &sps_;
+  ctrls[1].id = V4L2_CID_STATELESS_H264_PPS;
+  ctrls[1].size = sizeof(pps_);
+  ctrls[1].ptr = &pps_;
+  ctrls[2].id = V4L2_CID_STATELESS_H264_SCALING_MATRIX;
+  ctrls[2].size = sizeof(scaling_matrix_);
+  ctrls[2].ptr = &scaling_matrix_;
+  ctrls[3].id = V4L2_CID_STATELESS_H264_DECODE_PARAMS;
+  ctrls[3].size = sizeof(decode_params_);
+  ctrls[3].ptr = &decode_params_;
+
+  num_slices_ = 0;
+  if (!v4l2_dec_->SetExtCtrls(dec_surface, ctrls, arraysize(ctrls)))
+    return false;
+
+  dec_surface->SetReferenceSurfaces(ref_surfaces_);
+  ref_surfaces_.clear();
+  return v4l2_dec_->DecodeSurface(dec_surface);
+}
+
+bool V4L2SliceVideoDecodeAccelerator::V4L2H264Accelerator::OutputPicture(
+    const scoped_refptr<H264Picture>& pic) {
+  scoped_refptr<V4L2DecodeSurface> dec_surface =
+      H264PictureToV4L2DecodeSurface(pic);
+  // Without cropping in the SPS, the whole frame is visible.
+  dec_surface->set_visible_rect(pic->visible_rect.IsEmpty()
+                                    ? Rect(v4l2_dec_->decoder_->GetPicSize())
+                                    : pic->visible_rect);
+  v4l2_dec_->SurfaceReady(dec_surface, dec_surface->bitstream_id());
+  return true;
+}
+
+void V4L2SliceVideoDecodeAccelerator::V4L2H264Accelerator::Reset() {
+  num_slices_ = 0;
+  ref_surfaces_.clear();
+}
+
+scoped_refptr<V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>
+V4L2SliceVideoDecodeAccelerator::V4L2H264Accelerator::
+    H264PictureToV4L2DecodeSurface(const scoped_refptr<H264Picture>& pic) {
+  V4L2H264Picture* v4l2_pic = pic->AsV4L2H264Picture();
+  CHECK(v4l2_pic);
+  return v4l2_pic->dec_surface();
+}
+
+V4L2SliceVideoDecodeAccelerator::V4L2VP8Accelerator::V4L2VP8Accelerator(
+    V4L2SliceVideoDecodeAccelerator* v4l2_dec)
+    : v4l2_dec_(v4l2_dec) {
+  DCHECK(v4l2_dec_);
+}
+
+V4L2SliceVideoDecodeAccelerator::V4L2VP8Accelerator::~V4L2VP8Accelerator() {}
+
+scoped_refptr<VP8Picture>
+V4L2SliceVideoDecodeAccelerator::V4L2VP8Accelerator::CreateVP8Picture() {
+  scoped_refptr<V4L2DecodeSurface> dec_surface = v4l2_dec_->CreateSurface();
+  if (!dec_surface)
+    return nullptr;
+
+  return new V4L2VP8Picture(dec_surface);
+}
+
+bool V4L2SliceVideoDecodeAccelerator::V4L2VP8Accelerator::SubmitDecode(
+    const scoped_refptr<VP8Picture>& pic,
+    const Vp8FrameHeader* frame_hdr,
+    const scoped_refptr<VP8Picture>& last_frame,
+    const scoped_refptr<VP8Picture>& golden_frame,
+    const scoped_refptr<VP8Picture>& alt_frame) {
+  struct v4l2_ctrl_vp8_frame v4l2_frame;
+  memset(&v4l2_frame, 0, sizeof(v4l2_frame));
+
+  const Vp8SegmentationHeader& segm_hdr = frame_hdr->segmentation_hdr;
+  struct v4l2_vp8_segment& v4l2_segm = v4l2_frame.segment;
+  if (segm_hdr.segmentation_enabled)
+    v4l2_segm.flags |= V4L2_VP8_SEGMENT_FLAG_ENABLED;
+  if (segm_hdr.update_mb_segmentation_map)
+    v4l2_segm.flags |= V4L2_VP8_SEGMENT_FLAG_UPDATE_MAP;
+  if (segm_hdr.update_segment_feature_data)
+    v4l2_segm.flags |= V4L2_VP8_SEGMENT_FLAG_UPDATE_FEATURE_DATA;
+  if (segm_hdr.segment_feature_mode ==
+      Vp8SegmentationHeader::FEATURE_MODE_DELTA) {
+    v4l2_segm.flags |= V4L2_VP8_SEGMENT_FLAG_DELTA_VALUE_MODE;
+  }
+  std::copy(std::begin(segm_hdr.quantizer_update_value),
+            std::end(segm_hdr.quantizer_update_value),
+            std::begin(v4l2_segm.quant_update));
+  std::copy(std::begin(segm_hdr.lf_update_value),
+            std::end(segm_hdr.lf_update_value),
+            std::begin(v4l2_segm.lf_update));
+  std::copy(std::begin(segm_hdr.segment_prob), std::end(segm_hdr.segment_prob),
+            std::begin(v4l2_segm.segment_probs));
+
+  const Vp8LoopFilterHeader& lf_hdr = frame_hdr->loopfilter_hdr;
+  struct v4l2_vp8_loop_filter& v4l2_lf = v4l2_frame.lf;
+  if (lf_hdr.type == Vp8LoopFilterHeader::LOOP_FILTER_TYPE_SIMPLE)
+    v4l2_lf.flags |= V4L2_VP8_LF_FILTER_TYPE_SIMPLE;
+  if (lf_hdr.loop_filter_adj_enable)
+    v4l2_lf.flags |= V4L2_VP8_LF_ADJ_ENABLE;
+  if (lf_hdr.mode_ref_lf_delta_update)
+    v4l2_lf.flags |= V4L2_VP8_LF_DELTA_UPDATE;
+  v4l2_lf.level = lf_hdr.level;
+  v4l2_lf.sharpness_level = lf_hdr.sharpness_level;
+  std::copy(std::begin(lf_hdr.ref_frame_delta),
+            std::end(lf_hdr.ref_frame_delta),
+            std::begin(v4l2_lf.ref_frm_delta));
+  std::copy(std::begin(lf_hdr.mb_mode_delta), std::end(lf_hdr.mb_mode_delta),
+            std::begin(v4l2_lf.mb_mode_delta));
+
+  const Vp8QuantizationHeader& quant_hdr = frame_hdr->quantization_hdr;
+  v4l2_frame.quant.y_ac_qi = quant_hdr.y_ac_qi;
+  v4l2_frame.quant.y_dc_delta = quant_hdr.y_dc_delta;
+  v4l2_frame.quant.y2_dc_delta = quant_hdr.y2_dc_delta;
+  v4l2_frame.quant.y2_ac_delta = quant_hdr.y2_ac_delta;
+  v4l2_frame.quant.uv_dc_delta = quant_hdr.uv_dc_delta;
+  v4l2_frame.quant.uv_ac_delta = quant_hdr.uv_ac_delta;
+
+  const Vp8EntropyHeader& entropy_hdr = frame_hdr->entropy_hdr;
+  static_assert(sizeof(v4l2_frame.entropy.coeff_probs) ==
+                    sizeof(entropy_hdr.coeff_probs),
+                "VP8 coefficient probabilities mismatch");
+  static_assert(
+      sizeof(v4l2_frame.entropy.mv_probs) == sizeof(entropy_hdr.mv_probs),
+      "VP8 motion vector probabilities mismatch");
+  memcpy(v4l2_frame.entropy.coeff_probs, entropy_hdr.coeff_probs,
+         sizeof(entropy_hdr.coeff_probs));
+  memcpy(v4l2_frame.entropy.y_mode_probs, entropy_hdr.y_mode_probs,
+         sizeof(entropy_hdr.y_mode_probs));
+  memcpy(v4l2_frame.entropy.uv_mode_probs, entropy_hdr.uv_mode_probs,
+         sizeof(entropy_hdr.uv_mode_probs));
+  memcpy(v4l2_frame.entropy.mv_probs, entropy_hdr.mv_probs,
+         sizeof(entropy_hdr.mv_probs));
+
+  // The state of the bool decoder after the frame header, where the device
+  // resumes decoding the first partition.
+  v4l2_frame.coder_state.range = frame_hdr->bool_dec_range;
+  v4l2_frame.coder_state.value = frame_hdr->bool_dec_value;
+  v4l2_frame.coder_state.bit_count = frame_hdr->bool_dec_count;
+
+  v4l2_frame.width = frame_hdr->width;
+  v4l2_frame.height = frame_hdr->height;
+  v4l2_frame.horizontal_scale = frame_hdr->horizontal_scale;
+  v4l2_frame.vertical_scale = frame_hdr->vertical_scale;
+  v4l2_frame.version = frame_hdr->version;
+  v4l2_frame.prob_skip_false = frame_hdr->prob_skip_false;
+  v4l2_frame.prob_intra = frame_hdr->prob_intra;
+  v4l2_frame.prob_last = frame_hdr->prob_last;
+  v4l2_frame.prob_gf = frame_hdr->prob_gf;
+  v4l2_frame.num_dct_parts = frame_hdr->num_of_dct_partitions;
+  v4l2_frame.first_part_size = frame_hdr->first_part_size;
+  v4l2_frame.first_part_header_bits = frame_hdr->macroblock_bit_offset;
+  std::copy(std::begin(frame_hdr->dct_partition_sizes),
+            std::end(frame_hdr->dct_partition_sizes),
+            std::begin(v4l2_frame.dct_part_sizes));
+
+  if (frame_hdr->IsKeyframe())
+    v4l2_frame.flags |= V4L2_VP8_FRAME_FLAG_KEY_FRAME;
+  if (frame_hdr->is_experimental)
+    v4l2_frame.flags |= V4L2_VP8_FRAME_FLAG_EXPERIMENTAL;
+  if (frame_hdr->show_frame)
+    v4l2_frame.flags |= V4L2_VP8_FRAME_FLAG_SHOW_FRAME;
+  if (frame_hdr->mb_no_skip_coeff)
+    v4l2_frame.flags |= V4L2_VP8_FRAME_FLAG_MB_NO_SKIP_COEFF;
+  if (frame_hdr->sign_bias_golden)
+    v4l2_frame.flags |= V4L2_VP8_FRAME_FLAG_SIGN_BIAS_GOLDEN;
+  if (frame_hdr->sign_bias_alternate)
+    v4l2_frame.flags |= V4L2_VP8_FRAME_FLAG_SIGN_BIAS_ALT;
+
+  std::vector<scoped_refptr<V4L2DecodeSurface>> ref_surfaces;
+  if (last_frame) {
+    ref_surfaces.push_back(VP8PictureToV4L2DecodeSurface(last_frame));
+    v4l2_frame.last_frame_ts = ref_surfaces.back()->timestamp_ns();
+  }
+  if (golden_frame) {
+    ref_surfaces.push_back(VP8PictureToV4L2DecodeSurface(golden_frame));
+    v4l2_frame.golden_frame_ts = ref_surfaces.back()->timestamp_ns();
+  }
+  if (alt_frame) {
+    ref_surfaces.push_back(VP8PictureToV4L2DecodeSurface(alt_frame));
+    v4l2_frame.alt_frame_ts = ref_surfaces.back()->timestamp_ns();
+  }
+
+  scoped_refptr<V4L2DecodeSurface> dec_surface =
+      VP8PictureToV4L2DecodeSurface(pic);
+  if (!v4l2_dec_->AppendToInputBuffer(dec_surface, frame_hdr->data,
+                                      frame_hdr->frame_size)) {
+    return false;
+  }
+
+  struct v4l2_ext_control ctrl;
+  memset(&ctrl, 0, sizeof(ctrl));
+  ctrl.id = V4L2_CID_STATELESS_VP8_FRAME;
+  ctrl.size = sizeof(v4l2_frame);
+  ctrl.ptr = &v4l2_frame;
+  if (!v4l2_dec_->SetExtCtrls(dec_surface, &ctrl, 1))
+    return false;
+
+  dec_surface->SetReferenceSurfaces(ref_surfaces);
+  return v4l2_dec_->DecodeSurface(dec_surface);
+}
+
+bool V4L2SliceVideoDecodeAccelerator::V4L2VP8Accelerator::OutputPicture(
+    const scoped_refptr<VP8Picture>& pic) {
+  scoped_refptr<V4L2DecodeSurface> dec_surface =
+      VP8PictureToV4L2DecodeSurface(pic);
+  dec_surface->set_visible_rect(pic->visible_rect);
+  v4l2_dec_->SurfaceReady(dec_surface, dec_surface->bitstream_id());
+  return true;
+}
+
+scoped_refptr<V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>
+V4L2SliceVideoDecodeAccelerator::V4L2VP8Accelerator::
+    VP8PictureToV4L2DecodeSurface(const scoped_refptr<VP8Picture>& pic) {
+  V4L2VP8Picture* v4l2_pic = pic->AsV4L2VP8Picture();
+  CHECK(v4l2_pic);
+  return v4l2_pic->dec_surface();
+}
+
+V4L2SliceVideoDecodeAccelerator::V4L2VP9Accelerator::V4L2VP9Accelerator(
+    V4L2SliceVideoDecodeAccelerator* v4l2_dec)
+    : v4l2_dec_(v4l2_dec) {
+  DCHECK(v4l2_dec_);
+}
+
+V4L2SliceVideoDecodeAccelerator::V4L2VP9Accelerator::~V4L2VP9Accelerator() {}
+
+scoped_refptr<VP9Picture>
+V4L2SliceVideoDecodeAccelerator::V4L2VP9Accelerator::CreateVP9Picture() {
+  scoped_refptr<V4L2DecodeSurface> dec_surface = v4l2_dec_->CreateSurface();
+  if (!dec_surface)
+    return nullptr;
+
+  return new V4L2VP9Picture(dec_surface);
+}
+
+bool V4L2SliceVideoDecodeAccelerator::V4L2VP9Accelerator::SubmitDecode(
+    const scoped_refptr<VP9Picture>& pic,
+    const Vp9SegmentationParams& segm_params,
+    const Vp9LoopFilterParams& lf_params,
+    const std::vector<scoped_refptr<VP9Picture>>& ref_pictures,
+    const base::Closure& done_cb) {
+  const Vp9FrameHeader* frame_hdr = pic->frame_hdr.get();
+  DCHECK(frame_hdr);
+
+  struct v4l2_ctrl_vp9_frame v4l2_frame;
+  memset(&v4l2_frame, 0, sizeof(v4l2_frame));
+
+  struct v4l2_vp9_loop_filter& v4l2_lf = v4l2_frame.lf;
+  if (lf_params.delta_enabled)
+    v4l2_lf.flags |= V4L2_VP9_LOOP_FILTER_FLAG_DELTA_ENABLED;
+  if (lf_params.delta_update)
+    v4l2_lf.flags |= V4L2_VP9_LOOP_FILTER_FLAG_DELTA_UPDATE;
+  v4l2_lf.level = lf_params.level;
+  v4l2_lf.sharpness = lf_params.sharpness;
+  std::copy(std::begin(lf_params.ref_deltas), std::end(lf_params.ref_deltas),
+            std::begin(v4l2_lf.ref_deltas));
+  std::copy(std::begin(lf_params.mode_deltas), std::end(lf_params.mode_deltas),
+            std::begin(v4l2_lf.mode_deltas));
+
+  const Vp9QuantizationParams& quant_params = frame_hdr->quant_params;
+  v4l2_frame.quant.base_q_idx = quant_params.base_q_idx;
+  v4l2_frame.quant.delta_q_y_dc = quant_params.delta_q_y_dc;
+  v4l2_frame.quant.delta_q_uv_dc = quant_params.delta_q_uv_dc;
+  v4l2_frame.quant.delta_q_uv_ac = quant_params.delta_q_uv_ac;
+
+  struct v4l2_vp9_segmentation& v4l2_segm = v4l2_frame.seg;
+  if (segm_params.enabled)
+    v4l2_segm.flags |= V4L2_VP9_SEGMENTATION_FLAG_ENABLED;
+  if (segm_params.update_map)
+    v4l2_segm.flags |= V4L2_VP9_SEGMENTATION_FLAG_UPDATE_MAP;
+  if (segm_params.temporal_update)
+    v4l2_segm.flags |= V4L2_VP9_SEGMENTATION_FLAG_TEMPORAL_UPDATE;
+  if (segm_params.update_data)
+    v4l2_segm.flags |= V4L2_VP9_SEGMENTATION_FLAG_UPDATE_DATA;
+  if (segm_params.abs_or_delta_update)
+    v4l2_segm.flags |= V4L2_VP9_SEGMENTATION_FLAG_ABS_OR_DELTA_UPDATE;
+  for (size_t i = 0; i < Vp9SegmentationParams::kNumSegments; ++i) {
+    for (size_t j = 0; j < Vp9SegmentationParams::SEG_LVL_MAX; ++j) {
+      if (segm_params.feature_enabled[i][j])
+        v4l2_segm.feature_enabled[i] |= V4L2_VP9_SEGMENT_FEATURE_ENABLED(j);
+      v4l2_segm.feature_data[i][j] = segm_params.feature_data[i][j];
+    }
+  }
+  std::copy(std::begin(segm_params.tree_probs),
+            std::end(segm_params.tree_probs),
+            std::begin(v4l2_segm.tree_probs));
+  std::copy(std::begin(segm_params.pred_probs),
+            std::end(segm_params.pred_probs),
+            std::begin(v4l2_segm.pred_probs));
+
+  if (frame_hdr->IsKeyframe())
+    v4l2_frame.flags |= V4L2_VP9_FRAME_FLAG_KEY_FRAME;
+  if (frame_hdr->show_frame)
+    v4l2_frame.flags |= V4L2_VP9_FRAME_FLAG_SHOW_FRAME;
+  if (frame_hdr->error_resilient_mode)
+    v4l2_frame.flags |= V4L2_VP9_FRAME_FLAG_ERROR_RESILIENT;
+  if (frame_hdr->intra_only)
+    v4l2_frame.flags |= V4L2_VP9_FRAME_FLAG_INTRA_ONLY;
+  if (frame_hdr->allow_high_precision_mv)
+    v4l2_frame.flags |= V4L2_VP9_FRAME_FLAG_ALLOW_HIGH_PREC_MV;
+  if (frame_hdr->refresh_frame_context)
+    v4l2_frame.flags |= V4L2_VP9_FRAME_FLAG_REFRESH_FRAME_CTX;
+  if (frame_hdr->frame_parallel_decoding_mode)
+    v4l2_frame.flags |= V4L2_VP9_FRAME_FLAG_PARALLEL_DEC_MODE;
+  if (frame_hdr->subsampling_x)
+    v4l2_frame.flags |= V4L2_VP9_FRAME_FLAG_X_SUBSAMPLING;
+  if (frame_hdr->subsampling_y)
+    v4l2_frame.flags |= V4L2_VP9_FRAME_FLAG_Y_SUBSAMPLING;
+  if (frame_hdr->color_range)
+    v4l2_frame.flags |= V4L2_VP9_FRAME_FLAG_COLOR_RANGE_FULL_SWING;
+
+  v4l2_frame.compressed_header_size = frame_hdr->header_size_in_bytes;
+  v4l2_frame.uncompressed_header_size = frame_hdr->uncompressed_header_size;
+  v4l2_frame.frame_width_minus_1 = frame_hdr->frame_width - 1;
+  v4l2_frame.frame_height_minus_1 = frame_hdr->frame_height - 1;
+  v4l2_frame.render_width_minus_1 = frame_hdr->render_width - 1;
+  v4l2_frame.render_height_minus_1 = frame_hdr->render_height - 1;
+  v4l2_frame.reset_frame_context =
+      Vp9ResetFrameContextToV4L2(frame_hdr->reset_frame_context);
+  v4l2_frame.frame_context_idx = frame_hdr->frame_context_idx;
+  v4l2_frame.profile = frame_hdr->profile;
+  v4l2_frame.bit_depth = frame_hdr->bit_depth;
+  v4l2_frame.interpolation_filter = frame_hdr->interpolation_filter;
+  v4l2_frame.tile_cols_log2 = frame_hdr->tile_cols_log2;
+  v4l2_frame.tile_rows_log2 = frame_hdr->tile_rows_log2;
+  v4l2_frame.reference_mode = frame_hdr->compressed_header.reference_mode;
+
+  // The references used by inter frames, in the order of ref_frame_idx.
+  const uint8_t kSignBiasFlags[kVp9NumRefsPerFrame] = {
+      V4L2_VP9_SIGN_BIAS_LAST, V4L2_VP9_SIGN_BIAS_GOLDEN,
+      V4L2_VP9_SIGN_BIAS_ALT,
+  };
+  __u64* const ref_timestamps[kVp9NumRefsPerFrame] = {
+      &v4l2_frame.last_frame_ts, &v4l2_frame.golden_frame_ts,
+      &v4l2_frame.alt_frame_ts,
+  };
+  std::vector<scoped_refptr<V4L2DecodeSurface>> ref_surfaces;
+  for (size_t i = 0; i < kVp9NumRefsPerFrame; ++i) {
+    if (frame_hdr->ref_frame_sign_bias[VP9_FRAME_LAST + i])
+      v4l2_frame.ref_frame_sign_bias |= kSignBiasFlags[i];
+    if (frame_hdr->IsIntra())
+      continue;
+
+    const scoped_refptr<VP9Picture>& ref_pic =
+        ref_pictures[frame_hdr->ref_frame_idx[i]];
+    if (!ref_pic) {
+      VLOGF(1) << "Missing reference frame " << i;
+      return false;
+    }
+    ref_surfaces.push_back(VP9PictureToV4L2DecodeSurface(ref_pic));
+    *ref_timestamps[i] = ref_surfaces.back()->timestamp_ns();
+  }
+
+  // The probability updates are laid out as a Vp9FrameContext.
+  struct v4l2_ctrl_vp9_compressed_hdr v4l2_compressed_hdr;
+  static_assert(sizeof(v4l2_compressed_hdr) ==
+                    sizeof(v4l2_compressed_hdr.tx_mode) +
+                        sizeof(Vp9FrameContext),
+                "VP9 probability updates mismatch");
+  v4l2_compressed_hdr.tx_mode = frame_hdr->compressed_header.tx_mode;
+  memcpy(v4l2_compressed_hdr.tx8, &frame_hdr->compressed_header.prob_updates,
+         sizeof(Vp9FrameContext));
+
+  scoped_refptr<V4L2DecodeSurface> dec_surface =
+      VP9PictureToV4L2DecodeSurface(pic);
+  if (!v4l2_dec_->AppendToInputBuffer(dec_surface, frame_hdr->data,
+                                      frame_hdr->frame_size)) {
+    return false;
+  }
+
+  struct v4l2_ext_control ctrls[2];
+  memset(ctrls, 0, sizeof(ctrls));
+  ctrls[0].id = V4L2_CID_STATELESS_VP9_FRAME;
+  ctrls[0].size = sizeof(v4l2_frame);
+  ctrls[0].ptr = &v4l2_frame;
+  ctrls[1].id = V4L2_CID_STATELESS_VP9_COMPRESSED_HDR;
+  ctrls[1].size = sizeof(v4l2_compressed_hdr);
+  ctrls[1].ptr = &v4l2_compressed_hdr;
+  if (!v4l2_dec_->SetExtCtrls(dec_surface, ctrls, arraysize(ctrls)))
+    return false;
+
+  dec_surface->SetReferenceSurfaces(ref_surfaces);
+  if (!v4l2_dec_->DecodeSurface(dec_surface))
+    return false;
+
+  // The parser needs no context from the device, don't wait for the decode.
+  if (!done_cb.is_null())
+    done_cb.Run();
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::V4L2VP9Accelerator::OutputPicture(
+    const scoped_refptr<VP9Picture>& pic) {
+  V4L2VP9Picture* v4l2_pic = pic->AsV4L2VP9Picture();
+  CHECK(v4l2_pic);
+
+  scoped_refptr<V4L2DecodeSurface> dec_surface = v4l2_pic->dec_surface();
+  // The render size is cleared if it is invalid.
+  dec_surface->set_visible_rect(pic->visible_rect.IsEmpty()
+                                    ? Rect(v4l2_dec_->decoder_->GetPicSize())
+                                    : pic->visible_rect);
+  // A frame shown by show_existing_frame is the output of the current
+  // bitstream buffer, not of the one it was decoded from.
+  DCHECK(v4l2_dec_->decoder_current_bitstream_buffer_.get());
+  v4l2_dec_->SurfaceReady(
+      dec_surface, v4l2_dec_->decoder_current_bitstream_buffer_->input_id);
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::V4L2VP9Accelerator::
+    IsFrameContextRequired() const {
+  // The probability updates are parsed from the compressed header.
+  return true;
+}
+
+bool V4L2SliceVideoDecodeAccelerator::V4L2VP9Accelerator::GetFrameContext(
+    const scoped_refptr<VP9Picture>& pic,
+    Vp9FrameContext* frame_ctx) {
+  // Backward adaptation happens in the device, whose contexts the parser only
+  // sends updates to.
+  *frame_ctx = pic->frame_hdr->frame_context;
+  return true;
+}
+
+scoped_refptr<V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface>
+V4L2SliceVideoDecodeAccelerator::V4L2VP9Accelerator::
+    VP9PictureToV4L2DecodeSurface(const scoped_refptr<VP9Picture>& pic) {
+  V4L2VP9Picture* v4l2_pic = pic->AsV4L2VP9Picture();
+  CHECK(v4l2_pic);
+  return v4l2_pic->dec_surface();
+}
+
+}  // namespace media
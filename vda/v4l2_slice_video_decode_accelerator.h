@@ -0,0 +1,424 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+// This file contains an implementation of VideoDecodeAccelerator for stateless
+// (slice-based) V4L2 decoders of H.264, VP8 and VP9, which parse no bitstream
+// themselves. The stream is parsed in userspace by AcceleratedVideoDecoders,
+// and every frame is sent to the device as a request of the Media Request API,
+// carrying the frame data and its parsed parameters as controls.
+
+#ifndef V4L2_SLICE_VIDEO_DECODE_ACCELERATOR_H_
+#define V4L2_SLICE_VIDEO_DECODE_ACCELERATOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "accelerated_video_decoder.h"
+#include "base/callback.h"
+#include "base/files/scoped_file.h"
+#include "base/macros.h"
+#include "base/memory/linked_ptr.h"
+#include "base/memory/ref_counted.h"
+#include "base/memory/weak_ptr.h"
+#include "base/threading/thread.h"
+#include "rect.h"
+#include "shared_memory_mapping_cache.h"
+#include "size.h"
+#include "v4l2_device.h"
+#include "video_decode_accelerator.h"
+
+namespace media {
+
+// The threading model is the one of V4L2VideoDecodeAccelerator with
+// PollMode::kPollThread: API calls are posted from the child thread to
+// |decoder_thread_|, which owns all the state, and |device_poll_thread_| only
+// waits for the device and posts ServiceDeviceTask()s to |decoder_thread_|.
+//
+// The accelerators of the AcceleratedVideoDecoders run on |decoder_thread_|
+// too. For each frame, they get a V4L2DecodeSurface holding an input buffer,
+// the request it is queued with, and the output buffer the frame is decoded
+// into. The surface stays alive while the decoder keeps the frame as a
+// reference, so its output buffer is not reused meanwhile.
+class V4L2SliceVideoDecodeAccelerator : public VideoDecodeAccelerator {
+ public:
+  class V4L2DecodeSurface;
+
+  explicit V4L2SliceVideoDecodeAccelerator(
+      const scoped_refptr<V4L2Device>& device);
+  ~V4L2SliceVideoDecodeAccelerator() override;
+
+  // VideoDecodeAccelerator implementation.
+  // Note: Initialize() and Destroy() are synchronous.
+  bool Initialize(const Config& config, Client* client) override;
+  void Decode(const BitstreamBuffer& bitstream_buffer) override;
+  void AssignPictureBuffers(const std::vector<PictureBuffer>& buffers) override;
+  void ImportBufferForPicture(
+      int32_t picture_buffer_id,
+      VideoPixelFormat pixel_format,
+      const NativePixmapHandle& native_pixmap_handle) override;
+  void ReusePictureBuffer(int32_t picture_buffer_id) override;
+  void Flush() override;
+  void Reset() override;
+  void Destroy() override;
+  size_t GetNumPictureBuffersForDpbSize(size_t dpb_size) const override;
+  bool TryToSetupDecodeOnSeparateThread(
+      const base::WeakPtr<Client>& decode_client,
+      const scoped_refptr<base::SingleThreadTaskRunner>& decode_task_runner)
+      override;
+
+  static VideoDecodeAccelerator::SupportedProfiles GetSupportedProfiles();
+
+ private:
+  class V4L2H264Accelerator;
+  class V4L2VP8Accelerator;
+  class V4L2VP9Accelerator;
+
+  enum {
+    // Number of input buffers, and of frames that can be queued to the device
+    // at a time.
+    kInputBufferCount = 8,
+    // Input bitstream buffer size for frames of up to 1080p, see
+    // GetInputBufferSize().
+    kInputBufferMinSize = 1024 * 1024,
+    // Number of bitstream buffer mappings kept alive across Decode() calls.
+    kInputMappingCacheSize = 16,
+    // Number of pictures |decoder_| asks for on top of the frames the stream
+    // needs for reference and reordering, as kPicsInPipeline in H264Decoder.
+    // GetRequiredNumOfPictures() of VP8Decoder and VP9Decoder add the same.
+    kPicsInPipeline = 6,
+  };
+
+  // Internal state of the decoder.
+  enum State {
+    kUninitialized,  // Initialize() not yet called.
+    kDecoding,       // Initialize() returned true; decoding frames.
+    // Requested new PictureBuffers via ProvidePictureBuffers(), awaiting
+    // AssignPictureBuffers().
+    kAwaitingPictureBuffers,
+    kError,  // Error in kDecoding state.
+  };
+
+  enum BufferId {
+    kFlushBufferId = -2  // Buffer id for flush buffer, queued by FlushTask().
+  };
+
+  // Auto-destruction reference for BitstreamBuffer, for message-passing from
+  // Decode() to DecodeTask().
+  struct BitstreamBufferRef;
+
+  // Record for input buffers.
+  struct InputRecord {
+    InputRecord();
+    InputRecord(InputRecord&&) = default;
+    ~InputRecord();
+    bool at_device;    // Held by the device.
+    void* address;     // mmap() address.
+    size_t length;     // mmap() length.
+    size_t bytes_used;  // Bytes filled in the mmap() segment.
+    // The request this buffer is queued with. Each input buffer has its own,
+    // as a frame is exactly one buffer and one request.
+    base::ScopedFD request_fd;
+  };
+
+  // Record for output buffers. A record is free to decode into when it is
+  // neither at the device, at the client, nor held by a surface.
+  struct OutputRecord {
+    OutputRecord();
+    OutputRecord(OutputRecord&&) = default;
+    ~OutputRecord();
+    bool at_device;
+    // Number of pictures of this buffer sent to the client and not returned
+    // yet. A frame can be shown more than once.
+    int num_times_sent_to_client;
+    bool held_by_surface;
+    int32_t picture_id;  // Picture buffer id as returned to PictureReady().
+    // Dmabuf fds imported from the client, one per plane.
+    std::vector<base::ScopedFD> dmabuf_fds;
+  };
+
+  //
+  // Methods for the accelerators, run on decoder_thread_.
+  //
+
+  // Return a new surface for the frame of the current bitstream buffer, or
+  // nullptr if no input or output buffer is free.
+  scoped_refptr<V4L2DecodeSurface> CreateSurface();
+  // Append |size| bytes of |data| to the input buffer of |surface|. Return
+  // false if they do not fit.
+  bool AppendToInputBuffer(const scoped_refptr<V4L2DecodeSurface>& surface,
+                           const void* data,
+                           size_t size);
+  // Set the |num_ctrls| controls of |ext_ctrls| in the request of |surface|.
+  // Return true on success.
+  bool SetExtCtrls(const scoped_refptr<V4L2DecodeSurface>& surface,
+                   struct v4l2_ext_control* ext_ctrls,
+                   size_t num_ctrls);
+  // Queue |surface| to the device, with the data and controls set so far.
+  // Return true on success.
+  bool DecodeSurface(const scoped_refptr<V4L2DecodeSurface>& surface);
+  // Queue |surface| for output as the picture of |bitstream_id|, once it is
+  // decoded and all the surfaces queued before it have been output.
+  void SurfaceReady(const scoped_refptr<V4L2DecodeSurface>& surface,
+                    int32_t bitstream_id);
+
+  //
+  // Decoding tasks, to be run on decoder_thread_.
+  //
+
+  // Task to finish initialization on decoder_thread_.
+  void InitializeTask();
+  // Enqueue a BitstreamBuffer to decode.
+  void DecodeTask(const BitstreamBuffer& bitstream_buffer);
+  // Decode from the buffers queued in decoder_input_queue_, until we run out of
+  // input, of surfaces, or need new output buffers.
+  void DecodeBufferTask();
+  // Schedule a DecodeBufferTask() if none is scheduled yet.
+  void ScheduleDecodeBufferTaskIfNeeded();
+
+  // Stop decoding and wait for all surfaces to be output, to reallocate the
+  // buffers for the new stream format, see FinishSurfaceSetChange().
+  void InitiateSurfaceSetChange();
+  // Reallocate the buffers once nothing is decoding. Return false if it is
+  // still too early.
+  bool FinishSurfaceSetChange();
+
+  void AssignPictureBuffersTask(const std::vector<PictureBuffer>& buffers);
+  void ImportBufferForPictureTask(int32_t picture_buffer_id,
+                                  std::vector<base::ScopedFD> dmabuf_fds);
+  void ReusePictureBufferTask(int32_t picture_buffer_id);
+
+  // Service I/O on the V4L2 devices. This task should only be scheduled from
+  // DevicePollTask().
+  void ServiceDeviceTask();
+  // Dequeue all the buffers the device is done with.
+  void Dequeue();
+  bool DequeueInputBuffer();
+  bool DequeueOutputBuffer();
+  // Queue the output buffer of |surface| to the device.
+  bool EnqueueOutputRecord(const scoped_refptr<V4L2DecodeSurface>& surface);
+  // Queue the input buffer of |surface|, with its request.
+  bool EnqueueInputRecord(const scoped_refptr<V4L2DecodeSurface>& surface);
+  // Start the streams if they are not running yet.
+  bool StartStreams();
+  // Make the request of |input_record| reusable once its buffer is back.
+  bool ReinitInputRequest(InputRecord* input_record);
+
+  // Send the decoded surfaces at the front of |decoder_display_queue_| to the
+  // client, in order.
+  void TryOutputSurfaces();
+  // Called when the last reference to a surface is gone. |input_record| is -1
+  // if the input buffer of the surface was queued to the device.
+  void ReleaseSurface(int input_record, int output_record);
+  // Put |output_record| back on the free list if nobody holds it anymore.
+  void MaybeFreeOutputRecord(int output_record);
+
+  void FlushTask();
+  // Finish a flush started by FlushTask() once all surfaces are output.
+  void NotifyFlushDoneIfNeeded();
+  void ResetTask();
+  // Finish a reset once no output buffers are being reallocated.
+  void FinishReset();
+  void DestroyTask();
+
+  // Start and stop |device_poll_thread_|.
+  bool StartDevicePoll();
+  bool StopDevicePoll();
+  // Stop the streams, dropping all the buffers queued to the device.
+  bool StopStreams();
+
+  // Poll the device while buffers are queued to it.
+  void SchedulePollIfNeeded();
+
+  // The device task, to be run on device_poll_thread_.
+  void DevicePollTask();
+
+  // Error notification (using PostTask() to child thread, if necessary).
+  void NotifyError(Error error);
+  // Set the state_ to kError and notify the client (if necessary).
+  void SetErrorState(Error error);
+
+  //
+  // Buffer management, run on decoder_thread_ or, before it is started, on
+  // the child thread.
+  //
+
+  // Set the H.264 decode mode and start code format the accelerator relies on.
+  bool SetupDecodeControls();
+  // Set the input format for frames of |coded_size| and the output format.
+  // Update |coded_size_| and |output_planes_count_| from the output format
+  // chosen by the device.
+  bool SetupFormats(const Size& coded_size);
+  // Return the input buffer size for frames of |coded_size|.
+  static size_t GetInputBufferSize(const Size& coded_size);
+  // Allocate and map the input buffers, with a request for each.
+  bool CreateInputBuffers();
+  void DestroyInputBuffers();
+  // Release the output buffers, dismissing their PictureBuffers. Return false
+  // if anything failed.
+  bool DestroyOutputBuffers();
+
+  // Records |stage| of |bitstream_id| if latency tracking is enabled.
+  void RecordLatency(int32_t bitstream_id, FrameLatencyTracker::Stage stage);
+
+  // Our original calling task runner for the child thread.
+  scoped_refptr<base::SingleThreadTaskRunner> child_task_runner_;
+  // Task runner Decode() and PictureReady() run on.
+  scoped_refptr<base::SingleThreadTaskRunner> decode_task_runner_;
+
+  // WeakPtr<> pointing to |this| for use in posting tasks from the decoder or
+  // device worker threads back to the child thread.
+  base::WeakPtr<V4L2SliceVideoDecodeAccelerator> weak_this_;
+
+  // To expose client callbacks from VideoDecodeAccelerator.
+  // NOTE: all calls to these objects *MUST* be executed on
+  // child_task_runner_.
+  std::unique_ptr<base::WeakPtrFactory<Client>> client_ptr_factory_;
+  base::WeakPtr<Client> client_;
+  // Callbacks to |decode_client_| must be executed on |decode_task_runner_|.
+  base::WeakPtr<Client> decode_client_;
+
+  scoped_refptr<V4L2Device> device_;
+
+  // This thread services tasks posted from the VDA API entry points by the
+  // child thread and device service callbacks posted from the device thread.
+  base::Thread decoder_thread_;
+  // The device polling thread.
+  base::Thread device_poll_thread_;
+
+  //
+  // Decoder state, owned and operated by decoder_thread_.
+  //
+
+  State state_;
+  // Config::low_latency.
+  bool low_latency_;
+  // Config::latency_tracker. Set in Initialize() and used on all threads.
+  scoped_refptr<FrameLatencyTracker> latency_tracker_;
+
+  VideoCodecProfile video_profile_;
+  uint32_t input_format_fourcc_;
+  uint32_t output_format_fourcc_;
+
+  // The parser and reference frame manager, and its accelerator for the codec
+  // of |video_profile_|.
+  std::unique_ptr<V4L2H264Accelerator> h264_accelerator_;
+  std::unique_ptr<V4L2VP8Accelerator> vp8_accelerator_;
+  std::unique_ptr<V4L2VP9Accelerator> vp9_accelerator_;
+  std::unique_ptr<AcceleratedVideoDecoder> decoder_;
+
+  // Mappings of the client's bitstream buffers, reused across DecodeTask()s.
+  // Declared before the buffers mapped through it, which release their
+  // mappings on destruction.
+  SharedMemoryMappingCache decoder_mapping_cache_;
+  // Input queue for decoder_thread_: BitstreamBuffers in.
+  std::queue<linked_ptr<BitstreamBufferRef>> decoder_input_queue_;
+  // BitstreamBuffer we're presently decoding, set as the stream of |decoder_|.
+  linked_ptr<BitstreamBufferRef> decoder_current_bitstream_buffer_;
+  // Whether a DecodeBufferTask() is posted.
+  bool decoder_decode_buffer_task_scheduled_;
+  // Set if |decoder_| asked for new output buffers, until they are assigned.
+  bool surface_set_change_pending_;
+  // Set between the flush buffer being reached, or dropped by a reset, and
+  // NotifyFlushDone().
+  bool decoder_flushing_;
+  // Set if Reset() was called while waiting for picture buffers.
+  bool reset_pending_;
+
+  // Surfaces queued to the device, in decode order.
+  std::deque<scoped_refptr<V4L2DecodeSurface>> surfaces_at_device_;
+  // Surfaces to output, in display order, with the bitstream id of the picture
+  // each one is output as.
+  std::queue<std::pair<int32_t, scoped_refptr<V4L2DecodeSurface>>>
+      decoder_display_queue_;
+
+  // Input buffer state.
+  bool input_streamon_;
+  int input_buffer_queued_count_;
+  std::vector<InputRecord> input_buffer_map_;
+  std::list<int> free_input_buffers_;
+
+  // Output buffer state.
+  bool output_streamon_;
+  int output_buffer_queued_count_;
+  std::vector<OutputRecord> output_buffer_map_;
+  // As a FIFO, so that the least recently displayed buffers are reused first.
+  std::list<int> free_output_buffers_;
+  // Number of planes (i.e. separate memory buffers) for output.
+  size_t output_planes_count_;
+
+  // Output picture coded size, as aligned by the device.
+  Size coded_size_;
+
+  // The WeakPtrFactory for |weak_this_|.
+  base::WeakPtrFactory<V4L2SliceVideoDecodeAccelerator> weak_this_factory_;
+
+  DISALLOW_COPY_AND_ASSIGN(V4L2SliceVideoDecodeAccelerator);
+};
+
+// A frame being decoded, or decoded and kept by the decoder.
+class V4L2SliceVideoDecodeAccelerator::V4L2DecodeSurface
+    : public base::RefCounted<V4L2DecodeSurface> {
+ public:
+  using ReleaseCB = base::Callback<void(int, int)>;
+
+  // |release_cb| is called with the input record, or -1 once it is queued to
+  // the device, and |output_record| on destruction.
+  V4L2DecodeSurface(int32_t bitstream_id,
+                    int input_record,
+                    int output_record,
+                    const ReleaseCB& release_cb);
+
+  // Keep |ref_surfaces| alive until this surface is decoded, so that the
+  // output buffers it references are not reused in the meantime.
+  void SetReferenceSurfaces(
+      const std::vector<scoped_refptr<V4L2DecodeSurface>>& ref_surfaces);
+  void SetDecoded();
+  // Called once the input buffer is queued to the device, which returns it.
+  void set_input_queued() { input_queued_ = true; }
+
+  // The timestamp of the buffers of this surface, which references to it are
+  // made by. The device copies it from the input buffer to the output buffer.
+  struct timeval timestamp() const;
+  // |timestamp()| in nanoseconds, as used in the controls.
+  uint64_t timestamp_ns() const;
+
+  int32_t bitstream_id() const { return bitstream_id_; }
+  int input_record() const { return input_record_; }
+  int output_record() const { return output_record_; }
+  bool decoded() const { return decoded_; }
+  const Rect& visible_rect() const { return visible_rect_; }
+  void set_visible_rect(const Rect& visible_rect) {
+    visible_rect_ = visible_rect;
+  }
+
+ private:
+  friend class base::RefCounted<V4L2DecodeSurface>;
+  ~V4L2DecodeSurface();
+
+  const int32_t bitstream_id_;
+  const int input_record_;
+  const int output_record_;
+  bool input_queued_;
+  bool decoded_;
+  Rect visible_rect_;
+  std::vector<scoped_refptr<V4L2DecodeSurface>> reference_surfaces_;
+  ReleaseCB release_cb_;
+
+  DISALLOW_COPY_AND_ASSIGN(V4L2DecodeSurface);
+};
+
+// Returns the V4L2_VP9_RESET_FRAME_CTX_* value for the reset_frame_context
+// syntax element of a VP9 uncompressed header. Exposed for testing.
+uint8_t Vp9ResetFrameContextToV4L2(uint8_t reset_frame_context);
+
+}  // namespace media
+
+#endif  // V4L2_SLICE_VIDEO_DECODE_ACCELERATOR_H_
@@ -12,10 +12,14 @@
 #include <linux/videodev2.h>
 #include <poll.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
+#include <algorithm>
+#include <iterator>
+
 #include "base/bind.h"
 #include "base/command_line.h"
 #include "base/message_loop/message_loop.h"
@@ -62,6 +66,20 @@
 
 namespace media {
 
+namespace {
+
+// An H264 NALU found in a bitstream buffer.
+struct NaluIndexEntry {
+  // Offset of the end of the NALU from the start of the bitstream buffer.
+  off_t end;
+  int nal_unit_type;
+  off_t size;
+  // Whether the NALU is a slice with first_mb_in_slice equal to zero.
+  bool first_mb_in_slice_zero;
+};
+
+}  // namespace
+
 // static
 const uint32_t V4L2VideoDecodeAccelerator::supported_input_fourccs_[] = {
     V4L2_PIX_FMT_H264, V4L2_PIX_FMT_VP8, V4L2_PIX_FMT_VP9,
@@ -79,6 +97,15 @@ struct V4L2VideoDecodeAccelerator::BitstreamBufferRef {
   const std::unique_ptr<SharedMemoryRegion> shm;
   size_t bytes_used;
   const int32_t input_id;
+
+  // H264 NALUs of this buffer, built by BuildNaluIndex().
+  bool nalu_index_built;
+  // Set if parsing stopped at an invalid or unsupported NALU after the last
+  // entry of |nalu_index|.
+  bool nalu_index_error;
+  std::vector<NaluIndexEntry> nalu_index;
+  // First entry of |nalu_index| that has not been fully consumed.
+  size_t nalu_index_pos;
 };
 
 V4L2VideoDecodeAccelerator::BitstreamBufferRef::BitstreamBufferRef(
@@ -90,7 +117,10 @@ V4L2VideoDecodeAccelerator::BitstreamBufferRef::BitstreamBufferRef(
       client_task_runner(client_task_runner),
       shm(std::move(shm)),
       bytes_used(0),
-      input_id(input_id) {}
+      input_id(input_id),
+      nalu_index_built(false),
+      nalu_index_error(false),
+      nalu_index_pos(0) {}
 
 V4L2VideoDecodeAccelerator::BitstreamBufferRef::~BitstreamBufferRef() {
   if (input_id >= 0) {
@@ -119,11 +149,14 @@ V4L2VideoDecodeAccelerator::PictureRecord::PictureRecord(bool cleared,
 V4L2VideoDecodeAccelerator::PictureRecord::~PictureRecord() {}
 
 V4L2VideoDecodeAccelerator::V4L2VideoDecodeAccelerator(
-    const scoped_refptr<V4L2Device>& device)
+    const scoped_refptr<V4L2Device>& device,
+    PollMode poll_mode)
     : child_task_runner_(base::ThreadTaskRunnerHandle::Get()),
       decoder_thread_("V4L2DecoderThread"),
       decoder_state_(kUninitialized),
       output_mode_(Config::OutputMode::ALLOCATE),
+      low_latency_(false),
+      decoder_mapping_cache_(kInputMappingCacheSize),
       device_(device),
       decoder_delay_bitstream_buffer_id_(-1),
       decoder_current_input_buffer_(-1),
@@ -134,14 +167,21 @@ V4L2VideoDecodeAccelerator::V4L2VideoDecodeAccelerator(
       flush_awaiting_last_output_buffer_(false),
       reset_pending_(false),
       decoder_partial_frame_pending_(false),
+      decoder_h264_bytes_scanned_(0),
+      decoder_h264_bytes_submitted_(0),
+      input_memory_(V4L2_MEMORY_MMAP),
       input_streamon_(false),
       input_buffer_queued_count_(0),
+      input_buffers_growable_(false),
+      input_buffer_max_length_(0),
       output_streamon_(false),
       output_buffer_queued_count_(0),
       output_dpb_size_(0),
       output_planes_count_(0),
       picture_clearing_count_(0),
       device_poll_thread_("V4L2DevicePollThread"),
+      poll_mode_(poll_mode),
+      device_poll_watching_(false),
       video_profile_(VIDEO_CODEC_PROFILE_UNKNOWN),
       input_format_fourcc_(0),
       output_format_fourcc_(0),
@@ -186,7 +226,7 @@ bool V4L2VideoDecodeAccelerator::Initialize(const Config& config,
   video_profile_ = config.profile;
 
   input_format_fourcc_ =
-      V4L2Device::VideoCodecProfileToV4L2PixFmt(video_profile_);
+      V4L2Device::VideoCodecProfileToV4L2PixFmt(video_profile_, false);
 
   if (!device_->Open(V4L2Device::Type::kDecoder, input_format_fourcc_)) {
     VLOGF(1) << "Failed to open device for profile: " << config.profile
@@ -211,13 +251,19 @@ bool V4L2VideoDecodeAccelerator::Initialize(const Config& config,
     decoder_h264_parser_.reset(new H264Parser());
   }
 
-  if (!decoder_thread_.Start()) {
+  // The device is watched from decoder_thread_'s message loop, if asked to.
+  base::Thread::Options options;
+  if (poll_mode_ == PollMode::kDecoderThread)
+    options.message_loop_type = base::MessageLoop::TYPE_IO;
+  if (!decoder_thread_.StartWithOptions(options)) {
     VLOGF(1) << "decoder thread failed to start";
     return false;
   }
 
   decoder_state_ = kInitialized;
   output_mode_ = config.output_mode;
+  low_latency_ = config.low_latency;
+  latency_tracker_ = config.latency_tracker;
 
   // InitializeTask will NOTIFY_ERROR on failure.
   decoder_thread_.task_runner()->PostTask(
@@ -238,13 +284,14 @@ void V4L2VideoDecodeAccelerator::InitializeTask() {
   sub.type = V4L2_EVENT_SOURCE_CHANGE;
   IOCTL_OR_ERROR_RETURN(VIDIOC_SUBSCRIBE_EVENT, &sub);
 
+  // CreateInputBuffers() depends on this to choose the input memory type.
+  decoder_cmd_supported_ = IsDecoderCmdSupported();
+
   if (!CreateInputBuffers()) {
     NOTIFY_ERROR(PLATFORM_FAILURE);
     return;
   }
 
-  decoder_cmd_supported_ = IsDecoderCmdSupported();
-
   if (!StartDevicePoll())
     return;
 }
@@ -262,6 +309,7 @@ void V4L2VideoDecodeAccelerator::Decode(
     NOTIFY_ERROR(INVALID_ARGUMENT);
     return;
   }
+  RecordLatency(bitstream_buffer.id(), FrameLatencyTracker::Stage::kDecode);
 
   // DecodeTask() will take care of running a DecodeBufferTask().
   decoder_thread_.task_runner()->PostTask(
@@ -286,7 +334,7 @@ void V4L2VideoDecodeAccelerator::AssignPictureBuffersTask(
   DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
   DCHECK_EQ(decoder_state_, kAwaitingPictureBuffers);
 
-  uint32_t req_buffer_count = output_dpb_size_ + kDpbOutputBufferExtraCount;
+  uint32_t req_buffer_count = GetOutputBufferCount();
 
   if (buffers.size() < req_buffer_count) {
     VLOGF(1) << "Failed to provide requested picture buffers. (Got "
@@ -300,7 +348,9 @@ void V4L2VideoDecodeAccelerator::AssignPictureBuffersTask(
   memset(&reqbufs, 0, sizeof(reqbufs));
   reqbufs.count = buffers.size();
   reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-  reqbufs.memory = V4L2_MEMORY_MMAP;
+  // The client imports its own buffers, so the device only needs the buffer
+  // slots and decodes straight into the imported dmabufs.
+  reqbufs.memory = V4L2_MEMORY_DMABUF;
   IOCTL_OR_ERROR_RETURN(VIDIOC_REQBUFS, &reqbufs);
 
   if (reqbufs.count != buffers.size()) {
@@ -402,8 +452,21 @@ void V4L2VideoDecodeAccelerator::ImportBufferForPictureTask(
 
   DCHECK_EQ(output_planes_count_, dmabuf_fds.size());
 
-  iter->processor_output_fds.swap(dmabuf_fds);
+  iter->output_fds.swap(dmabuf_fds);
   free_output_buffers_.push_back(index);
+
+  // The client imports the buffers it was asked for in CreateOutputBuffers().
+  // Once it does, decoding can go on, or a reset postponed in ResetTask() while
+  // awaiting the buffers can finish.
+  if (decoder_state_ == kAwaitingPictureBuffers) {
+    DVLOGF(3) << "Change state to kDecoding";
+    decoder_state_ = kDecoding;
+    if (reset_pending_) {
+      FinishReset();
+      return;
+    }
+  }
+
   if (decoder_state_ != kChangingResolution) {
       Enqueue();
       ScheduleDecodeBufferTaskIfNeeded();
@@ -460,6 +523,13 @@ void V4L2VideoDecodeAccelerator::Destroy() {
   VLOGF(2) << "Destroyed.";
 }
 
+size_t V4L2VideoDecodeAccelerator::GetNumPictureBuffersForDpbSize(
+    size_t dpb_size) const {
+  // The device usually reports the DPB size as V4L2_CID_MIN_BUFFERS_FOR_CAPTURE.
+  return dpb_size + (low_latency_ ? kDpbOutputBufferExtraCountForLowLatency
+                                  : kDpbOutputBufferExtraCount);
+}
+
 bool V4L2VideoDecodeAccelerator::TryToSetupDecodeOnSeparateThread(
     const base::WeakPtr<Client>& decode_client,
     const scoped_refptr<base::SingleThreadTaskRunner>& decode_task_runner) {
@@ -472,7 +542,7 @@ bool V4L2VideoDecodeAccelerator::TryToSetupDecodeOnSeparateThread(
 // static
 VideoDecodeAccelerator::SupportedProfiles
 V4L2VideoDecodeAccelerator::GetSupportedProfiles() {
-    scoped_refptr<V4L2Device> device(new V4L2Device());
+  scoped_refptr<V4L2Device> device = V4L2Device::Create();
   if (!device)
     return SupportedProfiles();
 
@@ -496,12 +566,17 @@ void V4L2VideoDecodeAccelerator::DecodeTask(
   if (bitstream_buffer.size() == 0)
     return;
 
-  if (!bitstream_record->shm->Map()) {
+  // The buffer is queued to the device as a dmabuf and never read by us.
+  if (input_memory_ == V4L2_MEMORY_DMABUF) {
+    DVLOGF(4) << "dmabuf fd=" << bitstream_record->shm->fd()
+              << ", offset=" << bitstream_record->shm->offset();
+  } else if (!bitstream_record->shm->Map(&decoder_mapping_cache_)) {
     VLOGF(1) << "could not map bitstream_buffer";
     NOTIFY_ERROR(UNREADABLE_INPUT);
     return;
+  } else {
+    DVLOGF(4) << "mapped at=" << bitstream_record->shm->memory();
   }
-  DVLOGF(4) << "mapped at=" << bitstream_record->shm->memory();
 
   if (decoder_state_ == kResetting || decoder_flushing_) {
     // In the case that we're resetting or flushing, we need to delay decoding
@@ -529,20 +604,31 @@ void V4L2VideoDecodeAccelerator::DecodeBufferTask() {
 
   decoder_decode_buffer_tasks_scheduled_--;
 
+  // Drain as much of decoder_input_queue_ as the input buffers allow, but
+  // yield after a while so that ServiceDeviceTask() can recycle buffers.
+  for (int i = 0; i < kDecodeBufferTaskBudget; ++i) {
+    if (!DecodeBufferFragment())
+      return;
+  }
+  ScheduleDecodeBufferTaskIfNeeded();
+}
+
+bool V4L2VideoDecodeAccelerator::DecodeBufferFragment() {
+  DVLOGF(4);
   if (decoder_state_ != kInitialized && decoder_state_ != kDecoding) {
     DVLOGF(3) << "early out: state=" << decoder_state_;
-    return;
+    return false;
   }
 
   if (decoder_current_bitstream_buffer_ == NULL) {
     if (decoder_input_queue_.empty()) {
       // We're waiting for a new buffer -- exit without scheduling a new task.
-      return;
+      return false;
     }
     linked_ptr<BitstreamBufferRef>& buffer_ref = decoder_input_queue_.front();
     if (decoder_delay_bitstream_buffer_id_ == buffer_ref->input_id) {
       // We're asked to delay decoding on this and subsequent buffers.
-      return;
+      return false;
     }
 
     // Setup to use the next buffer.
@@ -586,6 +672,10 @@ void V4L2VideoDecodeAccelerator::DecodeBufferTask() {
   } else if (shm->size() == 0) {
     // This is a buffer queued from the client that has zero size.  Skip.
     schedule_task = true;
+  } else if (input_memory_ == V4L2_MEMORY_DMABUF) {
+    // The whole buffer is handed to the device and to the input record that
+    // queues it, which returns it to the client once it is dequeued.
+    return DecodeBufferDmabuf();
   } else {
     // This is a buffer queued from the client, with actual contents.  Decode.
     const uint8_t* const data =
@@ -595,7 +685,7 @@ void V4L2VideoDecodeAccelerator::DecodeBufferTask() {
         shm->size() - decoder_current_bitstream_buffer_->bytes_used;
     if (!AdvanceFrameFragment(data, data_size, &decoded_size)) {
       NOTIFY_ERROR(UNREADABLE_INPUT);
-      return;
+      return false;
     }
     // AdvanceFrameFragment should not return a size larger than the buffer
     // size, even on invalid data.
@@ -610,16 +700,18 @@ void V4L2VideoDecodeAccelerator::DecodeBufferTask() {
         break;
       default:
         NOTIFY_ERROR(ILLEGAL_STATE);
-        return;
+        return false;
     }
   }
   if (decoder_state_ == kError) {
     // Failed during decode.
-    return;
+    return false;
   }
 
   if (schedule_task) {
     decoder_current_bitstream_buffer_->bytes_used += decoded_size;
+    if (decoder_h264_parser_)
+      decoder_h264_bytes_submitted_ += decoded_size;
     if ((shm ? shm->size() : 0) ==
         decoder_current_bitstream_buffer_->bytes_used) {
       // Our current bitstream buffer is done; return it.
@@ -628,8 +720,39 @@ void V4L2VideoDecodeAccelerator::DecodeBufferTask() {
       // BitstreamBufferRef destructor calls NotifyEndOfBitstreamBuffer().
       decoder_current_bitstream_buffer_.reset();
     }
-    ScheduleDecodeBufferTaskIfNeeded();
   }
+  return schedule_task;
+}
+
+void V4L2VideoDecodeAccelerator::BuildNaluIndex(BitstreamBufferRef* buffer,
+                                                const uint8_t* data) {
+  DCHECK(!buffer->nalu_index_built);
+  const size_t size = buffer->shm->size();
+  decoder_h264_parser_->SetStream(data, size);
+  decoder_h264_bytes_scanned_ += size;
+
+  H264NALU nalu;
+  for (;;) {
+    const H264Parser::Result result =
+        decoder_h264_parser_->AdvanceToNextNALU(&nalu);
+    if (result == H264Parser::kEOStream)
+      break;
+    if (result != H264Parser::kOk) {
+      buffer->nalu_index_error = true;
+      break;
+    }
+    // The "first_mb_in_slice" field is Exp-Golomb coded starting on the eighth
+    // data bit of the NAL; a zero value is encoded with a leading '1' bit in
+    // the byte, which we can detect as the byte being (unsigned) greater than
+    // or equal to 0x80.
+    const bool first_mb_in_slice_zero = nalu.size > 1 && nalu.data[1] >= 0x80;
+    buffer->nalu_index.push_back({(nalu.data + nalu.size) - data,
+                                  nalu.nal_unit_type, nalu.size,
+                                  first_mb_in_slice_zero});
+  }
+  buffer->nalu_index_built = true;
+  DVLOGF(4) << "input_id=" << buffer->input_id
+            << ", NALUs=" << buffer->nalu_index.size();
 }
 
 bool V4L2VideoDecodeAccelerator::AdvanceFrameFragment(const uint8_t* data,
@@ -637,37 +760,40 @@ bool V4L2VideoDecodeAccelerator::AdvanceFrameFragment(const uint8_t* data,
                                                       size_t* endpos) {
   if (video_profile_ >= H264PROFILE_MIN && video_profile_ <= H264PROFILE_MAX) {
     // For H264, we need to feed HW one frame at a time.  This is going to take
-    // some parsing of our input stream.
-    decoder_h264_parser_->SetStream(data, size);
-    H264NALU nalu;
-    H264Parser::Result result;
+    // some parsing of our input stream. The whole bitstream buffer is parsed
+    // once; |data| always starts at a NALU boundary we returned before.
+    BitstreamBufferRef* buffer = decoder_current_bitstream_buffer_.get();
+    const off_t start = buffer->bytes_used;
+    if (!buffer->nalu_index_built)
+      BuildNaluIndex(buffer, data - start);
+    const std::vector<NaluIndexEntry>& index = buffer->nalu_index;
+    while (buffer->nalu_index_pos < index.size() &&
+           index[buffer->nalu_index_pos].end <= start) {
+      ++buffer->nalu_index_pos;
+    }
     *endpos = 0;
 
     // Keep on peeking the next NALs while they don't indicate a frame
     // boundary.
-    for (;;) {
-      bool end_of_frame = false;
-      result = decoder_h264_parser_->AdvanceToNextNALU(&nalu);
-      if (result == H264Parser::kInvalidStream ||
-          result == H264Parser::kUnsupportedStream)
-        return false;
-      if (result == H264Parser::kEOStream) {
+    for (size_t i = buffer->nalu_index_pos;; ++i) {
+      if (i == index.size()) {
+        if (buffer->nalu_index_error)
+          return false;
         // We've reached the end of the buffer before finding a frame boundary.
         decoder_partial_frame_pending_ = true;
         *endpos = size;
         return true;
       }
+      const NaluIndexEntry& nalu = index[i];
+      bool end_of_frame = false;
       switch (nalu.nal_unit_type) {
         case H264NALU::kNonIDRSlice:
         case H264NALU::kIDRSlice:
           if (nalu.size < 1)
             return false;
           // For these two, if the "first_mb_in_slice" field is zero, start a
-          // new frame and return.  This field is Exp-Golomb coded starting on
-          // the eighth data bit of the NAL; a zero value is encoded with a
-          // leading '1' bit in the byte, which we can detect as the byte being
-          // (unsigned) greater than or equal to 0x80.
-          if (nalu.data[1] >= 0x80) {
+          // new frame and return.
+          if (nalu.first_mb_in_slice_zero) {
             end_of_frame = true;
             break;
           }
@@ -703,7 +829,7 @@ bool V4L2VideoDecodeAccelerator::AdvanceFrameFragment(const uint8_t* data,
           return true;
         }
       }
-      *endpos = (nalu.data + nalu.size) - data;
+      *endpos = nalu.end - start;
     }
     NOTREACHED();
     return false;
@@ -721,11 +847,11 @@ bool V4L2VideoDecodeAccelerator::AdvanceFrameFragment(const uint8_t* data,
 void V4L2VideoDecodeAccelerator::ScheduleDecodeBufferTaskIfNeeded() {
   DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
 
-  // If we're behind on tasks, schedule another one.
-  int buffers_to_decode = decoder_input_queue_.size();
-  if (decoder_current_bitstream_buffer_ != NULL)
-    buffers_to_decode++;
-  if (decoder_decode_buffer_tasks_scheduled_ < buffers_to_decode) {
+  // DecodeBufferTask() decodes as many buffers as it can, so one scheduled
+  // task is enough.
+  if (decoder_decode_buffer_tasks_scheduled_ == 0 &&
+      (decoder_current_bitstream_buffer_ != NULL ||
+       !decoder_input_queue_.empty())) {
     decoder_decode_buffer_tasks_scheduled_++;
     decoder_thread_.task_runner()->PostTask(
         FROM_HERE, base::Bind(&V4L2VideoDecodeAccelerator::DecodeBufferTask,
@@ -786,6 +912,51 @@ bool V4L2VideoDecodeAccelerator::DecodeBufferContinue(const void* data,
           (decoder_partial_frame_pending_ || FlushInputFrame()));
 }
 
+bool V4L2VideoDecodeAccelerator::DecodeBufferDmabuf() {
+  DVLOGF(4);
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK_EQ(input_memory_, V4L2_MEMORY_DMABUF);
+  DCHECK(decoder_state_ == kInitialized || decoder_state_ == kDecoding);
+  // VP8/VP9 buffers are never split into frames, so nothing can be pending.
+  DCHECK_EQ(decoder_current_input_buffer_, -1);
+  DCHECK_EQ(decoder_current_bitstream_buffer_->bytes_used, 0u);
+
+  if (free_input_buffers_.empty()) {
+    Dequeue();
+    if (free_input_buffers_.empty()) {
+      DVLOGF(4) << "stalled for input buffers";
+      return false;
+    }
+  }
+  const int index = free_input_buffers_.back();
+  free_input_buffers_.pop_back();
+  InputRecord& input_record = input_buffer_map_[index];
+  DCHECK_EQ(input_record.bytes_used, 0);
+  DCHECK_EQ(input_record.input_id, -1);
+  DCHECK(!input_record.bitstream_buffer);
+
+  input_record.input_id = decoder_current_bitstream_buffer_->input_id;
+  input_record.bytes_used = decoder_current_bitstream_buffer_->shm->size();
+  decoder_current_bitstream_buffer_->bytes_used = input_record.bytes_used;
+  input_record.bitstream_buffer = std::move(decoder_current_bitstream_buffer_);
+  decoder_partial_frame_pending_ = false;
+
+  input_ready_queue_.push(index);
+  DVLOGF(4) << "submitting input_id=" << input_record.input_id;
+  Enqueue();
+  if (decoder_state_ == kError)
+    return false;
+
+  if (decoder_state_ == kInitialized) {
+    // Same as DecodeBufferInitial(): keep feeding the device until the format
+    // is known and the output buffers are allocated.
+    Dequeue();
+    if (!coded_size_.IsEmpty() && !output_buffer_map_.empty())
+      decoder_state_ = kDecoding;
+  }
+  return true;
+}
+
 bool V4L2VideoDecodeAccelerator::AppendToInputFrame(const void* data,
                                                     size_t size) {
   DVLOGF(4);
@@ -796,11 +967,26 @@ bool V4L2VideoDecodeAccelerator::AppendToInputFrame(const void* data,
   // This routine can handle data == NULL and size == 0, which occurs when
   // we queue an empty buffer for the purposes of flushing the pipe.
 
-  // Flush if we're too big
-  if (decoder_current_input_buffer_ != -1) {
-    InputRecord& input_record =
-        input_buffer_map_[decoder_current_input_buffer_];
-    if (input_record.bytes_used + size > input_record.length) {
+  // The frame does not fit in the buffer we're filling. Move it to a larger
+  // one rather than splitting it, which the device would take as two frames.
+  // Flush if there is no larger buffer and we cannot add one.
+  if (decoder_current_input_buffer_ != -1 &&
+      input_buffer_map_[decoder_current_input_buffer_].bytes_used + size >
+          input_buffer_map_[decoder_current_input_buffer_].length) {
+    const size_t frame_size =
+        input_buffer_map_[decoder_current_input_buffer_].bytes_used + size;
+    if (frame_size <= input_buffer_max_length_) {
+      if (!MoveInputFrameToFreeBuffer(frame_size)) {
+        Dequeue();
+        if (!MoveInputFrameToFreeBuffer(frame_size)) {
+          DVLOGF(4) << "stalled for a larger input buffer";
+          return false;
+        }
+      }
+    } else if (!AddInputBuffers(
+                   std::max(frame_size, GetInputBufferSize(coded_size_))) ||
+               !MoveInputFrameToFreeBuffer(frame_size)) {
+      VLOGF(2) << "splitting a frame of at least " << frame_size << " bytes";
       if (!FlushInputFrame())
         return false;
       decoder_current_input_buffer_ = -1;
@@ -809,17 +995,32 @@ bool V4L2VideoDecodeAccelerator::AppendToInputFrame(const void* data,
 
   // Try to get an available input buffer
   if (decoder_current_input_buffer_ == -1) {
-    if (free_input_buffers_.empty()) {
+    if (!TakeFreeInputBuffer(size)) {
       // See if we can get more free buffers from HW
       Dequeue();
-      if (free_input_buffers_.empty()) {
-        // Nope!
-        DVLOGF(4) << "stalled for input buffers";
-        return false;
+      if (!TakeFreeInputBuffer(size)) {
+        if (size <= input_buffer_max_length_) {
+          // Nope!
+          DVLOGF(4) << "stalled for input buffers";
+          return false;
+        }
+        // None of the buffers is large enough, add larger ones.
+        const size_t buffer_size =
+            std::max(size, GetInputBufferSize(coded_size_));
+        if (!AddInputBuffers(buffer_size)) {
+          VLOGF(1) << "over-size frame, erroring";
+          NOTIFY_ERROR(UNREADABLE_INPUT);
+          return false;
+        }
+        // The device may have made the buffers smaller than asked for.
+        if (!TakeFreeInputBuffer(size)) {
+          VLOGF(1) << "added input buffers are smaller than " << size
+                   << " bytes";
+          NOTIFY_ERROR(PLATFORM_FAILURE);
+          return false;
+        }
       }
     }
-    decoder_current_input_buffer_ = free_input_buffers_.back();
-    free_input_buffers_.pop_back();
     InputRecord& input_record =
         input_buffer_map_[decoder_current_input_buffer_];
     DCHECK_EQ(input_record.bytes_used, 0);
@@ -838,11 +1039,7 @@ bool V4L2VideoDecodeAccelerator::AppendToInputFrame(const void* data,
 
   // Copy in to the buffer.
   InputRecord& input_record = input_buffer_map_[decoder_current_input_buffer_];
-  if (size > input_record.length - input_record.bytes_used) {
-    VLOGF(1) << "over-size frame, erroring";
-    NOTIFY_ERROR(UNREADABLE_INPUT);
-    return false;
-  }
+  DCHECK_LE(size, input_record.length - input_record.bytes_used);
   memcpy(reinterpret_cast<uint8_t*>(input_record.address) +
              input_record.bytes_used,
          data, size);
@@ -851,6 +1048,87 @@ bool V4L2VideoDecodeAccelerator::AppendToInputFrame(const void* data,
   return true;
 }
 
+bool V4L2VideoDecodeAccelerator::TakeFreeInputBuffer(size_t size) {
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  // Prefer the most recently freed buffer, as a LIFO.
+  for (auto it = free_input_buffers_.rbegin(); it != free_input_buffers_.rend();
+       ++it) {
+    if (input_buffer_map_[*it].length >= size) {
+      decoder_current_input_buffer_ = *it;
+      free_input_buffers_.erase(std::next(it).base());
+      return true;
+    }
+  }
+  return false;
+}
+
+bool V4L2VideoDecodeAccelerator::MoveInputFrameToFreeBuffer(size_t size) {
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK_NE(decoder_current_input_buffer_, -1);
+  const int old_index = decoder_current_input_buffer_;
+  if (!TakeFreeInputBuffer(size))
+    return false;
+
+  InputRecord& old_record = input_buffer_map_[old_index];
+  InputRecord& new_record = input_buffer_map_[decoder_current_input_buffer_];
+  DCHECK_EQ(new_record.bytes_used, 0);
+  DCHECK_EQ(new_record.input_id, -1);
+  memcpy(new_record.address, old_record.address, old_record.bytes_used);
+  new_record.bytes_used = old_record.bytes_used;
+  new_record.input_id = old_record.input_id;
+  old_record.bytes_used = 0;
+  old_record.input_id = -1;
+  free_input_buffers_.push_back(old_index);
+  return true;
+}
+
+// static
+size_t V4L2VideoDecodeAccelerator::GetInputBufferSize(const Size& coded_size) {
+  const size_t area = static_cast<size_t>(coded_size.width()) *
+                      static_cast<size_t>(coded_size.height());
+  return std::max<size_t>(kInputBufferInitialSize, area / 2);
+}
+
+bool V4L2VideoDecodeAccelerator::AddInputBuffers(size_t buffer_size) {
+  VLOGF(2) << "buffer_size=" << buffer_size;
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK_EQ(input_memory_, V4L2_MEMORY_MMAP);
+
+  if (!input_buffers_growable_ ||
+      input_buffer_map_.size() + kInputBufferGrowCount > VIDEO_MAX_FRAME) {
+    VLOGF(1) << "Cannot add more input buffers";
+    return false;
+  }
+
+  // VIDIOC_CREATE_BUFS can be called while streaming, so the buffers already
+  // queued are left alone.
+  struct v4l2_create_buffers create;
+  memset(&create, 0, sizeof(create));
+  create.count = kInputBufferGrowCount;
+  create.memory = V4L2_MEMORY_MMAP;
+  create.format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  if (device_->Ioctl(VIDIOC_G_FMT, &create.format) != 0) {
+    VPLOGF(1) << "ioctl() failed: VIDIOC_G_FMT";
+    return false;
+  }
+  create.format.fmt.pix_mp.plane_fmt[0].sizeimage = buffer_size;
+  if (device_->Ioctl(VIDIOC_CREATE_BUFS, &create) != 0) {
+    VPLOGF(1) << "ioctl() failed: VIDIOC_CREATE_BUFS";
+    return false;
+  }
+  DCHECK_EQ(create.index, input_buffer_map_.size());
+
+  input_buffer_map_.resize(create.index + create.count);
+  for (size_t i = create.index; i < input_buffer_map_.size(); ++i) {
+    if (!MapInputBuffer(i))
+      return false;
+    free_input_buffers_.push_back(i);
+  }
+  VLOGF(2) << "input buffers: " << input_buffer_map_.size()
+           << ", largest: " << input_buffer_max_length_;
+  return true;
+}
+
 bool V4L2VideoDecodeAccelerator::FlushInputFrame() {
   DVLOGF(4);
   DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
@@ -888,23 +1166,45 @@ bool V4L2VideoDecodeAccelerator::FlushInputFrame() {
 }
 
 void V4L2VideoDecodeAccelerator::ServiceDeviceTask(bool event_pending) {
+  DVLOGF(4);
+  // poll() doesn't tell which queue is ready, so service both.
+  ServiceDevice(EPOLLIN | EPOLLOUT | (event_pending ? EPOLLPRI : 0));
+}
+
+void V4L2VideoDecodeAccelerator::OnFileCanReadWithoutBlocking(int fd) {
   DVLOGF(4);
   DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
-  DCHECK_NE(decoder_state_, kUninitialized);
+  DCHECK_EQ(poll_mode_, PollMode::kDecoderThread);
 
-  if (decoder_state_ == kResetting) {
-    DVLOGF(3) << "early out: kResetting state";
-    return;
-  } else if (decoder_state_ == kError) {
-    DVLOGF(3) << "early out: kError state";
+  uint32_t device_events = 0;
+  if (!device_->GetEpollEvents(&device_events)) {
+    NOTIFY_ERROR(PLATFORM_FAILURE);
     return;
-  } else if (decoder_state_ == kChangingResolution) {
-    DVLOGF(3) << "early out: kChangingResolution state";
+  }
+  ServiceDevice(device_events);
+}
+
+void V4L2VideoDecodeAccelerator::OnFileCanWriteWithoutBlocking(int fd) {
+  NOTREACHED();
+}
+
+void V4L2VideoDecodeAccelerator::ServiceDevice(uint32_t device_events) {
+  DVLOGF(4) << "device_events=0x" << std::hex << device_events;
+  DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
+  DCHECK_NE(decoder_state_, kUninitialized);
+
+  if (decoder_state_ == kResetting || decoder_state_ == kError ||
+      decoder_state_ == kChangingResolution) {
+    DVLOGF(3) << "early out: state=" << decoder_state_;
+    // device_poll_thread_ is not asked to poll again in these states. Stop
+    // watching the device too, until StartDevicePoll().
+    if (poll_mode_ == PollMode::kDecoderThread)
+      StopDevicePoll();
     return;
   }
 
   bool resolution_change_pending = false;
-  if (event_pending)
+  if (device_events & EPOLLPRI)
     resolution_change_pending = DequeueResolutionChangeEvent();
 
   if (!resolution_change_pending && coded_size_.IsEmpty()) {
@@ -925,7 +1225,10 @@ void V4L2VideoDecodeAccelerator::ServiceDeviceTask(bool event_pending) {
     }
   }
 
-  Dequeue();
+  // EPOLLERR is reported when the queues are in an error state or idle, let the
+  // dequeues tell.
+  DequeueQueues(device_events & (EPOLLOUT | EPOLLERR),
+                device_events & (EPOLLIN | EPOLLERR));
   Enqueue();
 
   // Clear the interrupt fd.
@@ -940,17 +1243,26 @@ void V4L2VideoDecodeAccelerator::ServiceDeviceTask(bool event_pending) {
   if (input_buffer_queued_count_ + output_buffer_queued_count_ > 0)
     poll_device = true;
 
-  // ServiceDeviceTask() should only ever be scheduled from DevicePollTask(),
-  // so either:
-  // * device_poll_thread_ is running normally
-  // * device_poll_thread_ scheduled us, but then a ResetTask() or DestroyTask()
-  //   shut it down, in which case we're either in kResetting or kError states
-  //   respectively, and we should have early-outed already.
-  DCHECK(device_poll_thread_.message_loop());
-  // Queue the DevicePollTask() now.
-  device_poll_thread_.task_runner()->PostTask(
-      FROM_HERE, base::Bind(&V4L2VideoDecodeAccelerator::DevicePollTask,
-                            base::Unretained(this), poll_device));
+  if (poll_mode_ == PollMode::kDecoderThread) {
+    // We keep watching the device, just update what for.
+    DCHECK(device_poll_watching_);
+    if (!device_->SetEpollDevice(poll_device)) {
+      NOTIFY_ERROR(PLATFORM_FAILURE);
+      return;
+    }
+  } else {
+    // ServiceDeviceTask() should only ever be scheduled from DevicePollTask(),
+    // so either:
+    // * device_poll_thread_ is running normally
+    // * device_poll_thread_ scheduled us, but then a ResetTask() or
+    //   DestroyTask() shut it down, in which case we're either in kResetting
+    //   or kError states respectively, and we should have early-outed already.
+    DCHECK(device_poll_thread_.message_loop());
+    // Queue the DevicePollTask() now.
+    device_poll_thread_.task_runner()->PostTask(
+        FROM_HERE, base::Bind(&V4L2VideoDecodeAccelerator::DevicePollTask,
+                              base::Unretained(this), poll_device));
+  }
 
   DVLOGF(3) << "ServiceDeviceTask(): buffer counts: DEC["
             << decoder_input_queue_.size() << "->"
@@ -1062,15 +1374,20 @@ bool V4L2VideoDecodeAccelerator::DequeueResolutionChangeEvent() {
 }
 
 void V4L2VideoDecodeAccelerator::Dequeue() {
+  DequeueQueues(true, true);
+}
+
+void V4L2VideoDecodeAccelerator::DequeueQueues(bool dequeue_input,
+                                               bool dequeue_output) {
   DVLOGF(4);
   DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
   DCHECK_NE(decoder_state_, kUninitialized);
 
-  while (input_buffer_queued_count_ > 0) {
+  while (dequeue_input && input_buffer_queued_count_ > 0) {
     if (!DequeueInputBuffer())
       break;
   }
-  while (output_buffer_queued_count_ > 0) {
+  while (dequeue_output && output_buffer_queued_count_ > 0) {
     if (!DequeueOutputBuffer())
       break;
   }
@@ -1089,7 +1406,7 @@ bool V4L2VideoDecodeAccelerator::DequeueInputBuffer() {
   memset(&dqbuf, 0, sizeof(dqbuf));
   memset(planes, 0, sizeof(planes));
   dqbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-  dqbuf.memory = V4L2_MEMORY_MMAP;
+  dqbuf.memory = input_memory_;
   dqbuf.m.planes = planes;
   dqbuf.length = 1;
   if (device_->Ioctl(VIDIOC_DQBUF, &dqbuf) != 0) {
@@ -1103,10 +1420,14 @@ bool V4L2VideoDecodeAccelerator::DequeueInputBuffer() {
   }
   InputRecord& input_record = input_buffer_map_[dqbuf.index];
   DCHECK(input_record.at_device);
+  RecordLatency(input_record.input_id,
+                FrameLatencyTracker::Stage::kInputDequeued);
   free_input_buffers_.push_back(dqbuf.index);
   input_record.at_device = false;
   input_record.bytes_used = 0;
   input_record.input_id = -1;
+  // BitstreamBufferRef destructor calls NotifyEndOfBitstreamBuffer().
+  input_record.bitstream_buffer.reset();
   input_buffer_queued_count_--;
 
   return true;
@@ -1125,7 +1446,7 @@ bool V4L2VideoDecodeAccelerator::DequeueOutputBuffer() {
   memset(&dqbuf, 0, sizeof(dqbuf));
   memset(planes.get(), 0, sizeof(struct v4l2_plane) * output_planes_count_);
   dqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-  dqbuf.memory = V4L2_MEMORY_MMAP;
+  dqbuf.memory = V4L2_MEMORY_DMABUF;
   dqbuf.m.planes = planes.get();
   dqbuf.length = output_planes_count_;
   if (device_->Ioctl(VIDIOC_DQBUF, &dqbuf) != 0) {
@@ -1153,6 +1474,8 @@ bool V4L2VideoDecodeAccelerator::DequeueOutputBuffer() {
     DCHECK_GE(bitstream_buffer_id, 0);
     DVLOGF(4) << "Dequeue output buffer: dqbuf index=" << dqbuf.index
               << " bitstream input_id=" << bitstream_buffer_id;
+    RecordLatency(bitstream_buffer_id,
+                  FrameLatencyTracker::Stage::kOutputDequeued);
     output_record.state = kAtClient;
     decoder_frames_at_client_++;
 
@@ -1191,11 +1514,21 @@ bool V4L2VideoDecodeAccelerator::EnqueueInputRecord() {
   qbuf.index = buffer;
   qbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
   qbuf.timestamp.tv_sec = input_record.input_id;
-  qbuf.memory = V4L2_MEMORY_MMAP;
+  qbuf.memory = input_memory_;
   qbuf.m.planes = &qbuf_plane;
   qbuf.m.planes[0].bytesused = input_record.bytes_used;
+  if (input_memory_ == V4L2_MEMORY_DMABUF) {
+    DCHECK(input_record.bitstream_buffer);
+    const auto& shm = input_record.bitstream_buffer->shm;
+    // |bytesused| includes |data_offset|, see the V4L2 spec.
+    qbuf.m.planes[0].m.fd = shm->fd();
+    qbuf.m.planes[0].data_offset = shm->offset();
+    qbuf.m.planes[0].bytesused += shm->offset();
+  }
   qbuf.length = 1;
   IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_QBUF, &qbuf);
+  RecordLatency(input_record.input_id,
+                FrameLatencyTracker::Stage::kInputQueued);
   input_ready_queue_.pop();
   input_record.at_device = true;
   input_buffer_queued_count_++;
@@ -1213,15 +1546,18 @@ bool V4L2VideoDecodeAccelerator::EnqueueOutputRecord() {
   OutputRecord& output_record = output_buffer_map_[buffer];
   DCHECK_EQ(output_record.state, kFree);
   DCHECK_NE(output_record.picture_id, -1);
+  DCHECK_EQ(output_record.output_fds.size(), output_planes_count_);
   struct v4l2_buffer qbuf;
   std::unique_ptr<struct v4l2_plane[]> qbuf_planes(
       new v4l2_plane[output_planes_count_]);
   memset(&qbuf, 0, sizeof(qbuf));
   memset(qbuf_planes.get(), 0,
          sizeof(struct v4l2_plane) * output_planes_count_);
+  for (size_t i = 0; i < output_planes_count_; ++i)
+    qbuf_planes[i].m.fd = output_record.output_fds[i].get();
   qbuf.index = buffer;
   qbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-  qbuf.memory = V4L2_MEMORY_MMAP;
+  qbuf.memory = V4L2_MEMORY_DMABUF;
   qbuf.m.planes = qbuf_planes.get();
   qbuf.length = output_planes_count_;
   DVLOGF(4) << "qbuf.index=" << qbuf.index;
@@ -1395,6 +1731,8 @@ void V4L2VideoDecodeAccelerator::ResetTask() {
   decoder_current_bitstream_buffer_.reset();
   while (!decoder_input_queue_.empty())
     decoder_input_queue_.pop();
+  // The client may replace its bitstream buffers after a reset.
+  decoder_mapping_cache_.Clear();
 
   decoder_current_input_buffer_ = -1;
 
@@ -1457,7 +1795,7 @@ void V4L2VideoDecodeAccelerator::ResetDoneTask() {
   }
 
   // Start poll thread if NotifyFlushDoneIfNeeded has not already.
-  if (!device_poll_thread_.IsRunning()) {
+  if (!IsDevicePollRunning()) {
     if (!StartDevicePoll())
       return;
   }
@@ -1502,13 +1840,33 @@ void V4L2VideoDecodeAccelerator::DestroyTask() {
 
   DestroyInputBuffers();
   DestroyOutputBuffers();
+
+  VLOGF(2) << "bitstream mapping cache hits: " << decoder_mapping_cache_.hits()
+           << ", misses: " << decoder_mapping_cache_.misses()
+           << ", H264 bytes scanned: " << decoder_h264_bytes_scanned_
+           << ", submitted: " << decoder_h264_bytes_submitted_;
+  decoder_mapping_cache_.Clear();
 }
 
 bool V4L2VideoDecodeAccelerator::StartDevicePoll() {
   DVLOGF(3);
-  DCHECK(!device_poll_thread_.IsRunning());
+  DCHECK(!IsDevicePollRunning());
   DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
 
+  if (poll_mode_ == PollMode::kDecoderThread) {
+    // Like the first DevicePollTask(), only the interrupt is watched until
+    // ServiceDevice() finds buffers queued.
+    if (!base::MessageLoopForIO::current()->WatchFileDescriptor(
+            device_->GetEpollFd(), true, base::MessageLoopForIO::WATCH_READ,
+            &device_poll_watcher_, this)) {
+      VLOGF(1) << "Failed watching the device";
+      NOTIFY_ERROR(PLATFORM_FAILURE);
+      return false;
+    }
+    device_poll_watching_ = true;
+    return true;
+  }
+
   // Start up the device poll thread and schedule its first DevicePollTask().
   if (!device_poll_thread_.Start()) {
     VLOGF(1) << "Device thread failed to start";
@@ -1525,12 +1883,24 @@ bool V4L2VideoDecodeAccelerator::StartDevicePoll() {
 bool V4L2VideoDecodeAccelerator::StopDevicePoll() {
   DVLOGF(3);
 
-  if (!device_poll_thread_.IsRunning())
+  if (!IsDevicePollRunning())
     return true;
 
   if (decoder_thread_.IsRunning())
     DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
 
+  if (poll_mode_ == PollMode::kDecoderThread) {
+    device_poll_watcher_.StopWatchingFileDescriptor();
+    device_poll_watching_ = false;
+    if (!device_->ClearDevicePollInterrupt() ||
+        !device_->SetEpollDevice(false)) {
+      NOTIFY_ERROR(PLATFORM_FAILURE);
+      return false;
+    }
+    DVLOGF(3) << "device watch stopped";
+    return true;
+  }
+
   // Signal the DevicePollTask() to stop, and stop the device poll thread.
   if (!device_->SetDevicePollInterrupt()) {
     VPLOGF(1) << "SetDevicePollInterrupt(): failed";
@@ -1547,6 +1917,12 @@ bool V4L2VideoDecodeAccelerator::StopDevicePoll() {
   return true;
 }
 
+bool V4L2VideoDecodeAccelerator::IsDevicePollRunning() const {
+  if (poll_mode_ == PollMode::kDecoderThread)
+    return device_poll_watching_;
+  return device_poll_thread_.IsRunning();
+}
+
 bool V4L2VideoDecodeAccelerator::StopOutputStream() {
   VLOGF(2);
   if (!output_streamon_)
@@ -1591,6 +1967,7 @@ bool V4L2VideoDecodeAccelerator::StopInputStream() {
     input_buffer_map_[i].at_device = false;
     input_buffer_map_[i].bytes_used = 0;
     input_buffer_map_[i].input_id = -1;
+    input_buffer_map_[i].bitstream_buffer.reset();
   }
   input_buffer_queued_count_ = 0;
 
@@ -1615,6 +1992,9 @@ void V4L2VideoDecodeAccelerator::StartResolutionChange() {
     NOTIFY_ERROR(PLATFORM_FAILURE);
     return;
   }
+  // The client may also reallocate its bitstream buffers for the new size.
+  // Mappings of the buffers still queued stay alive until they are returned.
+  decoder_mapping_cache_.Clear();
 
   FinishResolutionChange();
 }
@@ -1747,6 +2127,15 @@ bool V4L2VideoDecodeAccelerator::CreateBuffersForFormat(
            << ", visible size: " << visible_size_.ToString()
            << ", decoder output planes count: " << output_planes_count_;
 
+  // Now that the resolution is known, make room for its largest frames up
+  // front rather than on the first one that does not fit. Failing here is not
+  // fatal, the frames may still fit.
+  const size_t input_size = GetInputBufferSize(coded_size_);
+  if (input_memory_ == V4L2_MEMORY_MMAP && input_buffers_growable_ &&
+      input_size > input_buffer_max_length_) {
+    AddInputBuffers(input_size);
+  }
+
   return CreateOutputBuffers();
 }
 
@@ -1811,39 +2200,68 @@ bool V4L2VideoDecodeAccelerator::CreateInputBuffers() {
   memset(&reqbufs, 0, sizeof(reqbufs));
   reqbufs.count = kInputBufferCount;
   reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+
+  // VP8/VP9 bitstream buffers always carry whole frames, so they can be queued
+  // to the device as they are. H264 buffers need to be split or merged into
+  // frames, which needs a copy. The flush buffer carries no dmabuf, so this
+  // also requires V4L2_DEC_CMD_STOP to flush.
+  if (video_profile_ >= VP8PROFILE_MIN && video_profile_ <= VP9PROFILE_MAX &&
+      decoder_cmd_supported_) {
+    reqbufs.memory = V4L2_MEMORY_DMABUF;
+    if (device_->Ioctl(VIDIOC_REQBUFS, &reqbufs) == 0) {
+      input_memory_ = V4L2_MEMORY_DMABUF;
+      VLOGF(2) << "Using DMABUF input buffers";
+      input_buffer_map_.resize(reqbufs.count);
+      for (size_t i = 0; i < input_buffer_map_.size(); ++i)
+        free_input_buffers_.push_back(i);
+      return true;
+    }
+    VPLOGF(2) << "DMABUF input not supported, falling back to MMAP";
+  }
+
+  input_memory_ = V4L2_MEMORY_MMAP;
   reqbufs.memory = V4L2_MEMORY_MMAP;
   IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_REQBUFS, &reqbufs);
   input_buffer_map_.resize(reqbufs.count);
   for (size_t i = 0; i < input_buffer_map_.size(); ++i) {
     free_input_buffers_.push_back(i);
-
-    // Query for the MEMORY_MMAP pointer.
-    struct v4l2_plane planes[1];
-    struct v4l2_buffer buffer;
-    memset(&buffer, 0, sizeof(buffer));
-    memset(planes, 0, sizeof(planes));
-    buffer.index = i;
-    buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-    buffer.memory = V4L2_MEMORY_MMAP;
-    buffer.m.planes = planes;
-    buffer.length = 1;
-    IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_QUERYBUF, &buffer);
-    void* address = device_->Mmap(NULL,
-                                  buffer.m.planes[0].length,
-                                  PROT_READ | PROT_WRITE,
-                                  MAP_SHARED,
-                                  buffer.m.planes[0].m.mem_offset);
-    if (address == MAP_FAILED) {
-      VPLOGF(1) << "mmap() failed";
+    if (!MapInputBuffer(i))
       return false;
-    }
-    input_buffer_map_[i].address = address;
-    input_buffer_map_[i].length = buffer.m.planes[0].length;
   }
 
   return true;
 }
 
+bool V4L2VideoDecodeAccelerator::MapInputBuffer(size_t index) {
+  DCHECK_EQ(input_memory_, V4L2_MEMORY_MMAP);
+  // Query for the MEMORY_MMAP pointer.
+  struct v4l2_plane planes[1];
+  struct v4l2_buffer buffer;
+  memset(&buffer, 0, sizeof(buffer));
+  memset(planes, 0, sizeof(planes));
+  buffer.index = index;
+  buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  buffer.memory = V4L2_MEMORY_MMAP;
+  buffer.m.planes = planes;
+  buffer.length = 1;
+  IOCTL_OR_ERROR_RETURN_FALSE(VIDIOC_QUERYBUF, &buffer);
+  void* address = device_->Mmap(NULL,
+                                buffer.m.planes[0].length,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED,
+                                buffer.m.planes[0].m.mem_offset);
+  if (address == MAP_FAILED) {
+    VPLOGF(1) << "mmap() failed";
+    return false;
+  }
+  input_buffer_map_[index].address = address;
+  input_buffer_map_[index].length = buffer.m.planes[0].length;
+  input_buffer_max_length_ =
+      std::max(input_buffer_max_length_, input_buffer_map_[index].length);
+
+  return true;
+}
+
 static bool IsSupportedOutputFormat(uint32_t v4l2_format) {
   // Only support V4L2_PIX_FMT_NV12 output format for now.
   // TODO(johnylin): add more supported format if necessary.
@@ -1862,32 +2280,30 @@ bool V4L2VideoDecodeAccelerator::SetupFormats() {
   DCHECK(!input_streamon_);
   DCHECK(!output_streamon_);
 
+  // With a count of 0, VIDIOC_CREATE_BUFS only checks that it is supported.
+  struct v4l2_create_buffers create;
+  memset(&create, 0, sizeof(create));
+  create.memory = V4L2_MEMORY_MMAP;
+  create.format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  input_buffers_growable_ = device_->Ioctl(VIDIOC_CREATE_BUFS, &create) == 0;
+
+  // If larger buffers can be added once the stream needs them, start small.
+  // Otherwise the buffers must fit the largest stream the device supports.
   size_t input_size;
   Size max_resolution, min_resolution;
   device_->GetSupportedResolution(input_format_fourcc_, &min_resolution,
                                   &max_resolution);
-  if (max_resolution.width() > 1920 && max_resolution.height() > 1088)
+  if (input_buffers_growable_)
+    input_size = kInputBufferInitialSize;
+  else if (max_resolution.width() > 1920 && max_resolution.height() > 1088)
     input_size = kInputBufferMaxSizeFor4k;
   else
     input_size = kInputBufferMaxSizeFor1080p;
+  VLOGF(2) << "input buffer size: " << input_size
+           << ", growable: " << input_buffers_growable_;
 
-  struct v4l2_fmtdesc fmtdesc;
-  memset(&fmtdesc, 0, sizeof(fmtdesc));
-  fmtdesc.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-  bool is_format_supported = false;
-  while (device_->Ioctl(VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
-    if (fmtdesc.pixelformat == input_format_fourcc_) {
-      is_format_supported = true;
-      break;
-    }
-    ++fmtdesc.index;
-  }
-
-  if (!is_format_supported) {
-    VLOGF(1) << "Input fourcc " << input_format_fourcc_
-             << " not supported by device.";
-    return false;
-  }
+  // The input fourcc needs no check here, Open() only picks a device that
+  // enumerated it.
 
   struct v4l2_format format;
   memset(&format, 0, sizeof(format));
@@ -1900,6 +2316,7 @@ bool V4L2VideoDecodeAccelerator::SetupFormats() {
   // We have to set up the format for output, because the driver may not allow
   // changing it once we start streaming; whether it can support our chosen
   // output format or not may depend on the input format.
+  struct v4l2_fmtdesc fmtdesc;
   memset(&fmtdesc, 0, sizeof(fmtdesc));
   fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
   while (device_->Ioctl(VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
@@ -1943,7 +2360,7 @@ bool V4L2VideoDecodeAccelerator::CreateOutputBuffers() {
 
   // Output format setup in Initialize().
 
-  uint32_t buffer_count = output_dpb_size_ + kDpbOutputBufferExtraCount;
+  uint32_t buffer_count = GetOutputBufferCount();
 
   VideoPixelFormat pixel_format =
       V4L2Device::V4L2PixFmtToVideoPixelFormat(output_format_fourcc_);
@@ -1986,11 +2403,12 @@ void V4L2VideoDecodeAccelerator::DestroyInputBuffers() {
   memset(&reqbufs, 0, sizeof(reqbufs));
   reqbufs.count = 0;
   reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-  reqbufs.memory = V4L2_MEMORY_MMAP;
+  reqbufs.memory = input_memory_;
   IOCTL_OR_LOG_ERROR(VIDIOC_REQBUFS, &reqbufs);
 
   input_buffer_map_.clear();
   free_input_buffers_.clear();
+  input_buffer_max_length_ = 0;
 }
 
 bool V4L2VideoDecodeAccelerator::DestroyOutputBuffers() {
@@ -2016,7 +2434,7 @@ bool V4L2VideoDecodeAccelerator::DestroyOutputBuffers() {
   memset(&reqbufs, 0, sizeof(reqbufs));
   reqbufs.count = 0;
   reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-  reqbufs.memory = V4L2_MEMORY_MMAP;
+  reqbufs.memory = V4L2_MEMORY_DMABUF;
   if (device_->Ioctl(VIDIOC_REQBUFS, &reqbufs) != 0) {
     VPLOGF(1) << "ioctl() failed: VIDIOC_REQBUFS";
     NOTIFY_ERROR(PLATFORM_FAILURE);
@@ -2034,13 +2452,28 @@ bool V4L2VideoDecodeAccelerator::DestroyOutputBuffers() {
   return success;
 }
 
+uint32_t V4L2VideoDecodeAccelerator::GetOutputBufferCount() const {
+  return GetNumPictureBuffersForDpbSize(output_dpb_size_);
+}
+
+void V4L2VideoDecodeAccelerator::RecordLatency(
+    int32_t bitstream_id,
+    FrameLatencyTracker::Stage stage) {
+  if (latency_tracker_)
+    latency_tracker_->Record(bitstream_id, stage);
+}
+
 void V4L2VideoDecodeAccelerator::SendPictureReady() {
   DVLOGF(4);
   DCHECK(decoder_thread_.task_runner()->BelongsToCurrentThread());
   bool send_now = (decoder_state_ == kChangingResolution ||
                    decoder_state_ == kResetting || decoder_flushing_);
   while (pending_picture_ready_.size() > 0) {
-    bool cleared = pending_picture_ready_.front().cleared;
+    // Imported buffers are written by the device before being returned, so
+    // there is nothing to clear. In low-latency mode, skip the round trip
+    // through the child thread even for the first use of a buffer.
+    bool cleared = pending_picture_ready_.front().cleared ||
+                   (low_latency_ && output_mode_ == Config::OutputMode::IMPORT);
     const Picture& picture = pending_picture_ready_.front().picture;
     if (cleared && picture_clearing_count_ == 0) {
       // This picture is cleared. It can be posted to a thread different than
@@ -2049,6 +2482,8 @@ void V4L2VideoDecodeAccelerator::SendPictureReady() {
       decode_task_runner_->PostTask(
           FROM_HERE,
           base::Bind(&Client::PictureReady, decode_client_, picture));
+      RecordLatency(picture.bitstream_buffer_id(),
+                    FrameLatencyTracker::Stage::kPictureReady);
       pending_picture_ready_.pop();
     } else if (!cleared || send_now) {
       DVLOGF(4) << "cleared=" << pending_picture_ready_.front().cleared
@@ -2067,6 +2502,8 @@ void V4L2VideoDecodeAccelerator::SendPictureReady() {
           base::Bind(&V4L2VideoDecodeAccelerator::PictureCleared,
                      base::Unretained(this)));
       picture_clearing_count_++;
+      RecordLatency(picture.bitstream_buffer_id(),
+                    FrameLatencyTracker::Stage::kPictureReady);
       pending_picture_ready_.pop();
     } else {
       // This picture is cleared. But some pictures are about to be cleared on
@@ -23,9 +23,11 @@
 #include "base/macros.h"
 #include "base/memory/linked_ptr.h"
 #include "base/memory/ref_counted.h"
+#include "base/message_loop/message_loop.h"
 #include "base/synchronization/waitable_event.h"
 #include "base/threading/thread.h"
 #include "picture.h"
+#include "shared_memory_mapping_cache.h"
 #include "size.h"
 #include "v4l2_device.h"
 #include "video_decode_accelerator.h"
@@ -55,7 +57,9 @@ class H264Parser;
 // * The device_poll_thread_, owned by this class.  All it does is epoll() on
 //   the V4L2 in DevicePollTask() and schedule a ServiceDeviceTask() on the
 //   decoder_thread_ when something interesting happens.
-//   TODO(sheu): replace this thread with an TYPE_IO decoder_thread_.
+//   With PollMode::kDecoderThread, there is no such thread: decoder_thread_ is
+//   a TYPE_IO thread that watches the device itself and calls ServiceDevice()
+//   directly, saving two thread hops per device event.
 //
 // Note that this class has (almost) no locks, apart from the pictures_assigned_
 // WaitableEvent. Everything (apart from buffer (re)allocation) is serviced on
@@ -82,10 +86,20 @@ class H264Parser;
 //   buffrers. We cannot drop any frame during resolution change. So V4L2VDA
 //   should destroy output buffers after image processor returns all the frames.
 class V4L2VideoDecodeAccelerator
-    : public VideoDecodeAccelerator {
+    : public VideoDecodeAccelerator,
+      public base::MessageLoopForIO::Watcher {
  public:
+  // Where V4L2 device events are waited for.
+  enum class PollMode {
+    // On device_poll_thread_, which posts ServiceDeviceTask()s.
+    kPollThread,
+    // In the message loop of decoder_thread_.
+    kDecoderThread,
+  };
+
   V4L2VideoDecodeAccelerator(
-      const scoped_refptr<V4L2Device>& device);
+      const scoped_refptr<V4L2Device>& device,
+      PollMode poll_mode = PollMode::kPollThread);
   ~V4L2VideoDecodeAccelerator() override;
 
   // VideoDecodeAccelerator implementation.
@@ -101,6 +115,7 @@ class V4L2VideoDecodeAccelerator
   void Flush() override;
   void Reset() override;
   void Destroy() override;
+  size_t GetNumPictureBuffersForDpbSize(size_t dpb_size) const override;
   bool TryToSetupDecodeOnSeparateThread(
       const base::WeakPtr<Client>& decode_client,
       const scoped_refptr<base::SingleThreadTaskRunner>& decode_task_runner)
@@ -108,13 +123,28 @@ class V4L2VideoDecodeAccelerator
 
   static VideoDecodeAccelerator::SupportedProfiles GetSupportedProfiles();
 
+  // base::MessageLoopForIO::Watcher implementation, for
+  // PollMode::kDecoderThread.
+  void OnFileCanReadWithoutBlocking(int fd) override;
+  void OnFileCanWriteWithoutBlocking(int fd) override;
+
  private:
   // These are rather subjectively tuned.
   enum {
     kInputBufferCount = 8,
-    // TODO(posciak): determine input buffer size based on level limits.
-    // See http://crbug.com/255116.
-    // Input bitstream buffer size for up to 1080p streams.
+    // Number of input buffers added at a time when a frame does not fit in any
+    // of the existing ones.
+    kInputBufferGrowCount = 2,
+    // Number of bitstream buffer mappings kept alive across Decode() calls.
+    // Clients usually recycle fewer buffers than this.
+    kInputMappingCacheSize = 16,
+    // Maximum number of frame fragments decoded by one DecodeBufferTask()
+    // before it yields to other tasks on the decoder thread.
+    kDecodeBufferTaskBudget = 16,
+    // Initial input bitstream buffer size, if the device can add larger
+    // buffers later on. See GetInputBufferSize().
+    kInputBufferInitialSize = 256 * 1024,
+    // Otherwise, input bitstream buffer size for up to 1080p streams.
     kInputBufferMaxSizeFor1080p = 1024 * 1024,
     // Input bitstream buffer size for up to 4k streams.
     kInputBufferMaxSizeFor4k = 4 * kInputBufferMaxSizeFor1080p,
@@ -125,6 +155,9 @@ class V4L2VideoDecodeAccelerator
     // limits::kMaxVideoFrames to fill up the GpuVideoDecode pipeline,
     // and +1 for a frame in transit.
     kDpbOutputBufferExtraCount = kMaxVideoFrames + 1,
+    // With Config::low_latency the client does not queue up decoded pictures,
+    // so only the frame in transit is needed.
+    kDpbOutputBufferExtraCountForLowLatency = 1,
     // Number of extra output buffers if image processor is used.
     kDpbOutputBufferExtraCountForImageProcessor = 1,
   };
@@ -170,12 +203,18 @@ class V4L2VideoDecodeAccelerator
   // Record for input buffers.
   struct InputRecord {
     InputRecord();
+    InputRecord(InputRecord&&) = default;
     ~InputRecord();
     bool at_device;    // held by device.
     void* address;     // mmap() address.
     size_t length;     // mmap() length.
     off_t bytes_used;  // bytes filled in the mmap() segment.
     int32_t input_id;  // triggering input_id as given to Decode().
+    // The bitstream buffer queued as this record's dmabuf. Used only when
+    // |input_memory_| is V4L2_MEMORY_DMABUF. The device reads the client's
+    // memory directly, so the buffer is held (and not returned to the client)
+    // until the record is dequeued.
+    std::unique_ptr<BitstreamBufferRef> bitstream_buffer;
   };
 
   // Record for output buffers.
@@ -187,8 +226,10 @@ class V4L2VideoDecodeAccelerator
     int32_t picture_id;     // picture buffer id as returned to PictureReady().
     bool cleared;           // Whether the texture is cleared and safe to render
                             // from. See TextureManager for details.
-    // Output fds of the processor. Used only when OutputMode is IMPORT.
-    std::vector<base::ScopedFD> processor_output_fds;
+    // Dmabuf fds imported from the client, one per plane. These are queued
+    // to the CAPTURE queue with V4L2_MEMORY_DMABUF, so the device decodes
+    // directly into the client's buffers.
+    std::vector<base::ScopedFD> output_fds;
   };
 
   //
@@ -203,18 +244,45 @@ class V4L2VideoDecodeAccelerator
   // the buffer.
   void DecodeTask(const BitstreamBuffer& bitstream_buffer);
 
-  // Decode from the buffers queued in decoder_input_queue_.  Calls
-  // DecodeBufferInitial() or DecodeBufferContinue() as appropriate.
+  // Decode from the buffers queued in decoder_input_queue_, until we run out of
+  // input buffers or of kDecodeBufferTaskBudget.
   void DecodeBufferTask();
+  // Decode the next fragment of the current bitstream buffer. Calls
+  // DecodeBufferInitial() or DecodeBufferContinue() as appropriate. Return true
+  // if we should continue decoding.
+  bool DecodeBufferFragment();
   // Advance to the next fragment that begins a frame.
   bool AdvanceFrameFragment(const uint8_t* data, size_t size, size_t* endpos);
-  // Schedule another DecodeBufferTask() if we're behind.
+  // Parse all NALUs of the H264 bitstream buffer |buffer| whose contents are
+  // at |data|, and store their boundaries in it. Called once per buffer, so
+  // that AdvanceFrameFragment() never scans the same bytes twice.
+  void BuildNaluIndex(BitstreamBufferRef* buffer, const uint8_t* data);
+  // Schedule a DecodeBufferTask() if there is input to decode and none is
+  // scheduled yet.
   void ScheduleDecodeBufferTaskIfNeeded();
 
   // Return true if we should continue to schedule DecodeBufferTask()s after
   // completion.  Store the amount of input actually consumed in |endpos|.
   bool DecodeBufferInitial(const void* data, size_t size, size_t* endpos);
   bool DecodeBufferContinue(const void* data, size_t size);
+  // Queue the whole current bitstream buffer to the device as a dmabuf, without
+  // copying it. Only used when |input_memory_| is V4L2_MEMORY_DMABUF. Return
+  // true if we should continue to schedule DecodeBufferTask()s.
+  bool DecodeBufferDmabuf();
+
+  // Return the input buffer size for frames of |coded_size|. This allows half a
+  // byte per pixel, which matches the fixed 1080p and 4k sizes above.
+  static size_t GetInputBufferSize(const Size& coded_size);
+  // Take a free input buffer of at least |size| bytes as the buffer we're
+  // filling. Return false if there is none.
+  bool TakeFreeInputBuffer(size_t size);
+  // Move the partial frame of the buffer we're filling to a free input buffer
+  // of at least |size| bytes, which becomes the buffer we're filling. Return
+  // false if there is none.
+  bool MoveInputFrameToFreeBuffer(size_t size);
+  // Add kInputBufferGrowCount input buffers of |buffer_size| bytes to the
+  // queue with VIDIOC_CREATE_BUFS. Return true if success.
+  bool AddInputBuffers(size_t buffer_size);
 
   // Accumulate data for the next frame to decode.  May return false in
   // non-error conditions; for example when pipeline is full and should be
@@ -237,9 +305,16 @@ class V4L2VideoDecodeAccelerator
   // DevicePollTask().  If |event_pending| is true, one or more events
   // on file descriptor are pending.
   void ServiceDeviceTask(bool event_pending);
+  // Service the V4L2 device. |device_events| are the EPOLL* events pending on
+  // it: only the queues that are ready (EPOLLOUT for input, EPOLLIN for
+  // output) are dequeued.
+  void ServiceDevice(uint32_t device_events);
   // Handle the various device queues.
   void Enqueue();
   void Dequeue();
+  // Dequeue the input queue if |dequeue_input|, and the output queue if
+  // |dequeue_output|.
+  void DequeueQueues(bool dequeue_input, bool dequeue_output);
   // Dequeue one input buffer. Return true if success.
   bool DequeueInputBuffer();
   // Dequeue one output buffer. Return true if success.
@@ -282,11 +357,14 @@ class V4L2VideoDecodeAccelerator
   // Device destruction task.
   void DestroyTask();
 
-  // Start |device_poll_thread_|.
+  // Start |device_poll_thread_|, or watching the device on decoder_thread_.
   bool StartDevicePoll();
 
-  // Stop |device_poll_thread_|.
+  // Stop |device_poll_thread_|, or watching the device on decoder_thread_.
   bool StopDevicePoll();
+  // Return true if we are waiting for device events, on |device_poll_thread_|
+  // or on decoder_thread_.
+  bool IsDevicePollRunning() const;
 
   bool StopInputStream();
   bool StopOutputStream();
@@ -333,6 +411,8 @@ class V4L2VideoDecodeAccelerator
 
   // Create the buffers we need.
   bool CreateInputBuffers();
+  // Query and mmap() the MMAP input buffer |index|.
+  bool MapInputBuffer(size_t index);
   bool CreateOutputBuffers();
 
   // Destroy buffers.
@@ -351,6 +431,12 @@ class V4L2VideoDecodeAccelerator
   // Methods run on child thread.
   //
 
+  // Number of output buffers to request from the client.
+  uint32_t GetOutputBufferCount() const;
+
+  // Records |stage| of |bitstream_id| if latency tracking is enabled.
+  void RecordLatency(int32_t bitstream_id, FrameLatencyTracker::Stage stage);
+
   // Send decoded pictures to PictureReady.
   void SendPictureReady();
 
@@ -393,7 +479,15 @@ class V4L2VideoDecodeAccelerator
   State decoder_state_;
 
   Config::OutputMode output_mode_;
-
+  // Config::low_latency.
+  bool low_latency_;
+  // Config::latency_tracker. Set in Initialize() and used on all threads.
+  scoped_refptr<FrameLatencyTracker> latency_tracker_;
+
+  // Mappings of the client's bitstream buffers, reused across DecodeTask()s.
+  // Declared before the buffers mapped through it, which release their
+  // mappings on destruction.
+  SharedMemoryMappingCache decoder_mapping_cache_;
   // BitstreamBuffer we're presently reading.
   std::unique_ptr<BitstreamBufferRef> decoder_current_bitstream_buffer_;
   // The V4L2Device this class is operating upon.
@@ -404,9 +498,9 @@ class V4L2VideoDecodeAccelerator
   int decoder_delay_bitstream_buffer_id_;
   // Input buffer we're presently filling.
   int decoder_current_input_buffer_;
-  // We track the number of buffer decode tasks we have scheduled, since each
-  // task execution should complete one buffer.  If we fall behind (due to
-  // resource backpressure, etc.), we'll have to schedule more to catch up.
+  // We track the number of buffer decode tasks we have scheduled, so that we
+  // don't post another one while one is pending.  If we fall behind (due to
+  // resource backpressure, etc.), the next task will catch up.
   int decoder_decode_buffer_tasks_scheduled_;
   // Picture buffers held by the client.
   int decoder_frames_at_client_;
@@ -432,6 +526,10 @@ class V4L2VideoDecodeAccelerator
   std::unique_ptr<H264Parser> decoder_h264_parser_;
   // Set if the decoder has a pending incomplete frame in an input buffer.
   bool decoder_partial_frame_pending_;
+  // Number of H264 bytes parsed for frame boundaries, and number of bytes
+  // handed on as frame fragments. They are equal unless bytes get rescanned.
+  uint64_t decoder_h264_bytes_scanned_;
+  uint64_t decoder_h264_bytes_submitted_;
 
   //
   // Hardware state and associated queues.  Since decoder_thread_ services
@@ -446,6 +544,10 @@ class V4L2VideoDecodeAccelerator
   std::queue<int> input_ready_queue_;
 
   // Input buffer state.
+  // Memory type of the input (VIDEO_OUTPUT) queue. V4L2_MEMORY_DMABUF queues
+  // the client's bitstream buffers directly; V4L2_MEMORY_MMAP copies them
+  // into buffers allocated by the device.
+  v4l2_memory input_memory_;
   bool input_streamon_;
   // Input buffers enqueued to device.
   int input_buffer_queued_count_;
@@ -453,6 +555,11 @@ class V4L2VideoDecodeAccelerator
   std::vector<int> free_input_buffers_;
   // Mapping of int index to input buffer record.
   std::vector<InputRecord> input_buffer_map_;
+  // True if the device supports VIDIOC_CREATE_BUFS, so that larger input
+  // buffers can be added when a frame does not fit.
+  bool input_buffers_growable_;
+  // Length of the largest input buffer.
+  size_t input_buffer_max_length_;
 
   // Output buffer state.
   bool output_streamon_;
@@ -488,6 +595,11 @@ class V4L2VideoDecodeAccelerator
   // The thread.
   base::Thread device_poll_thread_;
 
+  const PollMode poll_mode_;
+  // Watches the device on decoder_thread_ with PollMode::kDecoderThread.
+  base::MessageLoopForIO::FileDescriptorWatcher device_poll_watcher_;
+  bool device_poll_watching_;
+
   //
   // Other state, held by the child (main) thread.
   //
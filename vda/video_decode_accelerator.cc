@@ -20,6 +20,8 @@ VideoDecodeAccelerator::Config::~Config() = default;
 std::string VideoDecodeAccelerator::Config::AsHumanReadableString() const {
   std::ostringstream s;
   s << "profile: " << GetProfileName(profile);
+  if (low_latency)
+    s << ", low latency";
   return s.str();
 }
 
@@ -38,6 +40,11 @@ bool VideoDecodeAccelerator::TryToSetupDecodeOnSeparateThread(
   return false;
 }
 
+size_t VideoDecodeAccelerator::GetNumPictureBuffersForDpbSize(
+    size_t dpb_size) const {
+  return 0;
+}
+
 void VideoDecodeAccelerator::ImportBufferForPicture(
     int32_t picture_buffer_id,
     VideoPixelFormat pixel_format,
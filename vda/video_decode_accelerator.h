@@ -12,6 +12,7 @@
 #include "base/memory/weak_ptr.h"
 
 #include "bitstream_buffer.h"
+#include "frame_latency_tracker.h"
 #include "native_pixmap_handle.h"
 #include "picture.h"
 #include "size.h"
@@ -149,6 +150,14 @@ class VideoDecodeAccelerator {
     // Each SPS and PPS is prefixed with the Annex B framing bytes: 0, 0, 0, 1.
     std::vector<uint8_t> sps;
     std::vector<uint8_t> pps;
+
+    // Whether the client displays every picture as soon as it is decoded, e.g.
+    // for streams without frame reordering. The VDA may then keep fewer output
+    // buffers in flight and return pictures with less delay.
+    bool low_latency = false;
+
+    // If set, the VDA records the stages of each bitstream buffer into it.
+    scoped_refptr<FrameLatencyTracker> latency_tracker;
   };
 
   // Interface for collaborating with picture interface to provide memory for
@@ -291,6 +300,14 @@ class VideoDecodeAccelerator {
   // unconditionally, so make sure to drop all pointers to it!
   virtual void Destroy() = 0;
 
+  // Returns the number of picture buffers this VDA will request through
+  // Client::ProvidePictureBuffers() for a stream that needs |dpb_size| frames
+  // for reference and reordering (the DPB size in H264, or the reference frame
+  // slots in VP8 and VP9, including the frame being decoded). This lets the
+  // client allocate the buffers before the stream is parsed. Returns 0 if the
+  // VDA cannot tell.
+  virtual size_t GetNumPictureBuffersForDpbSize(size_t dpb_size) const;
+
   // TO BE CALLED IN THE SAME PROCESS AS THE VDA IMPLEMENTATION ONLY.
   //
   // A decode "task" is a sequence that includes a Decode() call from Client,
@@ -0,0 +1,76 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "video_decode_accelerator_factory.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "v4l2_device.h"
+#include "v4l2_slice_video_decode_accelerator.h"
+
+namespace media {
+
+namespace {
+
+std::unique_ptr<VideoDecodeAccelerator> InitializeVDA(
+    std::unique_ptr<VideoDecodeAccelerator> vda,
+    const VideoDecodeAccelerator::Config& config,
+    VideoDecodeAccelerator::Client* client) {
+  if (!vda->Initialize(config, client))
+    return nullptr;
+  return vda;
+}
+
+}  // namespace
+
+// static
+std::unique_ptr<VideoDecodeAccelerator>
+VideoDecodeAcceleratorFactory::CreateAndInitialize(
+    Backend backend,
+    V4L2VideoDecodeAccelerator::PollMode poll_mode,
+    const VideoDecodeAccelerator::Config& config,
+    VideoDecodeAccelerator::Client* client) {
+  std::unique_ptr<VideoDecodeAccelerator> vda;
+  if (backend != Backend::kStateless) {
+    vda = InitializeVDA(
+        std::unique_ptr<VideoDecodeAccelerator>(new V4L2VideoDecodeAccelerator(
+            V4L2Device::Create(), poll_mode)),
+        config, client);
+    if (vda || backend == Backend::kStateful)
+      return vda;
+    VLOG(1) << "No stateful decoder for " << config.AsHumanReadableString()
+            << ", trying the stateless one";
+  }
+
+  return InitializeVDA(std::unique_ptr<VideoDecodeAccelerator>(
+                           new V4L2SliceVideoDecodeAccelerator(
+                               V4L2Device::Create())),
+                       config, client);
+}
+
+// static
+VideoDecodeAccelerator::SupportedProfiles
+VideoDecodeAcceleratorFactory::GetSupportedProfiles(Backend backend) {
+  VideoDecodeAccelerator::SupportedProfiles profiles;
+  if (backend != Backend::kStateless)
+    profiles = V4L2VideoDecodeAccelerator::GetSupportedProfiles();
+  if (backend == Backend::kStateful)
+    return profiles;
+
+  for (const auto& profile :
+       V4L2SliceVideoDecodeAccelerator::GetSupportedProfiles()) {
+    const bool supported =
+        std::any_of(profiles.begin(), profiles.end(),
+                    [&profile](
+                        const VideoDecodeAccelerator::SupportedProfile& other) {
+                      return other.profile == profile.profile;
+                    });
+    if (!supported)
+      profiles.push_back(profile);
+  }
+  return profiles;
+}
+
+}  // namespace media
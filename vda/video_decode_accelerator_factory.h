@@ -0,0 +1,48 @@
+// Copyright 2018 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VIDEO_DECODE_ACCELERATOR_FACTORY_H_
+#define VIDEO_DECODE_ACCELERATOR_FACTORY_H_
+
+#include <memory>
+
+#include "v4l2_video_decode_accelerator.h"
+#include "video_decode_accelerator.h"
+
+namespace media {
+
+// Creates the VideoDecodeAccelerator matching the V4L2 decoders of the
+// platform: V4L2VideoDecodeAccelerator for stateful decoders, which parse the
+// stream themselves, or V4L2SliceVideoDecodeAccelerator for stateless ones.
+class VideoDecodeAcceleratorFactory {
+ public:
+  enum class Backend {
+    // The stateful backend, or the stateless one if no stateful decoder
+    // supports the profile.
+    kAuto,
+    kStateful,
+    kStateless,
+  };
+
+  // Create a VDA of |backend| and initialize it with |config| and |client|.
+  // |poll_mode| only applies to the stateful backend. Return nullptr if no
+  // VDA could be initialized.
+  static std::unique_ptr<VideoDecodeAccelerator> CreateAndInitialize(
+      Backend backend,
+      V4L2VideoDecodeAccelerator::PollMode poll_mode,
+      const VideoDecodeAccelerator::Config& config,
+      VideoDecodeAccelerator::Client* client);
+
+  // Return the profiles supported by |backend|. With Backend::kAuto, the
+  // profiles of both backends are merged, preferring the stateful ones.
+  static VideoDecodeAccelerator::SupportedProfiles GetSupportedProfiles(
+      Backend backend);
+
+ private:
+  DISALLOW_IMPLICIT_CONSTRUCTORS(VideoDecodeAcceleratorFactory);
+};
+
+}  // namespace media
+
+#endif  // VIDEO_DECODE_ACCELERATOR_FACTORY_H_
@@ -5,6 +5,8 @@
 
 #include "vp9_compressed_header_parser.h"
 
+#include <string.h>
+
 #include "base/logging.h"
 
 namespace media {
@@ -22,9 +24,9 @@ int InvRecenterNonneg(int v, int m) {
   return m + (v >> 1);
 }
 
-// 6.3.5 Inv remap prob syntax, inv_remap_prob().
-Vp9Prob InvRemapProb(uint8_t delta_prob, uint8_t prob) {
-  static uint8_t inv_map_table[kVp9MaxProb] = {
+// 6.3.5 Inv remap prob syntax, inv_map_table[].
+uint8_t InvMapDeltaProb(uint8_t delta_prob) {
+  static const uint8_t inv_map_table[kVp9MaxProb] = {
       7,   20,  33,  46,  59,  72,  85,  98,  111, 124, 137, 150, 163, 176,
       189, 202, 215, 228, 241, 254, 1,   2,   3,   4,   5,   6,   8,   9,
       10,  11,  12,  13,  14,  15,  16,  17,  18,  19,  21,  22,  23,  24,
@@ -44,12 +46,16 @@ Vp9Prob InvRemapProb(uint8_t delta_prob, uint8_t prob) {
       222, 223, 224, 225, 226, 227, 229, 230, 231, 232, 233, 234, 235, 236,
       237, 238, 239, 240, 242, 243, 244, 245, 246, 247, 248, 249, 250, 251,
       252, 253, 253};
+  DCHECK_LT(delta_prob, arraysize(inv_map_table));
+  return inv_map_table[delta_prob];
+}
+
+// 6.3.5 Inv remap prob syntax, inv_remap_prob(), with |v| already mapped by
+// InvMapDeltaProb().
+Vp9Prob InvRemapProb(uint8_t v, uint8_t prob) {
   uint8_t m = prob;
-  uint8_t v = delta_prob;
   DCHECK_GE(m, 1);
   DCHECK_LE(m, kVp9MaxProb);
-  DCHECK_LT(v, arraysize(inv_map_table));
-  v = inv_map_table[v];
   m--;
   if ((m << 1) <= kVp9MaxProb) {
     return 1 + InvRecenterNonneg(v, m);
@@ -90,11 +96,21 @@ uint8_t Vp9CompressedHeaderParser::DecodeTermSubexp() {
   return (v << 1) - 1 + reader_.ReadLiteral(1);
 }
 
+// Returns the entry of |prob_updates_| for |prob|, a probability of
+// |frame_context_|.
+Vp9Prob* Vp9CompressedHeaderParser::ProbUpdate(Vp9Prob* prob) {
+  const ptrdiff_t offset = prob - reinterpret_cast<Vp9Prob*>(frame_context_);
+  DCHECK_GE(offset, 0);
+  DCHECK_LT(static_cast<size_t>(offset), sizeof(Vp9FrameContext));
+  return reinterpret_cast<Vp9Prob*>(prob_updates_) + offset;
+}
+
 // 6.3.3 Diff update prob syntax
 void Vp9CompressedHeaderParser::DiffUpdateProb(Vp9Prob* prob) {
   const Vp9Prob kUpdateProb = 252;
   if (reader_.ReadBool(kUpdateProb)) {
-    uint8_t delta_prob = DecodeTermSubexp();
+    uint8_t delta_prob = InvMapDeltaProb(DecodeTermSubexp());
+    *ProbUpdate(prob) = delta_prob;
     *prob = InvRemapProb(delta_prob, *prob);
   }
 }
@@ -241,8 +257,10 @@ void Vp9CompressedHeaderParser::ReadMvProbs(bool allow_high_precision_mv,
 
 // 6.3.17 Update mv prob syntax
 void Vp9CompressedHeaderParser::UpdateMvProb(Vp9Prob* prob) {
-  if (reader_.ReadBool(252))
+  if (reader_.ReadBool(252)) {
     *prob = reader_.ReadLiteral(7) << 1 | 1;
+    *ProbUpdate(prob) = *prob;
+  }
 }
 
 // Helper function to UpdateMvProb an array of probs.
@@ -261,6 +279,12 @@ bool Vp9CompressedHeaderParser::Parse(const uint8_t* stream,
   if (!reader_.Initialize(stream, frame_size))
     return false;
 
+  // The probabilities of the Vp9FrameContext are updated in place, and their
+  // updates recorded at the same offset in |prob_updates|.
+  frame_context_ = &fhdr->frame_context;
+  prob_updates_ = &fhdr->compressed_header.prob_updates;
+  memset(prob_updates_, 0, sizeof(*prob_updates_));
+
   ReadTxMode(fhdr);
   if (fhdr->compressed_header.tx_mode == Vp9CompressedHeader::TX_MODE_SELECT)
     ReadTxModeProbs(&fhdr->frame_context);
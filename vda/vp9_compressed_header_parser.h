@@ -22,6 +22,7 @@ class Vp9CompressedHeaderParser {
  private:
   void ReadTxMode(Vp9FrameHeader* fhdr);
   uint8_t DecodeTermSubexp();
+  Vp9Prob* ProbUpdate(Vp9Prob* prob);
   void DiffUpdateProb(Vp9Prob* prob);
   template <int N>
   void DiffUpdateProbArray(Vp9Prob (&prob_array)[N]);
@@ -44,6 +45,10 @@ class Vp9CompressedHeaderParser {
   // Bool decoder for compressed frame header.
   Vp9BoolDecoder reader_;
 
+  // The context and the probability updates of the header being parsed.
+  Vp9FrameContext* frame_context_ = nullptr;
+  Vp9FrameContext* prob_updates_ = nullptr;
+
   DISALLOW_COPY_AND_ASSIGN(Vp9CompressedHeaderParser);
 };
 
@@ -181,6 +181,11 @@ struct Vp9CompressedHeader {
 
   Vp9TxMode tx_mode;
   Vp9ReferenceMode reference_mode;
+
+  // The probability updates coded in the header, 0 where there is none: the
+  // inv_map_table[] values of diff_update_prob(), and the new values of
+  // update_mv_prob(). Stateless decoders apply them to their own contexts.
+  Vp9FrameContext prob_updates;
 };
 
 // VP9 frame header.